@@ -7,6 +7,42 @@
 static __thread cpu_t *s_current = nullptr;
 
 extern "C" void wrmsr(u32 msr, u64 val);
+extern "C" u64 rdmsr(u32 msr);
+
+// arch/x86_64/syscall.asm
+extern "C" void syscall_entry(void);
+
+/*
+ * the per-cpu state syscall_entry reaches through KERNEL_GS_BASE. It lives in
+ * the cpu's local page, past the GDT, TSS and the TLS block
+ */
+struct syscall_percpu {
+  u64 kernel_rsp;  // the stack to run the syscall on
+  u64 user_rsp;    // scratch space for the user's stack pointer
+};
+#define SYSCALL_PERCPU_OFFSET (PGSIZE - 1024)
+
+static inline struct syscall_percpu *syscall_percpu(void *local) {
+  return (struct syscall_percpu *)((char *)local + SYSCALL_PERCPU_OFFSET);
+}
+
+/*
+ * point the SYSCALL instruction at syscall_entry. SYSCALL loads the kernel
+ * segments from STAR[47:32], and SYSRET the user ones from STAR[63:48] (data
+ * at +8, code at +16)
+ */
+static void syscall_msr_init(void *local) {
+  wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+  wrmsr(MSR_STAR, ((u64)((SEG_KCPU << 3) | DPL_USER) << 48) |
+                      ((u64)(SEG_KCODE << 3) << 32));
+  wrmsr(MSR_LSTAR, (u64)syscall_entry);
+  // enter with interrupts off (until the stack is switched) and a clean
+  // direction flag
+  wrmsr(MSR_FMASK, FL_IF | FL_TF | FL_DF | FL_AC);
+  // user code runs with a zero GS base, the kernel's is swapped in on entry
+  wrmsr(MSR_GS_BASE, 0);
+  wrmsr(MSR_KERNEL_GS_BASE, (u64)syscall_percpu(local));
+}
 
 struct gdt_desc64 {
   uint16_t limit;
@@ -34,7 +70,7 @@ void cpu::seginit(void *local) {
 
   tss[0x64] |= (0x64 * sizeof(u32)) << 16;
 
-  wrmsr(0xC0000100, ((u64)local) + (PGSIZE / 2));
+  wrmsr(MSR_FS_BASE, ((u64)local) + (PGSIZE / 2));
 
   // zero out the CPU
   cpu_t *c = &cpus[cpunum++];
@@ -51,11 +87,15 @@ void cpu::seginit(void *local) {
   gdt[SEG_TSS + 0] = (0x0067) | ((addr & 0xFFFFFF) << 16) | (0x00E9LL << 40) |
                      (((addr >> 24) & 0xFF) << 56);
   gdt[SEG_TSS + 1] = (addr >> 32);
+  // read-only data, DPL=3. Never loaded, only its limit is looked at
+  gdt[SEG_CPUNUM] = 0x0000F00000000000 | (c - cpus);
 
-  lgdt((void *)gdt, 8 * sizeof(u64));
+  lgdt((void *)gdt, 9 * sizeof(u64));
 
   ltr(SEG_TSS << 3);
 
+  syscall_msr_init(local);
+
 #endif
 }
 
@@ -78,6 +118,9 @@ void cpu::switch_vm(struct thread *thd) {
 
     case RING_USER:
       tss_set_rsp(tss, 0, (u64)thd->stack + thd->stack_size + 8);
+      // syscalls come in on the same stack as interrupts
+      syscall_percpu(c.local)->kernel_rsp =
+          (u64)thd->stack + thd->stack_size + 8;
       break;
 
     default:
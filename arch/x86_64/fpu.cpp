@@ -0,0 +1,205 @@
+#include <arch.h>
+#include <asm.h>
+#include <cpu.h>
+#include <fpu.h>
+#include <idt.h>
+#include <mem.h>
+#include <printk.h>
+#include <sched.h>
+
+/*
+ * Lazy FPU switching (see include/fpu.h).
+ *
+ * Each cpu remembers the thread whose state its registers hold (the owner).
+ * While a thread runs with its state loaded, `live` is set and CR0.TS is
+ * clear. Otherwise TS is set, and the first FPU/SIMD instruction traps into
+ * nm_handler, which loads the state. A thread's saved state is always up to
+ * date while it isn't running, so threads can move between cpus freely: the
+ * owner's registers are only reused if the thread was last loaded there.
+ */
+
+enum save_insn { SAVE_FXSAVE, SAVE_XSAVE, SAVE_XSAVEOPT, SAVE_XSAVEC };
+
+static save_insn s_save = SAVE_FXSAVE;
+static u64 s_xfeatures = XFEATURE_X87 | XFEATURE_SSE;
+static size_t s_state_size = 512;
+
+static struct {
+  struct thread *owner;
+  bool in_kernel;
+} s_cpu[16];
+
+static inline int cpu_index(void) { return &cpu::current() - cpus; }
+
+static inline void cpuid(u32 leaf, u32 sub, u32 &a, u32 &b, u32 &c, u32 &d) {
+  asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(sub));
+}
+
+static inline void clts(void) { asm volatile("clts"); }
+static inline void stts(void) { write_cr0(read_cr0() | CR0_TS); }
+
+static void save(void *st) {
+  u32 lo = s_xfeatures, hi = s_xfeatures >> 32;
+  switch (s_save) {
+    case SAVE_XSAVEC:
+      asm volatile("xsavec64 (%0)" ::"r"(st), "a"(lo), "d"(hi) : "memory");
+      break;
+    case SAVE_XSAVEOPT:
+      asm volatile("xsaveopt64 (%0)" ::"r"(st), "a"(lo), "d"(hi) : "memory");
+      break;
+    case SAVE_XSAVE:
+      asm volatile("xsave64 (%0)" ::"r"(st), "a"(lo), "d"(hi) : "memory");
+      break;
+    default:
+      asm volatile("fxsave64 (%0)" ::"r"(st) : "memory");
+      break;
+  }
+}
+
+static void restore(void *st) {
+  u32 lo = s_xfeatures, hi = s_xfeatures >> 32;
+  // xrstor takes the compacted format (from xsavec) as well as the standard
+  if (s_save != SAVE_FXSAVE)
+    asm volatile("xrstor64 (%0)" ::"r"(st), "a"(lo), "d"(hi) : "memory");
+  else
+    asm volatile("fxrstor64 (%0)" ::"r"(st) : "memory");
+}
+
+// #NM: someone used the FPU with CR0.TS set
+static void nm_handler(int, reg_t *) {
+  // a context switch in here would set TS again under us
+  cpu::pushcli();
+  clts();
+
+  auto &pc = s_cpu[cpu_index()];
+  if (pc.in_kernel) panic("fpu: trap inside a kernel SIMD section\n");
+
+  auto *thd = cpu::current().current_thread;
+  if (thd == nullptr) {
+    // the scheduler itself. Nobody needs what it leaves in the registers
+    pc.owner = nullptr;
+  } else {
+    restore(thd->fpu.state);
+    pc.owner = thd;
+    thd->fpu.last_cpu = cpu_index();
+    thd->fpu.live = true;
+  }
+
+  cpu::popcli();
+}
+
+void fpu::init(void) {
+  u32 a, b, c, d;
+
+  cpuid(1, 0, a, b, c, d);
+  bool xsave = (c >> 26) & 1;
+
+  if (xsave) {
+    write_cr4(read_cr4() | CR4_OSXSAVE);
+
+    cpuid(0xD, 0, a, b, c, d);
+    u64 supported = a | ((u64)d << 32);
+    u64 mask = supported & (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX);
+    // AVX-512 is all or nothing
+    if ((supported & XFEATURE_AVX512) == XFEATURE_AVX512)
+      mask |= XFEATURE_AVX512;
+    asm volatile("xsetbv" ::"c"(0), "a"((u32)mask), "d"((u32)(mask >> 32)));
+    s_xfeatures = mask;
+
+    // with XCR0 set, ebx is the size of a standard format area for it
+    cpuid(0xD, 0, a, b, c, d);
+    s_state_size = b;
+    s_save = SAVE_XSAVE;
+
+    cpuid(0xD, 1, a, b, c, d);
+    if (a & (1 << 1)) {
+      // compacted, so only as big as what is enabled (IA32_XSS is 0)
+      s_save = SAVE_XSAVEC;
+      s_state_size = b;
+    } else if (a & (1 << 0)) {
+      s_save = SAVE_XSAVEOPT;
+    }
+  }
+
+  ::irq::install(T_DEVICE, nm_handler, "Device Not Available");
+
+  // nobody's state is loaded yet
+  s_cpu[cpu_index()].owner = nullptr;
+  stts();
+
+  KINFO("fpu: %s, features %llx, %zu byte state\n",
+        s_save == SAVE_XSAVEC      ? "xsavec"
+        : s_save == SAVE_XSAVEOPT ? "xsaveopt"
+        : s_save == SAVE_XSAVE    ? "xsave"
+                                  : "fxsave",
+        s_xfeatures, s_state_size);
+}
+
+u64 fpu::xfeatures(void) { return s_xfeatures; }
+
+size_t fpu::state_size(void) { return s_state_size; }
+
+void fpu::thread_init(struct thread &thd) {
+  // xsave areas must be 64 byte aligned
+  thd.fpu.buf = kmalloc(s_state_size + 63);
+  thd.fpu.state = (void *)(((off_t)thd.fpu.buf + 63) & ~63);
+  thd.fpu.last_cpu = -1;
+  thd.fpu.live = false;
+
+  // the init state: an empty XSTATE_BV (or zeroed registers for fxrstor),
+  // with the usual control words, which are loaded regardless
+  auto *st = (u8 *)thd.fpu.state;
+  memset(st, 0, s_state_size);
+  *(u16 *)(st + 0) = 0x37f;    // FCW
+  *(u32 *)(st + 24) = 0x1f80;  // MXCSR
+}
+
+void fpu::thread_free(struct thread &thd) {
+  for (int i = 0; i < 16; i++) {
+    struct thread *self = &thd;
+    __atomic_compare_exchange_n(&s_cpu[i].owner, &self, nullptr, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+  kfree(thd.fpu.buf);
+  thd.fpu.buf = thd.fpu.state = nullptr;
+}
+
+void fpu::switch_in(struct thread &thd) {
+  int c = cpu_index();
+  // our registers are still here from last time, untouched since
+  if (s_cpu[c].owner == &thd && thd.fpu.last_cpu == c) {
+    clts();
+    thd.fpu.live = true;
+  }
+}
+
+void fpu::switch_out(struct thread &thd) {
+  if (thd.fpu.live) {
+    save(thd.fpu.state);
+    thd.fpu.live = false;
+  }
+  // the registers stay ours until someone else traps
+  stts();
+}
+
+void fpu::kernel_begin(void) {
+  cpu::pushcli();
+  auto &pc = s_cpu[cpu_index()];
+  assert(!pc.in_kernel);
+  pc.in_kernel = true;
+
+  clts();
+  auto *thd = cpu::current().current_thread;
+  if (thd != nullptr && thd->fpu.live) {
+    save(thd->fpu.state);
+    thd->fpu.live = false;
+  }
+  pc.owner = nullptr;
+}
+
+void fpu::kernel_end(void) {
+  // the thread's state gets loaded again when it next wants it
+  stts();
+  s_cpu[cpu_index()].in_kernel = false;
+  cpu::popcli();
+}
@@ -1,5 +1,6 @@
 #include <arch.h>
 #include <cpu.h>
+#include <hrtimer.h>
 #include <paging.h>
 #include <pit.h>
 #include <printk.h>
@@ -92,7 +93,8 @@ const char *excp_codes[128][2] = {
 };
 
 void arch::irq::eoi(int i) {
-  if (i >= 32) {
+  // vectors past the legacy lines (like IPIs) never came through the PIC
+  if (i >= 32 && i < 48) {
     int pic_irq = i - 32;
     if (pic_irq >= 8) {
       outb(0xA0, 0x20);
@@ -105,7 +107,7 @@ void arch::irq::eoi(int i) {
 
 void arch::irq::enable(int num) {
   // if the interrupt is larger than 32, enable in the ioapic
-  if (num >= 32) {
+  if (num >= 32 && num < 48) {
     smp::ioapicenable(num - 32, /* TODO */ 0);
     pic_enable(num - 32);
   }
@@ -113,7 +115,7 @@ void arch::irq::enable(int num) {
 
 void arch::irq::disable(int num) {
   // if the interrupt is larger than 32, disable in the ioapic
-  if (num >= 32) {
+  if (num >= 32 && num < 48) {
     // smp::ioapicdisable(num);
     pic_disable(num - 32);
   }
@@ -129,20 +131,10 @@ static void mkgate(u32 *idt, u32 n, void *kva, u32 pl, u32 trap) {
   idt[n + 3] = 0;
 }
 
-static u64 last_tsc = 0;
-
-// TODO: move to sched.cpp
+// the local APIC timer, armed for the next hrtimer (the tick among them)
 static void tick_handle(int i, reg_t *tf) {
-  auto &cpu = cpu::current();
-
-  u64 now = arch::read_timestamp();
-
-  last_tsc = now;
-
-  // increment the number of ticks
-  cpu.ticks++;
-  sched::handle_tick(cpu.ticks);
-  return;
+  time::interrupt();
+  sched::handle_tick(cpu::get_ticks());
 }
 
 static void 
@@ -385,7 +377,18 @@ extern "C" void trap(reg_t *regs) {
 
   irq::eoi(tf->trapno);
 
-  // TODO: generalize
-  bool to_userspace = tf->cs == 0x23;
+  bool to_userspace = tf->cs == ((SEG_UCODE << 3) | DPL_USER);
   sched::before_iret(to_userspace);
 }
+
+/*
+ * called from syscall_entry (arch/x86_64/syscall.asm) with a trap frame built
+ * to look like an int 0x80 one, so everything after this can't tell the two
+ * apart
+ */
+extern "C" void syscall_trap(reg_t *regs) {
+  // SYSCALL came in with interrupts masked by FMASK
+  arch::sti();
+  syscall_handle(0x80, regs);
+  sched::before_iret(true);
+}
@@ -1,7 +1,10 @@
 #include <cpu.h>
 #include <dev/serial.h>
 #include <fs/ext2.h>
+#include <fs/tmpfs.h>
 #include <fs/vfs.h>
+#include <fpu.h>
+#include <hrtimer.h>
 #include <kargs.h>
 #include <module.h>
 #include <net/ipv4.h>
@@ -66,6 +69,7 @@ int kernel_init(void *);
 static void kmain2(void) {
   irq::init();
   enable_sse();
+  fpu::init();
 
   call_global_constructors();
 
@@ -75,6 +79,7 @@ static void kmain2(void) {
   if (!smp::init()) panic("smp failed!\n");
   KINFO("Discovered SMP Cores\n");
   smp::lapic_init();
+  time::init();
 
   // initialize the scheduler
   assert(sched::init());
@@ -97,6 +102,26 @@ void init_rootvfs(ref<fs::file> dev) {
   if (vfs::mount_root(move(rootfs)) < 0) panic("failed to mount rootfs");
 }
 
+/*
+ * mount the first multiboot module, a cpio or tar archive, as the root. The
+ * archive stays where the bootloader put it, and its files are read from there
+ */
+bool init_initramfs(void) {
+  if (!(mbinfo->flags & MULTIBOOT_INFO_MODS) || mbinfo->mods_count == 0)
+    return false;
+
+  auto *mod = (multiboot_module_t *)p2v(mbinfo->mods_addr);
+  auto rootfs = make_unique<fs::tmpfs>();
+  if (!rootfs->init()) return false;
+
+  int err = rootfs->unpack(mod->mod_start, mod->mod_end - mod->mod_start);
+  if (err < 0) {
+    KERR("failed to unpack the initramfs (%d)\n", err);
+    return false;
+  }
+  return vfs::mount_root(move(rootfs)) == 0;
+}
+
 int kernel_init(void *) {
   pci::init(); /* initialize the PCI subsystem */
   KINFO("Initialized PCI\n");
@@ -112,9 +137,18 @@ int kernel_init(void *) {
   // open up the disk device for the root filesystem
   const char *rootdev_path = kargs::get("root", "ata0p1");
   KINFO("rootdev=%s\n", rootdev_path);
-  auto rootdev = dev::open(rootdev_path);
-  assert(rootdev);
-  init_rootvfs(rootdev);
+  if (!strcmp(rootdev_path, "initramfs")) {
+    if (!init_initramfs()) panic("failed to mount the initramfs as root\n");
+  } else {
+    auto rootdev = dev::open(rootdev_path);
+    assert(rootdev);
+    init_rootvfs(rootdev);
+  }
+
+  // scratch space lives in memory
+  auto tmp = make_unique<fs::tmpfs>();
+  if (!tmp->init() || vfs::mount(move(tmp), "/tmp") < 0)
+    KWARN("failed to mount tmpfs on /tmp\n");
 
   // setup stdio stuff for the kernel (to be inherited by spawn)
   int fd = sys::open("/dev/console", O_RDWR);
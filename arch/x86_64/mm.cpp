@@ -1,4 +1,6 @@
+#include <cpu.h>
 #include <errno.h>
+#include <lock.h>
 #include <mem.h>
 #include <mm.h>
 #include <multiboot.h>
@@ -7,6 +9,8 @@
 #include <util.h>
 #include <types.h>
 
+#include "smp.h"
+
 #define round_down(x, y) ((x) & ~((y)-1))
 extern int mm_init(void);
 
@@ -28,43 +32,147 @@ static struct mmap_info mm_info;
 
 static u64 *kernel_page_table;
 
+// bumped whenever a new top level table appears in the kernel half, so the
+// address spaces that share it know to pick it up
 int kmem_revision = 0;
 
+/*
+ * PCIDs tag TLB entries with the address space they came from, so loading a
+ * space doesn't have to flush what it left behind last time. Each table gets
+ * its own for as long as it lives. When they run out, tables share pcid 0,
+ * which is flushed every time it is loaded (just like without PCIDs)
+ */
+#define NR_PCIDS 4096
+static u64 pcid_map[NR_PCIDS / 64] = {1};  // pcid 0 is never handed out
+static spinlock pcid_lock;
+
+static int pcid_alloc(void) {
+  if (!smp::pcid_enabled()) return 0;
+
+  int pcid = 0;
+  pcid_lock.lock();
+  for (int i = 0; i < NR_PCIDS / 64; i++) {
+    if (pcid_map[i] == ~0ULL) continue;
+    int b = __builtin_ctzll(~pcid_map[i]);
+    pcid_map[i] |= 1ULL << b;
+    pcid = i * 64 + b;
+    break;
+  }
+  pcid_lock.unlock();
+  return pcid;
+}
+
+static void pcid_free(int pcid) {
+  if (pcid == 0) return;
+  pcid_lock.lock();
+  pcid_map[pcid / 64] &= ~(1ULL << (pcid % 64));
+  pcid_lock.unlock();
+}
+
 namespace x86 {
 class pagetable : public mm::pagetable {
   u64 *pml4;
+  int pcid;
+  // the kmem_revision of the kernel half we last copied in
+  int kern_revision;
+  /*
+   * a bit for each cpu that may have translations from this table cached.
+   * Without PCIDs, loading another table flushes them, so that is just the
+   * cpus that have it loaded. With PCIDs they stay behind, and a cpu's bit is
+   * only dropped by flush(), after which its next load of us does flush
+   */
+  u64 active_cpus = 0;
+
+  void sync_kernel(void);
 
  public:
-  pagetable(u64 *pml4) : pml4(pml4) {}
+  pagetable(u64 *pml4) : pml4(pml4), pcid(pcid_alloc()), kern_revision(-1) {
+    sync_kernel();
+  }
   virtual ~pagetable();
 
   virtual bool switch_to(void) override;
 
-  virtual int add_mapping(off_t va, struct mm::pte &) override;
+  virtual int add_mapping(off_t va, struct mm::pte &,
+                          struct mm::tlb_batch &) override;
   virtual int get_mapping(off_t va, struct mm::pte &) override;
-  virtual int del_mapping(off_t va) override;
+  virtual int del_mapping(off_t va, struct mm::tlb_batch &) override;
+  virtual void flush(struct mm::tlb_batch &) override;
 };
 }  // namespace x86
 
+/*
+ * the kernel half (pml4 entries 272 and up) is the same in every table: they
+ * all point at the kernel's own lower level tables, so mappings made below
+ * those show up everywhere at once. Only a new top level entry needs copying
+ */
+void x86::pagetable::sync_kernel(void) {
+  auto kptable = (u64 *)p2v(kernel_page_table);
+  auto pptable = (u64 *)p2v(pml4);
+  if (kptable == pptable) return;
+
+  int rev = __atomic_load_n(&kmem_revision, __ATOMIC_ACQUIRE);
+  if (rev == kern_revision) return;
+  for (int i = 272; i < 512; i++) pptable[i] = kptable[i];
+  kern_revision = rev;
+}
+
 x86::pagetable::~pagetable(void) {
+  cpu::pushcli();
+  // don't free the table out from under ourselves
+  if (cpu::current().active_pt == this) mm::space::kernel_space().switch_to();
+  cpu::popcli();
+
+  // don't leave any cpu pointing at us
+  for (int i = 0; i < cpunum; i++) {
+    mm::pagetable *self = this;
+    __atomic_compare_exchange_n(&cpus[i].active_pt, &self, nullptr, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+
+  // whatever is still cached under our pcid would turn up in its next owner
+  if (pcid != 0) {
+    u64 targets = __atomic_load_n(&active_cpus, __ATOMIC_ACQUIRE);
+    cpu::pushcli();
+    u64 self = 1ULL << (&cpu::current() - cpus);
+    if (targets & self) smp::tlb_invalidate(pcid, nullptr, -1);
+    cpu::popcli();
+    smp::tlb_shootdown(targets, pcid, nullptr, -1);
+    pcid_free(pcid);
+  }
+
   paging::free_table(pml4);
 }
 
 bool x86::pagetable::switch_to(void) {
-  auto kptable = (u64 *)p2v(kernel_page_table);
-  auto pptable = (u64 *)p2v(pml4);
+  cpu::pushcli();
+  auto &c = cpu::current();
 
-  // TODO: do this with pagefaults instead
-  // TODO: maybe flush the tlb if it changes?
-  if (kptable != pptable) {
-    for (int i = 272; i < 512; i++) {
-      if (kptable[i] == 0) break;  // optimization
-      pptable[i] = kptable[i];
-    }
+  // the same space, so everything is already in place
+  if (c.active_pt == this) {
+    cpu::popcli();
+    return true;
   }
 
-  write_cr3((u64)v2p(pml4));
+  sync_kernel();
+
+  u64 bit = 1ULL << (&c - cpus);
+  auto *prev = (x86::pagetable *)c.active_pt;
+  if (prev != nullptr && !smp::pcid_enabled())
+    __atomic_and_fetch(&prev->active_cpus, ~bit, __ATOMIC_ACQ_REL);
+
+  // publish that we are here before looking at our bit, so a flush() that
+  // clears it either sees us and sends an IPI or makes us flush on load
+  __atomic_store_n(&c.active_pt, this, __ATOMIC_SEQ_CST);
+  u64 old = __atomic_fetch_or(&active_cpus, bit, __ATOMIC_SEQ_CST);
+
+  u64 cr3 = (u64)v2p(pml4) | pcid;
+  // our bit survived since we were last here, so whatever is cached for this
+  // pcid is still good
+  if (pcid != 0 && (old & bit)) cr3 |= CR3_NOFLUSH;
+  write_cr3(cr3);
 
+  cpu::popcli();
   return true;
 }
 
@@ -73,13 +181,20 @@ ref<mm::pagetable> mm::pagetable::create() {
   return make_ref<x86::pagetable>(pml4);
 }
 
-int x86::pagetable::add_mapping(off_t va, struct mm::pte &p) {
+int x86::pagetable::add_mapping(off_t va, struct mm::pte &p,
+                                struct mm::tlb_batch &tlb) {
   int flags = PTE_P;
   // TOOD: if (p.prot | PROT_READ)
   if (va < KERNEL_VIRTUAL_BASE) flags |= PTE_U;
   if (p.prot & PROT_WRITE) flags |= PTE_W;
   if ((p.prot & PROT_EXEC) == 0) flags |= PTE_NX;
-  map_into(pml4, va, p.ppn << 12, paging::pgsize::page, flags);
+
+  u64 *pte = paging::find_mapping(pml4, va, paging::pgsize::page);
+  u64 old = *pte;
+  // only the low flag bits, as map_into has always done
+  *pte = ((p.ppn << 12) & ~0xFFF) | (u16)flags;
+  // a new mapping can't be cached anywhere, a replaced one can
+  if (old & PTE_P) tlb.add(va);
 
   return 0;
 }
@@ -94,11 +209,53 @@ int x86::pagetable::get_mapping(off_t va, struct mm::pte &r) {
 
   return 0;
 }
-int x86::pagetable::del_mapping(off_t va) {
-  *paging::find_mapping(pml4, va, paging::pgsize::page) = 0;
+int x86::pagetable::del_mapping(off_t va, struct mm::tlb_batch &tlb) {
+  u64 *pte = paging::find_mapping(pml4, va, paging::pgsize::page);
+  if (*pte & PTE_P) tlb.add(va);
+  *pte = 0;
   return 0;
 }
 
+void x86::pagetable::flush(struct mm::tlb_batch &tlb) {
+  if (tlb.empty()) return;
+
+  int count = tlb.all ? -1 : tlb.count;
+  int id = pcid;
+  u64 targets = 0;
+
+  if ((u64 *)p2v(pml4) == (u64 *)p2v(kernel_page_table)) {
+    // the kernel half is in every table, so it can be cached by any cpu under
+    // any pcid
+    targets = (1ULL << cpunum) - 1;
+    id = -1;
+  } else if (!smp::pcid_enabled()) {
+    targets = __atomic_load_n(&active_cpus, __ATOMIC_ACQUIRE);
+  } else {
+    u64 mask = __atomic_load_n(&active_cpus, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < cpunum; i++) {
+      u64 bit = 1ULL << i;
+      if (!(mask & bit)) continue;
+      if (__atomic_load_n(&cpus[i].active_pt, __ATOMIC_SEQ_CST) != this) {
+        // not loaded there, so rather than interrupt it, make its next load
+        // flush. If it loaded us in the meantime, it missed that and needs
+        // the IPI after all
+        __atomic_and_fetch(&active_cpus, ~bit, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cpus[i].active_pt, __ATOMIC_SEQ_CST) != this)
+          continue;
+      }
+      targets |= bit;
+    }
+  }
+
+  cpu::pushcli();
+  u64 self = 1ULL << (&cpu::current() - cpus);
+  if (targets & self) smp::tlb_invalidate(id, tlb.vas, count);
+  cpu::popcli();
+
+  smp::tlb_shootdown(targets, id, tlb.vas, count);
+  tlb.clear();
+}
+
 /**
  * ksbrk - shift the end of the heap further.
  */
@@ -121,6 +278,29 @@ void *ksbrk(i64 inc) {
 }
 
 
+/*
+ * give [start, end) to the physical allocator, except for the memory that
+ * multiboot modules (like the initramfs) were loaded into
+ */
+static void free_around_modules(u8 *start, u8 *end) {
+  if (start >= end) return;
+
+  if (multiboot_info_ptr->flags & MULTIBOOT_INFO_MODS) {
+    auto *mods = (multiboot_module_t *)(u64)multiboot_info_ptr->mods_addr;
+    for (u32 i = 0; i < multiboot_info_ptr->mods_count; i++) {
+      auto *mstart = (u8 *)round_down((u64)mods[i].mod_start, 4096);
+      auto *mend = (u8 *)round_up((u64)mods[i].mod_end, 4096);
+      if (mstart < end && start < mend) {
+        free_around_modules(start, mstart);
+        free_around_modules(mend, end);
+        return;
+      }
+    }
+  }
+
+  phys::free_range(start, end);
+}
+
 void arch::mem_init(unsigned long mbd) {
   multiboot_info_ptr = (multiboot_info_t *)mbd;
 
@@ -189,7 +369,7 @@ void arch::mem_init(unsigned long mbd) {
     if (end < kend) continue;
     if (start < kend) start = kend + PGSIZE;
 
-    phys::free_range(start, end);
+    free_around_modules(start, end);
   }
 
   u64 page_step = PAGE_SIZE;
@@ -124,6 +124,9 @@ u64 *paging::find_mapping(u64 *pml4, u64 va, pgsize size) {
         pflags |= PTE_U;
       }
       table[ind] = (u64)(new_table) | pflags;
+      // the other address spaces only share the kernel half below this level
+      if (i == 3 && va >= KERNEL_VIRTUAL_BASE)
+        __atomic_add_fetch(&kmem_revision, 1, __ATOMIC_RELEASE);
     }
 
     INFO("table(%p)[%d, ind=%d] = %p\n", table, i, ind, table[ind]);
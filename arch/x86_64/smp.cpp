@@ -1,7 +1,11 @@
+#include <arch.h>
+#include <cpu.h>
 #include <func.h>
 #include <idt.h>
+#include <lock.h>
 #include <mem.h>
 #include <paging.h>
+#include <pit.h>
 #include "smp.h"
 #include <vec.h>
 
@@ -39,6 +43,7 @@
 #define LAPIC_TIMER (0x0320 / 4)   // Local Vector Table 0 (TIMER)
 #define LAPIC_X1 0x0000000B        // divide counts by 1
 #define LAPIC_PERIODIC 0x00020000  // Periodic
+#define LAPIC_TSC_DEADLINE 0x00040000  // fire when the TSC reaches a deadline
 #define LAPIC_PCINT (0x0340 / 4)   // Performance Counter LVT
 #define LAPIC_LINT0 (0x0350 / 4)   // Local Vector Table 1 (LINT0)
 #define LAPIC_LINT1 (0x0360 / 4)   // Local Vector Table 2 (LINT1)
@@ -83,7 +88,65 @@ void smp::ioapicenable(int irq, int cpunum) {
 }
 
 static uint32_t *lapic = NULL;
-static uint32_t ticksin10ms = 0;
+
+// what the timer counts at, found by timing it against the PIT
+static u64 lapic_khz = 0;
+// the timer can be given a TSC value to go off at, rather than a count
+static bool have_tsc_deadline = false;
+
+extern "C" void wrmsr(u32 msr, u64 val);
+
+#define CALIBRATE_MS 50
+
+/*
+ * time the timer (and the TSC, which is the clock everything else uses)
+ * against a stretch of the PIT, which runs at a known rate
+ */
+static void lapic_calibrate(void) {
+  auto &c = cpu::current();
+
+  smp::lapic_write(LAPIC_TDCR, LAPIC_X1);
+  smp::lapic_write(LAPIC_TIMER, LAPIC_MASKED | T_IRQ0);
+  smp::lapic_write(LAPIC_TICR, 0xFFFFFFFF);
+  u64 start = arch::read_timestamp();
+
+  pit_spin_ms(CALIBRATE_MS);
+
+  u32 left = lapic[LAPIC_TCCR];
+  u64 cycles = arch::read_timestamp() - start;
+  smp::lapic_write(LAPIC_TICR, 0);
+
+  lapic_khz = (0xFFFFFFFF - left) / CALIBRATE_MS;
+  c.speed_khz = cycles / CALIBRATE_MS;
+  KINFO("TSC runs at %u khz, the LAPIC timer at %llu khz\n", c.speed_khz,
+        lapic_khz);
+}
+
+void arch::timer_arm(unsigned long deadline) {
+  if (!lapic) return;
+
+  if (have_tsc_deadline) {
+    // 0 disarms it, and a deadline in the past goes off right away
+    wrmsr(MSR_TSC_DEADLINE, deadline);
+    return;
+  }
+
+  if (deadline == 0) {
+    smp::lapic_write(LAPIC_TICR, 0);
+    return;
+  }
+
+  u64 now = arch::read_timestamp();
+  u64 khz = cpu::current().speed_khz;
+  u64 count = 1;
+  if (deadline > now && khz != 0)
+    count = (unsigned __int128)(deadline - now) * lapic_khz / khz;
+  // too far out to count to, so go off early and get armed again then
+  if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+  if (count == 0) count = 1;
+  smp::lapic_write(LAPIC_TICR, count);
+}
+
 void smp::lapic_init(void) {
   if (!lapic) return;
 
@@ -92,18 +155,23 @@ void smp::lapic_init(void) {
   // Enable local APIC; set spurious interrupt vector.
   lapic_write(LAPIC_SVR, LAPIC_ENABLE | (32 + 31 /* spurious */));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If we cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  lapic_calibrate();
 
-  if (ticksin10ms == 0) {
-    ticksin10ms = 1000000;
-  }
+  // the timer only goes off when it is armed for the next timer event (see
+  // kernel/hrtimer.cpp), preferably straight from a TSC deadline
+  u32 eax, ebx, ecx, edx;
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(1), "c"(0));
+  have_tsc_deadline = (ecx >> 24) & 1;
 
   lapic_write(LAPIC_TDCR, LAPIC_X1);
-  lapic_write(LAPIC_TIMER, LAPIC_PERIODIC | (32));
-  lapic_write(LAPIC_TICR, ticksin10ms);
+  if (have_tsc_deadline) {
+    lapic_write(LAPIC_TIMER, LAPIC_TSC_DEADLINE | T_IRQ0);
+  } else {
+    // one-shot
+    lapic_write(LAPIC_TIMER, T_IRQ0);
+  }
 
   // Disable logical interrupt lines.
   lapic_write(LAPIC_LINT0, LAPIC_MASKED);
@@ -167,6 +235,96 @@ void smp::lapic_eoi(void) {
   if (lapic) lapic_write(LAPIC_EOI, 0);
 }
 
+static void send_ipi(int apic_id, int vector) {
+  smp::lapic_write(LAPIC_ICRHI, apic_id << 24);
+  smp::lapic_write(LAPIC_ICRLO, LAPIC_FIXED | LAPIC_ASSERT | vector);
+  while (lapic[LAPIC_ICRLO] & LAPIC_DELIVS)
+    ;
+}
+
+/*
+ * TLB shootdown. One request is out at a time: the sender fills in
+ * `shootdown`, interrupts each target, and waits for them all to count
+ * `pending` down. Senders wait with interrupts on, so two cpus shooting at
+ * each other still answer each other
+ */
+static spinlock shootdown_lock;
+static struct {
+  int pcid;
+  const off_t *vas;
+  int count;
+  int pending;
+} shootdown;
+
+// INVPCID can drop everything but the global (kernel) entries without
+// reloading cr3, and entries of spaces other than the loaded one
+static bool have_invpcid = false;
+static bool have_pcid = false;
+
+bool smp::pcid_enabled(void) { return have_pcid; }
+
+static inline void invpcid(u64 type, u64 pcid, u64 va) {
+  struct {
+    u64 pcid;
+    u64 va;
+  } desc = {pcid, va};
+  asm volatile("invpcid %0, %1" ::"m"(desc), "r"(type) : "memory");
+}
+
+void smp::tlb_invalidate(int pcid, const off_t *vas, int count) {
+  if (have_pcid) {
+    // the kernel half, which every pcid has a copy of. There is no way to
+    // drop one page from all of them, so drop everything
+    if (pcid < 0) {
+      invpcid(2, 0, 0);
+      return;
+    }
+    // the space may or may not be the one loaded here
+    if (count < 0) {
+      invpcid(1, pcid, 0);
+      return;
+    }
+    for (int i = 0; i < count; i++) invpcid(0, pcid, vas[i]);
+    return;
+  }
+
+  if (count < 0) {
+    if (have_invpcid)
+      invpcid(3, 0, 0);
+    else
+      arch::flush_tlb();
+    return;
+  }
+  for (int i = 0; i < count; i++) arch::invalidate_page(vas[i]);
+}
+
+static void tlb_shootdown_handler(int i, reg_t *) {
+  smp::tlb_invalidate(shootdown.pcid, shootdown.vas, shootdown.count);
+  __atomic_sub_fetch(&shootdown.pending, 1, __ATOMIC_RELEASE);
+}
+
+void smp::tlb_shootdown(u64 targets, int pcid, const off_t *vas, int count) {
+  if (!lapic) return;
+
+  // the lapic id is the index into the global cpus array
+  targets &= ~(1ULL << (&cpu::current() - ::cpus));
+  if (targets == 0) return;
+
+  shootdown_lock.lock();
+  shootdown.pcid = pcid;
+  shootdown.vas = vas;
+  shootdown.count = count;
+  __atomic_store_n(&shootdown.pending, __builtin_popcountll(targets),
+                   __ATOMIC_RELEASE);
+
+  for (int id = 0; targets != 0; id++, targets >>= 1)
+    if (targets & 1) send_ipi(id, T_TLB_SHOOTDOWN);
+
+  while (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) != 0)
+    asm("pause");
+  shootdown_lock.unlock();
+}
+
 smp::mp::mp_table_entry_ioapic *ioapic_entry = NULL;
 
 static smp::mp::mp_float_ptr_struct *find_mp_floating_ptr(void) {
@@ -261,14 +419,14 @@ static bool parse_mp_table(smp::mp::mp_table *table) {
 static smp::mp::mp_float_ptr_struct *mp_floating_ptr;
 
 // global variable that stores the CPUs
-static vec<smp::cpu_state *> cpus;
+static vec<smp::cpu_state *> cpu_states;
 
 smp::cpu_state &smp::get_state(void) {
   // TODO: get the real cpu number
   auto cpu_index = 0;
 
   // return the cpu at that index, unchecked.
-  return *cpus[cpu_index];
+  return *cpu_states[cpu_index];
 }
 
 bool smp::init(void) {
@@ -286,8 +444,27 @@ bool smp::init(void) {
 
   INFO("cpunum = %d\n", cpunum());
 
+  u32 eax, ebx, ecx, edx;
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(7), "c"(0));
+  have_invpcid = (ebx >> 10) & 1;
+
+  // PCIDs are only worth it with INVPCID to clean up after them. cr3 has
+  // pcid 0 right now, which enabling them requires
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+               : "a"(1), "c"(0));
+  if (have_invpcid && ((ecx >> 17) & 1)) {
+    write_cr4(read_cr4() | CR4_PCIDE);
+    have_pcid = true;
+    INFO("using PCIDs\n");
+  }
+
+  ::irq::install(T_TLB_SHOOTDOWN, tlb_shootdown_handler, "TLB Shootdown");
+
   // mp table was parsed and loaded into global memory
-  INFO("ncpus: %d\n", cpus.size());
+  INFO("ncpus: %d\n", cpu_states.size());
   return true;
 }
 
@@ -39,6 +39,21 @@ int cpunum(void);
 
 void ioapicenable(int irq, int cpu);
 
+// address spaces are tagged with PCIDs (see x86::pagetable)
+bool pcid_enabled(void);
+
+/*
+ * invalidate `count` pages of the address space tagged `pcid` (or, if count
+ * is -1, all of it) in the TLB of each cpu in the `cpus` bitmask, and wait
+ * until they all have. The calling cpu is skipped, so do its own with
+ * tlb_invalidate. A pcid of -1 means every address space, for the shared
+ * kernel half. Without PCIDs, `pcid` is ignored and only the loaded space is
+ * affected
+ */
+void tlb_shootdown(u64 cpus, int pcid, const off_t *vas, int count);
+// the same, on this cpu only
+void tlb_invalidate(int pcid, const off_t *vas, int count);
+
 // the first field of the floating structure must be this value
 
 // use mp tables, as they are a little easier.
@@ -0,0 +1,100 @@
+;; SYSCALL entry point.
+;;
+;; SYSCALL leaves the user's rip in rcx and rflags in r11, and doesn't touch the
+;; stack, so the first thing to do is get onto the thread's kernel stack, which
+;; cpu::switch_vm keeps in the per-cpu area that KERNEL_GS_BASE points to. From
+;; there the same trap frame trap.asm builds is pushed, so the syscall code,
+;; the scheduler and anything that returns through trapret see no difference.
+
+extern syscall_trap
+extern trapret
+
+global syscall_entry
+
+;; offsets into struct syscall_percpu (arch/x86_64/cpu.cpp)
+PERCPU_KERNEL_RSP equ 0
+PERCPU_USER_RSP equ 8
+
+;; (SEG_UDATA << 3) | DPL_USER and (SEG_UCODE << 3) | DPL_USER
+USER_SS equ 0x23
+USER_CS equ 0x2B
+
+;; the offsets of the iret part of the trap frame, once the registers are popped
+FRAME_RIP equ 0
+FRAME_RFLAGS equ 16
+FRAME_RSP equ 24
+
+syscall_entry:
+	swapgs
+	mov [gs:PERCPU_USER_RSP], rsp
+	mov rsp, [gs:PERCPU_KERNEL_RSP]
+
+	;; the iret frame, then trapno and error code
+	push qword USER_SS
+	push qword [gs:PERCPU_USER_RSP]
+	push r11
+	push qword USER_CS
+	push rcx
+	push qword 0
+	push qword 0x80
+
+	;; the kernel doesn't use GS, so give the user's back now, while
+	;; interrupts are still off
+	swapgs
+
+	push r15
+	push r14
+	push r13
+	push r12
+	push r11
+	push rbp
+	push rcx
+	push rbx
+
+	push r9
+	push r8
+	push r10
+	push rdx
+	push rsi
+	push rdi
+	push rax
+
+	mov rdi, rsp ; frame in arg1
+	call syscall_trap
+
+	cli
+
+	;; SYSRET with a non-canonical rip faults in ring 0 on the user's stack. If
+	;; the frame was changed to return somewhere odd, let iretq deal with it
+	mov rcx, [rsp + 17 * 8]
+	mov r11, rcx
+	sar r11, 47
+	jz .fast
+	cmp r11, -1
+	jne trapret
+
+.fast:
+	pop rax
+	pop rdi
+	pop rsi
+	pop rdx
+	pop r10
+	pop r8
+	pop r9
+
+	pop rbx
+	pop rcx ; clobbered below, SYSCALL doesn't preserve it
+	pop rbp
+	pop r11 ; same
+	pop r12
+	pop r13
+	pop r14
+	pop r15
+
+	;; discard trapno and errorcode
+	add rsp, 16
+
+	mov rcx, [rsp + FRAME_RIP]
+	mov r11, [rsp + FRAME_RFLAGS]
+	mov rsp, [rsp + FRAME_RSP]
+	o64 sysret
@@ -0,0 +1,184 @@
+;; The code page of the vDSO (see include/vdso.h).
+;;
+;; Nothing here runs in the kernel: kernel/vdso.cpp copies the section into a
+;; page which is mapped into userspace at VDSO_CODE, right after the data page.
+;; Everything must therefore be position independent, and the data page is
+;; reached relative to the start of the code.
+
+global vdso_image_start
+global vdso_image_end
+
+VDSO_MAGIC equ 0x4f534456
+VDSO_NR_FUNCS equ 4
+VDSO_MAX_CPUS equ 16
+
+;; offsets into struct vdso_data
+VD_SEQ equ 0
+VD_TSC_MULT equ 16
+VD_TICK_TSC equ 32
+VD_MONO_NS equ 40
+VD_WALL_NS equ 48
+VD_CPUS equ 64
+
+;; offsets into struct vdso_cpu
+VC_SEQ equ 0
+VC_PID equ 4
+VC_TID equ 8
+VC_SIZE equ 16
+
+;; (SEG_CPUNUM << 3) | DPL_USER. The limit of that segment is the cpu's index
+CPUNUM_SEL equ 0x43
+
+CLOCK_REALTIME equ 0
+CLOCK_MONOTONIC equ 1
+
+EINVAL equ 22
+ENOSYS equ 38
+
+NSEC_PER_SEC equ 1000000000
+
+section .vdso
+
+vdso_image_start:
+	dd VDSO_MAGIC
+	dd VDSO_NR_FUNCS
+
+;; the jump table, one 8 byte slot per function in VDSO_FUNC order
+%macro slot 1
+	jmp near %1
+	align 8, db 0xcc
+%endmacro
+	slot vdso_clock_gettime
+	slot vdso_time
+	slot vdso_getpid
+	slot vdso_gettid
+
+%define vvar(off) [rel vdso_image_start - 4096 + off]
+
+
+;; long vdso_clock_gettime(int clock, struct timespec *ts)
+vdso_clock_gettime:
+	cmp edi, CLOCK_MONOTONIC
+	ja .einval
+
+.retry:
+	mov ecx, vvar(VD_SEQ)
+	test ecx, 1
+	jnz .busy
+
+	mov r9, vvar(VD_TICK_TSC)
+	mov r10, vvar(VD_TSC_MULT)
+	;; no calibrated TSC to extrapolate with
+	test r10, r10
+	jz .nosys
+	mov r11, vvar(VD_MONO_NS)
+	cmp edi, CLOCK_REALTIME
+	jne .read_tsc
+	mov r11, vvar(VD_WALL_NS)
+
+.read_tsc:
+	;; don't let the TSC be read before the fields above
+	lfence
+	rdtsc
+	shl rdx, 32
+	or rax, rdx
+	sub rax, r9
+	jae .scale
+	;; another cpu's TSC can be a little behind the boot cpu's
+	xor eax, eax
+.scale:
+	;; ns since the tick = cycles * mult >> 32, in 128 bits so a long gap
+	;; between ticks can't overflow
+	mul r10
+	shrd rax, rdx, 32
+	add r11, rax
+
+	cmp ecx, vvar(VD_SEQ)
+	jne .retry
+
+	mov rax, r11
+	xor edx, edx
+	mov r9, NSEC_PER_SEC
+	div r9
+	mov [rsi], rax
+	mov [rsi + 8], rdx
+	xor eax, eax
+	ret
+
+.busy:
+	pause
+	jmp .retry
+
+.einval:
+	mov rax, -EINVAL
+	ret
+
+.nosys:
+	mov rax, -ENOSYS
+	ret
+
+
+;; time_t vdso_time(time_t *tloc). Only as precise as the last tick, which is
+;; plenty for whole seconds
+vdso_time:
+	cmp qword vvar(VD_TSC_MULT), 0
+	je .nosys
+	mov rax, vvar(VD_WALL_NS)
+	xor edx, edx
+	mov rcx, NSEC_PER_SEC
+	div rcx
+	test rdi, rdi
+	jz .done
+	mov [rdi], rax
+.done:
+	ret
+
+.nosys:
+	mov rax, -ENOSYS
+	ret
+
+
+;; long vdso_getpid(void)
+vdso_getpid:
+	mov esi, VC_PID
+	jmp cpu_slot_read
+
+;; long vdso_gettid(void)
+vdso_gettid:
+	mov esi, VC_TID
+	;; fall through
+
+;; read the field at offset rsi of this cpu's struct vdso_cpu. That is our own
+;; thread's only if we ran on the same cpu the whole time, so check the cpu
+;; didn't change and didn't switch threads (which bumps the slot's seq)
+cpu_slot_read:
+.retry:
+	mov edi, CPUNUM_SEL
+	lsl edi, edi
+	jnz .nosys
+	cmp edi, VDSO_MAX_CPUS
+	jae .nosys
+
+	mov edx, edi
+	shl edx, 4 ; * VC_SIZE
+	lea r8, vvar(VD_CPUS)
+	add r8, rdx
+
+	mov ecx, [r8 + VC_SEQ]
+	mov eax, [r8 + rsi]
+
+	mov edx, CPUNUM_SEL
+	lsl edx, edx
+	cmp edx, edi
+	jne .retry
+	cmp ecx, [r8 + VC_SEQ]
+	jne .retry
+
+	movsxd rax, eax
+	ret
+
+.nosys:
+	mov rax, -ENOSYS
+	ret
+
+vdso_image_end:
@@ -4,9 +4,11 @@
 #include <cpu.h>
 #include <dev/driver.h>
 #include <dev/mbr.h>
+#include <hrtimer.h>
 #include <lock.h>
 #include <mem.h>
 #include <module.h>
+#include <mutex.h>
 #include <pci.h>
 #include <phys.h>
 #include <printk.h>
@@ -38,6 +40,9 @@
 #define ATA_IRQ2 (32 + 11)
 #define ATA_IRQ3 (32 + 9)
 
+// the sector count register is 8 bits, and 0 means 256
+#define ATA_MAX_PIO_SECTORS 255u
+
 #define ATA_CMD_READ_PIO 0x20
 #define ATA_CMD_READ_DMA 0xC8
 
@@ -67,12 +72,37 @@
 #define BMR_STATUS_ERR 0x2
 
 waitqueue ata_wq;
+// how many threads are asleep on ata_wq (or about to be). The interrupt only
+// notifies when there is one, since the waitqueue would otherwise bank a
+// wakeup for every command that finished while its issuer was still polling
+static int ata_sleepers = 0;
+
+// how many times to look at a busy drive before sleeping between looks
+#define ATA_SPIN_POLLS 1000
+
+/*
+ * called each time a poll finds the drive still busy. Most commands are done
+ * within a few polls, but past that, sleep until the drive interrupts. The
+ * interrupt can go to a command on the other drive, so look again each tick
+ */
+static void ata_backoff(int polls) {
+  if (polls >= ATA_SPIN_POLLS && cpu::in_thread() && sched::enabled()) {
+    __atomic_fetch_add(&ata_sleepers, 1, __ATOMIC_SEQ_CST);
+    ata_wq.wait_timeout(TICK_NS);
+    __atomic_fetch_sub(&ata_sleepers, 1, __ATOMIC_SEQ_CST);
+  }
+}
 
 /**
- * TODO: use per-channel ATA mutex locks. Right now every ata drive is locked
- * the same way
+ * one per channel, held across whole commands, which sleep while the drive
+ * works. Drives on different channels run their commands side by side
  */
-static spinlock drive_lock;
+static mutex channel_locks[2];
+
+static mutex *channel_lock(u16 io_base) {
+  // the secondary channel's registers start at 0x170
+  return &channel_locks[io_base == 0x170 ? 1 : 0];
+}
 
 /*
  * TODO: determine if we need this function
@@ -87,7 +117,8 @@ u16 primary_master_bmr_status = 0;
 u16 primary_master_bmr_command = 0;
 
 dev::ata::ata(u16 portbase, bool master) : dev::blk_dev(nullptr) {
-  drive_lock.lock();
+  m_lock = channel_lock(portbase);
+  m_lock->lock();
   m_io_base = portbase;
   TRACE;
   sector_size = 512;
@@ -104,17 +135,17 @@ dev::ata::ata(u16 portbase, bool master) : dev::blk_dev(nullptr) {
   control_port = portbase + 0x206;
 
   m_dma_buffer = nullptr;
-  drive_lock.unlock();
+  m_lock->unlock();
 }
 
 dev::ata::~ata() {
-  drive_lock.lock();
+  m_lock->lock();
   TRACE;
   kfree(id_buf);
   if (m_dma_buffer != 0) {
     phys::free(m_dma_buffer);
   }
-  drive_lock.unlock();
+  m_lock->unlock();
 }
 
 void dev::ata::select_device() {
@@ -123,7 +154,7 @@ void dev::ata::select_device() {
 }
 
 bool dev::ata::identify() {
-  drive_lock.lock();
+  m_lock->lock();
 
   // select the correct device
   select_device();
@@ -135,7 +166,7 @@ bool dev::ata::identify() {
 
   // not valid, no device on that bus
   if (status == 0xFF) {
-    drive_lock.unlock();
+    m_lock->unlock();
     return false;
   }
 
@@ -150,7 +181,7 @@ bool dev::ata::identify() {
 
   status = command_port.in();
   if (status == 0x00) {
-    drive_lock.unlock();
+    m_lock->unlock();
     return false;
   }
 
@@ -161,7 +192,7 @@ bool dev::ata::identify() {
 
   if (status & 0x01) {
     printk("error identifying ATA drive. status=%02x\n", status);
-    drive_lock.unlock();
+    m_lock->unlock();
     return false;
   }
 
@@ -206,7 +237,7 @@ bool dev::ata::identify() {
     }
   }
 
-  drive_lock.unlock();
+  m_lock->unlock();
   return true;
 }
 
@@ -217,19 +248,54 @@ bool dev::ata::read_block(u32 sector, u8* data) {
   if (use_dma) {
     return read_block_dma(sector, data);
   }
+  return read_blocks_pio(sector, 1, data);
+}
 
-  // take a scoped lock
-  scoped_lock lck(drive_lock);
+bool dev::ata::write_block(u32 sector, const u8* buf) {
+  TRACE;
+  return write_blocks_pio(sector, 1, buf);
+}
 
-  // printk("read block %d\n", sector);
+bool dev::ata::read_blocks(u32 sector, u32 count, u8* data) {
+  TRACE;
+  // split the run into as few commands as the transfer mode allows
+  u32 max = use_dma ? dma_max_sectors() : ATA_MAX_PIO_SECTORS;
+  while (count > 0) {
+    u32 n = min(count, max);
+    bool ok = use_dma ? read_blocks_dma(sector, n, data)
+                      : read_blocks_pio(sector, n, data);
+    if (!ok) return false;
+    sector += n;
+    count -= n;
+    data += n * sector_size;
+  }
+  return true;
+}
+
+bool dev::ata::write_blocks(u32 sector, u32 count, const u8* data) {
+  TRACE;
+  while (count > 0) {
+    u32 n = min(count, ATA_MAX_PIO_SECTORS);
+    if (!write_blocks_pio(sector, n, data)) return false;
+    sector += n;
+    count -= n;
+    data += n * sector_size;
+  }
+  return true;
+}
+
+bool dev::ata::read_blocks_pio(u32 sector, u32 count, u8* data) {
+  TRACE;
+  // take a scoped lock
+  scoped_lock lck(*m_lock);
 
   if (sector & 0xF0000000) return false;
+  if (count == 0 || count > ATA_MAX_PIO_SECTORS) return false;
 
   // select the correct device, and put bits of the address
   device_port.out((master ? 0xE0 : 0xF0) | ((sector & 0x0F000000) >> 24));
   error_port.out(0);
-  // read a single sector
-  sector_count_port.out(1);
+  sector_count_port.out(count);
 
   lba_low_port.out((sector & 0x00FF));
   lba_mid_port.out((sector & 0xFF00) >> 8);
@@ -238,37 +304,39 @@ bool dev::ata::read_block(u32 sector, u8* data) {
   // read command
   command_port.out(0x20);
 
-  u8 status = wait();
-  if (status & 0x1) {
-    printk("error reading ATA drive\n");
-    return false;
-  }
-
   auto* buf = (char*)data;
 
-  for (u16 i = 0; i < sector_size; i += 2) {
-    u16 d = data_port.in();
+  // the drive raises DRQ once per sector
+  for (u32 s = 0; s < count; s++) {
+    u8 status = wait();
+    if (status & 0x1) {
+      printk("error reading ATA drive\n");
+      return false;
+    }
+
+    for (u16 i = 0; i < sector_size; i += 2) {
+      u16 d = data_port.in();
 
-    buf[i] = d & 0xFF;
-    buf[i + 1] = (d >> 8) & 0xFF;
+      buf[i] = d & 0xFF;
+      buf[i + 1] = (d >> 8) & 0xFF;
+    }
+    buf += sector_size;
   }
 
   return true;
 }
 
-bool dev::ata::write_block(u32 sector, const u8* buf) {
+bool dev::ata::write_blocks_pio(u32 sector, u32 count, const u8* buf) {
   TRACE;
-  scoped_lock lck(drive_lock);
-
-  // hexdump((void*)buf, 512);
+  scoped_lock lck(*m_lock);
 
   if (sector & 0xF0000000) return false;
+  if (count == 0 || count > ATA_MAX_PIO_SECTORS) return false;
 
   // select the correct device, and put bits of the address
   device_port.out((master ? 0xE0 : 0xF0) | ((sector & 0x0F000000) >> 24));
   error_port.out(0);
-  // write a single sector
-  sector_count_port.out(1);
+  sector_count_port.out(count);
 
   lba_low_port.out((sector & 0x00FF));
   lba_mid_port.out((sector & 0xFF00) >> 8);
@@ -277,12 +345,23 @@ bool dev::ata::write_block(u32 sector, const u8* buf) {
   // write command
   command_port.out(0x30);
 
-  for (u16 i = 0; i < sector_size; i += 2) {
-    u16 d = buf[i];
-    d |= ((u16)buf[i + 1]) << 8;
-    data_port.out(d);
+  for (u32 s = 0; s < count; s++) {
+    // wait for the drive to ask for the next sector
+    u8 status = wait();
+    if (status & 0x1) {
+      printk("error writing ATA drive\n");
+      return false;
+    }
+
+    for (u16 i = 0; i < sector_size; i += 2) {
+      u16 d = buf[i];
+      d |= ((u16)buf[i + 1]) << 8;
+      data_port.out(d);
+    }
+    buf += sector_size;
   }
 
+  // only flush the write cache once for the whole run
   flush();
 
   return true;
@@ -293,11 +372,7 @@ bool dev::ata::flush(void) {
   device_port.out(master ? 0xE0 : 0xF0);
   command_port.out(0xE7);
 
-  // TODO: schedule out while waiting?
-  u8 status = command_port.in();
-  while (((status & 0x80) == 0x80) && ((status & 0x01) != 0x01)) {
-    status = command_port.in();
-  }
+  u8 status = wait();
   if (status & 0x1) {
     printk("error flushing ATA drive\n");
     return false;
@@ -308,20 +383,14 @@ bool dev::ata::flush(void) {
 u8 dev::ata::wait(void) {
   TRACE;
 
-  if (cpu::in_thread() && false) {
-    // wait, but don't allow rude awakening
-    ata_wq.wait_noint();
-    return 0;
-  } else {
-    // TODO: schedule out while waiting?
-    u8 status = command_port.in();
-    while (((status & 0x80) == 0x80) && ((status & 0x01) != 0x01)) {
-      status = command_port.in();
-    }
-
-    return status;
+  u8 status = command_port.in();
+  for (int polls = 0; ((status & 0x80) == 0x80) && ((status & 0x01) != 0x01);
+       polls++) {
+    ata_backoff(polls);
+    status = command_port.in();
   }
-  return -1;
+
+  return status;
 }
 
 u64 dev::ata::sector_count(void) {
@@ -337,15 +406,25 @@ size_t dev::ata::block_size() {
 ssize_t dev::ata::size() { return sector_size * n_sectors; }
 
 bool dev::ata::read_block_dma(u32 sector, u8* data) {
-  TRACE;
+  return read_blocks_dma(sector, 1, data);
+}
 
-  // TODO: take a lock.
+u32 dev::ata::dma_max_sectors(void) {
+  // the data lives in the same page as the prdt
+  return (PGSIZE - sizeof(prdt_t)) / sector_size;
+}
+
+bool dev::ata::read_blocks_dma(u32 sector, u32 count, u8* data) {
+  TRACE;
+  // the dma buffer is shared too
+  scoped_lock lck(*m_lock);
 
   if (sector & 0xF0000000) return false;
+  if (count == 0 || count > dma_max_sectors()) return false;
 
   // setup the prdt for DMA
   auto* prdt = static_cast<prdt_t*>(p2v(m_dma_buffer));
-  prdt->transfer_size = sector_size;
+  prdt->transfer_size = sector_size * count;
   prdt->buffer_phys = (u64)m_dma_buffer + sizeof(prdt_t);
   prdt->mark_end = 0x8000;
 
@@ -367,8 +446,7 @@ bool dev::ata::read_block_dma(u32 sector, u8* data) {
   device_port.out((master ? 0xE0 : 0xF0) | ((sector & 0x0F000000) >> 24));
   // clear the error port
   error_port.out(0);
-  // read a single sector
-  sector_count_port.out(1);
+  sector_count_port.out(count);
 
   lba_low_port.out((sector & 0x00FF));
   lba_mid_port.out((sector & 0xFF00) >> 8);
@@ -380,24 +458,18 @@ bool dev::ata::read_block_dma(u32 sector, u8* data) {
   // start bus master
   outb(bmr_command, 0x9);
 
-  int i = 0;
-
-  while (1) {
-    i++;
+  for (int polls = 0;; polls++) {
     auto status = inb(bmr_status);
     auto dstatus = command_port.in();
-    if (!(status & 0x04)) {
-      continue;
-    }
-    if (!(dstatus & 0x80)) {
+    if ((status & 0x04) && !(dstatus & 0x80)) {
       break;
     }
+    ata_backoff(polls);
   }
 
   // wait_400ns(m_io_base);
-  // printk("loops: %d\n", i);
 
-  memcpy(data, dma_dst, sector_size);
+  memcpy(data, dma_dst, sector_size * count);
 
   return true;
 }
@@ -409,7 +481,7 @@ static void ata_interrupt(int intr, reg_t* fr) {
   inb(primary_master_bmr_status);
   outb(primary_master_bmr_status, BMR_COMMAND_DMA_STOP);
 
-  if (sched::enabled()) {
+  if (sched::enabled() && __atomic_load_n(&ata_sleepers, __ATOMIC_SEQ_CST)) {
     ata_wq.notify();
   }
   // INFO("interrupt: err=%d\n", fr->err);
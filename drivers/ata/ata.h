@@ -3,6 +3,7 @@
 
 #include <asm.h>
 #include <dev/blk_dev.h>
+#include <mutex.h>
 #include <pci.h>
 #include <types.h>
 
@@ -44,6 +45,9 @@ class ata : public dev::blk_dev {
   byte_port control_port;
 
   u16 m_io_base;
+  // the lock of the channel the drive is on. Both drives on a channel share
+  // its registers, so only one of them can have a command going at a time
+  mutex *m_lock;
 
   struct pdrt {
     u64 offset;
@@ -87,12 +91,22 @@ class ata : public dev::blk_dev {
 
   virtual bool read_block(u32 sector, u8* data);
   virtual bool write_block(u32 sector, const u8* data);
+  virtual bool read_blocks(u32 sector, u32 count, u8* data);
+  virtual bool write_blocks(u32 sector, u32 count, const u8* data);
   virtual size_t block_size(void);
   virtual ssize_t size(void); // how big the drive is in bytes
 
   bool read_block_dma(u32 sector, u8* data);
   bool write_block_dma(u32 sector, const u8* data);
 
+  // transfer up to dma_max_sectors() sectors through the DMA buffer
+  bool read_blocks_dma(u32 sector, u32 count, u8* data);
+  u32 dma_max_sectors(void);
+
+  // transfer up to ATA_MAX_PIO_SECTORS sectors in a single PIO command
+  bool read_blocks_pio(u32 sector, u32 count, u8* data);
+  bool write_blocks_pio(u32 sector, u32 count, const u8* data);
+
   // flush the internal buffer on the disk
   bool flush();
 
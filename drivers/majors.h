@@ -24,3 +24,9 @@
 #define MAJOR_FB 21
 
 #define MAJOR_SB16 22
+
+// the kernel log, /dev/kmsg
+#define MAJOR_KMSG 23
+
+// spinlock contention statistics, /dev/lockstat
+#define MAJOR_LOCKSTAT 24
@@ -1,6 +1,7 @@
 #include "e1000.h"
 
 #include <arch.h>
+#include <hrtimer.h>
 #include <lock.h>
 #include <mem.h>
 #include <module.h>
@@ -191,7 +192,8 @@ int e1000_daemon(void *) {
   assert(device != NULL);
 
   while (1) {
-    // e1000wait.wait();
+    // sleep until the irq handler has something for us
+    e1000wait.wait();
   }
 }
 
@@ -292,7 +294,7 @@ void e1000_init(void) {
     /* initialize */
     write_command(E1000_REG_CTRL, ctrl | (1 << 26));
 
-    sched::dumb_sleepticks(1);
+    sched::sleep_ns(TICK_NS);
 
     uint32_t status = read_command(E1000_REG_CTRL);
     status |= (1 << 5);       /* set auto speed detection */
@@ -52,6 +52,10 @@ void mem_init(unsigned long mbd);
 
 unsigned long read_timestamp(void);
 
+// have this cpu's timer interrupt go off once the timestamp counter reaches
+// `deadline` (or not at all, if it is 0)
+void timer_arm(unsigned long deadline);
+
 /**
  * the architecture must only implement init() and eoi(). The arch must
  * implement calling irq::dispatch() when an interrupt is received.
@@ -43,6 +43,9 @@
 #define CR0_CD (1 << 30)
 #define CR0_PG (1 << 31)
 
+// with CR4_PCIDE, load cr3 without flushing the new pcid
+#define CR3_NOFLUSH (1ULL << 63)
+
 #define CR4_VME 1
 #define CR4_PVI 2
 #define CR4_TSD (1 << 2)
@@ -83,12 +86,27 @@
 #define FL_VIP 0x00100000        // Virtual Interrupt Pending
 #define FL_ID 0x00200000         // ID flag
 
-#define SEG_KCODE 1  // kernel code
-#define SEG_KDATA 2  // kernel data+stack
-#define SEG_KCPU 3   // kernel per-cpu data
-#define SEG_UCODE 4  // user code
-#define SEG_UDATA 5  // user data+stack
-#define SEG_TSS 6    // this process's task state
+// SYSCALL and SYSRET find the segments relative to one another, so the kernel
+// data must follow the kernel code, and the user code the user data
+#define SEG_KCODE 1   // kernel code
+#define SEG_KDATA 2   // kernel data+stack
+#define SEG_KCPU 3    // kernel per-cpu data
+#define SEG_UDATA 4   // user data+stack
+#define SEG_UCODE 5   // user code
+#define SEG_TSS 6     // this process's task state (two entries)
+#define SEG_CPUNUM 8  // the limit is the cpu's index, for userspace to lsl
+
+// model specific registers
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_FMASK 0xC0000084
+#define MSR_FS_BASE 0xC0000100
+#define MSR_GS_BASE 0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+#define MSR_TSC_DEADLINE 0x6E0
+
+#define EFER_SCE 0x1  // SYSCALL/SYSRET enable
 
 #define DPL_KERN 0x0
 #define DPL_USER 0x3  // User DPL
@@ -108,6 +108,14 @@ struct atom {
     return *__ptr;
   }
 
+  inline T fetch_add(T __i, memory_order __m = memory_order_seq_cst) noexcept {
+    return __atomic_fetch_add(&_M_i, __i, int(__m));
+  }
+
+  inline T fetch_sub(T __i, memory_order __m = memory_order_seq_cst) noexcept {
+    return __atomic_fetch_sub(&_M_i, __i, int(__m));
+  }
+
   inline bool compare_exchange_weak(T& __e, T __i, memory_order __s,
                              memory_order __f) noexcept {
     return __atomic_compare_exchange(&(_M_i), &(__e), &(__i), true, int(__s),
@@ -26,6 +26,10 @@ int getc(bool block = false);
 
 void putc(char c);
 
+// output is sent in the background. Push out whatever hasn't gone yet, for
+// when there won't be a background anymore (panic)
+void sync(void);
+
 };  // namespace console
 
 #endif
@@ -6,14 +6,20 @@
 
 struct cpu_t {
   void *local;
+  // how deep in pushcli we are, and if interrupts were on before the first
   int ncli;
+  int intena;
   size_t ticks;
 
   uint16_t preemption_depth;
 
+  // the TSC rate, calibrated in smp::lapic_init
   u32 speed_khz;
   struct thread *current_thread;
   struct thread_context *sched_ctx;
+
+  // the page table this cpu has loaded
+  mm::pagetable *active_pt;
 };
 
 extern int cpunum;
@@ -33,8 +39,6 @@ struct process *proc(void);
 struct thread *thread(void);
 bool in_thread(void);
 
-void calc_speed_khz(void);
-
 void pushcli();
 void popcli();
 
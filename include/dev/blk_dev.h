@@ -20,6 +20,11 @@ class blk_dev : public dev::device {
   virtual bool read_block(u32 index, u8* buf) = 0;
   virtual bool write_block(u32 index, const u8* buf) = 0;
 
+  // transfer a run of contiguous blocks. The default just loops over
+  // read_block/write_block, but drivers can do it in fewer commands
+  virtual bool read_blocks(u32 index, u32 count, u8* buf);
+  virtual bool write_blocks(u32 index, u32 count, const u8* buf);
+
 
 };
 };  // namespace dev
@@ -16,6 +16,8 @@ class partition : public dev::blk_dev {
   virtual u64 block_size(void);
   virtual bool read_block(u32 index, u8* buf);
   virtual bool write_block(u32 index, const u8* buf);
+  virtual bool read_blocks(u32 index, u32 count, u8* buf);
+  virtual bool write_blocks(u32 index, u32 count, const u8* buf);
 
  protected:
   dev::blk_dev &m_disk;
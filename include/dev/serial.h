@@ -1,6 +1,8 @@
 #ifndef __SERIAL__
 #define __SERIAL__
 
+#include <types.h>
+
 /* Serial */
 #define COM1 0x3f8
 #define SERIAL_PORT_A 0x3F8
@@ -17,5 +19,9 @@ char serial_recv_async(int device);
 int serial_transmit_empty(int device);
 void serial_send(int device, char out);
 void serial_string(int device, char* out);
+// queue bytes for the port. Only waits when the transmit ring is full
+void serial_write(int device, const char* buf, size_t len);
+// send everything queued right now, by polling
+void serial_flush(int device);
 
 #endif
@@ -1,12 +1,35 @@
 #ifndef __CK_DIRENT_H
 #define __CK_DIRENT_H
 
+// values of d_type
+#define DT_UNKNOWN 0
+#define DT_FIFO 1
+#define DT_CHR 2
+#define DT_DIR 4
+#define DT_BLK 6
+#define DT_REG 8
+#define DT_LNK 10
+#define DT_SOCK 12
+
 struct dirent {
 	unsigned long d_ino;
-	// unsigned long d_off;
-	// unsigned short d_reclen;
-	// unsigned char d_type;
+	long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
 	char d_name[256];
 };
 
+/*
+ * the records sys::getdents64 packs into its buffer. Each is d_reclen bytes
+ * long (a multiple of 8), and d_name is NUL terminated inside it. d_off is the
+ * cursor to seek the directory to in order to resume after this entry
+ */
+struct dirent64 {
+	unsigned long d_ino;
+	long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
 #endif
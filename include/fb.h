@@ -0,0 +1,28 @@
+#ifndef __CK_FB_H
+#define __CK_FB_H
+
+/*
+ * /dev/fb0, the linear framebuffer.
+ *
+ * The device can be read, written, or (best) mmap'd. Pixels are 32 bit
+ * 0x00RRGGBB, rows are `pitch` bytes apart, and there are `virt_height` rows
+ * in all, of which the `height` starting at the Y offset are on screen. While
+ * the device is open the kernel console stays off the screen.
+ *
+ * This header is shared with userspace (as <chariot/fb.h>), so keep it C.
+ */
+
+// ioctl(fd, FB_GET_INFO, struct fb_info *)
+#define FB_GET_INFO 1980
+// ioctl(fd, FB_SET_Y_OFFSET, row): show the screen starting at `row`
+#define FB_SET_Y_OFFSET 1982
+
+struct fb_info {
+  unsigned int width;
+  unsigned int height;
+  unsigned int virt_height;
+  unsigned int pitch;  // in bytes
+  unsigned int bpp;
+};
+
+#endif
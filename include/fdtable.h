@@ -0,0 +1,88 @@
+#pragma once
+
+#ifndef __FDTABLE_H__
+#define __FDTABLE_H__
+
+#include <atom.h>
+#include <fs.h>
+#include <lock.h>
+#include <mutex.h>
+#include <ptr.h>
+
+// the most descriptors a process can have open
+#define FD_MAX 65536
+
+/**
+ * fd_table - a process's open files, indexed by descriptor.
+ *
+ * The files live in a dense array, with a bitmap of which slots are in use so
+ * the lowest free descriptor is found a word at a time. Looking a descriptor
+ * up takes no lock: readers only announce themselves in one of two counters,
+ * and anything that takes a file out of the table (or replaces the array when
+ * it grows) waits for the readers that might have seen the old value to leave
+ * before dropping it. Changes to the table are serialized by `lock`, and the
+ * waiting is done after it has been dropped.
+ */
+class fd_table {
+ public:
+  fd_table(void);
+  ~fd_table(void);
+
+  fd_table(const fd_table &) = delete;
+  fd_table &operator=(const fd_table &) = delete;
+
+  // the file open on fd, or null. Does not lock
+  ref<fs::file> get(int fd);
+
+  // put a file in the lowest free slot that is at least `min`. Returns the fd
+  int install(ref<fs::file>, int min = 0);
+  // put a file in a specific slot, closing what was there. -EBADF if the
+  // slot is out of range
+  int install_at(int fd, ref<fs::file>);
+  // close a descriptor. -EBADF if it wasn't open
+  int remove(int fd);
+  // close everything
+  void clear(void);
+
+  // call cb(fd, file) for every open descriptor, with the table locked
+  template <typename Fn>
+  void each(Fn cb) {
+    scoped_lock l(lock);
+    auto *t = current.load();
+    for (int fd = 0; fd < t->size; fd++)
+      if (t->files[fd] != nullptr) cb(fd, t->files[fd]);
+  }
+
+ private:
+  struct array {
+    int size;
+    fs::file **files;
+    // a bit per slot, set when the slot is in use
+    u64 *used;
+  };
+
+  static array *alloc_array(int size);
+  static void free_array(array *);
+
+  // grow the array so that `fd` is a valid index. Called with `lock` held.
+  // If the array was replaced, the old one is left in `retired` for the
+  // caller to free after a synchronize(), once it has dropped the lock
+  int expand(int fd, array *&retired);
+  // wait for every reader that started before now to finish. Never called
+  // with `lock` held, since it can take a while
+  void synchronize(void);
+  // put `f` into an empty slot `fd`. Called with `lock` held
+  void set_slot(array *t, int fd, fs::file *f);
+
+  atom<array *> current;
+  spinlock lock;
+  // serializes synchronize()
+  mutex sync_lock;
+
+  // readers count themselves in readers[gen & 1]. synchronize() flips gen and
+  // waits for the old side to empty
+  atom<unsigned> gen = 0;
+  atom<int> readers[2];
+};
+
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <types.h>
+
+/*
+ * FPU/SIMD register state.
+ *
+ * Registers are switched lazily. A thread's state is only loaded once it
+ * actually uses the FPU during a time slice (CR0.TS makes that use trap), and
+ * only saved on the way out if it was loaded. A thread that comes back to the
+ * cpu whose registers still hold its state doesn't need to load it at all.
+ *
+ * With XSAVE, everything the cpu has (AVX, AVX-512) is enabled for userspace
+ * and saved with it, so the per thread area is as big as CPUID says.
+ *
+ * The kernel itself is free to use SIMD registers between kernel_begin() and
+ * kernel_end(), which save whatever thread state was loaded first. Nothing in
+ * between may sleep, and interrupts are off.
+ */
+
+// bits of fpu::xfeatures()
+#define XFEATURE_X87 (1 << 0)
+#define XFEATURE_SSE (1 << 1)
+#define XFEATURE_AVX (1 << 2)
+#define XFEATURE_OPMASK (1 << 5)
+#define XFEATURE_ZMM_HI256 (1 << 6)
+#define XFEATURE_HI16_ZMM (1 << 7)
+#define XFEATURE_AVX512 \
+  (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
+struct thread;
+
+namespace fpu {
+
+// detect and enable what the cpu has, once per cpu
+void init(void);
+
+// the state components that are enabled (XCR0), or just x87|SSE without XSAVE
+u64 xfeatures(void);
+// how big a thread's saved state is
+size_t state_size(void);
+
+// set up (and free) the thread's state, which starts out clean
+void thread_init(struct thread &);
+void thread_free(struct thread &);
+
+// called by the scheduler around running a thread
+void switch_in(struct thread &);
+void switch_out(struct thread &);
+
+void kernel_begin(void);
+void kernel_end(void);
+
+}  // namespace fpu
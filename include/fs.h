@@ -6,10 +6,12 @@
 #include <atom.h>
 #include <func.h>
 #include <lock.h>
+#include <mutex.h>
 #include <net/sock.h>
 #include <stat.h>
 #include <string.h>
 #include <types.h>
+#include <uio.h>
 #include <wait.h>
 
 #define FDIR_READ 1
@@ -97,6 +99,18 @@ struct file_operations {
   int (*seek)(fs::file &, off_t old_off, off_t new_off) = NULL;
   ssize_t (*read)(fs::file &, char *, size_t) = NULL;
   ssize_t (*write)(fs::file &, const char *, size_t) = NULL;
+
+  /**
+   * readv/writev - move data between the file, starting at `off`, and each
+   * segment in turn. The file offset is neither used nor changed, so files
+   * that implement these can be used with pread and friends. Return the bytes
+   * moved, which is short only at the end of the file or on an error.
+   *
+   * Optional: without them, readv and writev fall back to calling read or
+   * write per segment, and positional I/O fails with -ESPIPE
+   */
+  ssize_t (*readv)(fs::file &, const struct iovec *, int iovcnt, off_t off) = NULL;
+  ssize_t (*writev)(fs::file &, const struct iovec *, int iovcnt, off_t off) = NULL;
   int (*ioctl)(fs::file &, unsigned int, off_t) = NULL;
 
   /**
@@ -113,8 +127,13 @@ struct file_operations {
    */
   void (*close)(fs::file &) = NULL;
 
-  /* map a file into a vm area */
-  int (*mmap)(fs::file &, struct mm::area &);
+  /*
+   * map a file into a vm area. The area is new and empty, and the filesystem
+   * may fill in any of its pages with pages of its own (taking a user on each)
+   * so faults on them don't have to read the file. Pages it leaves empty are
+   * read in by the fault handler, which is also all that happens without it
+   */
+  int (*mmap)(fs::file &, struct mm::area &) = NULL;
   // resize a file. if size is zero, it is a truncate
   int (*resize)(fs::file &, size_t);
 
@@ -153,6 +172,15 @@ class file : public refcounted<file> {
   ssize_t read(void *, ssize_t);
   ssize_t write(void *data, ssize_t);
 
+  // vectored I/O at the file offset, which is advanced past what was moved
+  ssize_t readv(const struct iovec *, int iovcnt);
+  ssize_t writev(const struct iovec *, int iovcnt);
+  // vectored and single buffer I/O at `off`, leaving the file offset alone
+  ssize_t preadv(const struct iovec *, int iovcnt, off_t off);
+  ssize_t pwritev(const struct iovec *, int iovcnt, off_t off);
+  ssize_t pread(void *, size_t, off_t off);
+  ssize_t pwrite(void *, size_t, off_t off);
+
   int close();
 
   inline off_t offset(void) { return m_offset; }
@@ -170,6 +198,16 @@ class file : public refcounted<file> {
   struct fs::inode *ino;
   string path;
   off_t m_offset = 0;
+
+  // sequential readahead state, for filesystems that do readahead
+  struct {
+    // where the next read starts if the file is being read sequentially
+    off_t next = 0;
+    // the end of what has already been prefetched
+    off_t end = 0;
+    // how far ahead of the reader to prefetch, in bytes. 0 when it is off
+    size_t window = 0;
+  } ra;
 };
 
 /**
@@ -213,6 +251,12 @@ struct inode {
 
   bool fixed = false;
 
+  // set once the dcache has a reference to this inode, so it can be purged
+  bool in_dcache = false;
+  // bumped whenever a name in this directory is invalidated, so a lookup
+  // that raced with the change doesn't cache what it found
+  unsigned dcache_gen = 0;
+
   template <typename T>
   T *&priv(void) {
     return (T *&)_priv;
@@ -227,6 +271,9 @@ struct inode {
       struct direntry *entries;
       // an "owned" string that represents the name
       const char *name;
+      // set once `entries` holds every name in the directory. Until then,
+      // misses are forwarded to dops->lookup and listing calls dops->walk
+      bool complete;
     } dir;
 
     // T_SOCK
@@ -235,9 +282,12 @@ struct inode {
 
   /*
    * the directory entry list in this->as.dir is a linked list that must be
-   * traversed to find the entry. When the subclass creates a directory, it must
-   * populate that list with at least the names of the entries. If an entry
-   * contains a NULL inode, it calls 'resolve_direntry' which returns the
+   * traversed to find the entry. When the subclass creates a directory, it can
+   * either populate that list with at least the names of the entries, or leave
+   * it empty and provide dops->lookup and dops->walk. In the latter case names
+   * are resolved one at a time through lookup, and the full list is only read
+   * (through walk) the first time someone enumerates the directory. If an
+   * entry contains a NULL inode, it calls 'resolve_direntry' which returns the
    * backing inode.
    */
   int register_direntry(string name, int type, struct inode * = NULL);
@@ -259,13 +309,18 @@ struct inode {
   static int release(struct inode *);
 
   spinlock lock;
+  // protects dir.entries and dir.complete. It is held across dops->lookup and
+  // dops->walk, which read the disk, so it has to be able to sleep
+  mutex dir_lock;
 
  protected:
   int rc = 0;
 
  private:
+  // these expect dir_lock to be held
   struct inode *get_direntry_nolock(const char *name);
   struct inode *get_direntry_ino(struct direntry *);
+  void populate_direntries(void);
 };
 
 // src/fs/pipe.cpp
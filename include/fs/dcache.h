@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#include <fs.h>
+
+/**
+ * The dentry cache is a global hash table that maps (parent inode, name) to the
+ * inode that name resolves to. Misses are cached too (negative entries), so a
+ * repeated lookup of a name that does not exist never reaches the filesystem.
+ *
+ * Lookups are lockless: each hash bucket is guarded by a seqlock and the
+ * entries live in a static pool that is never freed, so a reader racing with
+ * an eviction can only ever see a stale (but mapped) entry, which the sequence
+ * check then rejects.
+ */
+namespace fs {
+namespace dcache {
+
+// names longer than this are not cached, and always go to the directory
+#define DCACHE_NAME_LEN 40
+
+#define DCACHE_MISS 0
+#define DCACHE_POSITIVE 1
+#define DCACHE_NEGATIVE 2
+
+/*
+ * lookup - find `name` in `dir` without taking any locks. Returns one of the
+ * DCACHE_* codes above. `res` is only written on DCACHE_POSITIVE
+ */
+int lookup(struct inode *dir, const char *name, struct inode *&res);
+
+// the directory's generation, to be read before looking a name up in it
+unsigned generation(struct inode *dir);
+
+// cache the result of a directory lookup. A NULL inode is a negative entry.
+// `gen` is generation(dir) from before the lookup, and nothing is cached if
+// a name in the directory has been invalidated since
+void insert(struct inode *dir, const char *name, struct inode *ino,
+            unsigned gen);
+
+// drop any entry (positive or negative) for `name` in `dir`
+void invalidate(struct inode *dir, const char *name);
+
+// drop every entry that refers to the inode, either as a parent or a child
+void purge(struct inode *);
+
+};  // namespace dcache
+};  // namespace fs
+
+#endif
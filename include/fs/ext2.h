@@ -6,7 +6,9 @@
 #include <func.h>
 #include <lock.h>
 #include <map.h>
+#include <mutex.h>
 #include <vec.h>
+#include <wait.h>
 
 /*
  * Ext2 directory file types.  Only the low 3 bits are used.  The
@@ -23,6 +25,59 @@
 
 #define EXT2_FT_MAX 8
 
+// the on-disk size of a directory entry with a name of a given length
+#define EXT2_DIR_REC_LEN(name_len) (((name_len) + 8 + 3) & ~3)
+
+// s_feature_compat
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL 0x0004
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+
+// s_flags
+#define EXT2_FLAGS_SIGNED_HASH 0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+// inode flags
+#define EXT2_INDEX_FL 0x00001000   /* hash-indexed directory */
+#define EXT4_EXTENTS_FL 0x00080000 /* inode uses an ext4 extent tree */
+
+// s_feature_incompat
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT3_FEATURE_INCOMPAT_RECOVER 0x0004     /* the journal needs replay */
+#define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV 0x0008 /* this is a journal device */
+#define EXT4_FEATURE_INCOMPAT_EXTENTS 0x0040
+
+// htree hash versions (the *_UNSIGNED ones are never stored on disk)
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_LEGACY_UNSIGNED 3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED 5
+
+// the JBD (ext3 journal) format. Everything in the journal is big endian
+#define JBD_MAGIC 0xC03B3998U
+
+// journal block types
+#define JBD_DESCRIPTOR_BLOCK 1
+#define JBD_COMMIT_BLOCK 2
+#define JBD_SUPERBLOCK_V1 3
+#define JBD_SUPERBLOCK_V2 4
+#define JBD_REVOKE_BLOCK 5
+
+// descriptor tag flags
+#define JBD_FLAG_ESCAPE 1    /* the block's first word was JBD_MAGIC */
+#define JBD_FLAG_SAME_UUID 2 /* no uuid follows the tag */
+#define JBD_FLAG_DELETED 4
+#define JBD_FLAG_LAST_TAG 8
+
+// journal superblock features
+#define JBD_FEATURE_COMPAT_CHECKSUM 0x1
+#define JBD_FEATURE_INCOMPAT_REVOKE 0x1
+#define JBD_FEATURE_INCOMPAT_64BIT 0x2
+#define JBD_FEATURE_INCOMPAT_ASYNC_COMMIT 0x4
+#define JBD_FEATURE_INCOMPAT_CSUM_V2 0x8
+#define JBD_FEATURE_INCOMPAT_CSUM_V3 0x10
+
 namespace fs {
 
 struct ext2_block_cache_line {
@@ -34,6 +89,25 @@ struct ext2_block_cache_line {
 
 class ext2;
 
+typedef struct __ext2_dir_entry {
+  uint32_t inode;
+  uint16_t size;
+  uint8_t namelength;
+  uint8_t reserved;  // the file type, with EXT2_FEATURE_INCOMPAT_FILETYPE
+  char name[0];
+  /* name here */
+} __attribute__((packed)) ext2_dir;
+
+struct [[gnu::packed]] block_group_desc {
+  uint32_t block_of_block_usage_bitmap;
+  uint32_t block_of_inode_usage_bitmap;
+  uint32_t block_of_inode_table;
+  uint16_t num_of_unalloc_block;
+  uint16_t num_of_unalloc_inode;
+  uint16_t num_of_dirs;
+  uint8_t unused[14];
+};
+
 /**
  * represents the actual structure on-disk of an inode.
  *
@@ -64,14 +138,179 @@ struct [[gnu::packed]] ext2_inode_info {
   uint8_t ossv2[12];
 };
 
+// a run of blocks that are contiguous both in the file and on disk
+struct ext2_extent {
+  u32 lblk;  // first logical block in the file
+  u32 pblk;  // first block on disk
+  u32 len;
+};
+
 // inode data. To be stored in the inode's private data.
 // Freed on release
 struct ext2_idata {
   // block pointers
   uint32_t block_pointers[15];
-  int cached_path[4] = {0, 0, 0, 0};
-  int *blk_bufs[4] = {NULL, NULL, NULL, NULL};
-  ~ext2_idata(void);
+  // the on-disk i_flags (EXT2_*_FL)
+  uint32_t flags = 0;
+
+  // the logical->physical block map, sorted by lblk. Anything not covered by
+  // an extent is a hole. Built the first time the inode's blocks are needed,
+  // and thrown away (mapped = false) whenever the block pointers change
+  bool mapped = false;
+  vec<ext2_extent> extents;
+  // held while the block map is built, looked at or changed, and while the
+  // block pointers it comes from are. Readers, readahead and writers all map
+  // blocks at once, and building the map reads the disk, so it can't spin
+  mutex map_lock;
+
+  // i_blocks, in 512 byte sectors (including indirect blocks)
+  uint32_t disk_sectors = 0;
+
+  // blocks reserved for this file's next appends, so files that grow a bit at
+  // a time stay contiguous. They are marked in the bitmap, and given back
+  // when the file is closed
+  uint32_t prealloc_start = 0;
+  uint32_t prealloc_count = 0;
+
+  // unlinked, but still referenced. Freed on disk by ~ext2_inode
+  bool orphan = false;
+};
+
+// an on-disk inode held in memory, and whether it has changes to write back
+struct ext2_icache_entry {
+  ext2_inode_info info;
+  bool dirty = false;
+};
+
+/**
+ * A JBD (ext3) journal, kept in an inode of the filesystem, in ordered mode.
+ *
+ * Metadata blocks (bitmaps, descriptors, inode tables, directories and
+ * indirect blocks) that are written join the running transaction instead of
+ * going to their home on disk. A kernel thread commits it every few seconds,
+ * or sooner once it gets big, so many operations go out together in a few
+ * sequential writes. A commit first closes the transaction, then writes out
+ * the file data in the block cache, then the transaction's blocks to the log,
+ * then a commit block. Operations carry on in the next transaction while that
+ * happens. Logged blocks are only written home (checkpointed) once the log
+ * fills up, so a block that changes in many transactions is written home once.
+ *
+ * If the filesystem wasn't unmounted cleanly, every complete transaction in
+ * the log is replayed when it is mounted.
+ */
+class ext2_journal {
+ public:
+  ext2_journal(ext2 *efs);
+  ~ext2_journal(void);
+
+  // read the journal in inode `inum`, and replay it if it isn't empty.
+  // Returns 0 or a negative errno
+  int load(u32 inum);
+
+  // operations hold a handle while they change metadata, so a commit never
+  // catches one half done. Handles don't nest, and start() may wait for a
+  // commit if the running transaction has grown too big for the log
+  void start(void);
+  void stop(void);
+
+  /* the block cache hooks. All of these need the cache lock held */
+  // `data` is the new contents of metadata block `block`
+  void dirty(u32 block, const void *data);
+  // the block has changes that the journal hasn't written home yet
+  bool pending(u32 block);
+  // copy the journal's version of any pending blocks in a run over `buf`
+  void patch(u32 block, u32 count, void *buf);
+
+  // the block was freed, so nothing logged for it may be replayed over it
+  void forget(u32 block);
+
+  // write the running transaction to the log
+  int commit(void);
+  // write every logged block home, and empty the log
+  int checkpoint(void);
+
+ private:
+  struct jblock {
+    // the latest contents
+    u8 *data;
+    // the contents as of the last transaction that was closed with it in it.
+    // That is what goes to the log, and then home
+    u8 *frozen;
+    // changed in the running transaction
+    bool running;
+    // in the transaction being written to the log
+    bool committing;
+    // `frozen` is in the log, and not home yet
+    bool logged;
+    // being written home right now
+    bool writing;
+    // freed while it was committing. Dropped once the commit is done
+    bool freed;
+  };
+
+  bool io(u32 lblk, u32 count, void *buf, bool write);
+  bool write_home(u32 block, u32 count, const void *buf);
+  bool write_jsb(u32 start, u32 seq);
+  u32 log_free(void);
+  inline u32 log_next(u32 b) { return b + 1 == maxlen ? first : b + 1; }
+  u32 log_blocks(u32 nblocks, u32 nrevoked);
+
+  int recover(void);
+  int do_pass(int pass, u32 &end, map<u32, u32> &revokes, int &replayed);
+
+  int do_commit(vec<u32> &list, vec<u32> &revokes, u32 tid);
+  int do_checkpoint(void);
+  void drop(u32 block, jblock *jb);
+  void wake_handles(void);
+  void spawn(void);
+  void kick(void);
+  static int commit_thread(void *);
+
+  ext2 *efs;
+  u32 bsize;
+
+  // where the journal inode's blocks are on disk
+  vec<ext2_extent> extents;
+
+  // the log is journal blocks [first, maxlen)
+  u32 first = 0, maxlen = 0;
+  // the next log block to write
+  u32 head = 0;
+  // the start of the oldest transaction that isn't checkpointed (0 if none)
+  u32 tail = 0;
+  // the id of the running transaction
+  u32 sequence = 0;
+  u32 incompat = 0;
+  // the journal superblock
+  u8 *jsb = nullptr;
+
+  // every metadata block whose latest version isn't home
+  map<u32, jblock *> blocks;
+  u32 nrunning = 0;
+  // logged blocks freed in the running transaction
+  vec<u32> revoked;
+
+  // one commit or checkpoint at a time. Taken before the other locks
+  mutex commit_lock;
+
+  mutex lock;
+  int handles = 0;
+  // a commit is waiting to close the running transaction, so new handles
+  // have to wait until it has
+  bool want_commit = false;
+  waitqueue drained;
+  // handles waiting in start(), and where they wait
+  int blocked = 0;
+  waitqueue unblocked;
+  // forget()s waiting for a block to get home
+  int home_waiters = 0;
+  waitqueue home_wq;
+
+  bool kicked = false;
+  bool thread_started = false;
+  bool stopping = false;
+  bool exited = false;
+  waitqueue commit_wq;
 };
 
 class ext2_inode : public fs::inode {
@@ -113,22 +352,66 @@ class ext2 final : public filesystem {
   bool read_block(u32 block, void *buf);
   bool write_block(u32 block, const void *buf);
 
-  bool read_inode(ext2_inode_info &dst, u32 inode);
+  // copy part of a block in or out of the block cache, without a whole block
+  // sized buffer
+  bool read_block_part(u32 block, u32 off, void *dst, u32 len);
+  bool write_block_part(u32 block, u32 off, const void *src, u32 len);
+
+  // write a metadata block (or part of one) through the journal, if there is
+  // one. File data is written with write_block(s)
+  bool write_meta(u32 block, const void *buf);
+  bool write_meta_part(u32 block, u32 off, const void *src, u32 len);
+
+  // start and stop a journal handle around an operation that changes metadata
+  void journal_start(void);
+  void journal_stop(void);
 
+  // inodes are read and written through the inode cache, and written back
+  // to the inode table by flush_inodes()
+  bool read_inode(ext2_inode_info &dst, u32 inode);
   bool write_inode(ext2_inode_info &dst, u32 inode);
+  int flush_inodes(void);
 
-  void traverse_dir(u32 inode, func<bool(u32 ino, const char *name)> callback);
-  void traverse_dir(ext2_inode_info &inode,
+  // call `callback` with each entry of a directory until it returns false
+  void traverse_dir(fs::inode &dir,
                     func<bool(u32 ino, const char *name)> callback);
-  void traverse_blocks(vec<u32>, void *, func<bool(void *)> callback);
 
-  u32 balloc(void);
+  // pull blocks into the block cache, so later reads of them don't wait
+  void prefetch(u32 block, u32 count);
+
+  // read or write `count` contiguous blocks in a single disk request
+  bool read_blocks(u32 block, u32 count, void *buf);
+  bool write_blocks(u32 block, u32 count, const void *buf);
+
+  /*
+   * map_blocks - translate a logical block in an inode to a disk block. `run`
+   * is set to how many blocks starting at `lblk` are contiguous on disk (or
+   * how long the hole is, if the return value is 0). Returns 0 for a hole
+   */
+  u32 map_blocks(fs::inode &, u32 lblk, u32 &run);
+
+  /*
+   * dx_lookup - find a name in a hash-indexed (htree) directory. Returns 0 and
+   * fills in `ino` if it was found, -ENOENT if the index says it is not there,
+   * or another negative errno if the directory can't be searched by its index
+   * (in which case the caller should fall back to a linear scan)
+   */
+  int dx_lookup(fs::inode &dir, const char *name, u32 &ino);
+
+  /*
+   * balloc - allocate a block, as close after `goal` as possible. Returns 0
+   * if the disk is full. balloc_at allocates exactly `block`, if it's free
+   */
+  u32 balloc(u32 goal = 0);
+  bool balloc_at(u32 block);
   void bfree(u32);
 
-  // entrypoint to read a file
+  // allocate an inode number, near the parent (files) or spread out (dirs)
+  u32 ialloc(u32 parent, bool is_dir);
+  void ifree(u32 inode, bool is_dir);
 
-  vec<u32> blocks_for_inode(u32 inode);
-  vec<u32> blocks_for_inode(ext2_inode_info &inode);
+  // write the superblock and group descriptors back if allocation changed them
+  int sync_meta(void);
 
   // update the disk copy of the superblock
   int write_superblock(void);
@@ -219,10 +502,31 @@ class ext2 final : public filesystem {
   // the location of the first block group descriptor
   u32 first_bgd = 0;
 
-  // blocks are read here for access. This is so the filesystem can cut down on
-  // allocations when doing general maintainence
-  void *work_buf = nullptr;
-  void *inode_buf = nullptr;
+  // the block group descriptor table, resident for the life of the mount
+  block_group_desc *bgdt = nullptr;
+  u32 bgdt_blocks = 0;
+
+  // the allocation bitmaps of each group. Read the first time the group is
+  // allocated from, then kept in memory and written through on change
+  struct group_bitmaps {
+    u8 *blocks = nullptr;
+    u8 *inodes = nullptr;
+  };
+  group_bitmaps *bitmaps = nullptr;
+  u8 *block_bitmap(u32 group);
+  u8 *inode_bitmap(u32 group);
+
+  // the superblock or descriptor table have changes that aren't on disk
+  bool meta_dirty = false;
+
+  // on-disk inodes that have been read or written, by inode number
+  map<u32, ext2_icache_entry *> icache;
+  // the inodes that have been written since the last flush_inodes(), so it
+  // doesn't have to look at every entry. May name ones since evicted
+  vec<u32> icache_dirty;
+  mutex icache_lock;
+  ext2_icache_entry *icache_insert(u32 inode);
+  void locate_inode(u32 inode, u32 &block, u32 &off);
 
   struct inode *root;
 
@@ -232,14 +536,44 @@ class ext2 final : public filesystem {
   int cache_size;
   int cache_time = 0;
   struct ext2_block_cache_line *disk_cache;
-  spinlock cache_lock;
+  mutex cache_lock;
 
   struct ext2_block_cache_line *get_cache_line(int blkno);
+  struct ext2_block_cache_line *load_cache_line(u32 block, bool &valid);
+  // write dirty cache lines to the disk (without taking the cache lock)
+  void flush_cache_line(struct ext2_block_cache_line *);
+  void flush_cache(void);
+
+  // the journal, if the filesystem has one
+  ext2_journal *journal = nullptr;
 
   ref<fs::file> disk;
+  // the disk file has a single offset, so every seek has to stay with the read
+  // or write after it. Taken inside every other lock
+  mutex disk_lock;
+  bool disk_rw(off_t off, void *buf, size_t len, bool write);
 
-  spinlock m_lock;
+  mutex m_lock;
+};
+
+// holds a journal handle for as long as it is in scope
+class ext2_handle {
+  ext2 *efs;
+
+ public:
+  inline ext2_handle(ext2 *efs) : efs(efs) { efs->journal_start(); }
+  inline ~ext2_handle(void) { efs->journal_stop(); }
 };
 }  // namespace fs
 
+// solve the disk block of a logical block index in an inode (inode.cpp)
+int block_from_index(fs::inode &node, int i_block, int set_to = 0);
+
+// note a read of [pos, pos + len), and prefetch ahead if the file is being
+// read sequentially (readahead.cpp)
+void ext2_readahead(fs::file &f, off_t pos, size_t len);
+// forget any readahead queued for a filesystem that is going away, and wait
+// for any that is in progress (readahead.cpp)
+void ext2_readahead_drain(fs::ext2 *efs);
+
 #endif
@@ -4,8 +4,59 @@
 #define __TMPFS_H_
 
 #include <fs.h>
+#include <lock.h>
+#include <mm.h>
+#include <radix_tree.h>
 
-class tmpfs_inode : public fs::inode {};
+namespace fs {
 
+/**
+ * tmpfs - a filesystem that only exists in memory.
+ *
+ * Directories are plain direntry lists. File data is kept in whole pages, in a
+ * radix tree indexed by page number, so reads and writes are a lookup and a
+ * memcpy, and mmap hands the file's own pages to the address space instead of
+ * copying them in on each fault.
+ */
+class tmpfs final : public filesystem {
+ public:
+  tmpfs(void);
+  virtual ~tmpfs(void);
+
+  virtual bool init(void);
+  virtual struct inode *get_root(void);
+
+  // make a new inode of a type, owned by `own`
+  struct inode *create_inode(int type, struct file_ownership &own);
+
+  // fill the filesystem from a cpio (newc) or ustar archive that is in memory
+  // at physical address `pa`. File data is left where it is in the archive.
+  // (src/fs/initramfs.cpp)
+  int unpack(off_t pa, size_t len);
+
+ private:
+  struct inode *root = nullptr;
+
+  spinlock lock;
+  u32 next_ino = 1;
+};
+};  // namespace fs
+
+class tmpfs_inode : public fs::inode {
+ public:
+  tmpfs_inode(int type);
+  virtual ~tmpfs_inode(void);
+
+  // the file's data, by page index. Pages that were never written (or were
+  // truncated away) are holes, which read back as zeroes
+  radix_tree<ref<mm::page>> pages;
+  spinlock data_lock;
+
+  // data that is still in the image the filesystem was unpacked from, by
+  // physical address. Holes below image_len read from there, and only get a
+  // page of their own once they are written or mapped
+  off_t image_pa = 0;
+  size_t image_len = 0;
+};
 
 #endif
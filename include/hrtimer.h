@@ -0,0 +1,63 @@
+#pragma once
+
+#include <types.h>
+
+/*
+ * High resolution timers.
+ *
+ * Time is kept in nanoseconds since boot, read from the (calibrated) TSC.
+ * Each cpu has a heap of the timers queued on it, ordered by expiry, and its
+ * timer interrupt is armed for whichever comes first. The scheduler tick is
+ * one of those timers. It also runs the timing wheel (see timer.h), and while
+ * the cpu idles it only goes off when the wheel has something due, so an idle
+ * cpu sleeps until the next timer that actually has something to do.
+ *
+ * Timer functions run in the timer interrupt with interrupts off, so they
+ * must be short and can't sleep.
+ */
+
+#define NSEC_PER_SEC 1000000000UL
+#define NSEC_PER_MSEC 1000000UL
+#define NSEC_PER_USEC 1000UL
+
+// the scheduler tick, which cpu_t::ticks counts
+#define TICK_NS (10 * NSEC_PER_MSEC)
+
+// how many timers can be queued on one cpu at once
+#define HRTIMER_MAX 1024
+
+struct hrtimer {
+  // when it goes off, in ns since boot
+  u64 expires = 0;
+  void (*fn)(struct hrtimer *) = nullptr;
+  void *data = nullptr;
+
+  // the cpu it is queued on and its slot in the heap there, or -1
+  int cpu = -1;
+  int slot = -1;
+
+  // queue it on this cpu to go off at `expires`, moving it if it was already
+  // queued. Returns 0, or -ENOSPC if this cpu has too many timers
+  int start(u64 expires);
+  // take it off its queue. Returns if it hadn't gone off yet
+  bool cancel(void);
+  bool pending(void) const { return slot >= 0; }
+};
+
+namespace time {
+
+// ns since boot
+u64 now(void);
+u64 ns_to_tsc(u64 ns);
+
+// start timekeeping on this cpu, once the TSC is calibrated
+void init(void);
+
+// run the timers that are due and arm the next one. From the timer interrupt
+void interrupt(void);
+
+// stop the scheduler tick while this cpu idles, and start it again after
+void tick_stop(void);
+void tick_restart(void);
+
+}  // namespace time
@@ -31,6 +31,7 @@
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL 64   // system call
+#define T_TLB_SHOOTDOWN 0x7e  // IPI: flush TLB entries (see smp::tlb_shootdown)
 #define T_DEFAULT 500  // catchall
 
 #define T_IRQ0 32  // IRQ 0 corresponds to int T_IRQ
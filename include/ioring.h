@@ -0,0 +1,93 @@
+#ifndef __CK_IORING_H
+#define __CK_IORING_H
+
+/*
+ * Asynchronous I/O through a pair of rings shared with the kernel.
+ *
+ * ioring_setup() maps one region into the process: a header, then the
+ * submission queue (SQ) and the completion queue (CQ). Userspace fills in
+ * entries at sq_tail and advances it. ioring_enter() (or the ring's polling
+ * thread) hands them to the ring's kernel threads, which run them against
+ * the process's files and post results at cq_tail. Userspace consumes results by
+ * advancing cq_head. Each side only ever writes its own index. The kernel
+ * never has more submissions in flight than the CQ has free entries, so a
+ * completion always has somewhere to go; submissions past that stay in the SQ.
+ *
+ * Submissions run concurrently and complete in any order; match them up with
+ * `user_data`.
+ *
+ * This header is shared with userspace (as <chariot/ioring.h>), so keep it C.
+ */
+
+// the most entries a submission queue can have
+#define IORING_MAX_ENTRIES 4096
+
+// ioring_params.flags
+#define IORING_SETUP_SQPOLL (1 << 0)  // a kernel thread watches the SQ
+
+// ioring_header.flags
+#define IORING_SQ_NEED_WAKEUP (1 << 0)  // the polling thread went to sleep
+
+// ioring_enter() flags
+#define IORING_ENTER_GETEVENTS (1 << 0)  // wait for min_complete completions
+#define IORING_ENTER_SQ_WAKEUP (1 << 1)  // wake the polling thread
+
+#define IORING_OP_NOP 0
+// reads and writes move at most 64KiB each, and complete short past that
+#define IORING_OP_READ 1   // read(fd, addr, len), or pread at off
+#define IORING_OP_WRITE 2  // write(fd, addr, len), or pwrite at off
+
+struct ioring_sqe {
+  unsigned char opcode;
+  unsigned char flags;
+  unsigned short pad;
+  int fd;
+  // where in the file, or -1 for the file's own offset
+  long off;
+  unsigned long addr;
+  unsigned int len;
+  unsigned int pad2;
+  // handed back in the completion
+  unsigned long user_data;
+};
+
+struct ioring_cqe {
+  unsigned long user_data;
+  // what the equivalent syscall would have returned
+  long res;
+};
+
+// at the start of the mapped region
+struct ioring_header {
+  unsigned int sq_head;  // written by the kernel
+  unsigned int sq_tail;  // written by userspace
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+
+  unsigned int cq_head;  // written by userspace
+  unsigned int cq_tail;  // written by the kernel
+  unsigned int cq_mask;
+  unsigned int cq_entries;
+
+  unsigned int flags;
+  unsigned int pad[7];
+};
+
+struct ioring_params {
+  // in: how many submissions to make room for. out: rounded up to a power
+  // of two. The CQ has twice as many entries
+  unsigned int sq_entries;
+  unsigned int cq_entries;
+  unsigned int flags;
+  // IORING_SETUP_SQPOLL: how long the polling thread spins without work
+  // before it sleeps (and sets IORING_SQ_NEED_WAKEUP)
+  unsigned int sq_idle_ms;
+
+  // out: where the region is mapped, and the offsets of the two queues in it
+  unsigned long addr;
+  unsigned long size;
+  unsigned int sq_off;
+  unsigned int cq_off;
+};
+
+#endif
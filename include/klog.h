@@ -0,0 +1,78 @@
+#pragma once
+
+#include <types.h>
+
+/*
+ * The kernel log.
+ *
+ * printk formats into a line buffer that belongs to the current CPU, and
+ * finished lines are copied into one global ring of fixed size records.
+ * Producers never take a lock: a record is claimed by bumping a sequence
+ * number, and each slot carries the sequence it holds so readers can tell a
+ * finished record from one being written or one that has been overwritten.
+ * When the ring wraps, the oldest records are lost.
+ *
+ * Nothing on the printk path touches the (slow, polled) serial port. The
+ * [klogd] thread drains the ring to the console in the background. Before it
+ * is running, and on panic, the ring is drained by whoever is printing.
+ *
+ * Userspace reads the ring through /dev/kmsg, one record per read.
+ */
+
+#define LOG_ERR 3
+#define LOG_WARN 4
+#define LOG_INFO 6
+#define LOG_DEBUG 7
+
+// messages without a level marker
+#define LOG_DEFAULT LOG_INFO
+
+// a printk format that starts with one of these is logged at that level
+#define KERN_SOH "\001"
+#define KERN_ERR KERN_SOH "3"
+#define KERN_WARN KERN_SOH "4"
+#define KERN_INFO KERN_SOH "6"
+#define KERN_DEBUG KERN_SOH "7"
+
+// must be a power of two
+#define LOG_SLOTS 1024
+// the longest line a record holds. Longer lines are split
+#define LOG_LINE 224
+
+namespace klog {
+
+struct record {
+  u64 seq;
+  u64 tsc;
+  u8 level;
+  u8 cpu;
+  u16 len;
+  char text[LOG_LINE];
+};
+
+// bracket one message from printk. `level` applies to the lines it starts on
+// this CPU. Interrupts are off in between; begin returns what end needs to
+// put them back the way they were
+unsigned long begin(int level);
+void putc(char c);
+void end(unsigned long flags);
+
+// log `len` bytes as complete lines at `level`
+void write(int level, const char *buf, size_t len);
+
+// copy out record `seq`. Returns 0, -EAGAIN if it hasn't been logged yet,
+// or -ENOENT if it was overwritten (lost)
+int read(u64 seq, struct record &out);
+
+// the sequence number the next record will get
+u64 next_seq(void);
+// the oldest sequence number that might still be in the ring
+u64 first_seq(void);
+
+// push everything logged so far out to the console, right now. For panic
+void flush(void);
+
+// called each timer tick, to wake klogd for lines logged with interrupts off
+void tick(void);
+
+}  // namespace klog
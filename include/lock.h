@@ -3,42 +3,62 @@
 #include <asm.h>
 #include <atom.h>
 
-// TODO: use the correct cpu state
+struct lock_stats;
+
+/*
+ * A ticket lock: lock() takes the next ticket and waits for it to be served,
+ * so waiters get the lock in the order they asked for it, and while they wait
+ * they only read. Locking doesn't touch interrupts. Locks that are also taken
+ * from interrupts must use lock_irqsave(), which nests like pushcli().
+ *
+ * A lock constructed with a name keeps contention statistics, which can be
+ * read from /dev/lockstat.
+ */
 class spinlock {
  private:
-  // compare and swap dest to spinlock on
-  int locked = 0;
+  // the next ticket to hand out, and the ticket being served
+  u32 m_next = 0;
+  u32 m_owner = 0;
+
+  const char *m_name = nullptr;
+  struct lock_stats *m_stats = nullptr;
+
+  void account(u64 spins);
+
  public:
-  inline spinlock() { locked = 0; }
+  constexpr spinlock() {}
+  constexpr spinlock(const char *name) : m_name(name) {}
 
   void lock(void);
   void unlock(void);
 
+  // pushcli(), then lock. Undone by unlock_irqrestore()
+  void lock_irqsave(void);
+  void unlock_irqrestore(void);
+
   // for just locking ints
   static void lock(volatile int &);
   static void unlock(volatile int &);
   bool is_locked(void);
 };
 
-class rwlock {
- public:
-  int read_lock();
-  int read_unlock();
+// holds a spinlock (or a mutex, see mutex.h) for as long as it is in scope
+template <typename L>
+class scoped_lock {
+  L &lck;
 
-  int write_lock();
-  int write_unlock();
+ public:
+  inline scoped_lock(L &lck) : lck(lck) { lck.lock(); }
 
- private:
-  spinlock m_lock;
-  unsigned m_readers = 0;
+  inline ~scoped_lock(void) { lck.unlock(); }
 };
 
-class scoped_lock {
+class scoped_irqlock {
   spinlock &lck;
 
  public:
-  inline scoped_lock(spinlock &lck) : lck(lck) { lck.lock(); }
+  inline scoped_irqlock(spinlock &lck) : lck(lck) { lck.lock_irqsave(); }
 
-  inline ~scoped_lock(void) { lck.unlock(); }
+  inline ~scoped_irqlock(void) { lck.unlock_irqrestore(); }
 };
 
@@ -46,6 +46,34 @@ struct pte {
   off_t ppn;
   int prot;
 };
+/**
+ * TLB invalidations gathered over one operation on a page table. Changing a
+ * mapping only edits the table, and the batch is flushed once at the end on
+ * every CPU that might have the old translation cached.
+ */
+struct tlb_batch {
+  static constexpr int max = 32;
+  off_t vas[max];
+  int count = 0;
+  // too many to do one at a time, so flush everything instead
+  bool all = false;
+
+  inline void add(off_t va) {
+    if (all) return;
+    if (count == max) {
+      all = true;
+      return;
+    }
+    vas[count++] = va;
+  }
+
+  inline bool empty(void) const { return count == 0 && !all; }
+  inline void clear(void) {
+    count = 0;
+    all = false;
+  }
+};
+
 /**
  * Page tables are created and implemented by the specific arch.
  * Implementations are found in arch/.../
@@ -56,9 +84,14 @@ class pagetable : public refcounted<pagetable> {
   virtual ~pagetable(void);
   virtual bool switch_to(void) = 0;
 
-  virtual int add_mapping(off_t va, struct pte &) = 0;
+  // replacing or removing a present mapping adds it to the batch, which the
+  // caller must flush()
+  virtual int add_mapping(off_t va, struct pte &, struct tlb_batch &) = 0;
   virtual int get_mapping(off_t va, struct pte &) = 0;
-  virtual int del_mapping(off_t va) = 0;
+  virtual int del_mapping(off_t va, struct tlb_batch &) = 0;
+
+  // invalidate (and empty) the batch wherever this table is in use
+  virtual void flush(struct tlb_batch &) = 0;
 
   // implemented in arch, returns subclass
   static ref<pagetable> create();
@@ -100,6 +133,10 @@ class space {
 
   int delete_region(off_t va);
   int pagefault(off_t va, int err);
+  // the page behind user address `va`, faulted in (and copied, for a write to
+  // a COW page) if it has to be. The reference keeps it alive even if it is
+  // unmapped. Returns 0, or -EFAULT if it isn't mapped with that access
+  int pin_page(off_t va, bool write, ref<mm::page> &out);
   off_t mmap(off_t req, size_t size, int prot, int flags, ref<fs::file>,
              off_t off);
 
@@ -18,6 +18,9 @@ struct multiboot_elf_section_header_table {
 };
 typedef struct multiboot_elf_section_header_table multiboot_elf_section_header_table_t;
 
+// bits in multiboot_info.flags
+#define MULTIBOOT_INFO_MODS 0x00000008
+
 #define MULTIBOOT_MEMORY_AVAILABLE 1
 #define MULTIBOOT_MEMORY_RESERVED 2
 #define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE 3
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <lock.h>
+#include <wait.h>
+
+/*
+ * Sleeping locks, for anything that is held across I/O or for a long time.
+ *
+ * Both spin for a little while first, since most holders let go quickly, and
+ * then sleep. Only threads sleep: from the scheduler, or before it has
+ * started, they just keep spinning. Never take one from an interrupt, or
+ * while holding a spinlock.
+ */
+
+// how many times to look at a held lock before going to sleep on it
+#define MUTEX_SPINS 100
+
+class mutex {
+ public:
+  void lock(void);
+  void unlock(void);
+  // take it if nobody has it. Returns if it did
+  bool try_lock(void);
+  bool is_locked(void);
+
+ private:
+  int m_locked = 0;
+  // how many threads are asleep on it (or about to be)
+  int m_waiters = 0;
+  waitqueue m_wq;
+};
+
+/*
+ * A reader/writer lock for data that is read much more than it is written.
+ *
+ * Readers only touch a count of their own cpu, so they don't fight over a
+ * cache line. Writers go first: once one is waiting, new readers wait behind
+ * it, and it waits for the readers already inside to leave.
+ */
+class rwlock {
+ public:
+  int read_lock();
+  int read_unlock();
+
+  int write_lock();
+  int write_unlock();
+
+ private:
+  // how many readers are inside, per cpu. A reader may leave on a different
+  // cpu than it came in on, so only the sum means anything
+  struct alignas(64) reader_count {
+    int count = 0;
+  };
+  reader_count m_readers[16];
+
+  // set while a writer holds the lock or is waiting for the readers to leave
+  int m_writer = 0;
+  // held by that writer, so other writers and new readers sleep on it
+  mutex m_wlock;
+  // where the writer waits for the readers
+  waitqueue m_drained;
+
+  int readers(void);
+};
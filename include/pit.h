@@ -9,6 +9,9 @@ void init_pit(void);
 // takes number of interrupts in a second
 void set_pit_freq(u16 per_sec);
 
+// spin for `ms` milliseconds (at most ~54) without relying on interrupts
+void pit_spin_ms(u16 ms);
+
 void pic_enable(uint8_t irq);
 void pic_disable(uint8_t irq);
 void pic_ack(uint8_t irq);
@@ -10,6 +10,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <arch.h>
+#include <klog.h>
 // #include <string.h>
 
 typedef i64 acpi_native_int;
@@ -17,6 +18,7 @@ typedef i64 acpi_native_int;
 void putchar(char);
 int puts(char*);
 int printk(const char* format, ...);
+int vprintk(const char* format, va_list va);
 int sprintk(char* buffer, const char* format, ...);
 int snprintk(char* buffer, size_t count, const char* format, ...);
 int vsnprintk(char* buffer, size_t count, const char* format, va_list va);
@@ -36,14 +38,14 @@ const char* human_size(uint64_t bytes, char* buf);
 
 #define RESET "\e[0m"
 
-#define KLOG(PREFIX, fmt, args...)   \
-  do {                               \
-    printk(PREFIX ": " fmt, ##args); \
+#define KLOG(LEVEL, PREFIX, fmt, args...)    \
+  do {                                       \
+    printk(LEVEL PREFIX ": " fmt, ##args);   \
   } while (0);
 
-#define KINFO(fmt, args...) KLOG("K", fmt, ##args)
-#define KWARN(fmt, args...) KLOG("?", fmt, ##args)
-#define KERR(fmt, args...) KLOG("!", fmt, ##args)
+#define KINFO(fmt, args...) KLOG(KERN_INFO, "K", fmt, ##args)
+#define KWARN(fmt, args...) KLOG(KERN_WARN, "?", fmt, ##args)
+#define KERR(fmt, args...) KLOG(KERN_ERR, "!", fmt, ##args)
 
 template <typename... T>
 inline void do_panic(const char* fmt, T&&... args) {
@@ -51,6 +53,8 @@ inline void do_panic(const char* fmt, T&&... args) {
   arch::cli();
   printk(fmt, args...);
   printk("\n");
+  // nobody is going to drain the log for us now
+  klog::flush();
   while (1) {
     arch::halt();
   }
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fs/vfs.h>
 #include <dirent.h>
+#include <ioring.h>
 
 #define RING_KERNEL 0
 #define RING_USER 3
@@ -139,7 +139,7 @@ class refcounted_base {
  public:
   void ref_retain() {
     assert(m_ref_count);
-    m_ref_count.store(m_ref_count.load() + 1);
+    m_ref_count.fetch_add(1);
   }
 
   int ref_count() const { return m_ref_count; }
@@ -148,9 +148,10 @@ class refcounted_base {
   refcounted_base() {}
   ~refcounted_base() { /* assert(m_ref_count == 0); */ }
 
-  void deref_base() {
+  // returns how many references are left
+  unsigned deref_base() {
     assert(m_ref_count);
-    m_ref_count.store(m_ref_count.load() - 1);
+    return m_ref_count.fetch_sub(1) - 1;
   }
 
 
@@ -161,11 +162,12 @@ template <typename T>
 class refcounted : public refcounted_base {
  public:
   void ref_release() {
-    deref_base();
-    if (m_ref_count == 0) {
+    // only the thread that drops the last reference may see zero
+    unsigned left = deref_base();
+    if (left == 0) {
       call_will_be_destroyed_if_present(static_cast<T*>(this));
       delete static_cast<T*>(this);
-    } else if (m_ref_count == 1) {
+    } else if (left == 1) {
       call_one_ref_left_if_present(static_cast<T*>(this));
     }
   }
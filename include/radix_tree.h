@@ -0,0 +1,167 @@
+#pragma once
+
+#ifndef __RADIX_TREE_H__
+#define __RADIX_TREE_H__
+
+#include <template_lib.h>
+#include <types.h>
+
+/**
+ * radix_tree - a sparse array indexed by an integer, stored as a tree of
+ * 64-way nodes. Only the parts of the index space that are in use take up
+ * memory, and a lookup is one array index per 6 bits of the largest index.
+ *
+ * A default constructed T is an empty slot, so T must be default
+ * constructible and convertible to bool (pointers and ref<> both work)
+ */
+template <typename T>
+class radix_tree {
+  static constexpr int shift = 6;
+  static constexpr u64 fanout = 1 << shift;
+  static constexpr u64 mask = fanout - 1;
+  // enough levels to cover a 64 bit index
+  static constexpr int max_height = (64 + shift - 1) / shift;
+
+  // the bottom level holds the values, the levels above it hold nodes
+  struct leaf {
+    T slots[fanout];
+    int used = 0;
+  };
+  struct node {
+    void *slots[fanout] = {};
+    int used = 0;
+  };
+
+  void *root = nullptr;
+  // how many levels the tree has. 0 when it is empty, and 1 when the root is
+  // a leaf
+  int height = 0;
+
+  static inline int height_for(u64 index) {
+    int h = 1;
+    while (h < max_height && (index >> (h * shift)) != 0) h++;
+    return h;
+  }
+
+  static void free_level(void *p, int level) {
+    if (level == 1) {
+      delete (leaf *)p;
+      return;
+    }
+    auto *n = (node *)p;
+    for (u64 i = 0; i < fanout; i++)
+      if (n->slots[i] != nullptr) free_level(n->slots[i], level - 1);
+    delete n;
+  }
+
+  template <typename Fn>
+  static void each_level(void *p, int level, u64 base, Fn &cb) {
+    if (level == 1) {
+      auto *l = (leaf *)p;
+      for (u64 i = 0; i < fanout; i++)
+        if (l->slots[i]) cb(base + i, l->slots[i]);
+      return;
+    }
+    auto *n = (node *)p;
+    int bits = (level - 1) * shift;
+    for (u64 i = 0; i < fanout; i++)
+      if (n->slots[i] != nullptr)
+        each_level(n->slots[i], level - 1, base + (i << bits), cb);
+  }
+
+ public:
+  radix_tree() {}
+  ~radix_tree() { clear(); }
+
+  radix_tree(const radix_tree &) = delete;
+  radix_tree &operator=(const radix_tree &) = delete;
+
+  // the slot at `index`, or NULL if nothing has been stored near it
+  T *lookup(u64 index) {
+    if (height == 0 || height_for(index) > height) return nullptr;
+
+    void *p = root;
+    for (int level = height; level > 1; level--) {
+      p = ((node *)p)->slots[(index >> ((level - 1) * shift)) & mask];
+      if (p == nullptr) return nullptr;
+    }
+    return &((leaf *)p)->slots[index & mask];
+  }
+
+  // store `val` at `index`, growing the tree if it has to
+  void set(u64 index, T val) {
+    int need = height_for(index);
+    if (root == nullptr) {
+      height = need;
+    } else {
+      // add levels on top, with the old tree as the first child
+      while (height < need) {
+        auto *n = new node();
+        n->slots[0] = root;
+        n->used = 1;
+        root = n;
+        height++;
+      }
+    }
+
+    void **slot = &root;
+    for (int level = height; level > 1; level--) {
+      if (*slot == nullptr) *slot = new node();
+      auto *n = (node *)*slot;
+      slot = &n->slots[(index >> ((level - 1) * shift)) & mask];
+      if (*slot == nullptr) n->used++;
+    }
+    if (*slot == nullptr) *slot = new leaf();
+
+    auto *l = (leaf *)*slot;
+    auto &dst = l->slots[index & mask];
+    if (!dst && val) l->used++;
+    if (dst && !val) l->used--;
+    dst = move(val);
+  }
+
+  // empty the slot at `index`, freeing any nodes that end up empty
+  void remove(u64 index) {
+    if (height == 0 || height_for(index) > height) return;
+
+    // remember the path, so empty nodes can be unlinked on the way back up
+    void **path[max_height];
+    void **slot = &root;
+    for (int level = height; level > 1; level--) {
+      path[level - 1] = slot;
+      auto *n = (node *)*slot;
+      slot = &n->slots[(index >> ((level - 1) * shift)) & mask];
+      if (*slot == nullptr) return;
+    }
+
+    auto *l = (leaf *)*slot;
+    auto &dst = l->slots[index & mask];
+    if (!dst) return;
+    dst = T();
+    if (--l->used > 0) return;
+
+    delete l;
+    *slot = nullptr;
+    for (int level = 2; level <= height; level++) {
+      auto *n = (node *)*path[level - 1];
+      if (--n->used > 0) return;
+      delete n;
+      *path[level - 1] = nullptr;
+    }
+    height = 0;
+  }
+
+  // call cb(index, T&) for every slot that is in use, in index order
+  template <typename Fn>
+  void each(Fn cb) {
+    if (root != nullptr) each_level(root, height, 0, cb);
+  }
+
+  void clear(void) {
+    if (root != nullptr) free_level(root, height);
+    root = nullptr;
+    height = 0;
+  }
+};
+
+#endif
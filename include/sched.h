@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <fdtable.h>
 #include <func.h>
 #include <map.h>
 #include <mm.h>
@@ -113,8 +114,7 @@ struct process final : public refcounted<struct process> {
   /* threads stuck in a waitpid() call */
   waitqueue waiters;
 
-  spinlock file_lock;
-  map<int, ref<fs::file>> open_files;
+  fd_table files;
 
   /**
    * exec() - execute a command (implementation for startpid())
@@ -137,8 +137,13 @@ struct process final : public refcounted<struct process> {
 };
 
 struct thread_fpu_info {
-  bool initialized = false;
+  // the saved registers, fpu::state_size() bytes (64 byte aligned in buf)
   void *state;
+  void *buf;
+  // the cpu that last loaded our state. Its registers may still hold it
+  int last_cpu = -1;
+  // our state is loaded now, so it has to be saved when we stop
+  bool live = false;
 };
 
 struct thread_statistics {
@@ -167,6 +172,8 @@ struct thread_waitqueue_info {
   unsigned waiting_on = 0;
   int flags = 0;
   bool rudely_awoken = false;
+  // the wait gave up before anyone notified it
+  bool timed_out = false;
   // intrusive list for the waitqueue. It's the first if wq_prev == NULL
   struct thread *next;
   struct thread *prev;
@@ -256,7 +263,9 @@ void block();
 // does not return
 void run(void);
 
-void dumb_sleepticks(unsigned long);
+// block the current thread for (at least) `ns` nanoseconds. If it is woken
+// early, returns -EINTR and stores how much of the sleep was left in `rem`
+int sleep_ns(u64 ns, u64 *rem = NULL);
 
 void handle_tick(u64 tick);
 
@@ -0,0 +1,56 @@
+#pragma once
+
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <lock.h>
+
+/**
+ * seqlock - a reader/writer lock where readers never write to shared memory
+ *
+ * Writers serialize on an internal spinlock and bump the sequence counter on
+ * both sides of their critical section (so it is odd while a write is in
+ * progress). Readers sample the counter, do their reads optimistically, and
+ * retry if the counter moved. This means the data protected by a seqlock must
+ * always be safe to *read*, even while it is being modified.
+ *
+ *   unsigned seq;
+ *   do {
+ *     seq = lck.read_begin();
+ *     ... read the protected data ...
+ *   } while (lck.read_retry(seq));
+ */
+class seqlock {
+ public:
+  inline seqlock() {}
+
+  inline unsigned read_begin(void) const {
+    unsigned s;
+    while ((s = __atomic_load_n(&m_seq, __ATOMIC_ACQUIRE)) & 1) {
+      asm volatile("pause");
+    }
+    return s;
+  }
+
+  inline bool read_retry(unsigned start) const {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&m_seq, __ATOMIC_RELAXED) != start;
+  }
+
+  inline void write_lock(void) {
+    m_lock.lock();
+    __atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+
+  inline void write_unlock(void) {
+    __atomic_store_n(&m_seq, m_seq + 1, __ATOMIC_RELEASE);
+    m_lock.unlock();
+  }
+
+ private:
+  unsigned m_seq = 0;
+  spinlock m_lock;
+};
+
+#endif
@@ -50,6 +50,9 @@ long read(int fd, void *, long);
 /// num=0x14
 long write(int fd, void *, long);
 
+/// num=0x15
+int ioctl(int fd, unsigned long cmd, unsigned long arg);
+
 /// num=0x16
 int stat(const char *pathname, struct stat *statbuf);
 
@@ -102,13 +105,42 @@ int munmap(void *addr, unsigned long length);
 int mrename(void *addr, char *name);
 
 
-/// num=0x40
-int dirent(int fd, struct dirent *, int offset, int count);
+/// num=0x41
+long getdents64(int fd, void *dirp, unsigned long count);
 
 
 /// num=0x50
 time_t localtime(struct tm *tloc);
 
+/// num=0x51
+int nanosleep(struct timespec *req, struct timespec *rem);
+
 
 /// num=0x60
 int socket(int domain, int type, int protocol);
+
+
+/// num=0x70
+long pread64(int fd, void *, long, long offset);
+
+/// num=0x71
+long pwrite64(int fd, void *, long, long offset);
+
+/// num=0x72
+long readv(int fd, const struct iovec *iov, int iovcnt);
+
+/// num=0x73
+long writev(int fd, const struct iovec *iov, int iovcnt);
+
+/// num=0x74
+long preadv(int fd, const struct iovec *iov, int iovcnt, long offset);
+
+/// num=0x75
+long pwritev(int fd, const struct iovec *iov, int iovcnt, long offset);
+
+
+/// num=0x80
+int ioring_setup(unsigned entries, struct ioring_params *params);
+
+/// num=0x81
+int ioring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags);
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fs/vfs.h>
 #include <dirent.h>
+#include <ioring.h>
 
 #define RING_KERNEL 0
 #define RING_USER 3
@@ -35,6 +36,10 @@ long ksyscall(long n, ...);
 #define O_CLOEXEC 02000000
 #define O_NOFOLLOW_NOERROR 0x4000000
 
+// the most bytes one read or write can move, so the count fits in the return
+// value
+#define RW_MAX (~0UL >> 1)
+
 
 /**
  * the declaration of every syscall function. The kernel should go though this
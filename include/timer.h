@@ -0,0 +1,56 @@
+#pragma once
+
+#include <types.h>
+
+/*
+ * Timeouts, at tick granularity (see TICK_NS in hrtimer.h).
+ *
+ * Each cpu has a hierarchical timing wheel: four levels of 64 slots, where a
+ * slot in level n covers 64^n ticks. Adding or removing a timer is O(1), and
+ * the tick only looks at one slot, moving a slot of the next level down every
+ * 64 ticks. Most timeouts are removed long before they expire, which is what
+ * this is good at. For precise expiry, use an hrtimer.
+ *
+ * While a cpu idles its tick only runs when the wheel next needs it.
+ * Functions run in the tick with interrupts off, so they can't sleep.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+// the farthest out a timer can be. Later ones go off at this point
+#define WHEEL_MAX_TICKS ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer {
+  // the tick it goes off on (compare cpu::get_ticks())
+  u64 expires = 0;
+  void (*fn)(struct timer *) = nullptr;
+  void *data = nullptr;
+
+  // in slot `slot` of the wheel of `cpu`, which is -1 when not queued
+  struct timer *next = nullptr;
+  struct timer *prev = nullptr;
+  int cpu = -1;
+  int slot = -1;
+
+  // queue it on this cpu's wheel, moving it if it was already queued
+  void add(u64 expires);
+  // take it off its wheel. Returns if it hadn't gone off yet. If it is going
+  // off right now on another cpu, this waits for the function to be done
+  bool del(void);
+  bool pending(void) const { return cpu >= 0; }
+};
+
+namespace time {
+
+// the tick since boot, whether or not this cpu's tick is running
+u64 current_tick(void);
+// the tick that is at least `ns` away
+u64 tick_after(u64 ns);
+
+// run this cpu's timers that are due by `tick`. From the tick
+void run_timers(u64 tick);
+// the next tick this cpu's wheel has to run on, or 0 if it is empty
+u64 next_timer(void);
+
+}  // namespace time
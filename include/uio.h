@@ -0,0 +1,13 @@
+#ifndef __CK_UIO_H
+#define __CK_UIO_H
+
+// one segment of a vectored read or write
+struct iovec {
+	void *iov_base;
+	unsigned long iov_len;
+};
+
+// the most segments a single call can take
+#define IOV_MAX 1024
+
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifndef __VDSO_H__
+#define __VDSO_H__
+
+/*
+ * The vDSO: two pages the kernel maps at the top of every user address space.
+ *
+ * The first ("[vvar]") is data the kernel keeps up to date and userspace can
+ * only read: the time as of the last tick, what is needed to extrapolate from
+ * there with the TSC, and which thread each cpu is running. The second
+ * ("[vdso]") is code that reads it, reached through a table of jumps at the
+ * start of the page, so libc doesn't depend on the layout of the data.
+ *
+ * This header is shared with userspace (as <chariot/vdso.h>), so keep it C.
+ */
+
+#define VDSO_DATA 0x7fffffffd000UL
+#define VDSO_CODE 0x7fffffffe000UL
+
+#define VDSO_MAGIC 0x4f534456  // "VDSO"
+
+// the functions in the code page, by their slot in the jump table
+#define VDSO_CLOCK_GETTIME 0  // long (int clock, struct timespec *)
+#define VDSO_TIME 1           // time_t (time_t *)
+#define VDSO_GETPID 2         // long (void)
+#define VDSO_GETTID 3         // long (void)
+#define VDSO_NR_FUNCS 4
+
+// the address of a function in the code page
+#define VDSO_FUNC(n) ((void *)(VDSO_CODE + 8 + (n)*8))
+
+#define VDSO_MAX_CPUS 16
+
+// what a cpu is running. seq changes every time that cpu switches threads
+struct vdso_cpu {
+  unsigned int seq;
+  int pid;
+  int tid;
+  unsigned int pad;
+};
+
+/*
+ * The data page. The time fields are only consistent while `seq` is even and
+ * doesn't change across the reads. arch/x86_64/vdso.asm has these offsets too
+ */
+struct vdso_data {
+  unsigned int seq;
+  unsigned int nr_cpus;
+  // cpu_t::speed_khz of the boot cpu
+  unsigned long tsc_khz;
+  // nanoseconds = (cycles * tsc_mult) >> 32
+  unsigned long tsc_mult;
+  unsigned long ticks;
+  // the timestamp counter, the time since boot and the wall clock time as of
+  // the last tick
+  unsigned long tick_tsc;
+  unsigned long mono_ns;
+  unsigned long wall_ns;
+  unsigned long pad;
+
+  struct vdso_cpu cpus[VDSO_MAX_CPUS];
+};
+
+#ifdef __cplusplus
+#include <types.h>
+
+namespace mm {
+class space;
+}
+struct thread;
+
+namespace vdso {
+
+// map the vDSO into an address space, at exec
+int map(mm::space &);
+// update the time. Called from the timer tick on the boot cpu
+void tick(u64 tsc);
+// record that `thd` is about to run on this cpu
+void switch_to(struct thread *thd);
+
+}  // namespace vdso
+#endif
+
+#endif
@@ -22,5 +22,9 @@ void init();
 void early_init();
 void late_init();
 void putchar(char c);
+// draw what putchar changed since the last flush
+void flush(void);
+// the console is on the framebuffer, so putchar is worth calling
+bool fbcon(void);
 
 };  // namespace vga
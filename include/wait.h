@@ -5,6 +5,10 @@
 #include <types.h>
 
 #define WAIT_NOINT 1
+
+struct thread;
+struct timer;
+
 /**
  * implemented in sched.cpp
  */
@@ -15,6 +19,9 @@ class waitqueue {
 
   // wait, but not interruptable
   void wait_noint(u32 on = 0);
+  // wait_noint, but give up after `ns` (at tick granularity). Returns 0 if
+  // notified, or -ETIMEDOUT
+  int wait_timeout(u64 ns, u32 on = 0);
   void notify();
 
   void notify_all(void);
@@ -22,7 +29,9 @@ class waitqueue {
   bool should_notify(u32 val);
 
  private:
-  int do_wait(u32 on, int flags);
+  int do_wait(u32 on, int flags, u64 timeout);
+  void unlink(struct thread *thd);
+  static void wait_expired(struct timer *t);
   // navail is the number of unhandled notifications
   int navail = 0;
 
@@ -26,45 +26,21 @@ struct thread *cpu::thread() {
 
 extern "C" u64 get_sp(void);
 
-void cpu::calc_speed_khz(void) {
-  auto &c = current();
-  c.speed_khz = 0;
-  u64 rec_ms = 500;
-  auto start_cycle = arch::read_timestamp();
-  auto start_tick = c.ticks;
-
-  arch::sti();
-
-  // spin while recording
-  while (1) {
-    if (c.ticks - start_tick > rec_ms) {
-      break;
-    }
-    asm("pause");
-  }
-
-  double cycles = arch::read_timestamp() - start_cycle;
-  pushcli();
-
-  arch::cli();
-
-  double hz = (cycles / rec_ms) * 1000.0;
-  c.speed_khz = hz / 1000;
-  printk("%zu khz\n", c.speed_khz);
-}
-
 // Pushcli/popcli are like cli/sti except that they are matched:
 // it takes two popcli to undo two pushcli.  Also, if interrupts
 // are off, then pushcli, popcli leaves them off.
 void cpu::pushcli(void) {
+  int enabled = (readeflags() & FL_IF) != 0;
   arch::cli();
-  current().ncli++;
+  auto &c = current();
+  if (c.ncli++ == 0) c.intena = enabled;
 }
 
 void cpu::popcli(void) {
   if (readeflags() & FL_IF) panic("popcli - interruptible");
-  if (--current().ncli < 0) panic("popcli");
-  if (current().ncli == 0) arch::sti();
+  auto &c = current();
+  if (--c.ncli < 0) panic("popcli");
+  if (c.ncli == 0 && c.intena) arch::sti();
 }
 
 void cpu::preempt_enable(void) {
@@ -17,8 +17,7 @@ int dev::blk_dev::read(u64 offset, u32 len, void *data) {
 
   u64 blk_count = end_block - first_block;
 
-  for (u64 i = 0; i < blk_count; i++)
-    if (!read_block(first_block + i, (u8 *)data + bsize * i)) return -EIO;
+  if (!read_blocks(first_block, blk_count, (u8 *)data)) return -EIO;
 
   return len;
 }
@@ -34,9 +33,22 @@ int dev::blk_dev::write(u64 offset, u32 len, const void *data) {
 
   u64 blk_count = end_block - first_block;
 
-  for (u64 i = 0; i < blk_count; i++)
-    if (!write_block(first_block + i, (u8 *)data + bsize * i)) return -EIO;
+  if (!write_blocks(first_block, blk_count, (const u8 *)data)) return -EIO;
 
   return len;
 }
 
+
+bool dev::blk_dev::read_blocks(u32 index, u32 count, u8 *buf) {
+  u64 bsize = block_size();
+  for (u32 i = 0; i < count; i++)
+    if (!read_block(index + i, buf + bsize * i)) return false;
+  return true;
+}
+
+bool dev::blk_dev::write_blocks(u32 index, u32 count, const u8 *buf) {
+  u64 bsize = block_size();
+  for (u32 i = 0; i < count; i++)
+    if (!write_block(index + i, buf + bsize * i)) return false;
+  return true;
+}
@@ -16,3 +16,11 @@ bool dev::partition::write_block(u32 index, const u8 *buf) {
   return m_disk.write_block(index + m_offset, buf);
 }
 
+
+bool dev::partition::read_blocks(u32 index, u32 count, u8 *buf) {
+  return m_disk.read_blocks(index + m_offset, count, buf);
+}
+
+bool dev::partition::write_blocks(u32 index, u32 count, const u8 *buf) {
+  return m_disk.write_blocks(index + m_offset, count, buf);
+}
@@ -1,9 +1,12 @@
 #include <asm.h>
 #include <console.h>
+#include <cpu.h>
 #include <dev/serial.h>
 #include <arch.h>
+#include <lock.h>
 #include <module.h>
 #include <printk.h>
+#include <wait.h>
 
 #define IRQ_COM1 4
 
@@ -11,20 +14,60 @@ static int uart = 0;
 
 #define BAUD 115200
 
-void serial_install() {
-  // Turn off the FIFO
-  outb(COM1 + 2, 0);
+// 16550 registers, as offsets from the port base
+#define UART_DATA 0
+#define UART_IER 1
+#define UART_IIR 2  // read
+#define UART_FCR 2  // write
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+
+#define IER_RX 0x01
+#define IER_THRE 0x02
+
+#define LSR_DATA 0x01
+#define LSR_THRE 0x20
+
+// the transmit FIFO on a 16550
+#define UART_FIFO 16
+
+/*
+ * Output to COM1 goes through a ring. Writers copy into it and go on their
+ * way, and the THRE interrupt moves it out UART_FIFO bytes at a time, so
+ * nobody waits out the baud rate. Until the interrupt is installed (and when
+ * it can't be waited for) the ring is pushed out by polling.
+ */
+#define TX_RING 8192  // must be a power of two
+static char tx_ring[TX_RING];
+// tx_head is the next byte to send, tx_tail the next free byte
+static u32 tx_head = 0;
+static u32 tx_tail = 0;
+static spinlock tx_lock;
+static bool tx_irq = false;
+static u8 uart_ier = IER_RX;
+
+// how many writers found the ring full and are waiting (or about to wait) for
+// room. Each gets its own notify(), which the waitqueue keeps if the writer
+// hasn't gone to sleep yet
+static int tx_waiting = 0;
+static waitqueue tx_space;
 
+void serial_install() {
   // BAUD baud, 8 data bits, 1 stop bit, parity off.
-  outb(COM1 + 3, 0x80);  // Unlock divisor
+  outb(COM1 + UART_LCR, 0x80);  // Unlock divisor
   outb(COM1 + 0, 115200 / BAUD);
   outb(COM1 + 1, 0);
-  outb(COM1 + 3, 0x03);  // Lock divisor, 8 data bits.
-  outb(COM1 + 4, 0);
-  outb(COM1 + 1, 0x01);  // Enable receive interrupts.
+  outb(COM1 + UART_LCR, 0x03);  // Lock divisor, 8 data bits.
+  // enable and clear the FIFOs, and interrupt at 14 bytes received
+  outb(COM1 + UART_FCR, 0xC7);
+  // DTR, RTS, and OUT2, which gates the interrupt line on a PC
+  outb(COM1 + UART_MCR, 0x0B);
+  outb(COM1 + UART_IER, uart_ier);  // Enable receive interrupts.
 
   // If status is 0xFF, no serial port.
-  if (inb(COM1 + 5) == 0xFF) return;
+  if (inb(COM1 + UART_LSR) == 0xFF) return;
   uart = 1;
 }
 
@@ -40,21 +83,94 @@ char serial_recv_async(int device) { return inb(device); }
 
 int serial_transmit_empty(int device) { return inb(device + 5) & 0x20; }
 
-void serial_send(int device, char out) {
-  if (uart) {
-    /*
-    while (!serial_transmit_empty(device)) {
+static void send_polled(int device, char out) {
+  // bounded, so a missing or wedged UART can't hang the kernel
+  for (int i = 0; i < 100000 && !serial_transmit_empty(device); i++)
+    asm("pause");
+  outb(device, out);
+}
+
+static void set_ier(u8 ier) {
+  if (ier == uart_ier) return;
+  uart_ier = ier;
+  outb(COM1 + UART_IER, ier);
+}
+
+// move what fits into the hardware FIFO. tx_lock must be held
+static void tx_fill(void) {
+  if (inb(COM1 + UART_LSR) & LSR_THRE) {
+    for (int i = 0; i < UART_FIFO && tx_head != tx_tail; i++)
+      outb(COM1 + UART_DATA, tx_ring[tx_head++ & (TX_RING - 1)]);
+  }
+
+  // only ask for THRE interrupts while there is something left to send
+  if (tx_head == tx_tail)
+    set_ier(uart_ier & ~IER_THRE);
+  else
+    set_ier(uart_ier | IER_THRE);
+
+  if (tx_waiting > 0 && tx_tail - tx_head < TX_RING) {
+    for (; tx_waiting > 0; tx_waiting--) tx_space.notify();
+  }
+}
+
+// push everything in the ring out by polling. tx_lock must be held
+static void tx_drain_polled(void) {
+  while (tx_head != tx_tail)
+    send_polled(COM1, tx_ring[tx_head++ & (TX_RING - 1)]);
+}
+
+void serial_write(int device, const char* buf, size_t len) {
+  if (!uart) return;
+
+  if (device != COM1 || !tx_irq) {
+    for (size_t i = 0; i < len; i++) send_polled(device, buf[i]);
+    return;
+  }
+
+  while (len > 0) {
+    u64 flags = readeflags();
+    arch::cli();
+    tx_lock.lock();
+
+    size_t n = TX_RING - (tx_tail - tx_head);
+    if (n > len) n = len;
+    for (size_t i = 0; i < n; i++) tx_ring[tx_tail++ & (TX_RING - 1)] = buf[i];
+    buf += n;
+    len -= n;
+    tx_fill();
+
+    bool sleep = false;
+    if (len > 0) {
+      // full. Threads can wait for room, anything else has to make it
+      if ((flags & FL_IF) && cpu::in_thread()) {
+        tx_waiting++;
+        sleep = true;
+      } else {
+        tx_drain_polled();
+      }
     }
-    */
-    outb(device, out);
+
+    tx_lock.unlock();
+    if (flags & FL_IF) arch::sti();
+    if (sleep) tx_space.wait_noint();
   }
 }
 
+void serial_flush(int device) {
+  if (!uart || device != COM1) return;
+  u64 flags = readeflags();
+  arch::cli();
+  tx_lock.lock();
+  tx_drain_polled();
+  tx_lock.unlock();
+  if (flags & FL_IF) arch::sti();
+}
+
+void serial_send(int device, char out) { serial_write(device, &out, 1); }
+
 void serial_string(int device, char* out) {
-  for (uint32_t i = 0; out[i] != '\0'; i++) {
-    outb(device, out[i]);
-    // serial_send(device, out[i]);
-  }
+  serial_write(device, out, strlen(out));
 }
 
 static int uartgetc(void) {
@@ -63,11 +179,12 @@ static int uartgetc(void) {
   return inb(COM1 + 0);
 }
 
-void serial_irq_handle(int i, reg_t *) {
-
+static void serial_rx(void) {
   size_t nread = 0;
   char buf[32];
 
+  // take everything the receive FIFO has, not just the byte that
+  // triggered the interrupt
   while (1) {
     int c = uartgetc();
     if (c < 0) break;
@@ -75,19 +192,44 @@ void serial_irq_handle(int i, reg_t *) {
     // serial only sends \r for some reason
     if (c == '\r') c = '\n';
 
-    if (nread > 32) {
+    if (nread == sizeof(buf)) {
       console::feed(nread, buf);
       nread = 0;
     }
 
     buf[nread] = c;
     nread++;
-
   }
 
   if (nread != 0) console::feed(nread, buf);
 }
 
+void serial_irq_handle(int i, reg_t *) {
+  while (1) {
+    u8 iir = inb(COM1 + UART_IIR);
+    // bit 0 is set when nothing is pending
+    if (iir & 1) break;
+
+    switch ((iir >> 1) & 7) {
+      case 1:  // THR empty
+        tx_lock.lock();
+        tx_fill();
+        tx_lock.unlock();
+        break;
+      case 2:  // received data
+      case 6:  // character timeout
+        serial_rx();
+        break;
+      case 3:  // line status
+        inb(COM1 + UART_LSR);
+        break;
+      default:  // modem status
+        inb(COM1 + UART_MSR);
+        break;
+    }
+  }
+}
+
 static void serial_mod_init() {
   // setup interrupts on serial
   irq::install(32 + IRQ_COM1, serial_irq_handle, "COM1 Serial Port");
@@ -97,6 +239,9 @@ static void serial_mod_init() {
   inb(COM1 + 2);
   inb(COM1 + 0);
   // smp::ioapicenable(IRQ_COM1, 0);
+
+  // from here on, COM1 output is queued and sent from the interrupt
+  tx_irq = true;
 }
 
 module_init("serial", serial_mod_init);
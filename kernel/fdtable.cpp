@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <fdtable.h>
+#include <mem.h>
+#include <sched.h>
+
+// how many slots a new table starts with
+#define FD_INITIAL 64
+
+#define BITS_PER_WORD 64
+#define words_for(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+fd_table::array *fd_table::alloc_array(int size) {
+  auto *t = new array;
+  t->size = size;
+  t->files = (fs::file **)kmalloc(size * sizeof(fs::file *));
+  t->used = (u64 *)kmalloc(words_for(size) * sizeof(u64));
+  memset(t->files, 0, size * sizeof(fs::file *));
+  memset(t->used, 0, words_for(size) * sizeof(u64));
+  return t;
+}
+
+void fd_table::free_array(array *t) {
+  kfree(t->files);
+  kfree(t->used);
+  delete t;
+}
+
+fd_table::fd_table(void) {
+  readers[0] = 0;
+  readers[1] = 0;
+  current = alloc_array(FD_INITIAL);
+}
+
+fd_table::~fd_table(void) {
+  clear();
+  free_array(current.load());
+}
+
+ref<fs::file> fd_table::get(int fd) {
+  unsigned side;
+  while (1) {
+    side = gen.load() & 1;
+    readers[side].fetch_add(1);
+    // if a writer flipped the generation in the meantime, it may already have
+    // seen our side empty. Go again on the new side
+    if ((gen.load() & 1) == side) break;
+    readers[side].fetch_sub(1);
+  }
+
+  ref<fs::file> file;
+  auto *t = current.load();
+  if (fd >= 0 && fd < t->size) {
+    // the table's reference keeps the file alive until we leave
+    file = __atomic_load_n(&t->files[fd], __ATOMIC_ACQUIRE);
+  }
+
+  readers[side].fetch_sub(1);
+  return file;
+}
+
+void fd_table::synchronize(void) {
+  // one at a time: a second flip would leave us waiting on the wrong side
+  scoped_lock l(sync_lock);
+  unsigned old = gen.fetch_add(1) & 1;
+  while (readers[old].load() != 0) sched::yield();
+}
+
+int fd_table::expand(int fd, array *&retired) {
+  auto *t = current.load();
+  if (fd < t->size) return 0;
+  if (fd >= FD_MAX) return -EMFILE;
+
+  int size = t->size;
+  while (size <= fd) size *= 2;
+
+  auto *n = alloc_array(size);
+  memcpy(n->files, t->files, t->size * sizeof(fs::file *));
+  memcpy(n->used, t->used, words_for(t->size) * sizeof(u64));
+  current.store(n);
+
+  // readers may still be looking at the old array, so the caller frees it
+  // once it has dropped the lock and waited for them
+  retired = t;
+  return 0;
+}
+
+void fd_table::set_slot(array *t, int fd, fs::file *f) {
+  __atomic_store_n(&t->files[fd], f, __ATOMIC_RELEASE);
+  if (f != nullptr)
+    t->used[fd / BITS_PER_WORD] |= 1LLU << (fd % BITS_PER_WORD);
+  else
+    t->used[fd / BITS_PER_WORD] &= ~(1LLU << (fd % BITS_PER_WORD));
+}
+
+int fd_table::install(ref<fs::file> file, int min) {
+  if (!file) return -EINVAL;
+  if (min < 0) return -EINVAL;
+
+  array *retired = nullptr;
+  int fd = -1;
+  {
+    scoped_lock l(lock);
+
+    while (fd < 0) {
+      auto *t = current.load();
+      int words = words_for(t->size);
+      for (int w = min / BITS_PER_WORD; w < words; w++) {
+        u64 free = ~t->used[w];
+        // ignore the slots below min in the first word
+        if (w == min / BITS_PER_WORD) free &= ~0LLU << (min % BITS_PER_WORD);
+        if (free == 0) continue;
+
+        int slot = w * BITS_PER_WORD + __builtin_ctzll(free);
+        if (slot >= t->size) break;
+        set_slot(t, slot, file.leak_ref());
+        fd = slot;
+        break;
+      }
+      if (fd >= 0) break;
+
+      // everything is in use, so make room for one more. The new half of the
+      // array is empty, so this only happens once
+      int err = expand(max(t->size, min), retired);
+      if (err != 0) return err;
+    }
+  }
+
+  if (retired != nullptr) {
+    synchronize();
+    free_array(retired);
+  }
+  return fd;
+}
+
+int fd_table::install_at(int fd, ref<fs::file> file) {
+  if (!file) return -EINVAL;
+  if (fd < 0 || fd >= FD_MAX) return -EBADF;
+
+  fs::file *old;
+  array *retired = nullptr;
+  {
+    scoped_lock l(lock);
+    int err = expand(fd, retired);
+    if (err != 0) return err;
+
+    auto *t = current.load();
+    old = t->files[fd];
+    set_slot(t, fd, file.leak_ref());
+  }
+
+  if (old != nullptr || retired != nullptr) synchronize();
+  if (retired != nullptr) free_array(retired);
+  if (old != nullptr) old->ref_release();
+  return fd;
+}
+
+int fd_table::remove(int fd) {
+  fs::file *old;
+  {
+    scoped_lock l(lock);
+    auto *t = current.load();
+    if (fd < 0 || fd >= t->size || t->files[fd] == nullptr) return -EBADF;
+
+    old = t->files[fd];
+    set_slot(t, fd, nullptr);
+  }
+
+  synchronize();
+  old->ref_release();
+  return 0;
+}
+
+void fd_table::clear(void) {
+  vec<fs::file *> closed;
+  {
+    scoped_lock l(lock);
+    auto *t = current.load();
+    for (int fd = 0; fd < t->size; fd++) {
+      if (t->files[fd] == nullptr) continue;
+      closed.push(t->files[fd]);
+      set_slot(t, fd, nullptr);
+    }
+  }
+
+  if (closed.size() != 0) synchronize();
+  for (auto *f : closed) f->ref_release();
+}
@@ -37,9 +37,7 @@ static void consputc(int c) {
   } else {
     serial_send(COM1, c);
   }
-    // vga::putchar(c);
-  if (use_kernel_vm) {
-  }
+  if (vga::fbcon()) vga::putchar(c);
 }
 
 static void flush(void) {
@@ -86,10 +84,12 @@ void console::feed(size_t sz, char* buf) {
   // flush the atomic input if we arent buffering
   if (!buffer_input) flush();
   cons_input_lock.unlock();
+  if (echo && vga::fbcon()) vga::flush();
 }
 
 int console::getc(bool block) { return -1; }
 void console::putc(char c) { consputc(c); }
+void console::sync(void) { serial_flush(COM1); }
 
 static ssize_t console_read(fs::file& fd, char* buf, size_t sz) {
   if (fd) {
@@ -104,7 +104,19 @@ static ssize_t console_write(fs::file& fd, const char* buf, size_t sz) {
   if (fd) {
     auto minor = fd.ino->minor;
     if (minor != 0) return -1;
-    for (size_t i = 0; i < sz; i++) consputc(buf[i]);
+    // hand runs of plain bytes to the serial queue in one go
+    size_t start = 0;
+    for (size_t i = 0; i < sz; i++) {
+      if (buf[i] != CONS_DEL) continue;
+      serial_write(COM1, buf + start, i - start);
+      serial_write(COM1, "\b \b", 3);
+      start = i + 1;
+    }
+    serial_write(COM1, buf + start, sz - start);
+    if (vga::fbcon()) {
+      for (size_t i = 0; i < sz; i++) vga::putchar(buf[i]);
+      vga::flush();
+    }
     return sz;
   }
   return -1;
@@ -0,0 +1,275 @@
+#include <fs/dcache.h>
+#include <lock.h>
+#include <seqlock.h>
+#include <string.h>
+
+// #define DCACHE_DEBUG
+
+#ifdef DCACHE_DEBUG
+#define INFO(fmt, args...) printk("[DCACHE] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+// must be powers of two
+#define DCACHE_BUCKETS 1024
+#define DCACHE_ENTRIES 4096
+// buckets of the per-inode index, which only purge uses
+#define DCACHE_INODE_BUCKETS 256
+
+struct dentry {
+  // NULL if the slot is not in the table
+  struct fs::inode *dir;
+  // NULL for negative entries
+  struct fs::inode *ino;
+  u32 hash;
+  u8 len;
+  // set by readers, cleared by the clock hand on eviction
+  u8 referenced;
+  char name[DCACHE_NAME_LEN];
+
+  struct dentry *next;
+  // the chains in the per-inode index, keyed by `dir` and by `ino`
+  struct dentry *dir_next;
+  struct dentry *ino_next;
+};
+
+struct dcache_bucket {
+  seqlock seq;
+  struct dentry *head = NULL;
+};
+
+static struct dentry dentry_pool[DCACHE_ENTRIES];
+static struct dcache_bucket buckets[DCACHE_BUCKETS];
+
+// every entry by its parent, and every positive entry by its inode, so
+// purge() doesn't have to look at the whole pool. Writers only
+static struct dentry *by_dir[DCACHE_INODE_BUCKETS];
+static struct dentry *by_ino[DCACHE_INODE_BUCKETS];
+
+// serializes all writers. Readers only ever look at the bucket seqlocks
+static spinlock dcache_lock;
+static int clock_hand = 0;
+
+static inline u32 inode_hash(struct fs::inode *ino) {
+  u64 d = (u64)ino >> 4;
+  return (u32)(d ^ (d >> 8) ^ (d >> 16)) & (DCACHE_INODE_BUCKETS - 1);
+}
+
+/* does not take the dcache_lock! */
+static void index_add(struct dentry *e) {
+  auto &d = by_dir[inode_hash(e->dir)];
+  e->dir_next = d;
+  d = e;
+  if (e->ino != NULL) {
+    auto &i = by_ino[inode_hash(e->ino)];
+    e->ino_next = i;
+    i = e;
+  }
+}
+
+/* does not take the dcache_lock! */
+static void index_remove(struct dentry *e) {
+  for (auto **it = &by_dir[inode_hash(e->dir)]; *it != NULL;
+       it = &(*it)->dir_next) {
+    if (*it == e) {
+      *it = e->dir_next;
+      break;
+    }
+  }
+  if (e->ino == NULL) return;
+  for (auto **it = &by_ino[inode_hash(e->ino)]; *it != NULL;
+       it = &(*it)->ino_next) {
+    if (*it == e) {
+      *it = e->ino_next;
+      break;
+    }
+  }
+}
+
+static inline u32 name_hash(struct fs::inode *dir, const char *name, int &len) {
+  // FNV-1a over the name, then mixed with the parent's address
+  u32 h = 2166136261u;
+  for (len = 0; name[len] != '\0'; len++) {
+    h ^= (u8)name[len];
+    h *= 16777619u;
+  }
+  u64 d = (u64)dir >> 4;
+  h ^= (u32)d ^ (u32)(d >> 32);
+  h *= 16777619u;
+  return h;
+}
+
+static inline struct dcache_bucket &bucket_for(u32 hash) {
+  return buckets[hash & (DCACHE_BUCKETS - 1)];
+}
+
+static inline bool dentry_matches(struct dentry *e, struct fs::inode *dir,
+                                  const char *name, int len, u32 hash) {
+  if (e->hash != hash || e->dir != dir || e->len != len) return false;
+  for (int i = 0; i < len; i++) {
+    if (e->name[i] != name[i]) return false;
+  }
+  return true;
+}
+
+int fs::dcache::lookup(struct inode *dir, const char *name, struct inode *&res) {
+  int len;
+  u32 hash = name_hash(dir, name, len);
+  if (len >= DCACHE_NAME_LEN) return DCACHE_MISS;
+
+  auto &b = bucket_for(hash);
+
+  int result;
+  struct inode *found;
+  unsigned seq;
+  do {
+    seq = b.seq.read_begin();
+    result = DCACHE_MISS;
+    found = NULL;
+
+    // bound the walk. An entry that is moved to another chain while we are
+    // looking at it will trip the sequence check anyway
+    int steps = 0;
+    for (auto *e = __atomic_load_n(&b.head, __ATOMIC_ACQUIRE);
+         e != NULL && steps < DCACHE_ENTRIES;
+         e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE), steps++) {
+      if (dentry_matches(e, dir, name, len, hash)) {
+        found = e->ino;
+        result = found == NULL ? DCACHE_NEGATIVE : DCACHE_POSITIVE;
+        if (!e->referenced) e->referenced = 1;
+        break;
+      }
+    }
+  } while (b.seq.read_retry(seq));
+
+  if (result == DCACHE_POSITIVE) res = found;
+  return result;
+}
+
+/* does not take the dcache_lock! */
+static void unlink_dentry(struct dentry *e) {
+  auto &b = bucket_for(e->hash);
+  index_remove(e);
+
+  b.seq.write_lock();
+  for (struct dentry **it = &b.head; *it != NULL; it = &(*it)->next) {
+    if (*it == e) {
+      __atomic_store_n(it, e->next, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  e->dir = NULL;
+  e->ino = NULL;
+  b.seq.write_unlock();
+}
+
+/* does not take the dcache_lock! */
+static struct dentry *find_locked(struct fs::inode *dir, const char *name,
+                                  int len, u32 hash) {
+  for (auto *e = bucket_for(hash).head; e != NULL; e = e->next) {
+    if (dentry_matches(e, dir, name, len, hash)) return e;
+  }
+  return NULL;
+}
+
+/* does not take the dcache_lock! */
+static struct dentry *alloc_dentry(void) {
+  // second chance clock over the pool. Entries that have been hit since the
+  // last sweep get skipped once.
+  for (int i = 0; i < DCACHE_ENTRIES * 2; i++) {
+    auto *e = &dentry_pool[clock_hand];
+    clock_hand = (clock_hand + 1) & (DCACHE_ENTRIES - 1);
+
+    if (e->dir == NULL) return e;
+    if (e->referenced) {
+      e->referenced = 0;
+      continue;
+    }
+    unlink_dentry(e);
+    return e;
+  }
+
+  // everything was referenced twice in a row. Just take the next one
+  auto *e = &dentry_pool[clock_hand];
+  clock_hand = (clock_hand + 1) & (DCACHE_ENTRIES - 1);
+  if (e->dir != NULL) unlink_dentry(e);
+  return e;
+}
+
+unsigned fs::dcache::generation(struct inode *dir) {
+  return __atomic_load_n(&dir->dcache_gen, __ATOMIC_ACQUIRE);
+}
+
+void fs::dcache::insert(struct inode *dir, const char *name, struct inode *ino,
+                        unsigned gen) {
+  int len;
+  u32 hash = name_hash(dir, name, len);
+  if (len >= DCACHE_NAME_LEN) return;
+
+  scoped_lock l(dcache_lock);
+
+  // the directory changed while the caller was looking, so what it found may
+  // already be stale. invalidate() bumps this under the same lock
+  if (dir->dcache_gen != gen) return;
+
+  auto &b = bucket_for(hash);
+
+  auto *e = find_locked(dir, name, len, hash);
+  if (e != NULL) {
+    // update the existing entry in place
+    index_remove(e);
+    b.seq.write_lock();
+    e->ino = ino;
+    b.seq.write_unlock();
+    index_add(e);
+    if (ino != NULL) ino->in_dcache = true;
+    return;
+  }
+
+  e = alloc_dentry();
+
+  // the slot is not reachable by readers at this point
+  e->dir = dir;
+  e->ino = ino;
+  e->hash = hash;
+  dir->in_dcache = true;
+  if (ino != NULL) ino->in_dcache = true;
+  e->len = len;
+  e->referenced = 0;
+  memcpy(e->name, name, len);
+  e->name[len] = '\0';
+
+  b.seq.write_lock();
+  e->next = b.head;
+  __atomic_store_n(&b.head, e, __ATOMIC_RELEASE);
+  b.seq.write_unlock();
+  index_add(e);
+
+  INFO("insert %p/'%s' -> %p\n", dir, name, ino);
+}
+
+void fs::dcache::invalidate(struct inode *dir, const char *name) {
+  int len;
+  u32 hash = name_hash(dir, name, len);
+  if (len >= DCACHE_NAME_LEN) return;
+
+  scoped_lock l(dcache_lock);
+  __atomic_fetch_add(&dir->dcache_gen, 1, __ATOMIC_RELEASE);
+  auto *e = find_locked(dir, name, len, hash);
+  if (e != NULL) unlink_dentry(e);
+}
+
+void fs::dcache::purge(struct inode *ino) {
+  scoped_lock l(dcache_lock);
+  auto &d = by_dir[inode_hash(ino)];
+  for (auto *e = d, *next = e; e != NULL; e = next) {
+    next = e->dir_next;
+    if (e->dir == ino) unlink_dentry(e);
+  }
+  auto &i = by_ino[inode_hash(ino)];
+  for (auto *e = i, *next = e; e != NULL; e = next) {
+    next = e->ino_next;
+    if (e->ino == ino) unlink_dentry(e);
+  }
+}
@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <fs/ext2.h>
+#include <mem.h>
+
+/*
+ * Block and inode allocation.
+ *
+ * Both allocators work on the per-group bitmaps, which are read the first
+ * time a group is touched and then stay in memory. Every change is written
+ * through to the bitmap block (which lands in the block cache, and in the
+ * journal if there is one), while the free counts in the superblock and group
+ * descriptors are only marked dirty and flushed by sync_meta() once the
+ * operation that allocated is done.
+ */
+
+// #define EXT2_ALLOC_DEBUG
+
+#ifdef EXT2_ALLOC_DEBUG
+#define INFO(fmt, args...) printk("[EXT2 ALLOC] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+static inline bool test_bit(u8 *bm, u32 bit) {
+  return (bm[bit / 8] >> (bit % 8)) & 1;
+}
+static inline void set_bit(u8 *bm, u32 bit) { bm[bit / 8] |= 1 << (bit % 8); }
+static inline void clear_bit(u8 *bm, u32 bit) {
+  bm[bit / 8] &= ~(1 << (bit % 8));
+}
+
+// find the first clear bit in [from, nbits), or -1
+static int find_zero(u8 *bm, u32 from, u32 nbits) {
+  u32 i = from;
+  while (i < nbits) {
+    // skip over full bytes
+    if ((i % 8) == 0 && bm[i / 8] == 0xFF) {
+      i += 8;
+      continue;
+    }
+    if (!test_bit(bm, i)) return i;
+    i++;
+  }
+  return -1;
+}
+
+/* does not take the lock! */
+u8 *fs::ext2::block_bitmap(u32 group) {
+  auto &b = bitmaps[group];
+  if (b.blocks == nullptr) {
+    b.blocks = (u8 *)kmalloc(blocksize);
+    if (!read_block(bgdt[group].block_of_block_usage_bitmap, b.blocks)) {
+      kfree(b.blocks);
+      b.blocks = nullptr;
+    }
+  }
+  return b.blocks;
+}
+
+/* does not take the lock! */
+u8 *fs::ext2::inode_bitmap(u32 group) {
+  auto &b = bitmaps[group];
+  if (b.inodes == nullptr) {
+    b.inodes = (u8 *)kmalloc(blocksize);
+    if (!read_block(bgdt[group].block_of_inode_usage_bitmap, b.inodes)) {
+      kfree(b.inodes);
+      b.inodes = nullptr;
+    }
+  }
+  return b.inodes;
+}
+
+// how many blocks are in a group (the last one can be short)
+static u32 group_blocks(fs::ext2 *efs, u32 group) {
+  u32 first = efs->sb->superblock_id + group * efs->sb->blocks_in_blockgroup;
+  return min(efs->sb->blocks_in_blockgroup, efs->sb->blocks - first);
+}
+
+/* does not take the lock! */
+static u32 take_block(fs::ext2 *efs, u32 group, u32 bit) {
+  auto *bm = efs->bitmaps[group].blocks;
+  set_bit(bm, bit);
+  efs->write_meta(efs->bgdt[group].block_of_block_usage_bitmap, bm);
+
+  efs->bgdt[group].num_of_unalloc_block--;
+  efs->sb->unallocatedblocks--;
+  efs->meta_dirty = true;
+
+  return efs->sb->superblock_id + group * efs->sb->blocks_in_blockgroup + bit;
+}
+
+u32 fs::ext2::balloc(u32 goal) {
+  scoped_lock l(m_lock);
+
+  if (sb->unallocatedblocks == 0) return 0;
+
+  u32 first = sb->superblock_id;
+  if (goal < first || goal >= sb->blocks) goal = first;
+
+  u32 goal_group = (goal - first) / sb->blocks_in_blockgroup;
+  u32 goal_bit = (goal - first) % sb->blocks_in_blockgroup;
+
+  // start at the goal and walk forward through the groups. The goal's group
+  // is looked at again at the end, from its start
+  for (u32 n = 0; n <= blockgroups; n++) {
+    u32 group = (goal_group + n) % blockgroups;
+    if (bgdt[group].num_of_unalloc_block == 0) continue;
+
+    u8 *bm = block_bitmap(group);
+    if (bm == nullptr) continue;
+
+    int bit = find_zero(bm, n == 0 ? goal_bit : 0, group_blocks(this, group));
+    if (bit < 0) continue;
+
+    u32 blk = take_block(this, group, bit);
+    INFO("balloc(%u) = %u\n", goal, blk);
+    return blk;
+  }
+
+  return 0;
+}
+
+bool fs::ext2::balloc_at(u32 block) {
+  scoped_lock l(m_lock);
+
+  u32 first = sb->superblock_id;
+  if (block < first || block >= sb->blocks) return false;
+
+  u32 group = (block - first) / sb->blocks_in_blockgroup;
+  u32 bit = (block - first) % sb->blocks_in_blockgroup;
+
+  u8 *bm = block_bitmap(group);
+  if (bm == nullptr || test_bit(bm, bit)) return false;
+
+  take_block(this, group, bit);
+  return true;
+}
+
+void fs::ext2::bfree(u32 block) {
+  scoped_lock l(m_lock);
+
+  u32 first = sb->superblock_id;
+  if (block < first || block >= sb->blocks) {
+    printk("[EXT2 WARN] freeing block %u, which is out of range\n", block);
+    return;
+  }
+
+  u32 group = (block - first) / sb->blocks_in_blockgroup;
+  u32 bit = (block - first) % sb->blocks_in_blockgroup;
+
+  u8 *bm = block_bitmap(group);
+  if (bm == nullptr) return;
+
+  if (!test_bit(bm, bit)) {
+    printk("[EXT2 WARN] freeing block %u, which is already free\n", block);
+    return;
+  }
+
+  clear_bit(bm, bit);
+  write_meta(bgdt[group].block_of_block_usage_bitmap, bm);
+
+  // if it held metadata, the journal must not write that over its next use
+  if (journal != nullptr) journal->forget(block);
+
+  bgdt[group].num_of_unalloc_block++;
+  sb->unallocatedblocks++;
+  meta_dirty = true;
+}
+
+/*
+ * pick the group for a new inode. Directories go in a group with an above
+ * average number of free inodes and the most free blocks, so the tree spreads
+ * out over the disk. Everything else stays in its parent's group (or one found
+ * by hashing away from it) to keep files near their directory
+ */
+static int find_inode_group(fs::ext2 *efs, u32 parent_group, bool is_dir) {
+  u32 ngroups = efs->blockgroups;
+  auto *bgdt = efs->bgdt;
+
+  if (is_dir) {
+    u32 avg = efs->sb->unallocatedinodes / ngroups;
+    int best = -1;
+    for (u32 g = 0; g < ngroups; g++) {
+      if (bgdt[g].num_of_unalloc_inode == 0) continue;
+      if (bgdt[g].num_of_unalloc_inode < avg) continue;
+      if (best == -1 ||
+          bgdt[g].num_of_unalloc_block > bgdt[best].num_of_unalloc_block)
+        best = g;
+    }
+    if (best != -1) return best;
+  } else {
+    if (bgdt[parent_group].num_of_unalloc_inode != 0 &&
+        bgdt[parent_group].num_of_unalloc_block != 0)
+      return parent_group;
+
+    // quadratic probe away from the parent
+    for (u32 i = 1; i < ngroups; i <<= 1) {
+      u32 g = (parent_group + i) % ngroups;
+      if (bgdt[g].num_of_unalloc_inode != 0 &&
+          bgdt[g].num_of_unalloc_block != 0)
+        return g;
+    }
+  }
+
+  // settle for anything with an inode left
+  for (u32 i = 0; i < ngroups; i++) {
+    u32 g = (parent_group + i) % ngroups;
+    if (bgdt[g].num_of_unalloc_inode != 0) return g;
+  }
+  return -1;
+}
+
+u32 fs::ext2::ialloc(u32 parent, bool is_dir) {
+  scoped_lock l(m_lock);
+
+  if (sb->unallocatedinodes == 0) return 0;
+
+  u32 parent_group = (parent - 1) / sb->inodes_in_blockgroup;
+  int group = find_inode_group(this, parent_group, is_dir);
+  if (group < 0) return 0;
+
+  u8 *bm = inode_bitmap(group);
+  if (bm == nullptr) return 0;
+
+  // the reserved inodes (root, journal, ...) are never handed out
+  u32 from = 0;
+  if (group == 0) from = sb->major_version >= 1 ? sb->s_first_ino - 1 : 10;
+
+  int bit = find_zero(bm, from, sb->inodes_in_blockgroup);
+  if (bit < 0) return 0;
+
+  set_bit(bm, bit);
+  write_meta(bgdt[group].block_of_inode_usage_bitmap, bm);
+
+  bgdt[group].num_of_unalloc_inode--;
+  if (is_dir) bgdt[group].num_of_dirs++;
+  sb->unallocatedinodes--;
+  meta_dirty = true;
+
+  u32 ino = group * sb->inodes_in_blockgroup + bit + 1;
+  INFO("ialloc(%u, %d) = %u\n", parent, is_dir, ino);
+  return ino;
+}
+
+void fs::ext2::ifree(u32 ino, bool is_dir) {
+  scoped_lock l(m_lock);
+
+  if (ino == 0 || ino > sb->inodes) return;
+
+  u32 group = (ino - 1) / sb->inodes_in_blockgroup;
+  u32 bit = (ino - 1) % sb->inodes_in_blockgroup;
+
+  u8 *bm = inode_bitmap(group);
+  if (bm == nullptr || !test_bit(bm, bit)) return;
+
+  clear_bit(bm, bit);
+  write_meta(bgdt[group].block_of_inode_usage_bitmap, bm);
+
+  bgdt[group].num_of_unalloc_inode++;
+  if (is_dir) bgdt[group].num_of_dirs--;
+  sb->unallocatedinodes++;
+  meta_dirty = true;
+}
+
+int fs::ext2::sync_meta(void) {
+  int err = flush_inodes();
+
+  scoped_lock l(m_lock);
+  if (!meta_dirty) return err;
+
+  for (u32 i = 0; i < bgdt_blocks; i++) {
+    if (!write_meta(first_bgd + i, (char *)bgdt + i * blocksize)) return -EIO;
+  }
+  if (!write_superblock()) return -EIO;
+
+  meta_dirty = false;
+  return err;
+}
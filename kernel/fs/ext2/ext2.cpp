@@ -14,6 +14,9 @@
 // Standard information and structures for EXT2
 #define EXT2_SIGNATURE 0xEF53
 
+// how many on-disk inodes are kept in memory
+#define EXT2_ICACHE_SIZE 1024
+
 // #define EXT2_DEBUG
 // #define EXT2_TRACE
 #define USE_CACHE
@@ -33,34 +36,42 @@
 extern fs::file_operations ext2_file_ops;
 extern fs::dir_operations ext2_dir_ops;
 
-struct [[gnu::packed]] block_group_desc {
-  uint32_t block_of_block_usage_bitmap;
-  uint32_t block_of_inode_usage_bitmap;
-  uint32_t block_of_inode_table;
-  uint16_t num_of_unalloc_block;
-  uint16_t num_of_unalloc_inode;
-  uint16_t num_of_dirs;
-  uint8_t unused[14];
-};
-
-typedef struct __ext2_dir_entry {
-  uint32_t inode;
-  uint16_t size;
-  uint8_t namelength;
-  uint8_t reserved;
-  char name[0];
-  /* name here */
-} __attribute__((packed)) ext2_dir;
-
 #define EXT2_CACHE_SIZE 128
 
 fs::ext2::ext2(ref<fs::file> disk) : filesystem(/*super*/), disk(disk) { TRACE; }
 
 fs::ext2::~ext2(void) {
   TRACE;
-  if (sb != nullptr) delete sb;
-  if (work_buf != nullptr) kfree(work_buf);
-  if (inode_buf != nullptr) kfree(inode_buf);
+  // the readahead worker holds no reference to us
+  ext2_readahead_drain(this);
+  if (sb != nullptr) {
+    sync_meta();
+    if (journal != nullptr) {
+      journal->commit();
+      journal->checkpoint();
+      delete journal;
+      journal = nullptr;
+
+      // everything is home, so there's nothing to recover next time
+      sb->s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+      write_superblock();
+    }
+#ifdef USE_CACHE
+    scoped_lock l(cache_lock);
+    flush_cache();
+#endif
+    delete sb;
+  }
+  for (auto &ent : icache) delete ent.value;
+
+  if (bgdt != nullptr) kfree(bgdt);
+  if (bitmaps != nullptr) {
+    for (u32 i = 0; i < blockgroups; i++) {
+      if (bitmaps[i].blocks != nullptr) kfree(bitmaps[i].blocks);
+      if (bitmaps[i].inodes != nullptr) kfree(bitmaps[i].inodes);
+    }
+    delete[] bitmaps;
+  }
 
 #ifdef USE_CACHE
   for (int i = 0; i < cache_size; i++) {
@@ -79,8 +90,7 @@ bool fs::ext2::init(void) {
 
   sb = new superblock();
   // read the superblock
-  disk->seek(1024, SEEK_SET);
-  bool res = disk->read(sb, 1024);
+  bool res = disk_rw(1024, sb, 1024, false);
 
   if (!res) {
     printk("failed to read the superblock\n");
@@ -111,11 +121,48 @@ bool fs::ext2::init(void) {
   // blocks/blocks_per_group
   blockgroups = ceil((double)sb->blocks / (double)sb->blocks_in_blockgroup);
 
-  first_bgd = sb->superblock_id + (sizeof(fs::ext2::superblock) / blocksize);
+  // the descriptor table starts in the block after the superblock
+  first_bgd = sb->superblock_id + 1;
+
+  // read in the whole descriptor table
+  bgdt_blocks =
+      (blockgroups * sizeof(block_group_desc) + blocksize - 1) / blocksize;
+  bgdt = (block_group_desc *)kmalloc(bgdt_blocks * blocksize);
+  for (u32 i = 0; i < bgdt_blocks; i++) {
+    if (!read_block(first_bgd + i, (char *)bgdt + i * blocksize)) {
+      printk("failed to read the block group descriptors\n");
+      return false;
+    }
+  }
+  bitmaps = new group_bitmaps[blockgroups];
 
-  // allocate a block for the work_buf
-  work_buf = kmalloc(blocksize);
-  inode_buf = kmalloc(blocksize);
+  ext2_journal *j = nullptr;
+#ifdef USE_CACHE
+  if ((sb->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) &&
+      !(sb->s_feature_incompat & EXT3_FEATURE_INCOMPAT_JOURNAL_DEV)) {
+    if (sb->s_journal_inum == 0) {
+      KWARN("ext2: external journals are not supported\n");
+    } else {
+      j = new ext2_journal(this);
+      int err = j->load(sb->s_journal_inum);
+      if (err < 0) {
+        KWARN("ext2: failed to load the journal (%d)\n", err);
+        delete j;
+        j = nullptr;
+      } else {
+        // the replay may have rewritten the superblock and descriptors
+        disk_rw(1024, sb, 1024, false);
+        for (u32 i = 0; i < bgdt_blocks; i++)
+          read_block(first_bgd + i, (char *)bgdt + i * blocksize);
+        // and anything cached is from before it
+        for (auto &ent : icache) delete ent.value;
+        icache.clear();
+        icache_dirty.clear();
+        sb->s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+      }
+    }
+  }
+#endif
 
   root = get_inode(2);
   fs::inode::acquire(root);
@@ -125,6 +172,14 @@ bool fs::ext2::init(void) {
     return false;
   }
 
+  if (j != nullptr) {
+    // the superblock (with the recovery flag set) goes home before anything
+    // is journaled
+    scoped_lock l(cache_lock);
+    flush_cache();
+    journal = j;
+  }
+
   auto uuid = sb->s_uuid;
 
   u16 *u_shrts = (u16 *)(uuid + sizeof(u32));
@@ -138,58 +193,123 @@ bool fs::ext2::init(void) {
 
 int fs::ext2::write_superblock(void) {
   // TODO: lock
-  disk->seek(1024, SEEK_SET);
-  return disk->write(sb, 1024);
+  // go through the block cache, so a cached copy of the superblock's block
+  // can't later be flushed over this write
+  if (blocksize == 1024) return write_meta(1, sb);
+  return write_meta_part(0, 1024, sb, 1024);
 }
 
-bool fs::ext2::read_inode(ext2_inode_info &dst, u32 inode) {
-  TRACE;
+// find the block and byte offset of an inode in its group's inode table
+void fs::ext2::locate_inode(u32 inode, u32 &block, u32 &off) {
   u32 bg = (inode - 1) / sb->inodes_in_blockgroup;
-
-  // now that we have which BGF the inode is in, load that desc
-  read_block(first_bgd, work_buf);
-
-  auto *bgd = (block_group_desc *)work_buf + bg;
-
-  // find the index and seek to the inode
   u32 index = (inode - 1) % sb->inodes_in_blockgroup;
+  u32 byte = index * sb->s_inode_size;
 
-  u32 block = (index * sb->s_inode_size) / blocksize;
+  block = bgdt[bg].block_of_inode_table + byte / blocksize;
+  off = byte % blocksize;
+}
 
-  read_block(bgd->block_of_inode_table + block, inode_buf);
+/* does not take the icache lock! */
+fs::ext2_icache_entry *fs::ext2::icache_insert(u32 inode) {
+  if (icache.size() >= EXT2_ICACHE_SIZE) {
+    // evict a clean entry if there is one, otherwise write one back first
+    u32 victim = 0;
+    ext2_icache_entry *e = NULL;
+    for (auto &ent : icache) {
+      if (e == NULL || !ent.value->dirty) {
+        victim = ent.key;
+        e = ent.value;
+        if (!e->dirty) break;
+      }
+    }
+    if (e->dirty) {
+      u32 block, off;
+      locate_inode(victim, block, off);
+      write_meta_part(block, off, &e->info, sizeof(ext2_inode_info));
+    }
+    icache.remove(victim);
+    delete e;
+  }
 
-  auto *_inode =
-      (ext2_inode_info *)inode_buf + (index % (blocksize / sb->s_inode_size));
+  auto *e = new ext2_icache_entry();
+  icache.set(inode, e);
+  return e;
+}
 
-  memcpy(&dst, _inode, sizeof(ext2_inode_info));
+bool fs::ext2::read_inode(ext2_inode_info &dst, u32 inode) {
+  TRACE;
+  {
+    scoped_lock l(icache_lock);
+    auto it = icache.find(inode);
+    if (it != icache.end()) {
+      memcpy(&dst, &it->value->info, sizeof(ext2_inode_info));
+      return true;
+    }
+  }
+
+  u32 block, off;
+  locate_inode(inode, block, off);
+  if (!read_block_part(block, off, &dst, sizeof(ext2_inode_info))) return false;
 
+  scoped_lock l(icache_lock);
+  // someone else may have read (or written) it while we were at the disk
+  auto it = icache.find(inode);
+  if (it != icache.end()) {
+    memcpy(&dst, &it->value->info, sizeof(ext2_inode_info));
+    return true;
+  }
+  auto *e = icache_insert(inode);
+  memcpy(&e->info, &dst, sizeof(ext2_inode_info));
   return true;
 }
 
 bool fs::ext2::write_inode(ext2_inode_info &src, u32 inode) {
   TRACE;
-  u32 bg = (inode - 1) / sb->inodes_in_blockgroup;
-
-  // now that we have which BGF the inode is in, load that desc
-  read_block(first_bgd, work_buf);
-
-  auto *bgd = (block_group_desc *)work_buf + bg;
-
-  // find the index and seek to the inode
-  u32 index = (inode - 1) % sb->inodes_in_blockgroup;
-  u32 block = (index * sb->s_inode_size) / blocksize;
-
-  // read the inode buffer
-  read_block(bgd->block_of_inode_table + block, inode_buf);
+  scoped_lock l(icache_lock);
+
+  ext2_icache_entry *e = NULL;
+  auto it = icache.find(inode);
+  if (it != icache.end())
+    e = it->value;
+  else
+    e = icache_insert(inode);
+
+  // written back by flush_inodes()
+  memcpy(&e->info, &src, sizeof(ext2_inode_info));
+  if (!e->dirty) icache_dirty.push(inode);
+  e->dirty = true;
+  return true;
+}
 
-  // modify it...
-  auto *_inode =
-      (ext2_inode_info *)inode_buf + (index % (blocksize / sb->s_inode_size));
-  memcpy(_inode, &src, sizeof(ext2_inode_info));
+int fs::ext2::flush_inodes(void) {
+  scoped_lock l(icache_lock);
+  int err = 0;
+  // the ones that couldn't be written stay on the list for next time
+  vec<u32> failed;
+  for (u32 inode : icache_dirty) {
+    // it may have been written back when it was evicted
+    auto it = icache.find(inode);
+    if (it == icache.end() || !it->value->dirty) continue;
+    auto *e = it->value;
+
+    u32 block, off;
+    locate_inode(inode, block, off);
+    if (!write_meta_part(block, off, &e->info, sizeof(ext2_inode_info))) {
+      err = -EIO;
+      failed.push(inode);
+      continue;
+    }
+    e->dirty = false;
+  }
+  icache_dirty.clear();
+  for (u32 inode : failed) icache_dirty.push(inode);
+  return err;
+}
 
-  // and write the block back
-  write_block(bgd->block_of_inode_table + block, inode_buf);
-  return true;
+bool fs::ext2::disk_rw(off_t off, void *buf, size_t len, bool write) {
+  scoped_lock l(disk_lock);
+  disk->seek(off, SEEK_SET);
+  return (write ? disk->write(buf, len) : disk->read(buf, len)) > 0;
 }
 
 /* does not take a cache lock! */
@@ -218,126 +338,271 @@ struct fs::ext2_block_cache_line *fs::ext2::get_cache_line(int cba) {
   return &disk_cache[oldest];
 }
 
-bool fs::ext2::read_block(u32 block, void *buf) {
-#ifdef USE_CACHE
-  scoped_lock l(cache_lock);
-  int cba = block >> 2;
-  int cbo = block & 0x3;
+/* does not take a cache lock! */
+struct fs::ext2_block_cache_line *fs::ext2::load_cache_line(u32 block,
+                                                            bool &valid) {
+  int cba = block / (PGSIZE / blocksize);
   auto cl = get_cache_line(cba);
-
-  if (cl->dirty && cl->cba != cba) {
-    // flush
-    disk->seek(cl->cba * PGSIZE, SEEK_SET);
-    disk->write(cl->buffer, PGSIZE);
-    cl->dirty = false;
-  }
+  valid = true;
 
   if (cl->cba == cba) {
     cl->last_used = cache_time++;
-    memcpy(buf, cl->buffer + (cbo * blocksize), blocksize);
-    return true;
+    return cl;
   }
 
+  flush_cache_line(cl);
+
   // read into the cache line we found
   cl->cba = cba;
   cl->last_used = cache_time++;
   cl->dirty = 0;
 
-  disk->seek(cl->cba * PGSIZE, SEEK_SET);
-  bool valid = disk->read(cl->buffer, PGSIZE);
+  valid = disk_rw((off_t)cl->cba * PGSIZE, cl->buffer, PGSIZE, false);
+
+  // metadata the journal hasn't written home is newer than the disk
+  u32 per_line = PGSIZE / blocksize;
+  if (journal != nullptr) journal->patch(cba * per_line, per_line, cl->buffer);
+  return cl;
+}
+
+/* does not take a cache lock! */
+void fs::ext2::flush_cache_line(struct ext2_block_cache_line *cl) {
+  if (!cl->dirty || cl->cba == -1) return;
+
+  if (journal == nullptr) {
+    disk_rw((off_t)cl->cba * PGSIZE, cl->buffer, PGSIZE, true);
+  } else {
+    // blocks the journal is holding can't go home until they are
+    // checkpointed, so write around them
+    u32 per_line = PGSIZE / blocksize;
+    u32 base = cl->cba * per_line;
+    for (u32 i = 0; i < per_line;) {
+      if (journal->pending(base + i)) {
+        i++;
+        continue;
+      }
+      u32 n = 1;
+      while (i + n < per_line && !journal->pending(base + i + n)) n++;
+      disk_rw((off_t)(base + i) * blocksize, cl->buffer + i * blocksize,
+              n * blocksize, true);
+      i += n;
+    }
+  }
+  cl->dirty = false;
+}
+
+/* does not take a cache lock! */
+void fs::ext2::flush_cache(void) {
+  for (int i = 0; i < cache_size; i++) flush_cache_line(&disk_cache[i]);
+}
 
-  memcpy(buf, cl->buffer + (blocksize * cbo), blocksize);
+bool fs::ext2::read_block_part(u32 block, u32 off, void *dst, u32 len) {
+#ifdef USE_CACHE
+  scoped_lock l(cache_lock);
+  bool valid;
+  auto cl = load_cache_line(block, valid);
+  u32 cbo = block % (PGSIZE / blocksize);
+  memcpy(dst, cl->buffer + cbo * blocksize + off, len);
   return valid;
+#else
+  auto *buf = (char *)kmalloc(blocksize);
+  bool valid = read_block(block, buf);
+  memcpy(dst, buf + off, len);
+  kfree(buf);
+  return valid;
+#endif
+}
 
+bool fs::ext2::write_block_part(u32 block, u32 off, const void *src, u32 len) {
+#ifdef USE_CACHE
+  scoped_lock l(cache_lock);
+  bool valid;
+  auto cl = load_cache_line(block, valid);
+  u32 cbo = block % (PGSIZE / blocksize);
+  memcpy(cl->buffer + cbo * blocksize + off, src, len);
+  cl->dirty = 1;
+  return valid;
 #else
+  auto *buf = (char *)kmalloc(blocksize);
+  bool valid = read_block(block, buf);
+  memcpy(buf + off, src, len);
+  if (valid) valid = write_block(block, buf);
+  kfree(buf);
+  return valid;
+#endif
+}
+
+bool fs::ext2::write_meta_part(u32 block, u32 off, const void *src, u32 len) {
+#ifdef USE_CACHE
+  if (journal != nullptr) {
+    scoped_lock l(cache_lock);
+    bool valid;
+    auto cl = load_cache_line(block, valid);
+    auto *data = cl->buffer + (block % (PGSIZE / blocksize)) * blocksize;
+    memcpy(data + off, src, len);
+    // the line isn't dirtied. The journal writes the block home once the
+    // transaction it is in has committed
+    journal->dirty(block, data);
+    return valid;
+  }
+#endif
+  return write_block_part(block, off, src, len);
+}
 
-  disk.seek(block * blocksize, SEEK_SET);
-  return disk.read(buf, blocksize);
+bool fs::ext2::write_meta(u32 block, const void *buf) {
+  return write_meta_part(block, 0, buf, blocksize);
+}
 
+void fs::ext2::journal_start(void) {
+  if (journal != nullptr) journal->start();
+}
+
+void fs::ext2::journal_stop(void) {
+  if (journal != nullptr) journal->stop();
+}
+
+bool fs::ext2::read_block(u32 block, void *buf) {
+#ifdef USE_CACHE
+  return read_block_part(block, 0, buf, blocksize);
+#else
+  return disk_rw((off_t)block * blocksize, buf, blocksize, false);
 #endif
 }
 
 bool fs::ext2::write_block(u32 block, const void *buf) {
+#ifdef USE_CACHE
+  // written back when the line is evicted
+  return write_block_part(block, 0, buf, blocksize);
+#else
+  return disk_rw((off_t)block * blocksize, (void *)buf, blocksize, true);
+#endif
+}
 
-
+void fs::ext2::prefetch(u32 block, u32 count) {
 #ifdef USE_CACHE
-  // I am not sure if this write code is correct
-  scoped_lock l(cache_lock);
-  int cba = block >> 2;
-  int cbo = block & 0x3;
-  auto cl = get_cache_line(cba);
+  u32 per_line = PGSIZE / blocksize;
+  // one cache line at a time, so readers aren't locked out for the whole run
+  for (u32 b = block - block % per_line; b < block + count; b += per_line) {
+    scoped_lock l(cache_lock);
+    bool valid;
+    load_cache_line(b, valid);
+  }
+#endif
+}
 
-  if (cl->dirty && cl->cba != cba) {
-    // flush
-    disk->seek(cl->cba * PGSIZE, SEEK_SET);
-    disk->write(cl->buffer, PGSIZE);
-    cl->dirty = false;
+// runs shorter than this go through the block cache
+#define EXT2_DIRECT_MIN 4
+
+/* does not take a cache lock! */
+static bool cache_overlaps(fs::ext2 *efs, u32 block, u32 count) {
+  u64 start = (u64)block * efs->blocksize;
+  u64 end = start + (u64)count * efs->blocksize;
+  for (int i = 0; i < efs->cache_size; i++) {
+    auto &cl = efs->disk_cache[i];
+    if (cl.cba == -1) continue;
+    u64 cstart = (u64)cl.cba * PGSIZE;
+    if (cstart < end && cstart + PGSIZE > start) return true;
   }
+  return false;
+}
 
-  if (cl->cba == cba) {
-    cl->last_used = cache_time++;
-    memcpy(cl->buffer + (cbo * blocksize), buf, blocksize);
+bool fs::ext2::read_blocks(u32 block, u32 count, void *buf) {
+  auto *dst = (u8 *)buf;
+#ifdef USE_CACHE
+  if (count < EXT2_DIRECT_MIN) {
+    for (u32 i = 0; i < count; i++)
+      if (!read_block(block + i, dst + i * blocksize)) return false;
     return true;
   }
 
-  cl->cba = cba;
-  cl->last_used = cache_time++;
-  cl->dirty = 1;
-  disk->seek(cl->cba * PGSIZE, SEEK_SET);
-  bool valid = disk->read(cl->buffer, PGSIZE);
-  memcpy(cl->buffer + (cbo * blocksize), buf, blocksize);
+  cache_lock.lock();
+  // anything already in the cache may be newer than the disk
+  if (cache_overlaps(this, block, count)) {
+    cache_lock.unlock();
+    for (u32 i = 0; i < count; i++)
+      if (!read_block(block + i, dst + i * blocksize)) return false;
+    return true;
+  }
+  bool valid = disk_rw((off_t)block * blocksize, dst, count * blocksize, false);
+  if (journal != nullptr) journal->patch(block, count, dst);
+  cache_lock.unlock();
   return valid;
-
 #else
-
-  disk->seek(block * blocksize, SEEK_SET);
-  return disk->read((void*)buf, blocksize);
-
+  return disk_rw((off_t)block * blocksize, dst, count * blocksize, false);
 #endif
 }
 
-void fs::ext2::traverse_blocks(vec<u32> blks, void *buf,
-                               func<bool(void *)> callback) {
-  TRACE;
-  for (auto b : blks) {
-    read_block(b, buf);
-    if (!callback(buf)) return;
+bool fs::ext2::write_blocks(u32 block, u32 count, const void *buf) {
+  auto *src = (const u8 *)buf;
+#ifdef USE_CACHE
+  if (count < EXT2_DIRECT_MIN) {
+    for (u32 i = 0; i < count; i++)
+      if (!write_block(block + i, src + i * blocksize)) return false;
+    return true;
   }
-}
 
-void fs::ext2::traverse_dir(u32 inode,
-                            func<bool(u32 ino, const char *name)> callback) {
-  TRACE;
-  ext2_inode_info i;
-  read_inode(i, inode);
-  traverse_dir(i, callback);
+  scoped_lock l(cache_lock);
+  bool valid =
+      disk_rw((off_t)block * blocksize, (void *)src, count * blocksize, true);
+
+  // keep any cached copies of these blocks in sync with the disk
+  u64 start = (u64)block * blocksize;
+  u64 end = start + (u64)count * blocksize;
+  for (int i = 0; i < cache_size; i++) {
+    auto &cl = disk_cache[i];
+    if (cl.cba == -1) continue;
+    u64 cstart = (u64)cl.cba * PGSIZE;
+    u64 cend = cstart + PGSIZE;
+    if (cstart >= end || cend <= start) continue;
+
+    u64 from = max(start, cstart);
+    u64 to = min(end, cend);
+    memcpy(cl.buffer + (from - cstart), src + (from - start), to - from);
+  }
+  return valid;
+#else
+  return disk_rw((off_t)block * blocksize, (void *)src, count * blocksize,
+                 true);
+#endif
 }
 
-void fs::ext2::traverse_dir(ext2_inode_info &inode,
+/*
+ * call `callback` with every name in a directory, until it returns false. The
+ * blocks came off the disk, so a record that runs off the end of its block (or
+ * doesn't move us forward) ends the walk of that block, like dx_search_leaf
+ */
+void fs::ext2::traverse_dir(fs::inode &dir,
                             func<bool(u32 ino, const char *name)> callback) {
   TRACE;
-
-  void *buffer = kmalloc(blocksize);
-  traverse_blocks(blocks_for_inode(inode), buffer, [&](void *buffer) -> bool {
-    auto *entry = reinterpret_cast<ext2_dir *>(buffer);
-    while ((u64)entry < (u64)buffer + blocksize) {
-      if (entry->inode != 0) {
-        fs::directory_entry ent;
-        ent.inode = entry->inode;
-
-        // TODO: bad!
-        char buf[entry->namelength + 1];
-        memcpy(buf, entry->name, entry->namelength);
-        buf[entry->namelength] = 0;
-        ent.name = buf;
-        if (!callback(ent.inode, buf)) break;
+  u32 nblocks = (dir.size + blocksize - 1) / blocksize;
+  auto *buf = (u8 *)kmalloc(blocksize);
+  // namelength is a u8
+  char name[256];
+  bool more = true;
+
+  for (u32 lbi = 0; more && lbi < nblocks; lbi++) {
+    u32 run;
+    u32 blk = map_blocks(dir, lbi, run);
+    // directories shouldn't have holes, but don't read block 0 if one does
+    if (blk == 0) continue;
+    if (!read_block(blk, buf)) break;
+
+    u32 off = 0;
+    while (more && off + sizeof(ext2_dir) <= blocksize) {
+      auto *ent = (ext2_dir *)(buf + off);
+      if (ent->size < sizeof(ext2_dir) || ent->size > blocksize - off) break;
+      if (sizeof(ext2_dir) + ent->namelength > ent->size) break;
+
+      if (ent->inode != 0) {
+        memcpy(name, ent->name, ent->namelength);
+        name[ent->namelength] = 0;
+        more = callback(ent->inode, name);
       }
-      entry = (ext2_dir *)((char *)entry + entry->size);
+      off += ent->size;
     }
-    return true;
-  });
+  }
 
-  kfree(buffer);
+  kfree(buf);
 }
 
 struct fs::inode *fs::ext2::get_root(void) {
@@ -353,88 +618,6 @@ struct fs::inode *fs::ext2::get_inode(u32 index) {
   return inodes[index];
 }
 
-vec<u32> fs::ext2::blocks_for_inode(u32 inode) {
-  TRACE;
-  ext2_inode_info info;
-  read_inode(info, inode);
-  return blocks_for_inode(info);
-}
-
-vec<u32> fs::ext2::blocks_for_inode(ext2_inode_info &inode) {
-  TRACE;
-  u32 block_count = inode.size / blocksize;
-  if (inode.size % blocksize != 0) block_count++;
-
-  vec<u32> list;
-
-  list.ensure_capacity(block_count);
-
-  u32 blocks_remaining = block_count;
-
-  u32 direct_count = min(block_count, 12);
-
-  for (unsigned i = 0; i < direct_count; ++i) {
-    auto block_index = inode.dbp[i];
-    if (!block_index) return list;
-    list.push(block_index);
-    --blocks_remaining;
-  }
-
-  if (!blocks_remaining) return list;
-
-  auto process_block_array = [&](unsigned array_block_index, auto &&callback) {
-    u32 *array_block = (u32 *)kmalloc(blocksize);
-    read_block(array_block_index, array_block);
-    auto *array = reinterpret_cast<const u32 *>(array_block);
-    unsigned count = min(blocks_remaining, blocksize / sizeof(u32));
-    for (unsigned i = 0; i < count; ++i) {
-      if (!array[i]) {
-        blocks_remaining = 0;
-        kfree(array_block);
-        return;
-      }
-      callback(array[i]);
-      --blocks_remaining;
-    }
-    kfree(array_block);
-  };
-
-  // process the singly linked block
-  process_block_array(inode.singly_block, [&](unsigned entry) {
-    list.push(entry);
-    --blocks_remaining;
-  });
-
-  if (!blocks_remaining) return list;
-
-  process_block_array(inode.doubly_block, [&](unsigned entry) {
-    process_block_array(entry, [&](unsigned entry) {
-      list.push(entry);
-      --blocks_remaining;
-    });
-  });
-
-  if (!blocks_remaining) return list;
-
-  process_block_array(inode.triply_block, [&](unsigned entry) {
-    process_block_array(entry, [&](unsigned entry) {
-      process_block_array(entry, [&](unsigned entry) {
-        list.push(entry);
-        --blocks_remaining;
-      });
-    });
-  });
-  return list;
-}
-
-u32 fs::ext2::balloc(void) {
-  scoped_lock l(m_lock);
-
-  return 0;
-}
-
-void fs::ext2::bfree(u32 block) { scoped_lock l(m_lock); }
-
 static unique_ptr<fs::filesystem> ext2_mounter(ref<dev::device>, int flags) {
   printk("trying to mount\n");
   return nullptr;
@@ -0,0 +1,377 @@
+#include <errno.h>
+#include <fs.h>
+#include <fs/ext2.h>
+#include <mem.h>
+
+/*
+ * Hash-indexed ("htree") directory lookups.
+ *
+ * When a directory has EXT2_INDEX_FL set, its first block is not a normal
+ * directory block but the root of a shallow b-tree keyed on a hash of the name.
+ * The root (and any interior nodes) hold sorted (hash, block) pairs, and the
+ * leaves are plain directory blocks. Walking the tree finds the single leaf
+ * block that can contain a name, so a lookup reads O(depth) blocks instead of
+ * the whole directory.
+ *
+ * The hash functions here must match the ones in e2fsprogs and linux bit for
+ * bit, or the lookups will go to the wrong leaf.
+ */
+
+// #define HTREE_DEBUG
+
+#ifdef HTREE_DEBUG
+#define INFO(fmt, args...) printk("[HTREE] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+struct [[gnu::packed]] dx_dirent {
+  u32 inode;
+  u16 rec_len;
+  u8 name_len;
+  u8 file_type;
+};
+
+struct [[gnu::packed]] dx_root_info {
+  u32 reserved_zero;
+  u8 hash_version;
+  u8 info_length;  // 8
+  u8 indirect_levels;
+  u8 unused_flags;
+};
+
+struct [[gnu::packed]] dx_entry {
+  u32 hash;
+  u32 block;
+};
+
+// overlays the hash field of the first dx_entry in a node
+struct [[gnu::packed]] dx_countlimit {
+  u16 limit;
+  u16 count;
+};
+
+// linux refuses anything deeper than this on a non-largedir filesystem
+#define DX_MAX_LEVELS 2
+
+#define DX_HASH_EOF 0x7fffffff
+
+/*
+ * the legacy hash. The signed and unsigned versions only differ in how the
+ * name's bytes are widened, which matters for names with the high bit set
+ */
+template <typename C>
+static u32 dx_hack_hash(const char *name, int len) {
+  u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+  auto *cp = (const C *)name;
+
+  while (len--) {
+    hash = hash1 + (hash0 ^ (((int)*cp++) * 7152373));
+    if (hash & 0x80000000) hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return hash0 << 1;
+}
+
+template <typename C>
+static void str2hashbuf(const char *msg, int len, u32 *buf, int num) {
+  u32 pad, val;
+  auto *cp = (const C *)msg;
+
+  pad = (u32)len | ((u32)len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (len > num * 4) len = num * 4;
+  for (int i = 0; i < len; i++) {
+    val = ((int)cp[i]) + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0) *buf++ = val;
+  while (--num >= 0) *buf++ = pad;
+}
+
+#define TEA_DELTA 0x9E3779B9
+
+static void tea_transform(u32 buf[4], const u32 in[4]) {
+  u32 sum = 0;
+  u32 b0 = buf[0], b1 = buf[1];
+  u32 a = in[0], b = in[1], c = in[2], d = in[3];
+  int n = 16;
+
+  do {
+    sum += TEA_DELTA;
+    b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  } while (--n);
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+static inline u32 rol32(u32 word, unsigned shift) {
+  return (word << shift) | (word >> (32 - shift));
+}
+
+// F, G and H are the basic MD4 functions: selection, majority, parity
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = rol32(a, s))
+#define MD4_K1 0
+#define MD4_K2 013240474631UL
+#define MD4_K3 015666365641UL
+
+// a cut down MD4 transform, which only does half the rounds
+static void half_md4_transform(u32 buf[4], const u32 in[8]) {
+  u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  // round 1
+  MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1, 3);
+  MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1, 7);
+  MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+  MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+  MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1, 3);
+  MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1, 7);
+  MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+  MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+  // round 2
+  MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+  MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+  MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+  MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+  MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+  MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+  MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+  MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+  // round 3
+  MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+  MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+  MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+  MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+  MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+  MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+  MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+  MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+/*
+ * dx_hash - compute the major hash of a name. The low bit is always clear,
+ * since the index uses it to mark hash collisions that span leaf blocks
+ */
+static u32 dx_hash(const char *name, int len, int version, const u32 seed[4]) {
+  u32 hash = 0;
+  u32 in[8];
+  u32 buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+  // an all-zero seed means "use the default"
+  for (int i = 0; i < 4; i++) {
+    if (seed[i] != 0) {
+      for (int j = 0; j < 4; j++) buf[j] = seed[j];
+      break;
+    }
+  }
+
+  const char *p = name;
+  switch (version) {
+    case DX_HASH_LEGACY:
+      hash = dx_hack_hash<signed char>(name, len);
+      break;
+
+    case DX_HASH_LEGACY_UNSIGNED:
+      hash = dx_hack_hash<unsigned char>(name, len);
+      break;
+
+    case DX_HASH_HALF_MD4:
+    case DX_HASH_HALF_MD4_UNSIGNED:
+      while (len > 0) {
+        if (version == DX_HASH_HALF_MD4)
+          str2hashbuf<signed char>(p, len, in, 8);
+        else
+          str2hashbuf<unsigned char>(p, len, in, 8);
+        half_md4_transform(buf, in);
+        len -= 32;
+        p += 32;
+      }
+      hash = buf[1];
+      break;
+
+    case DX_HASH_TEA:
+    case DX_HASH_TEA_UNSIGNED:
+      while (len > 0) {
+        if (version == DX_HASH_TEA)
+          str2hashbuf<signed char>(p, len, in, 4);
+        else
+          str2hashbuf<unsigned char>(p, len, in, 4);
+        tea_transform(buf, in);
+        len -= 16;
+        p += 16;
+      }
+      hash = buf[0];
+      break;
+  }
+
+  hash &= ~1;
+  if (hash == (DX_HASH_EOF << 1)) hash = (DX_HASH_EOF - 1) << 1;
+  return hash;
+}
+
+/*
+ * search a single leaf (a normal directory block) for a name. Returns the
+ * inode number or 0. The block came off the disk, so a record that runs off
+ * its end (or doesn't move us forward) ends the walk
+ */
+static u32 dx_search_leaf(const u8 *buf, u32 bsize, const char *name,
+                          int len) {
+  u32 off = 0;
+  while (off + sizeof(dx_dirent) <= bsize) {
+    auto *ent = (const dx_dirent *)(buf + off);
+    if (ent->rec_len < sizeof(dx_dirent) || ent->rec_len > bsize - off) break;
+    if (sizeof(dx_dirent) + ent->name_len > ent->rec_len) break;
+
+    if (ent->inode != 0 && ent->name_len == len) {
+      auto *ename = (const char *)(ent + 1);
+      int i = 0;
+      while (i < len && ename[i] == name[i]) i++;
+      if (i == len) return ent->inode;
+    }
+    off += ent->rec_len;
+  }
+  return 0;
+}
+
+/*
+ * binary search a node for the last entry whose hash is <= the target. The
+ * first entry has an implicit hash of zero (its hash slot holds the
+ * count/limit)
+ */
+static int dx_find_entry(const dx_entry *entries, int count, u32 hash) {
+  int lo = 1, hi = count - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (entries[mid].hash > hash)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+  return lo - 1;
+}
+
+int fs::ext2::dx_lookup(fs::inode &dir, const char *name, u32 &ino) {
+  if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) return -ENOTSUP;
+  if (!(dir.priv<ext2_idata>()->flags & EXT2_INDEX_FL)) return -ENOTSUP;
+
+  // "." and ".." live in the root block, which isn't a leaf. The linear scan
+  // finds them in the first two entries anyway
+  if (!strcmp(name, ".") || !strcmp(name, "..")) return -ENOTSUP;
+
+  int len = strlen(name);
+  if (len == 0 || len > 255) return -ENOENT;
+
+  auto *buf = (u8 *)kmalloc(blocksize);
+  // the leaves are read in here, so the last node stays in `buf`
+  u8 *leaf = NULL;
+  int err = -EINVAL;
+
+  u32 blk = block_from_index(dir, 0);
+  if (blk == 0 || !read_block(blk, buf)) {
+    kfree(buf);
+    return -EIO;
+  }
+
+  // the root block starts with the fake "." and ".." entries
+  auto *info = (dx_root_info *)(buf + 24);
+  if (info->reserved_zero != 0 || info->info_length != 8 ||
+      info->indirect_levels >= DX_MAX_LEVELS) {
+    INFO("dir %d has a bad htree root\n", dir.ino);
+    kfree(buf);
+    return -EINVAL;
+  }
+
+  int version = info->hash_version;
+  if (version > DX_HASH_TEA) {
+    kfree(buf);
+    return -EINVAL;
+  }
+  if (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH) version += 3;
+
+  u32 hash = dx_hash(name, len, version, sb->s_hash_seed);
+  int levels = info->indirect_levels;
+
+  u32 entries_off = 24 + info->info_length;
+  // the hash of the entry right after the one we followed. If the next leaf
+  // starts with the same hash (plus the collision bit) the name may be there
+  u32 next_hash = DX_HASH_EOF << 1;
+
+  for (int level = 0;; level++) {
+    auto *entries = (dx_entry *)(buf + entries_off);
+    auto *cl = (dx_countlimit *)entries;
+    u32 max = (blocksize - entries_off) / sizeof(dx_entry);
+    if (cl->count == 0 || cl->count > cl->limit || cl->limit > max) {
+      INFO("dir %d has a bad htree node\n", dir.ino);
+      goto out;
+    }
+
+    int count = cl->count;
+    int at = dx_find_entry(entries, count, hash);
+
+    if (level == levels) {
+      leaf = (u8 *)kmalloc(blocksize);
+
+      for (int i = at; i < count; i++) {
+        if (i != at && (entries[i].hash & ~1) != hash) break;
+
+        blk = block_from_index(dir, entries[i].block);
+        if (blk == 0 || !read_block(blk, leaf)) {
+          err = -EIO;
+          goto out;
+        }
+
+        u32 found = dx_search_leaf(leaf, blocksize, name, len);
+        if (found != 0) {
+          ino = found;
+          err = 0;
+          goto out;
+        }
+
+        // the collision chain continues into the next node, which we can't
+        // see from here. Let the linear scan deal with it
+        if (i == count - 1 && (next_hash & 1) && (next_hash & ~1) == hash) {
+          err = -EAGAIN;
+          goto out;
+        }
+      }
+      err = -ENOENT;
+      goto out;
+    }
+
+    if (at + 1 < count) next_hash = entries[at + 1].hash;
+
+    blk = block_from_index(dir, entries[at].block);
+    if (blk == 0 || !read_block(blk, buf)) {
+      err = -EIO;
+      goto out;
+    }
+
+    // interior nodes start with a fake, empty, directory entry
+    entries_off = sizeof(dx_dirent);
+  }
+
+out:
+  if (leaf != NULL) kfree(leaf);
+  kfree(buf);
+  return err;
+}
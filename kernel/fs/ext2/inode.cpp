@@ -3,130 +3,575 @@
 #include <fs.h>
 #include <fs/ext2.h>
 
-#define EXT2_ADDR_PER_BLOCK(node) (node->block_size / sizeof(u32))
-
-static int ilog2(int x) {
-  /*
-   * Find the leftmost 1. Use a method that is similar to
-   * binary search.
-   */
-  int result = 0;
-  result = (!!(x >> 16)) << 4;  // if > 16?
-  // based on previous result, if > (result + 8)
-  result = result + ((!!(x >> (result + 8))) << 3);
-  result = result + ((!!(x >> (result + 4))) << 2);
-  result = result + ((!!(x >> (result + 2))) << 1);
-  result = result + (!!(x >> (result + 1)));
-  return result;
-}
-
-struct block_reader {
-  fs::ext2_inode &node;
-
-  int last_path[4];
-
- public:
-  block_reader(fs::ext2_inode &node) : node(node) {}
-};
-
 #define EXT2_NDIR_BLOCKS 12
 #define EXT2_IND_BLOCK EXT2_NDIR_BLOCKS
 #define EXT2_DIND_BLOCK (EXT2_IND_BLOCK + 1)
 #define EXT2_TIND_BLOCK (EXT2_DIND_BLOCK + 1)
 #define EXT2_N_BLOCKS (EXT2_TIND_BLOCK + 1)
-/**
- * block_to_path - given a block number, solve the indirect path to it
- *
- * @node: the inode you are looking into. This argument exists to get metadata,
- *        and no IO occurs
- * @block: the block index to find the path of
- * @offsets: the indirect path array to fill in
+
+#define EXT4_EXT_MAGIC 0xF30A
+// extents longer than this are "uninitialized", and read back as zeroes
+#define EXT4_EXT_INIT_MAX_LEN 32768
+#define EXT4_EXT_MAX_DEPTH 5
+
+struct [[gnu::packed]] ext4_extent_header {
+  u16 eh_magic;
+  u16 eh_entries;
+  u16 eh_max;
+  u16 eh_depth;
+  u32 eh_generation;
+};
+
+// leaf entry
+struct [[gnu::packed]] ext4_extent {
+  u32 ee_block;
+  u16 ee_len;
+  u16 ee_start_hi;
+  u32 ee_start_lo;
+};
+
+// interior entry
+struct [[gnu::packed]] ext4_extent_idx {
+  u32 ei_block;
+  u32 ei_leaf_lo;
+  u16 ei_leaf_hi;
+  u16 ei_unused;
+};
+
+fs::ext2_inode::ext2_inode(int type, u32 index) : fs::inode(type) {
+  this->ino = index;
+}
+
+int fs::ext2_inode::touch(string name, int mode, fs::inode *&dst) {
+  if (type != T_DIR) return -ENOTDIR;
+
+  printk("ext2 touch\n");
+  return -EINVAL;
+}
+
+/*
+ * add a single block to the end of an extent list, merging it into the last
+ * extent if it is contiguous with it
  */
-static int block_to_path(fs::inode *node, int i_block, int offsets[4],
-                         int *boundary = nullptr) {
-  int ptrs = EXT2_ADDR_PER_BLOCK(node);
-  int ptrs_bits = ilog2(ptrs);
-
-  // how many block pointers are in each indirect block
-  const long direct_blocks = 12;  // 12 direct blocks
-  const long indirect_blocks = ptrs;
-  const long double_blocks = (1 << (ptrs_bits * 2));
-
-  int n = 0;
-  int final = 0;
-
-  if (i_block < 0) {
-    printk("[EXT2 WARN] %s: block < 0\n", __func__);
-  } else if (i_block < direct_blocks) {
-    offsets[n++] = i_block;
-    final = direct_blocks;
-  } else if ((i_block -= direct_blocks) < indirect_blocks) {
-    offsets[n++] = EXT2_IND_BLOCK;
-    offsets[n++] = i_block;
-    final = ptrs;
-  } else if ((i_block -= indirect_blocks) < double_blocks) {
-    offsets[n++] = EXT2_DIND_BLOCK;
-    offsets[n++] = i_block >> ptrs_bits;
-    offsets[n++] = i_block & (ptrs - 1);
-    final = ptrs;
-  } else if (((i_block -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
-    offsets[n++] = EXT2_TIND_BLOCK;
-    offsets[n++] = i_block >> (ptrs_bits * 2);
-    offsets[n++] = (i_block >> ptrs_bits) & (ptrs - 1);
-    offsets[n++] = i_block & (ptrs - 1);
-    final = ptrs;
+static void extent_append(vec<fs::ext2_extent> &ex, u32 lblk, u32 pblk,
+                          u32 len) {
+  if (ex.size() > 0) {
+    auto &l = ex.last();
+    if (l.lblk + l.len == lblk && l.pblk + l.len == pblk) {
+      l.len += len;
+      return;
+    }
+  }
+  ex.push({.lblk = lblk, .pblk = pblk, .len = len});
+}
+
+struct map_state {
+  fs::ext2 *efs;
+  vec<fs::ext2_extent> &ex;
+  // the next logical block, and how many blocks the file has
+  u32 lblk;
+  u32 nblocks;
+  // one scratch block per level of indirection
+  u32 *bufs[EXT4_EXT_MAX_DEPTH];
+};
+
+/*
+ * walk an indirect block `depth` levels above the data blocks. A zero pointer
+ * at any level is a hole that covers everything below it
+ */
+static bool map_indirect(map_state &st, u32 blk, int depth) {
+  u32 ptrs = st.efs->blocksize / sizeof(u32);
+  u32 span = 1;
+  for (int i = 0; i < depth; i++) span *= ptrs;
+
+  if (blk == 0) {
+    st.lblk += span;
+    return true;
+  }
+
+  auto *table = st.bufs[depth - 1];
+  if (!st.efs->read_block(blk, table)) return false;
+
+  for (u32 i = 0; i < ptrs && st.lblk < st.nblocks; i++) {
+    if (depth == 1) {
+      if (table[i] != 0) extent_append(st.ex, st.lblk, table[i], 1);
+      st.lblk++;
+    } else {
+      // each depth has its own scratch buffer, so `table` survives this
+      if (!map_indirect(st, table[i], depth - 1)) return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * map the extents under `hdr`, which has `room` bytes to live in (the 60 bytes
+ * of i_block for the root, a block below it). The tree came off the disk, so
+ * a node that overflows its room, or a child that isn't exactly one level
+ * below its parent, refuses the whole file
+ */
+static bool map_ext4_node(map_state &st, ext4_extent_header *hdr, u32 room,
+                          int level) {
+  if (hdr->eh_magic != EXT4_EXT_MAGIC) return false;
+  if (hdr->eh_entries > hdr->eh_max) return false;
+  if (sizeof(*hdr) + hdr->eh_entries * sizeof(ext4_extent) > room) return false;
+
+  if (hdr->eh_depth == 0) {
+    auto *ents = (ext4_extent *)(hdr + 1);
+    for (int i = 0; i < hdr->eh_entries; i++) {
+      auto &e = ents[i];
+      // uninitialized extents are left as holes so they read as zeroes
+      if (e.ee_len > EXT4_EXT_INIT_MAX_LEN) continue;
+      // blocks are addressed with 32 bits everywhere in this driver, so one
+      // past that can't be read. Refuse the file rather than map it wrong
+      if (e.ee_start_hi != 0) return false;
+      extent_append(st.ex, e.ee_block, e.ee_start_lo, e.ee_len);
+    }
+    return true;
+  }
+
+  if (level >= EXT4_EXT_MAX_DEPTH) return false;
+
+  auto *idx = (ext4_extent_idx *)(hdr + 1);
+  for (int i = 0; i < hdr->eh_entries; i++) {
+    // same as above
+    if (idx[i].ei_leaf_hi != 0) return false;
+    auto *buf = st.bufs[level];
+    if (!st.efs->read_block(idx[i].ei_leaf_lo, buf)) return false;
+    auto *child = (ext4_extent_header *)buf;
+    if (child->eh_depth != hdr->eh_depth - 1) return false;
+    if (!map_ext4_node(st, child, st.efs->blocksize, level + 1)) return false;
+  }
+  return true;
+}
+
+/*
+ * build the extent list for an inode. Every indirect block is read exactly
+ * once, so this is the only time the inode's block tree is walked. The caller
+ * holds the map lock
+ */
+static bool build_block_map(fs::inode &node) {
+  auto efs = (fs::ext2 *)node.fs;
+  auto p = node.priv<fs::ext2_idata>();
+
+  p->extents.clear();
+
+  // fast symlinks keep the target in the block pointers
+  if (node.type == T_SYML && node.size < 60) {
+    p->mapped = true;
+    return true;
+  }
+
+  map_state st{.efs = efs, .ex = p->extents, .lblk = 0};
+  st.nblocks = (node.size + efs->blocksize - 1) / efs->blocksize;
+  for (int i = 0; i < EXT4_EXT_MAX_DEPTH; i++) st.bufs[i] = NULL;
+
+  bool ok = true;
+
+  if (p->flags & EXT4_EXTENTS_FL) {
+    for (int i = 0; i < EXT4_EXT_MAX_DEPTH; i++)
+      st.bufs[i] = (u32 *)kmalloc(efs->blocksize);
+    ok = map_ext4_node(st, (ext4_extent_header *)p->block_pointers,
+                       sizeof(p->block_pointers), 0);
   } else {
-    printk("[EXT2 WARN] %s: block is too big!\n", __func__);
+    for (int i = 0; i < 3; i++) st.bufs[i] = (u32 *)kmalloc(efs->blocksize);
+
+    for (int i = 0; i < EXT2_NDIR_BLOCKS && st.lblk < st.nblocks; i++) {
+      if (p->block_pointers[i] != 0)
+        extent_append(st.ex, st.lblk, p->block_pointers[i], 1);
+      st.lblk++;
+    }
+
+    for (int d = 1; ok && d <= 3 && st.lblk < st.nblocks; d++) {
+      ok = map_indirect(st, p->block_pointers[EXT2_IND_BLOCK + d - 1], d);
+    }
   }
 
-  if (boundary) *boundary = final - 1 - (i_block & (ptrs - 1));
-  return n;
+  for (int i = 0; i < EXT4_EXT_MAX_DEPTH; i++) {
+    if (st.bufs[i] != NULL) kfree(st.bufs[i]);
+  }
+
+  if (!ok) {
+    printk("[EXT2 WARN] failed to map the blocks of inode %d\n", node.ino);
+    p->extents.clear();
+    return false;
+  }
+
+  p->mapped = true;
+  return true;
 }
 
-fs::ext2_inode::ext2_inode(int type, u32 index) : fs::inode(type) {
-  this->ino = index;
+u32 fs::ext2::map_blocks(fs::inode &node, u32 lblk, u32 &run) {
+  auto p = node.priv<fs::ext2_idata>();
+  scoped_lock l(p->map_lock);
+  if (!p->mapped && !build_block_map(node)) {
+    run = 0;
+    return 0;
+  }
+
+  auto &ex = p->extents;
+
+  // find the last extent that starts at or before lblk
+  int lo = 0, hi = (int)ex.size() - 1, at = -1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ex[mid].lblk <= lblk) {
+      at = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  if (at != -1 && lblk < ex[at].lblk + ex[at].len) {
+    run = ex[at].lblk + ex[at].len - lblk;
+    return ex[at].pblk + (lblk - ex[at].lblk);
+  }
+
+  // a hole, which lasts until the next extent (or forever)
+  if (at + 1 < (int)ex.size())
+    run = ex[at + 1].lblk - lblk;
+  else
+    run = ~0u - lblk;
+  return 0;
 }
 
-fs::ext2_inode::~ext2_inode() {
-  auto p = priv<ext2_idata>();
-  for (int i = 0; i < 4; i++) {
-    if (p->blk_bufs[i] != nullptr) {
-      kfree(p->blk_bufs[i]);
+int block_from_index(fs::inode &node, int i_block, int set_to) {
+  auto efs = (fs::ext2 *)node.fs;
+  u32 run;
+  return efs->map_blocks(node, i_block, run);
+}
+
+// how many blocks to reserve past an allocation if the superblock has no hint
+#define EXT2_DEFAULT_PREALLOC 8
+
+// give back any blocks reserved for the file's appends
+static void ext2_discard_prealloc(fs::inode &node) {
+  auto efs = (fs::ext2 *)node.fs;
+  auto p = node.priv<fs::ext2_idata>();
+  for (u32 i = 0; i < p->prealloc_count; i++) efs->bfree(p->prealloc_start + i);
+  p->prealloc_count = 0;
+}
+
+// allocate and zero an indirect block
+static u32 ext2_new_indirect(fs::inode &node, u32 goal) {
+  auto efs = (fs::ext2 *)node.fs;
+  u32 blk = efs->balloc(goal);
+  if (blk == 0) return 0;
+
+  auto *zero = kmalloc(efs->blocksize);
+  memset(zero, 0, efs->blocksize);
+  efs->write_meta(blk, zero);
+  kfree(zero);
+
+  node.priv<fs::ext2_idata>()->disk_sectors += efs->blocksize / 512;
+  return blk;
+}
+
+/*
+ * ext2_set_block - point logical block `lbi` of an inode at disk block `pblk`,
+ * allocating any indirect blocks along the way
+ */
+static int ext2_set_block(fs::inode &node, u32 lbi, u32 pblk) {
+  auto efs = (fs::ext2 *)node.fs;
+  auto p = node.priv<fs::ext2_idata>();
+
+  // extent mapped files are never grown (see ext2_do_read_write)
+  if (p->flags & EXT4_EXTENTS_FL) return -EROFS;
+
+  scoped_lock l(p->map_lock);
+  u32 ptrs = efs->blocksize / sizeof(u32);
+  u32 offsets[3];
+  int depth = 0;
+  int root = 0;
+
+  u32 i = lbi;
+  if (i < EXT2_NDIR_BLOCKS) {
+    p->block_pointers[i] = pblk;
+  } else if ((i -= EXT2_NDIR_BLOCKS) < ptrs) {
+    root = EXT2_IND_BLOCK;
+    depth = 1;
+    offsets[0] = i;
+  } else if ((i -= ptrs) < ptrs * ptrs) {
+    root = EXT2_DIND_BLOCK;
+    depth = 2;
+    offsets[0] = i / ptrs;
+    offsets[1] = i % ptrs;
+  } else {
+    i -= ptrs * ptrs;
+    root = EXT2_TIND_BLOCK;
+    depth = 3;
+    offsets[0] = i / (ptrs * ptrs);
+    offsets[1] = (i / ptrs) % ptrs;
+    offsets[2] = i % ptrs;
+  }
+
+  if (depth > 0) {
+    u32 cur = p->block_pointers[root];
+    if (cur == 0) {
+      cur = ext2_new_indirect(node, pblk);
+      if (cur == 0) return -ENOSPC;
+      p->block_pointers[root] = cur;
     }
+
+    auto *table = (u32 *)kmalloc(efs->blocksize);
+    for (int d = 0; d < depth; d++) {
+      if (!efs->read_block(cur, table)) {
+        kfree(table);
+        return -EIO;
+      }
+      if (d == depth - 1) {
+        table[offsets[d]] = pblk;
+        efs->write_meta(cur, table);
+        break;
+      }
+
+      u32 next = table[offsets[d]];
+      if (next == 0) {
+        next = ext2_new_indirect(node, pblk);
+        if (next == 0) {
+          kfree(table);
+          return -ENOSPC;
+        }
+        table[offsets[d]] = next;
+        efs->write_meta(cur, table);
+      }
+      cur = next;
+    }
+    kfree(table);
   }
+
+  // keep the extent cache in sync. Appends just grow the last extent
+  if (p->mapped) {
+    auto &ex = p->extents;
+    if (ex.size() == 0 || lbi >= ex.last().lblk + ex.last().len)
+      extent_append(ex, lbi, pblk, 1);
+    else
+      p->mapped = false;
+  }
+  return 0;
 }
 
-int fs::ext2_inode::touch(string name, int mode, fs::inode *&dst) {
-  if (type != T_DIR) return -ENOTDIR;
+/*
+ * ext2_alloc_block - allocate a disk block for a hole at `lbi`. The block
+ * right after the previous logical block is preferred, and after a fresh
+ * allocation the following blocks are reserved so the next appends land
+ * there too. Returns 0 if the disk is full
+ */
+static u32 ext2_alloc_block(fs::inode &node, u32 lbi) {
+  auto efs = (fs::ext2 *)node.fs;
+  auto p = node.priv<fs::ext2_idata>();
+  auto *sb = efs->sb;
 
-  printk("ext2 touch\n");
-  return -EINVAL;
+  u32 goal = 0;
+  if (lbi > 0) {
+    u32 run;
+    u32 prev = efs->map_blocks(node, lbi - 1, run);
+    if (prev != 0) goal = prev + 1;
+  }
+  if (goal == 0) {
+    // start of the inode's block group
+    u32 group = (node.ino - 1) / sb->inodes_in_blockgroup;
+    goal = sb->superblock_id + group * sb->blocks_in_blockgroup;
+  }
+
+  u32 blk = 0;
+  if (p->prealloc_count > 0 && p->prealloc_start == goal) {
+    blk = p->prealloc_start++;
+    p->prealloc_count--;
+  } else {
+    ext2_discard_prealloc(node);
+    blk = efs->balloc(goal);
+    if (blk == 0) return 0;
+
+    if (node.type == T_FILE) {
+      u32 want = sb->s_prealloc_blocks;
+      if (want == 0) want = EXT2_DEFAULT_PREALLOC;
+      p->prealloc_start = blk + 1;
+      while (p->prealloc_count < want &&
+             efs->balloc_at(p->prealloc_start + p->prealloc_count))
+        p->prealloc_count++;
+    }
+  }
+
+  if (ext2_set_block(node, lbi, blk) != 0) {
+    efs->bfree(blk);
+    return 0;
+  }
+  p->disk_sectors += efs->blocksize / 512;
+  return blk;
+}
+
+/*
+ * free every data block at or after logical block `keep` under an indirect
+ * block covering logical blocks starting at `base`. Returns 1 if the indirect
+ * block ended up empty, in which case it was freed too, 0 if it is still in
+ * use, or -EIO if part of the tree couldn't be read. Anything under a block
+ * that couldn't be read is left allocated, rather than guessed at
+ */
+static int ext2_free_indirect(fs::inode &node, u32 blk, int depth, u32 base,
+                              u32 keep) {
+  auto efs = (fs::ext2 *)node.fs;
+  auto p = node.priv<fs::ext2_idata>();
+  u32 ptrs = efs->blocksize / sizeof(u32);
+  u32 sectors = efs->blocksize / 512;
+
+  u32 span = 1;
+  for (int i = 1; i < depth; i++) span *= ptrs;
+
+  auto *table = (u32 *)kmalloc(efs->blocksize);
+  if (!efs->read_block(blk, table)) {
+    kfree(table);
+    return -EIO;
+  }
+
+  int err = 0;
+  bool dirty = false;
+  for (u32 i = 0; i < ptrs; i++) {
+    u32 child = base + i * span;
+    if (table[i] == 0 || child + span <= keep) continue;
+
+    if (depth == 1) {
+      efs->bfree(table[i]);
+      p->disk_sectors -= sectors;
+      table[i] = 0;
+      dirty = true;
+      continue;
+    }
+
+    int r = ext2_free_indirect(node, table[i], depth - 1, child, keep);
+    if (r < 0) {
+      err = r;
+    } else if (r > 0) {
+      table[i] = 0;
+      dirty = true;
+    }
+  }
+
+  // a child that couldn't be freed keeps this block around too
+  bool empty = base >= keep && err == 0;
+  if (empty) {
+    efs->bfree(blk);
+    p->disk_sectors -= sectors;
+  } else if (dirty) {
+    efs->write_meta(blk, table);
+  }
+  kfree(table);
+  if (err != 0) return err;
+  return empty ? 1 : 0;
 }
 
-int block_from_index(fs::inode &node, int i_block, int set_to = 0) {
+/*
+ * free every block of the extent tree under `hdr`: the data blocks in its
+ * leaves, and the index blocks below it (but not the block `hdr` is in).
+ * `room` is how many bytes `hdr` has to live in
+ */
+static void ext2_free_extents(fs::inode &node, ext4_extent_header *hdr,
+                              u32 room, int level) {
   auto efs = (fs::ext2 *)node.fs;
 
-  auto bsize = efs->blocksize;
+  if (hdr->eh_magic != EXT4_EXT_MAGIC) return;
+  if (hdr->eh_entries > hdr->eh_max) return;
+  if (sizeof(*hdr) + hdr->eh_entries * sizeof(ext4_extent) > room) return;
+
+  if (hdr->eh_depth == 0) {
+    auto *ents = (ext4_extent *)(hdr + 1);
+    for (int i = 0; i < hdr->eh_entries; i++) {
+      auto &e = ents[i];
+      // past 32 bits (see map_ext4_node). There's no way to free these, so
+      // leak them rather than free the wrong ones
+      if (e.ee_start_hi != 0) continue;
+      // uninitialized extents own their blocks too
+      u32 len = e.ee_len;
+      if (len > EXT4_EXT_INIT_MAX_LEN) len -= EXT4_EXT_INIT_MAX_LEN;
+      for (u32 b = 0; b < len; b++) efs->bfree(e.ee_start_lo + b);
+    }
+    return;
+  }
 
+  if (level >= EXT4_EXT_MAX_DEPTH) return;
+
+  auto *idx = (ext4_extent_idx *)(hdr + 1);
+  auto *buf = kmalloc(efs->blocksize);
+  for (int i = 0; i < hdr->eh_entries; i++) {
+    if (idx[i].ei_leaf_hi != 0) continue;
+    u32 leaf = idx[i].ei_leaf_lo;
+    auto *child = (ext4_extent_header *)buf;
+    if (efs->read_block(leaf, buf) && child->eh_depth == hdr->eh_depth - 1)
+      ext2_free_extents(node, child, efs->blocksize, level + 1);
+    efs->bfree(leaf);
+  }
+  kfree(buf);
+}
+
+/*
+ * ext2_truncate - change the size of a file, freeing any blocks past the new
+ * end. Growing just leaves a hole.
+ *
+ * Extent mapped files can only be emptied, which is all that deleting them
+ * needs. Anything else would mean splitting extents
+ */
+static int ext2_truncate(fs::inode &node, size_t size) {
+  auto efs = (fs::ext2 *)node.fs;
   auto p = node.priv<fs::ext2_idata>();
-  // start the inodeS
-  auto table = (int *)p->block_pointers;
-  int path[4];
-  int n = block_to_path(&node, i_block, path);
-
-  for (int i = 0; i < n - 1; i++) {
-    int off = path[i];
-    if (p->blk_bufs[i] == NULL || p->cached_path[i] != off) {
-      if (p->blk_bufs[i] == NULL) p->blk_bufs[i] = (int *)kmalloc(bsize);
-      if (!efs->read_block(table[off], p->blk_bufs[i])) {
-        return 0;
+
+  if (p->flags & EXT4_EXTENTS_FL) {
+    if (size != 0) return -EROFS;
+    p->map_lock.lock();
+    auto *hdr = (ext4_extent_header *)p->block_pointers;
+    ext2_free_extents(node, hdr, sizeof(p->block_pointers), 0);
+
+    // leave an empty root behind
+    memset(p->block_pointers, 0, sizeof(p->block_pointers));
+    hdr->eh_magic = EXT4_EXT_MAGIC;
+    hdr->eh_max = (sizeof(p->block_pointers) - sizeof(*hdr)) /
+                  sizeof(ext4_extent);
+    p->disk_sectors = 0;
+    p->mapped = false;
+    p->map_lock.unlock();
+
+    node.size = 0;
+    ((fs::ext2_inode &)node).commit_info();
+    efs->sync_meta();
+    return 0;
+  }
+
+  ext2_discard_prealloc(node);
+
+  int err = 0;
+  if (size < (size_t)node.size) {
+    u32 bsize = efs->blocksize;
+    u32 ptrs = bsize / sizeof(u32);
+    u32 keep = (size + bsize - 1) / bsize;
+
+    scoped_lock l(p->map_lock);
+    for (u32 i = keep; i < EXT2_NDIR_BLOCKS; i++) {
+      if (p->block_pointers[i] == 0) continue;
+      efs->bfree(p->block_pointers[i]);
+      p->disk_sectors -= bsize / 512;
+      p->block_pointers[i] = 0;
+    }
+
+    u32 base = EXT2_NDIR_BLOCKS;
+    u32 span = ptrs;
+    for (int d = 1; d <= 3; d++) {
+      u32 &root = p->block_pointers[EXT2_IND_BLOCK + d - 1];
+      if (root != 0) {
+        int r = ext2_free_indirect(node, root, d, base, keep);
+        if (r < 0) err = r;
+        if (r > 0) root = 0;
       }
-      p->cached_path[i] = off;
+      base += span;
+      span *= ptrs;
     }
-    table = p->blk_bufs[i];
+
+    p->mapped = false;
   }
 
-  return table[path[n - 1]];
+  node.size = size;
+  ((fs::ext2_inode &)node).commit_info();
+  efs->sync_meta();
+  return err;
 }
 
 static int injest_info(fs::inode *ino, fs::ext2_inode_info &info) {
@@ -148,15 +593,12 @@ static int injest_info(fs::inode *ino, fs::ext2_inode_info &info) {
   for (int i = 0; i < 15; i++) {
     ino->priv<fs::ext2_idata>()->block_pointers[i] = table[i];
   }
+  ino->priv<fs::ext2_idata>()->flags = info.flags;
+  ino->priv<fs::ext2_idata>()->disk_sectors = info.disk_sectors;
 
-  if (ino->type == T_DIR) {
-    // TODO: clear out the dirents
-    efs->traverse_dir(ino->ino, [&](u32 nr, const char *name) -> bool {
-      // register the resident entries
-      ino->register_direntry(name, ENT_RES);
-      return true;
-    });
-  } else if (ino->type == T_CHAR || ino->type == T_BLK) {
+  // directories are not read here. Names are resolved on demand through
+  // ext2_lookup, and the whole directory is only walked if someone lists it
+  if (ino->type == T_CHAR || ino->type == T_BLK) {
     // parse the major/minor
     unsigned dev = info.dbp[0];
     if (!dev) dev = info.dbp[1];
@@ -186,6 +628,9 @@ int fs::ext2_inode::commit_info(void) {
   // ??
   info.delete_time = dtime;
 
+  info.flags = priv<ext2_idata>()->flags;
+  info.disk_sectors = priv<ext2_idata>()->disk_sectors;
+
   // copy the block pointers
   auto table = (u32 *)info.dbp;
   for (int i = 0; i < 15; i++) table[i] = priv<ext2_idata>()->block_pointers[i];
@@ -201,133 +646,565 @@ static int ext2_seek(fs::file &, off_t, off_t) {
   return 0;  // allow seek
 }
 
+// the most blocks that are moved in one disk request
+#define EXT2_MAX_RUN 64
+
+/*
+ * make sure every block in [first, last] is backed by a disk block. New blocks
+ * that the write will only partially cover are zeroed, so the rest of them
+ * doesn't leak whatever was on the disk before
+ */
+static int ext2_prepare_write(fs::inode &node, u32 first, u32 last,
+                              bool partial_first, bool partial_last) {
+  auto efs = (fs::ext2 *)node.fs;
+  void *zero = NULL;
+  int err = 0;
+
+  for (u32 lbi = first; lbi <= last; lbi++) {
+    u32 run;
+    if (efs->map_blocks(node, lbi, run) != 0) {
+      // skip the rest of the mapped run
+      lbi += min(run, last - lbi + 1) - 1;
+      continue;
+    }
+
+    u32 blk = ext2_alloc_block(node, lbi);
+    if (blk == 0) {
+      err = -ENOSPC;
+      break;
+    }
+
+    if ((lbi == first && partial_first) || (lbi == last && partial_last)) {
+      if (zero == NULL) {
+        zero = kmalloc(efs->blocksize);
+        memset(zero, 0, efs->blocksize);
+      }
+      efs->write_block(blk, zero);
+    }
+  }
+
+  if (zero != NULL) kfree(zero);
+  efs->sync_meta();
+  return err;
+}
+
+/*
+ * move nbytes at `offset`. The file offset is left alone.
+ *
+ * Files mapped by ext4 extents are read only. Their extent tree is read, but
+ * never changed: filling a hole or appending would mean inserting and
+ * splitting extents, and growing the tree when a node fills up, which isn't
+ * implemented. Refusing the write here keeps it from failing half way
+ */
 static ssize_t ext2_do_read_write(fs::file &f, char *buf, size_t nbytes,
-                                  bool is_write) {
+                                  off_t offset, bool is_write) {
   auto efs = (fs::ext2 *)f.ino->fs;
+
+  if (is_write && (f.ino->priv<fs::ext2_idata>()->flags & EXT4_EXTENTS_FL))
+    return -EROFS;
+  if (!is_write && offset > f.ino->size) return 0;
+
+  // the size of a single block
+  ssize_t bsize = efs->blocksize;
+
+  auto *given_buf = (u8 *)buf;
+  ssize_t remaining = nbytes;
+  if (!is_write) remaining = min((off_t)nbytes, (off_t)f.ino->size - offset);
+  if (remaining <= 0) return 0;
+
+  // a failure here still lets the write go as far as the blocks do, and is
+  // returned if it couldn't go anywhere
+  int prep_err = 0;
   if (is_write) {
-    // TODO: ensure blocks are avail
+    u32 first = offset / bsize;
+    u32 last = (offset + remaining - 1) / bsize;
+    prep_err = ext2_prepare_write(*f.ino, first, last, offset % bsize != 0,
+                                  (offset + remaining) % bsize != 0);
   }
 
-  ssize_t offset = f.offset();
-  if (offset > f.ino->size) return 0;
-
   // how many bytes have been read
   ssize_t nread = 0;
 
-  // the size of a single block
-  auto bsize = efs->blocksize;
-
-  off_t first_blk_ind = offset / bsize;
-  off_t last_blk_ind = (offset + nbytes) / bsize;
-  off_t offset_into_first_block = offset % bsize;
-
-  // TODO: lock the FS. We now want to own the efs->work_buf
-  auto *given_buf = (u8 *)buf;
+  // whole runs of blocks are moved through this in one request, instead of
+  // reading the block map and the disk once per block
+  ssize_t chunk_blocks = min((remaining + bsize - 1) / bsize + 1, EXT2_MAX_RUN);
+  auto *chunk = (u8 *)kmalloc(chunk_blocks * bsize);
+
+  ssize_t err = 0;
+  while (remaining > 0) {
+    u32 lbi = offset / bsize;
+    ssize_t offset_into_block = offset % bsize;
+
+    u32 run;
+    u32 blk = efs->map_blocks(*f.ino, lbi, run);
+    if (run == 0) {
+      printk("ext2fs: read_bytes: failed at lbi %u\n", lbi);
+      err = -EIO;
+      break;
+    }
 
-  int remaining_count = min((off_t)nbytes, (off_t)f.ino->size - offset);
+    // how many blocks this step touches, and how many bytes of them we use
+    ssize_t nblocks = (offset_into_block + remaining + bsize - 1) / bsize;
+    nblocks = min(nblocks, min((ssize_t)run, chunk_blocks));
+    ssize_t count = min(nblocks * bsize - offset_into_block, remaining);
 
-  for (int bi = first_blk_ind; remaining_count && bi <= last_blk_ind; bi++) {
-    u32 blk = block_from_index(*f.ino, bi);
     if (blk == 0) {
-      printk("ext2fs: read_bytes: failed at lbi %u\n", bi);
-      return -EIO;
+      // ext2_prepare_write didn't get this far
+      if (is_write) {
+        err = prep_err != 0 ? prep_err : -ENOSPC;
+        break;
+      }
+      memset(given_buf, 0, count);
+    } else if (is_write) {
+      // partial blocks at either end have to be read back first
+      bool head = offset_into_block != 0;
+      bool tail = (offset_into_block + count) % bsize != 0;
+      if (head) efs->read_block(blk, chunk);
+      if (tail && (!head || nblocks > 1))
+        efs->read_block(blk + nblocks - 1, chunk + (nblocks - 1) * bsize);
+
+      memcpy(chunk + offset_into_block, given_buf, count);
+      if (!efs->write_blocks(blk, nblocks, chunk)) {
+        err = -EIO;
+        break;
+      }
+    } else {
+      if (!efs->read_blocks(blk, nblocks, chunk)) {
+        err = -EIO;
+        break;
+      }
+      memcpy(given_buf, chunk + offset_into_block, count);
     }
 
-    auto *buf = (u8 *)efs->work_buf;
-    efs->read_block(blk, buf);
+    offset += count;
+    remaining -= count;
+    nread += count;
+    given_buf += count;
+  }
 
-    int offset_into_block = (bi == first_blk_ind) ? offset_into_first_block : 0;
-    int num_bytes_to_copy = min(bsize - offset_into_block, remaining_count);
+  kfree(chunk);
 
-    if (is_write) {
-      memcpy(buf + offset_into_block, given_buf, num_bytes_to_copy);
-      efs->write_block(blk, buf);
-    } else {
-      memcpy(given_buf, buf + offset_into_block, num_bytes_to_copy);
-    }
-    remaining_count -= num_bytes_to_copy;
-    nread += num_bytes_to_copy;
-    given_buf += num_bytes_to_copy;
+  if (is_write && nread > 0 && offset > f.ino->size) {
+    f.ino->size = offset;
+    ((fs::ext2_inode *)f.ino)->commit_info();
+    // the new size goes in the same transaction as the blocks behind it
+    efs->sync_meta();
   }
-  f.seek(nread, SEEK_CUR);
+
+  if (nread == 0 && err != 0) return err;
   return nread;
-  return -ENOTIMPL;
 }
 
 static ssize_t ext2_read(fs::file &f, char *dst, size_t sz) {
   if (f.ino->type != T_FILE) return -EINVAL;
-  return ext2_do_read_write(f, dst, sz, false);
+  off_t pos = f.offset();
+  ssize_t n = ext2_do_read_write(f, dst, sz, pos, false);
+  if (n > 0) {
+    f.seek(n, SEEK_CUR);
+    ext2_readahead(f, pos, n);
+  }
+  return n;
 }
 
 static ssize_t ext2_write(fs::file &f, const char *src, size_t sz) {
   if (f.ino->type != T_FILE) return -EINVAL;
-  return ext2_do_read_write(f, (char *)src, sz, true);
+  fs::ext2_handle h((fs::ext2 *)f.ino->fs);
+  ssize_t n = ext2_do_read_write(f, (char *)src, sz, f.offset(), true);
+  if (n > 0) f.seek(n, SEEK_CUR);
+  return n;
 }
 
-static int ext2_ioctl(fs::file &, unsigned int, off_t) {
-  UNIMPL();
-  return -ENOTIMPL;
+static ssize_t ext2_do_rw_vec(fs::file &f, const struct iovec *iov, int iovcnt,
+                              off_t off, bool is_write) {
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = ext2_do_read_write(f, (char *)iov[i].iov_base, iov[i].iov_len,
+                                   off + total, is_write);
+    if (n < 0) return total == 0 ? n : total;
+    total += n;
+    if ((size_t)n < iov[i].iov_len) break;
+  }
+  return total;
 }
 
-static int ext2_open(fs::file &) { return 0; }
-static void ext2_close(fs::file &) {}
+static ssize_t ext2_readv(fs::file &f, const struct iovec *iov, int iovcnt,
+                          off_t off) {
+  if (f.ino->type != T_FILE) return -EINVAL;
+  ssize_t n = ext2_do_rw_vec(f, iov, iovcnt, off, false);
+  // the whole call counts as one read for spotting sequential access
+  if (n > 0) ext2_readahead(f, off, n);
+  return n;
+}
 
-static int ext2_mmap(fs::file &, struct mm::area &) {
-  UNIMPL();
-  return -ENOTIMPL;
+static ssize_t ext2_writev(fs::file &f, const struct iovec *iov, int iovcnt,
+                           off_t off) {
+  if (f.ino->type != T_FILE) return -EINVAL;
+  // every segment goes into the same transaction
+  fs::ext2_handle h((fs::ext2 *)f.ino->fs);
+  return ext2_do_rw_vec(f, iov, iovcnt, off, true);
 }
 
-static int ext2_resize(fs::file &, size_t) {
-  UNIMPL();
-  return -ENOTIMPL;
+// regular files and directories have no ioctls. Userspace can get here, so
+// don't print anything
+static int ext2_ioctl(fs::file &, unsigned int, off_t) { return -ENOTTY; }
+
+static int ext2_open(fs::file &) { return 0; }
+static void ext2_close(fs::file &f) {
+  if (f.ino->type != T_FILE) return;
+  fs::ext2_handle h((fs::ext2 *)f.ino->fs);
+  ext2_discard_prealloc(*f.ino);
+  ((fs::ext2 *)f.ino->fs)->sync_meta();
 }
 
-fs::ext2_idata::~ext2_idata() {
-  for (int i = 0; i < 4; i++) {
-    if (blk_bufs[i] != nullptr) {
-      kfree(blk_bufs[i]);
-    }
-  }
+static int ext2_resize(fs::file &f, size_t size) {
+  if (f.ino->type != T_FILE) return -EINVAL;
+  // read only, like writes (see ext2_do_read_write)
+  if (f.ino->priv<fs::ext2_idata>()->flags & EXT4_EXTENTS_FL) return -EROFS;
+  fs::ext2_handle h((fs::ext2 *)f.ino->fs);
+  return ext2_truncate(*f.ino, size);
 }
 
-static void ext2_destroy_priv(fs::inode &v) { delete v.priv<fs::ext2_idata>(); }
+static void ext2_destroy_priv(fs::inode &v) {
+  ext2_discard_prealloc(v);
+  delete v.priv<fs::ext2_idata>();
+}
 
 fs::file_operations ext2_file_ops{
     .seek = ext2_seek,
     .read = ext2_read,
     .write = ext2_write,
+    .readv = ext2_readv,
+    .writev = ext2_writev,
     .ioctl = ext2_ioctl,
     .open = ext2_open,
     .close = ext2_close,
-    .mmap = ext2_mmap,
     .resize = ext2_resize,
     .destroy = ext2_destroy_priv,
 };
 
-static int ext2_create(fs::inode &, const char *name,
-                       struct fs::file_ownership &) {
-  UNIMPL();
-  return -ENOTIMPL;
+/*
+ * add a name to a directory, either in the slack at the end of an existing
+ * entry or in a new block on the end of the directory
+ */
+static int ext2_add_dirent(fs::inode &dir, const char *name, u32 ino,
+                           u8 file_type) {
+  auto efs = (fs::ext2 *)dir.fs;
+  auto p = dir.priv<fs::ext2_idata>();
+  u32 bsize = efs->blocksize;
+
+  int len = strlen(name);
+  if (len > 255) return -ENAMETOOLONG;
+  u32 needed = EXT2_DIR_REC_LEN(len);
+
+  if (!(efs->sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE))
+    file_type = 0;
+
+  // the hash index isn't maintained, so stop using it. The root block still
+  // reads as a normal directory block with a big ".." entry
+  if (p->flags & EXT2_INDEX_FL) p->flags &= ~EXT2_INDEX_FL;
+
+  auto *buf = (u8 *)kmalloc(bsize);
+  u32 nblocks = dir.size / bsize;
+  fs::ext2_dir *slot = NULL;
+  u32 blk = 0;
+
+  for (u32 lbi = 0; slot == NULL && lbi < nblocks; lbi++) {
+    blk = block_from_index(dir, lbi);
+    if (blk == 0 || !efs->read_block(blk, buf)) continue;
+
+    for (u32 off = 0; off + 8 <= bsize;) {
+      auto *ent = (fs::ext2_dir *)(buf + off);
+      if (ent->size < 8) break;
+
+      u32 used = ent->inode != 0 ? EXT2_DIR_REC_LEN(ent->namelength) : 0;
+      if (ent->size - used >= needed) {
+        if (used != 0) {
+          // split the entry, and take the slack at its end
+          auto *next = (fs::ext2_dir *)(buf + off + used);
+          next->size = ent->size - used;
+          ent->size = used;
+          ent = next;
+        }
+        slot = ent;
+        break;
+      }
+      off += ent->size;
+    }
+  }
+
+  if (slot == NULL) {
+    // extent mapped directories are never grown (see ext2_do_read_write)
+    if (p->flags & EXT4_EXTENTS_FL) {
+      kfree(buf);
+      return -EROFS;
+    }
+
+    // no room anywhere, so grow the directory by a block
+    blk = ext2_alloc_block(dir, nblocks);
+    if (blk == 0) {
+      kfree(buf);
+      return -ENOSPC;
+    }
+    memset(buf, 0, bsize);
+    slot = (fs::ext2_dir *)buf;
+    slot->size = bsize;
+    dir.size += bsize;
+  }
+
+  slot->inode = ino;
+  slot->namelength = len;
+  slot->reserved = file_type;
+  memcpy(slot->name, name, len);
+  efs->write_meta(blk, buf);
+  kfree(buf);
+
+  ((fs::ext2_inode &)dir).commit_info();
+  return 0;
 }
 
-static int ext2_mkdir(fs::inode &, const char *name,
-                      struct fs::file_ownership &) {
-  UNIMPL();
-  return -ENOTIMPL;
+// remove a name from a directory, by merging its entry into the previous one
+static int ext2_remove_dirent(fs::inode &dir, const char *name) {
+  auto efs = (fs::ext2 *)dir.fs;
+  u32 bsize = efs->blocksize;
+  int len = strlen(name);
+
+  auto *buf = (u8 *)kmalloc(bsize);
+  u32 nblocks = dir.size / bsize;
+  int err = -ENOENT;
+
+  for (u32 lbi = 0; err == -ENOENT && lbi < nblocks; lbi++) {
+    u32 blk = block_from_index(dir, lbi);
+    if (blk == 0 || !efs->read_block(blk, buf)) continue;
+
+    fs::ext2_dir *prev = NULL;
+    for (u32 off = 0; off + 8 <= bsize;) {
+      auto *ent = (fs::ext2_dir *)(buf + off);
+      if (ent->size < 8) break;
+
+      if (ent->inode != 0 && ent->namelength == len) {
+        int i = 0;
+        while (i < len && ent->name[i] == name[i]) i++;
+        if (i == len) {
+          if (prev != NULL)
+            prev->size += ent->size;
+          else
+            ent->inode = 0;
+          efs->write_meta(blk, buf);
+          err = 0;
+          break;
+        }
+      }
+      prev = ent;
+      off += ent->size;
+    }
+  }
+  kfree(buf);
+
+  if (err == 0) ((fs::ext2_inode &)dir).commit_info();
+  return err;
+}
+
+/*
+ * give a new directory its first block, with "." and ".." in it. `parent` is
+ * the directory it is being made in
+ */
+static int ext2_init_dir(fs::inode &ino, u32 parent) {
+  auto efs = (fs::ext2 *)ino.fs;
+  u32 bsize = efs->blocksize;
+  u32 blk = ext2_alloc_block(ino, 0);
+  if (blk == 0) return -ENOSPC;
+
+  auto *buf = (u8 *)kmalloc(bsize);
+  memset(buf, 0, bsize);
+  bool ft = efs->sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE;
+
+  auto *dot = (fs::ext2_dir *)buf;
+  dot->inode = ino.ino;
+  dot->size = EXT2_DIR_REC_LEN(1);
+  dot->namelength = 1;
+  dot->reserved = ft ? EXT2_FT_DIR : 0;
+  dot->name[0] = '.';
+
+  auto *dotdot = (fs::ext2_dir *)(buf + dot->size);
+  dotdot->inode = parent;
+  dotdot->size = bsize - dot->size;
+  dotdot->namelength = 2;
+  dotdot->reserved = ft ? EXT2_FT_DIR : 0;
+  dotdot->name[0] = '.';
+  dotdot->name[1] = '.';
+
+  efs->write_meta(blk, buf);
+  kfree(buf);
+
+  ino.size = bsize;
+  ((fs::ext2_inode &)ino).commit_info();
+  return 0;
+}
+
+// throw away an inode that never made it into a directory
+static void ext2_drop_new_inode(fs::inode *ino, bool is_dir) {
+  auto efs = (fs::ext2 *)ino->fs;
+  u32 nr = ino->ino;
+  if (is_dir) ext2_truncate(*ino, 0);
+  {
+    scoped_lock l(efs->m_lock);
+    efs->inodes.remove(nr);
+  }
+  // not an orphan, so this leaves the disk alone
+  delete ino;
+  efs->ifree(nr, is_dir);
+  efs->sync_meta();
+}
+
+/*
+ * allocate an inode, write its initial state to disk and link it into the
+ * directory under `name`. The caller holds a journal handle
+ */
+static int ext2_new_inode(fs::inode &dir, const char *name, u16 type,
+                          u8 file_type, struct fs::file_ownership &own,
+                          fs::inode *&res, unsigned dev = 0) {
+  auto efs = (fs::ext2 *)dir.fs;
+  if (dir.type != T_DIR) return -ENOTDIR;
+  if (strlen(name) > 255) return -ENAMETOOLONG;
+  if (dir.get_direntry(name) != NULL) return -EEXIST;
+
+  bool is_dir = type == 0x4000;
+  u32 nr = efs->ialloc(dir.ino, is_dir);
+  if (nr == 0) return -ENOSPC;
+
+  fs::ext2_inode_info info;
+  memset(&info, 0, sizeof(info));
+  info.type = type | (own.mode & 0xFFF);
+  info.uid = own.uid;
+  info.gid = own.gid;
+  info.hardlinks = is_dir ? 2 : 1;
+  info.last_access = info.create_time = info.last_modif = dev::RTC::now();
+  // the old 16 bit device encoding, which everything understands
+  info.dbp[0] = dev;
+  efs->write_inode(info, nr);
+  res = efs->get_inode(nr);
+
+  // a directory gets "." and ".." before anything can find it, so running out
+  // of space can't leave one behind without them
+  int err = is_dir ? ext2_init_dir(*res, dir.ino) : 0;
+  if (err == 0) err = ext2_add_dirent(dir, name, nr, file_type);
+  if (err != 0) {
+    ext2_drop_new_inode(res, is_dir);
+    res = NULL;
+    return err;
+  }
+
+  dir.register_direntry(name, ENT_RES, res);
+  efs->sync_meta();
+  return 0;
 }
 
-static int ext2_unlink(fs::inode &, const char *) {
-  UNIMPL();
-  return -ENOTIMPL;
+static int ext2_create(fs::inode &dir, const char *name,
+                       struct fs::file_ownership &own) {
+  fs::inode *ino = NULL;
+  fs::ext2_handle h((fs::ext2 *)dir.fs);
+  return ext2_new_inode(dir, name, 0x8000, EXT2_FT_REG_FILE, own, ino);
+}
+
+static int ext2_mkdir(fs::inode &dir, const char *name,
+                      struct fs::file_ownership &own) {
+  auto efs = (fs::ext2 *)dir.fs;
+  fs::inode *ino = NULL;
+  fs::ext2_handle h(efs);
+
+  int err = ext2_new_inode(dir, name, 0x4000, EXT2_FT_DIR, own, ino);
+  if (err != 0) return err;
+
+  // the new directory's ".." links back to the parent
+  dir.link_count++;
+  ((fs::ext2_inode &)dir).commit_info();
+
+  efs->sync_meta();
+  return 0;
+}
+
+static int ext2_unlink(fs::inode &dir, const char *name) {
+  auto efs = (fs::ext2 *)dir.fs;
+  if (dir.type != T_DIR) return -ENOTDIR;
+  if (!strcmp(name, ".") || !strcmp(name, "..")) return -EINVAL;
+
+  auto *ino = dir.get_direntry(name);
+  if (ino == NULL) return -ENOENT;
+
+  fs::ext2_handle h(efs);
+  bool is_dir = ino->type == T_DIR;
+  if (is_dir) {
+    // only "." and ".." may be left
+    bool empty = true;
+    efs->traverse_dir(*ino, [&](u32, const char *n) -> bool {
+      if (!strcmp(n, ".") || !strcmp(n, "..")) return true;
+      empty = false;
+      return false;
+    });
+    if (!empty) return -ENOTEMPTY;
+  }
+
+  int err = ext2_remove_dirent(dir, name);
+  if (err != 0) return err;
+
+  if (is_dir) {
+    // drop the ".." link, and the directory's own "." link
+    dir.link_count--;
+    ((fs::ext2_inode &)dir).commit_info();
+    ino->link_count = 0;
+  } else if (ino->link_count > 0) {
+    ino->link_count--;
+  }
+
+  ((fs::ext2_inode *)ino)->commit_info();
+
+  if (ino->link_count == 0) {
+    // it may still be open, so its blocks and number are given back when the
+    // last reference goes away (~ext2_inode). Nothing can look it up by name
+    // any more, and a new file with the same number needs a fresh inode
+    ino->priv<fs::ext2_idata>()->orphan = true;
+    scoped_lock l(efs->m_lock);
+    efs->inodes.remove(ino->ino);
+  }
+
+  efs->sync_meta();
+  return 0;
+}
+
+/*
+ * free an unlinked inode, now that nobody has it open. The private data is
+ * still around here: fops->destroy only runs in ~inode, after this
+ */
+fs::ext2_inode::~ext2_inode() {
+  auto p = priv<ext2_idata>();
+  if (p == NULL || !p->orphan) return;
+
+  auto efs = (fs::ext2 *)fs;
+  fs::ext2_handle h(efs);
+
+  // fast symlinks keep their target in the block pointers
+  bool fast_symlink = type == T_SYML && p->disk_sectors == 0;
+  if ((type == T_FILE || type == T_DIR || type == T_SYML) && !fast_symlink)
+    ext2_truncate(*this, 0);
+  dtime = dev::RTC::now();
+  commit_info();
+  efs->ifree(ino, type == T_DIR);
+  efs->sync_meta();
 }
 
 static struct fs::inode *ext2_lookup(fs::inode &node, const char *needle) {
   if (node.type != T_DIR) panic("ext2_lookup on non-dir\n");
 
-  bool found = false;
   auto efs = (fs::ext2 *)node.fs;
   u32 ent_inode_num;
-  efs->traverse_dir(node.ino, [&](u32 ino, const char *name) -> bool {
+
+  // try the hash index first, if the directory has one
+  int err = efs->dx_lookup(node, needle, ent_inode_num);
+  if (err == 0) return efs->get_inode(ent_inode_num);
+  if (err == -ENOENT) return NULL;
+
+  bool found = false;
+  efs->traverse_dir(node, [&](u32 ino, const char *name) -> bool {
     if (!strcmp(needle, name)) {
       ent_inode_num = ino;
       found = true;
@@ -340,15 +1217,22 @@ static struct fs::inode *ext2_lookup(fs::inode &node, const char *needle) {
   return NULL;
 }
 
-static int ext2_mknod(fs::inode &, const char *name,
-                      struct fs::file_ownership &, int major, int minor) {
-  UNIMPL();
-  return -ENOTIMPL;
+static int ext2_mknod(fs::inode &dir, const char *name,
+                      struct fs::file_ownership &own, int major, int minor) {
+  fs::inode *ino = NULL;
+  unsigned dev = ((major & 0xff) << 8) | (minor & 0xff);
+  fs::ext2_handle h((fs::ext2 *)dir.fs);
+  return ext2_new_inode(dir, name, 0x2000, EXT2_FT_CHRDEV, own, ino, dev);
 }
 
-static int ext2_walk(fs::inode &, func<bool(const string &)>) {
-  UNIMPL();
-  return -ENOTIMPL;
+static int ext2_walk(fs::inode &node, func<bool(const string &)> cb) {
+  if (node.type != T_DIR) return -ENOTDIR;
+
+  auto efs = (fs::ext2 *)node.fs;
+  efs->traverse_dir(node, [&](u32 ino, const char *name) -> bool {
+    return cb(string(name));
+  });
+  return 0;
 }
 
 fs::dir_operations ext2_dir_ops{
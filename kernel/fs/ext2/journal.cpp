@@ -0,0 +1,797 @@
+#include <errno.h>
+#include <fs/ext2.h>
+#include <hrtimer.h>
+#include <mem.h>
+#include <printk.h>
+#include <sched.h>
+
+/*
+ * The JBD journal (see the comment on fs::ext2_journal in fs/ext2.h).
+ *
+ * Lock order is the commit lock, then cache_lock, then the journal's lock,
+ * then the disk lock. The commit lock keeps commits and checkpoints apart,
+ * and is the only thing that guards the log itself (head, tail, sequence and
+ * the journal superblock). The others are only held to close a transaction
+ * or to copy blocks out of it, never across the writes to the log or home.
+ */
+
+// #define EXT2_JOURNAL_DEBUG
+
+#ifdef EXT2_JOURNAL_DEBUG
+#define INFO(fmt, args...) printk("[EXT2 JBD] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+// the most blocks described by one descriptor block, which is also the most
+// that are written to the log in one request
+#define EXT2_JOURNAL_BATCH 64
+
+// checkpoint once this many blocks are waiting to be written home
+#define EXT2_JOURNAL_MAX_PENDING 2048
+
+// commit at least this often
+#define EXT2_JOURNAL_COMMIT_NS (5 * NSEC_PER_SEC)
+
+// commit straight away once the running transaction needs this share of the
+// log, and make new handles wait for that commit at twice the size
+#define EXT2_JOURNAL_COMMIT_SHARE 8
+
+// the replay passes
+#define PASS_SCAN 0
+#define PASS_REVOKE 1
+#define PASS_REPLAY 2
+
+static inline u32 be32(const u8 *p) {
+  return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static inline u16 be16(const u8 *p) { return ((u16)p[0] << 8) | p[1]; }
+
+static inline void put_be32(u8 *p, u32 v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+// the header at the start of every journal metadata block
+static void put_header(u8 *buf, u32 type, u32 seq) {
+  put_be32(buf, JBD_MAGIC);
+  put_be32(buf + 4, type);
+  put_be32(buf + 8, seq);
+}
+
+fs::ext2_journal::ext2_journal(fs::ext2 *efs)
+    : efs(efs), bsize(efs->blocksize) {}
+
+fs::ext2_journal::~ext2_journal(void) {
+  if (thread_started) {
+    // let the commit thread see that it should exit
+    stopping = true;
+    commit_wq.notify();
+    while (!__atomic_load_n(&exited, __ATOMIC_ACQUIRE)) sched::yield();
+  }
+
+  for (auto &ent : blocks) {
+    kfree(ent.value->data);
+    if (ent.value->frozen != NULL) kfree(ent.value->frozen);
+    delete ent.value;
+  }
+  if (jsb != nullptr) kfree(jsb);
+}
+
+/* does not take a lock! (the log is guarded by the commit lock) */
+bool fs::ext2_journal::io(u32 lblk, u32 count, void *buf, bool write) {
+  auto *p = (u8 *)buf;
+  while (count > 0) {
+    // the journal is almost always a single extent, so just scan for it
+    ext2_extent *ex = NULL;
+    for (auto &e : extents) {
+      if (lblk >= e.lblk && lblk < e.lblk + e.len) {
+        ex = &e;
+        break;
+      }
+    }
+    if (ex == NULL) return false;
+
+    u32 n = min(count, ex->lblk + ex->len - lblk);
+    off_t off = (off_t)(ex->pblk + (lblk - ex->lblk)) * bsize;
+    if (!efs->disk_rw(off, p, n * bsize, write)) return false;
+
+    lblk += n;
+    count -= n;
+    p += n * bsize;
+  }
+  return true;
+}
+
+/* does not take a lock! */
+bool fs::ext2_journal::write_home(u32 block, u32 count, const void *buf) {
+  return efs->disk_rw((off_t)block * bsize, (void *)buf, count * bsize, true);
+}
+
+/* does not take a lock! */
+bool fs::ext2_journal::write_jsb(u32 start, u32 seq) {
+  put_be32(jsb + 24, seq);
+  put_be32(jsb + 28, start);
+  return io(0, 1, jsb, true);
+}
+
+/* does not take a lock! */
+u32 fs::ext2_journal::log_free(void) {
+  u32 len = maxlen - first;
+  if (tail == 0) return len;
+  if (tail > head) return tail - head;
+  return len - (head - tail);
+}
+
+// how many tags fit in a descriptor block, and records in a revoke block
+static void log_layout(u32 bsize, bool wide, u32 &tag_bytes, u32 &per_desc,
+                       u32 &per_revoke) {
+  tag_bytes = wide ? 12 : 8;
+  per_desc = min((bsize - 12 - 16) / tag_bytes, (u32)EXT2_JOURNAL_BATCH);
+  per_revoke = (bsize - 16) / (wide ? 8 : 4);
+}
+
+// how much of the log a transaction of `nblocks` blocks and `nrevoked`
+// revokes takes up, with its descriptors and commit block
+u32 fs::ext2_journal::log_blocks(u32 nblocks, u32 nrevoked) {
+  u32 tag_bytes, per_desc, per_revoke;
+  log_layout(bsize, incompat & JBD_FEATURE_INCOMPAT_64BIT, tag_bytes, per_desc,
+             per_revoke);
+  return (nblocks + per_desc - 1) / per_desc + nblocks +
+         (nrevoked + per_revoke - 1) / per_revoke + 1;
+}
+
+int fs::ext2_journal::load(u32 inum) {
+  auto *ino = efs->get_inode(inum);
+  if (ino == NULL) return -ENOENT;
+
+  // the journal has to be fully allocated. Remember where it is, since the
+  // block map can't be read while the cache lock is held
+  u32 nblocks = ino->size / bsize;
+  for (u32 lblk = 0; lblk < nblocks;) {
+    u32 run;
+    u32 pblk = efs->map_blocks(*ino, lblk, run);
+    if (run == 0 || pblk == 0) return -EINVAL;
+    run = min(run, nblocks - lblk);
+    extents.push({lblk, pblk, run});
+    lblk += run;
+  }
+  if (nblocks < 2) return -EINVAL;
+
+  scoped_lock cl(efs->cache_lock);
+
+  jsb = (u8 *)kmalloc(bsize);
+  if (!io(0, 1, jsb, false)) return -EIO;
+
+  u32 type = be32(jsb + 4);
+  if (be32(jsb) != JBD_MAGIC ||
+      (type != JBD_SUPERBLOCK_V1 && type != JBD_SUPERBLOCK_V2)) {
+    KWARN("ext2: bad journal superblock\n");
+    return -EINVAL;
+  }
+  if (be32(jsb + 12) != bsize) return -EINVAL;
+
+  maxlen = be32(jsb + 16);
+  first = be32(jsb + 20);
+  if (maxlen > nblocks || first == 0 || first >= maxlen) return -EINVAL;
+
+  if (type == JBD_SUPERBLOCK_V2) {
+    incompat = be32(jsb + 40);
+    u32 known = JBD_FEATURE_INCOMPAT_REVOKE | JBD_FEATURE_INCOMPAT_64BIT |
+                JBD_FEATURE_INCOMPAT_ASYNC_COMMIT |
+                JBD_FEATURE_INCOMPAT_CSUM_V2 | JBD_FEATURE_INCOMPAT_CSUM_V3;
+    if (incompat & ~known) {
+      KWARN("ext2: journal has unknown features %x\n", incompat & ~known);
+      return -ENOTSUP;
+    }
+  }
+
+  sequence = be32(jsb + 24);
+  if (be32(jsb + 28) != 0) {
+    int err = recover();
+    if (err < 0) return err;
+  }
+
+  // from here on the log is written in the plainest format (no checksums),
+  // which is fine to switch to now that it is empty
+  incompat = JBD_FEATURE_INCOMPAT_REVOKE |
+             (incompat & JBD_FEATURE_INCOMPAT_64BIT);
+  put_be32(jsb + 4, JBD_SUPERBLOCK_V2);
+  put_be32(jsb + 36, 0);
+  put_be32(jsb + 40, incompat);
+  head = first;
+  tail = 0;
+  if (!write_jsb(0, sequence)) return -EIO;
+
+  KINFO("ext2: journal of %u blocks, next transaction %u\n", maxlen - first,
+        sequence);
+  return 0;
+}
+
+/* does not take a lock! */
+int fs::ext2_journal::recover(void) {
+  map<u32, u32> revokes;
+  u32 end = 0;
+  int replayed = 0;
+
+  for (int pass = PASS_SCAN; pass <= PASS_REPLAY; pass++) {
+    int err = do_pass(pass, end, revokes, replayed);
+    if (err < 0) return err;
+  }
+
+  // anything cached was read before the replay
+  for (int i = 0; i < efs->cache_size; i++) {
+    efs->disk_cache[i].cba = -1;
+    efs->disk_cache[i].dirty = false;
+  }
+
+  KINFO("ext2: replayed %d blocks from transactions %u to %u\n", replayed,
+        sequence, end);
+  sequence = end;
+  return 0;
+}
+
+/*
+ * do_pass - one walk over the log, starting at the oldest transaction.
+ * PASS_SCAN finds the end of the last complete transaction, PASS_REVOKE
+ * collects every revoke record, and PASS_REPLAY writes the logged blocks home
+ */
+int fs::ext2_journal::do_pass(int pass, u32 &end, map<u32, u32> &revokes,
+                              int &replayed) {
+  bool csum3 = incompat & JBD_FEATURE_INCOMPAT_CSUM_V3;
+  bool csum = csum3 || (incompat & JBD_FEATURE_INCOMPAT_CSUM_V2);
+  bool wide = incompat & JBD_FEATURE_INCOMPAT_64BIT;
+
+  u32 tag_bytes = 8;
+  if (csum3)
+    tag_bytes = 16;
+  else if (csum)
+    tag_bytes = wide ? 14 : 10;
+  else if (wide)
+    tag_bytes = 12;
+  // checksummed descriptor and revoke blocks have a tail
+  u32 limit = bsize - (csum ? 4 : 0);
+
+  auto *buf = (u8 *)kmalloc(bsize);
+  auto *data = (u8 *)kmalloc(bsize);
+  int err = 0;
+
+  u32 tid = sequence;
+  u32 blk = be32(jsb + 28);
+
+  while (1) {
+    if (pass != PASS_SCAN && tid == end) break;
+
+    if (!io(blk, 1, buf, false)) {
+      err = -EIO;
+      break;
+    }
+    // the log ends at the first block that isn't the next one expected
+    if (be32(buf) != JBD_MAGIC || be32(buf + 8) != tid) break;
+    u32 type = be32(buf + 4);
+    blk = log_next(blk);
+
+    if (type == JBD_DESCRIPTOR_BLOCK) {
+      for (u32 off = 12; off + tag_bytes <= limit;) {
+        u8 *tag = buf + off;
+        u32 flags = csum3 ? be32(tag + 4) : be16(tag + 6);
+        u32 target = be32(tag);
+        bool high = wide && be32(tag + 8) != 0;
+
+        if (pass == PASS_REPLAY && !high) {
+          auto it = revokes.find(target);
+          bool revoked = it != revokes.end() && (int)(it->value - tid) >= 0;
+          if (!revoked && target < efs->sb->blocks) {
+            if (!io(blk, 1, data, false)) {
+              err = -EIO;
+              break;
+            }
+            if (flags & JBD_FLAG_ESCAPE) put_be32(data, JBD_MAGIC);
+            write_home(target, 1, data);
+            replayed++;
+          }
+        }
+
+        blk = log_next(blk);
+        off += tag_bytes;
+        if (!(flags & JBD_FLAG_SAME_UUID)) off += 16;
+        if (flags & JBD_FLAG_LAST_TAG) break;
+      }
+      if (err != 0) break;
+      continue;
+    }
+
+    if (type == JBD_COMMIT_BLOCK) {
+      tid++;
+      continue;
+    }
+
+    if (type == JBD_REVOKE_BLOCK) {
+      if (pass == PASS_REVOKE) {
+        u32 rec = wide ? 8 : 4;
+        u32 count = min(be32(buf + 12), limit);
+        for (u32 off = 16; off + rec <= count; off += rec) {
+          // blocks past 32 bits can't be on this filesystem anyway
+          if (wide && be32(buf + off) != 0) continue;
+          u32 b = be32(buf + off + (wide ? 4 : 0));
+          auto it = revokes.find(b);
+          if (it == revokes.end() || (int)(tid - it->value) > 0)
+            revokes.set(b, tid);
+        }
+      }
+      continue;
+    }
+
+    break;
+  }
+
+  if (pass == PASS_SCAN) end = tid;
+
+  kfree(buf);
+  kfree(data);
+  return err;
+}
+
+void fs::ext2_journal::start(void) {
+  lock.lock();
+  // wait while a commit closes the running transaction, or if it has grown
+  // big enough that it might not fit in the log
+  while (want_commit || log_blocks(nrunning, revoked.size()) >
+                            2 * (maxlen - first) / EXT2_JOURNAL_COMMIT_SHARE) {
+    blocked++;
+    lock.unlock();
+    kick();
+    unblocked.wait_noint();
+    lock.lock();
+  }
+  handles++;
+  lock.unlock();
+}
+
+void fs::ext2_journal::stop(void) {
+  lock.lock();
+  handles--;
+  if (handles == 0 && want_commit) drained.notify();
+  bool busy = nrunning > 0 || revoked.size() > 0;
+  // anything smaller waits for the commit thread's next round
+  bool now = log_blocks(nrunning, revoked.size()) >
+             (maxlen - first) / EXT2_JOURNAL_COMMIT_SHARE;
+  lock.unlock();
+
+  if (now)
+    kick();
+  else if (busy)
+    spawn();
+}
+
+/* needs the journal lock */
+void fs::ext2_journal::wake_handles(void) {
+  // each of them counted itself before it went to sleep, so a notify that
+  // comes first is kept for it
+  for (; blocked > 0; blocked--) unblocked.notify();
+}
+
+int fs::ext2_journal::commit_thread(void *arg) {
+  auto *j = (fs::ext2_journal *)arg;
+  while (1) {
+    // every so often, or as soon as someone asks
+    j->commit_wq.wait_timeout(EXT2_JOURNAL_COMMIT_NS);
+    if (j->stopping) break;
+
+    j->lock.lock();
+    j->kicked = false;
+    j->lock.unlock();
+
+    j->commit();
+  }
+  __atomic_store_n(&j->exited, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void fs::ext2_journal::spawn(void) {
+  lock.lock();
+  bool start_thread = !thread_started;
+  thread_started = true;
+  lock.unlock();
+
+  if (start_thread)
+    sched::proc::create_kthread("[ext2-jbd]", commit_thread, this);
+}
+
+void fs::ext2_journal::kick(void) {
+  lock.lock();
+  if (kicked) {
+    lock.unlock();
+    return;
+  }
+  kicked = true;
+  lock.unlock();
+
+  spawn();
+  commit_wq.notify();
+}
+
+/* needs the journal lock */
+void fs::ext2_journal::drop(u32 block, jblock *jb) {
+  blocks.remove(block);
+  kfree(jb->data);
+  if (jb->frozen != NULL) kfree(jb->frozen);
+  delete jb;
+}
+
+/* needs the cache lock */
+void fs::ext2_journal::dirty(u32 block, const void *data) {
+  scoped_lock l(lock);
+
+  jblock *jb = NULL;
+  auto it = blocks.find(block);
+  if (it != blocks.end()) {
+    jb = it->value;
+  } else {
+    jb = new jblock();
+    jb->data = (u8 *)kmalloc(bsize);
+    jb->frozen = NULL;
+    jb->running = false;
+    jb->committing = false;
+    jb->logged = false;
+    jb->writing = false;
+    jb->freed = false;
+    blocks.set(block, jb);
+  }
+
+  memcpy(jb->data, data, bsize);
+  // it was freed while committing, and has been handed out again since
+  jb->freed = false;
+  if (!jb->running) {
+    jb->running = true;
+    nrunning++;
+  }
+
+  // the block is in use again, so a revoke for it in this transaction would
+  // stop the new contents from being replayed
+  for (int i = 0; i < revoked.size(); i++) {
+    if (revoked[i] == block) {
+      revoked.remove(i);
+      break;
+    }
+  }
+}
+
+/* needs the cache lock */
+bool fs::ext2_journal::pending(u32 block) {
+  scoped_lock l(lock);
+  auto it = blocks.find(block);
+  return it != blocks.end() && !it->value->freed;
+}
+
+/* needs the cache lock */
+void fs::ext2_journal::patch(u32 block, u32 count, void *buf) {
+  scoped_lock l(lock);
+  if (blocks.size() == 0) return;
+
+  for (u32 i = 0; i < count; i++) {
+    auto it = blocks.find(block + i);
+    if (it == blocks.end() || it->value->freed) continue;
+    memcpy((u8 *)buf + i * bsize, it->value->data, bsize);
+  }
+}
+
+void fs::ext2_journal::forget(u32 block) {
+  lock.lock();
+
+  jblock *jb = NULL;
+  while (1) {
+    auto it = blocks.find(block);
+    if (it == blocks.end()) {
+      lock.unlock();
+      return;
+    }
+    jb = it->value;
+    if (!jb->writing) break;
+
+    // a checkpoint is writing it home. The block can be handed out again as
+    // soon as we return, so that write has to land first
+    home_waiters++;
+    lock.unlock();
+    home_wq.wait_noint();
+    lock.lock();
+  }
+
+  if (jb->logged || jb->committing) revoked.push(block);
+  if (jb->running) {
+    jb->running = false;
+    nrunning--;
+  }
+
+  // the commit still needs its copy. It drops the block when it is done
+  if (jb->committing)
+    jb->freed = true;
+  else
+    drop(block, jb);
+  lock.unlock();
+}
+
+int fs::ext2_journal::commit(void) {
+  scoped_lock c(commit_lock);
+
+  lock.lock();
+  if (nrunning == 0 && revoked.size() == 0) {
+    lock.unlock();
+    return 0;
+  }
+
+  // stop new handles, and wait for the operations that are in the middle of
+  // changing metadata
+  want_commit = true;
+  while (handles > 0) {
+    lock.unlock();
+    drained.wait_noint();
+    lock.lock();
+  }
+
+  if (log_blocks(nrunning, revoked.size()) >= log_free()) {
+    // make room by writing home what the earlier transactions logged. The
+    // running one stays in memory until it is in the log. Handles keep
+    // waiting, so it doesn't grow in the meantime
+    lock.unlock();
+    int err = do_checkpoint();
+    lock.lock();
+    if (err != 0) {
+      // leave it running, and try again next time
+      want_commit = false;
+      wake_handles();
+      lock.unlock();
+      return err;
+    }
+  }
+
+  // close the transaction: what its blocks look like now is what gets logged
+  vec<u32> list;
+  for (auto &ent : blocks) {
+    auto *jb = ent.value;
+    if (!jb->running) continue;
+    if (jb->frozen == NULL) jb->frozen = (u8 *)kmalloc(bsize);
+    memcpy(jb->frozen, jb->data, bsize);
+    jb->running = false;
+    jb->committing = true;
+    list.push(ent.key);
+  }
+  vec<u32> revokes = revoked;
+  revoked.clear();
+  nrunning = 0;
+  u32 tid = sequence++;
+
+  // the next transaction can start
+  want_commit = false;
+  wake_handles();
+  lock.unlock();
+
+  list.sort();
+  INFO("commit %u: %d blocks, %d revoked\n", tid, list.size(), revokes.size());
+
+  // ordered mode: the data the new metadata points at goes to disk first
+  efs->cache_lock.lock();
+  efs->flush_cache();
+  efs->cache_lock.unlock();
+
+  int err = 0;
+  if (log_blocks(list.size(), revokes.size()) >= log_free()) {
+    // the log is empty by now, and start() keeps transactions to a fraction
+    // of it, so this takes a journal too small for a single operation
+    KERR("ext2: transaction of %d blocks doesn't fit in the journal\n",
+         list.size());
+    err = -ENOSPC;
+  }
+  if (err == 0) err = do_commit(list, revokes, tid);
+
+  lock.lock();
+  for (u32 b : list) {
+    // committing blocks are only dropped here
+    auto *jb = blocks.find(b)->value;
+    jb->committing = false;
+    if (jb->freed)
+      drop(b, jb);
+    else
+      jb->logged = true;
+  }
+  lock.unlock();
+
+  if (err != 0) {
+    // the log can't be trusted to hold this transaction, so write it home
+    KERR("ext2: journal commit %u failed (%d)\n", tid, err);
+    err = do_checkpoint();
+    lock.lock();
+    wake_handles();
+    lock.unlock();
+    return err;
+  }
+
+  // keep at least half the log free, so the next commit fits
+  lock.lock();
+  bool full = log_free() < (maxlen - first) / 2 ||
+              blocks.size() > EXT2_JOURNAL_MAX_PENDING;
+  lock.unlock();
+  if (full) err = do_checkpoint();
+
+  // handles that were waiting for room
+  lock.lock();
+  wake_handles();
+  lock.unlock();
+  return err;
+}
+
+/*
+ * write a closed transaction to the log. Needs the commit lock, and takes the
+ * journal lock only to copy each batch of blocks out
+ */
+int fs::ext2_journal::do_commit(vec<u32> &list, vec<u32> &revokes, u32 tid) {
+  bool wide = incompat & JBD_FEATURE_INCOMPAT_64BIT;
+  u32 tag_bytes, per_desc, per_revoke;
+  log_layout(bsize, wide, tag_bytes, per_desc, per_revoke);
+
+  u32 n = list.size();
+  u32 nrev = revokes.size();
+  int err = 0;
+
+  // the superblock has to point at the log before anything in it counts
+  if (tail == 0) {
+    tail = head;
+    if (!write_jsb(tail, tid)) return -EIO;
+  }
+
+  auto *buf = (u8 *)kmalloc((per_desc + 1) * bsize);
+
+  // descriptor blocks, each followed by the blocks they describe
+  for (u32 i = 0; err == 0 && i < n; i += per_desc) {
+    u32 count = min(per_desc, n - i);
+    memset(buf, 0, bsize);
+    put_header(buf, JBD_DESCRIPTOR_BLOCK, tid);
+
+    lock.lock();
+    u32 off = 12;
+    for (u32 t = 0; t < count; t++) {
+      auto *jb = blocks.find(list[i + t])->value;
+      u8 *copy = buf + (t + 1) * bsize;
+      memcpy(copy, jb->frozen, bsize);
+
+      u32 flags = 0;
+      // a logged block can't look like a journal block
+      if (be32(copy) == JBD_MAGIC) {
+        put_be32(copy, 0);
+        flags |= JBD_FLAG_ESCAPE;
+      }
+      if (t != 0) flags |= JBD_FLAG_SAME_UUID;
+      if (t == count - 1) flags |= JBD_FLAG_LAST_TAG;
+
+      put_be32(buf + off, list[i + t]);
+      put_be32(buf + off + 4, flags);
+      off += tag_bytes;
+      if (t == 0) {
+        memcpy(buf + off, jsb + 48, 16);
+        off += 16;
+      }
+    }
+    lock.unlock();
+
+    // write the run, splitting it where the log wraps around
+    for (u32 done = 0; done < count + 1;) {
+      u32 chunk = min(count + 1 - done, maxlen - head);
+      if (!io(head, chunk, buf + done * bsize, true)) {
+        err = -EIO;
+        break;
+      }
+      done += chunk;
+      head = head + chunk == maxlen ? first : head + chunk;
+    }
+  }
+
+  // revoke records for logged blocks that were freed
+  for (u32 i = 0; err == 0 && i < nrev; i += per_revoke) {
+    u32 count = min(per_revoke, nrev - i);
+    memset(buf, 0, bsize);
+    put_header(buf, JBD_REVOKE_BLOCK, tid);
+    u32 off = 16;
+    for (u32 r = 0; r < count; r++) {
+      if (wide) off += 4;
+      put_be32(buf + off, revokes[i + r]);
+      off += 4;
+    }
+    put_be32(buf + 12, off);
+    if (!io(head, 1, buf, true)) err = -EIO;
+    head = log_next(head);
+  }
+
+  // and finally the commit block, which makes it all count
+  if (err == 0) {
+    memset(buf, 0, bsize);
+    put_header(buf, JBD_COMMIT_BLOCK, tid);
+    if (!io(head, 1, buf, true)) err = -EIO;
+    head = log_next(head);
+  }
+  kfree(buf);
+  return err;
+}
+
+/*
+ * write every logged block home, and empty the log. Needs the commit lock.
+ * Blocks that changed since they were logged stay in the journal, with their
+ * new contents, for the next commit
+ */
+int fs::ext2_journal::do_checkpoint(void) {
+  vec<u32> list;
+  lock.lock();
+  for (auto &ent : blocks) {
+    if (ent.value->logged) list.push(ent.key);
+  }
+  lock.unlock();
+  list.sort();
+
+  INFO("checkpoint: %d blocks\n", list.size());
+
+  // write them home, in runs of contiguous blocks
+  int err = 0;
+  auto *buf = (u8 *)kmalloc(EXT2_JOURNAL_BATCH * bsize);
+  for (int i = 0; i < list.size();) {
+    // anything freed since is left out, and forget() waits for the rest
+    lock.lock();
+    int n = 0;
+    while (i + n < list.size() && n < EXT2_JOURNAL_BATCH &&
+           list[i + n] == list[i] + n) {
+      auto it = blocks.find(list[i + n]);
+      if (it == blocks.end() || !it->value->logged) break;
+      it->value->writing = true;
+      memcpy(buf + n * bsize, it->value->frozen, bsize);
+      n++;
+    }
+    lock.unlock();
+
+    if (n == 0) {
+      i++;
+      continue;
+    }
+    if (!write_home(list[i], n, buf)) err = -EIO;
+
+    lock.lock();
+    for (int k = 0; k < n; k++) blocks.find(list[i + k])->value->writing = false;
+    for (; home_waiters > 0; home_waiters--) home_wq.notify();
+    lock.unlock();
+    i += n;
+  }
+  kfree(buf);
+
+  // if anything didn't make it home, leave the log for the next mount
+  if (err != 0) return err;
+
+  // the blocks that haven't changed since are home now. A cache line that is
+  // being read in takes its copy of them from the journal, so they can only
+  // be dropped under the cache lock
+  efs->cache_lock.lock();
+  lock.lock();
+  for (u32 b : list) {
+    auto it = blocks.find(b);
+    if (it == blocks.end()) continue;
+    auto *jb = it->value;
+    if (!jb->logged) continue;
+    jb->logged = false;
+    if (!jb->running) drop(b, jb);
+  }
+  lock.unlock();
+  efs->cache_lock.unlock();
+
+  head = first;
+  tail = 0;
+  if (!write_jsb(0, sequence)) return -EIO;
+  return 0;
+}
+
+int fs::ext2_journal::checkpoint(void) {
+  scoped_lock c(commit_lock);
+  lock.lock();
+  bool busy = nrunning != 0;
+  lock.unlock();
+  if (busy) return -EBUSY;
+  return do_checkpoint();
+}
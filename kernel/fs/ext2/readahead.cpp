@@ -0,0 +1,152 @@
+#include <fs/ext2.h>
+#include <lock.h>
+#include <sched.h>
+#include <wait.h>
+
+/*
+ * Sequential readahead.
+ *
+ * Every open file keeps track of where its next read would start if it is
+ * being read front to back. While that guess keeps being right, each read
+ * also queues the blocks past it to be pulled into the block cache by a
+ * kernel thread, so by the time the reader gets there they are already in
+ * memory. The window starts small and doubles each time the reader catches up
+ * with it. A read anywhere else turns readahead off until the reads are
+ * sequential again.
+ */
+
+// #define EXT2_RA_DEBUG
+
+#ifdef EXT2_RA_DEBUG
+#define INFO(fmt, args...) printk("[EXT2 RA] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+// the window, in blocks, when sequential reads are first noticed
+#define EXT2_RA_MIN_BLOCKS 4
+// the largest window, in bytes. Kept well under the size of the block cache,
+// so prefetched blocks aren't evicted before they are read
+#define EXT2_RA_MAX (128 * 1024)
+
+// must be a power of two
+#define EXT2_RA_QUEUE 64
+
+struct ra_request {
+  // null once the filesystem has been unmounted
+  fs::ext2 *efs;
+  u32 block;
+  u32 count;
+};
+
+static struct ra_request ra_queue[EXT2_RA_QUEUE];
+static u32 ra_head = 0, ra_tail = 0;
+static spinlock ra_lock;
+static waitqueue ra_wq;
+static bool ra_started = false;
+// the filesystem the worker is prefetching from right now
+static fs::ext2 *ra_active = nullptr;
+
+static int ext2_ra_worker(void *) {
+  while (1) {
+    ra_wq.wait_noint();
+
+    ra_lock.lock();
+    if (ra_head == ra_tail) {
+      ra_lock.unlock();
+      continue;
+    }
+    auto req = ra_queue[ra_tail++ & (EXT2_RA_QUEUE - 1)];
+    ra_active = req.efs;
+    ra_lock.unlock();
+
+    if (req.efs == nullptr) continue;
+    INFO("prefetch %u+%u\n", req.block, req.count);
+    req.efs->prefetch(req.block, req.count);
+
+    ra_lock.lock();
+    ra_active = nullptr;
+    ra_lock.unlock();
+  }
+  return 0;
+}
+
+void ext2_readahead_drain(fs::ext2 *efs) {
+  ra_lock.lock();
+  for (u32 i = ra_tail; i != ra_head; i++) {
+    auto &req = ra_queue[i & (EXT2_RA_QUEUE - 1)];
+    if (req.efs == efs) req.efs = nullptr;
+  }
+  // and wait out the one the worker may be in the middle of
+  while (ra_active == efs) {
+    ra_lock.unlock();
+    sched::yield();
+    ra_lock.lock();
+  }
+  ra_lock.unlock();
+}
+
+static void ext2_ra_queue(fs::ext2 *efs, u32 block, u32 count) {
+  ra_lock.lock();
+  if (!ra_started) {
+    ra_started = true;
+    sched::proc::create_kthread("[ext2-ra]", ext2_ra_worker);
+  }
+
+  // readahead is only a hint, so if the worker is this far behind just drop it
+  if (ra_head - ra_tail >= EXT2_RA_QUEUE) {
+    ra_lock.unlock();
+    return;
+  }
+  ra_queue[ra_head++ & (EXT2_RA_QUEUE - 1)] = {efs, block, count};
+  ra_lock.unlock();
+
+  ra_wq.notify();
+}
+
+void ext2_readahead(fs::file &f, off_t pos, size_t len) {
+  auto &ra = f.ra;
+  auto *efs = (fs::ext2 *)f.ino->fs;
+  off_t bsize = efs->blocksize;
+
+  off_t end = pos + len;
+  bool sequential = pos == ra.next;
+  ra.next = end;
+
+  if (!sequential) {
+    ra.window = 0;
+    ra.end = 0;
+    return;
+  }
+
+  off_t size = f.ino->size;
+  if (end >= size) return;
+
+  if (ra.window == 0) {
+    ra.window = EXT2_RA_MIN_BLOCKS * bsize;
+    ra.end = end;
+  } else if (end + (off_t)ra.window / 2 < ra.end) {
+    // still well inside what was prefetched last time
+    return;
+  } else {
+    ra.window = min(ra.window * 2, (size_t)EXT2_RA_MAX);
+  }
+
+  off_t from = max(ra.end, end);
+  off_t to = min(end + (off_t)ra.window, size);
+  if (to <= from) return;
+  ra.end = to;
+
+  // queue the range one run of contiguous disk blocks at a time
+  u32 lbi = from / bsize;
+  u32 last = (to - 1) / bsize;
+  while (lbi <= last) {
+    u32 run;
+    u32 blk = efs->map_blocks(*f.ino, lbi, run);
+    if (run == 0) break;
+    run = min(run, last - lbi + 1);
+    // holes read back as zeroes, there is nothing to fetch
+    if (blk != 0) ext2_ra_queue(efs, blk, run);
+    lbi += run;
+  }
+}
@@ -92,3 +92,68 @@ ssize_t fs::file::write(void *data, ssize_t len) {
   return -EINVAL;
 }
 
+
+ssize_t fs::file::preadv(const struct iovec *iov, int iovcnt, off_t off) {
+  if (!ino) return -ENOENT;
+  if (off < 0) return -EINVAL;
+  fs::file_operations *ops = fops();
+  if (ops && ops->readv) return ops->readv(*this, iov, iovcnt, off);
+  return -ESPIPE;
+}
+
+ssize_t fs::file::pwritev(const struct iovec *iov, int iovcnt, off_t off) {
+  if (!ino) return -ENOENT;
+  if (off < 0) return -EINVAL;
+  fs::file_operations *ops = fops();
+  if (ops && ops->writev) return ops->writev(*this, iov, iovcnt, off);
+  return -ESPIPE;
+}
+
+ssize_t fs::file::pread(void *dst, size_t len, off_t off) {
+  struct iovec iov = {dst, len};
+  return preadv(&iov, 1, off);
+}
+
+ssize_t fs::file::pwrite(void *data, size_t len, off_t off) {
+  struct iovec iov = {data, len};
+  return pwritev(&iov, 1, off);
+}
+
+ssize_t fs::file::readv(const struct iovec *iov, int iovcnt) {
+  if (!ino) return -ENOENT;
+  fs::file_operations *ops = fops();
+  if (ops && ops->readv) {
+    ssize_t n = ops->readv(*this, iov, iovcnt, m_offset);
+    if (n > 0) seek(n, SEEK_CUR);
+    return n;
+  }
+
+  // one read per segment, stopping at the first short one
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = read(iov[i].iov_base, iov[i].iov_len);
+    if (n < 0) return total == 0 ? n : total;
+    total += n;
+    if ((size_t)n < iov[i].iov_len) break;
+  }
+  return total;
+}
+
+ssize_t fs::file::writev(const struct iovec *iov, int iovcnt) {
+  if (!ino) return -ENOENT;
+  fs::file_operations *ops = fops();
+  if (ops && ops->writev) {
+    ssize_t n = ops->writev(*this, iov, iovcnt, m_offset);
+    if (n > 0) seek(n, SEEK_CUR);
+    return n;
+  }
+
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = write(iov[i].iov_base, iov[i].iov_len);
+    if (n < 0) return total == 0 ? n : total;
+    total += n;
+    if ((size_t)n < iov[i].iov_len) break;
+  }
+  return total;
+}
@@ -3,6 +3,7 @@
 #include <dev/driver.h>
 #include <errno.h>
 #include <fs.h>
+#include <fs/dcache.h>
 #include <module.h>
 #include <printk.h>
 
@@ -17,6 +18,7 @@ fs::inode::inode(int type) : type(type) {
       dir.mountpoint = nullptr;  // where the directory is mounted to
       dir.entries = nullptr;
       dir.name = nullptr;
+      dir.complete = false;
       break;
 
     case T_FILE:
@@ -55,6 +57,7 @@ static void destruct_dir(struct inode *ino) {
 fs::inode::~inode() {
   // printk("INODE DESTRUCT %d\n", ino);
   if (fops && fops->destroy) fops->destroy(*this);
+  if (in_dcache) fs::dcache::purge(this);
 
   switch (type) {
     case T_DIR:
@@ -73,9 +76,16 @@ fs::inode::~inode() {
   }
 }
 
+// put a new entry on the front of a directory's list
+static void push_direntry(struct inode *dir, struct direntry *ent) {
+  ent->prev = NULL;
+  ent->next = dir->dir.entries;
+  if (dir->dir.entries != NULL) dir->dir.entries->prev = ent;
+  dir->dir.entries = ent;
+}
+
 struct inode *fs::inode::get_direntry_ino(struct direntry *ent) {
   assert(type == T_DIR);
-  // no lock, internal api
   // if it was shadowed by a mount, return that
   if (ent->mount_shadow != NULL) {
     return ent->mount_shadow;
@@ -94,7 +104,8 @@ struct inode *fs::inode::get_direntry_ino(struct direntry *ent) {
 
   // otherwise attempt to resolve that entry
   ent->ino = dops->lookup(*this, ent->name.get());
-  if (ent->ino != NULL) fs::inode::acquire(ent->ino);
+  if (ent->ino == NULL) return NULL;
+  fs::inode::acquire(ent->ino);
 
   if (ent->ino->type == T_DIR) {
     ent->ino->set_name(ent->name);
@@ -117,76 +128,174 @@ struct inode *fs::inode::get_direntry_nolock(const char *name) {
       return get_direntry_ino(ent);
     }
   }
+
+  // the list is only a partial view of the directory, so ask the filesystem
+  if (!dir.complete && dops != NULL && dops->lookup != NULL) {
+    auto *ino = dops->lookup(*this, name);
+    if (ino == NULL) return nullptr;
+
+    auto ent = new fs::direntry;
+    ent->name = name;
+    ent->ino = ino;
+    ent->type = ENT_RES;
+    fs::inode::acquire(ino);
+    push_direntry(this, ent);
+
+    if (ino->type == T_DIR) ino->set_name(name);
+    return ino;
+  }
   return nullptr;
 }
 
+/*
+ * populate_direntries - read every name in the directory from the filesystem,
+ * so the entry list can be enumerated. Entries that were already resolved
+ * through lookup are kept (along with their inodes)
+ */
+void fs::inode::populate_direntries(void) {
+  assert(type == T_DIR);
+  if (dir.complete) return;
+
+  if (dops == NULL || dops->walk == NULL) {
+    dir.complete = true;
+    return;
+  }
+  // only the entries that were in the list before the walk can collide with
+  // the names it returns. New entries are pushed on the front of the list, so
+  // checking from the old head avoids rescanning them each time
+  auto *old_head = dir.entries;
+
+  int res = dops->walk(*this, [&](const string &name) -> bool {
+    for_in_ll(ent, old_head) {
+      if (ent->name == name) return true;
+    }
+    auto ent = new fs::direntry;
+    ent->name = name;
+    ent->ino = NULL;
+    ent->type = ENT_RES;
+    push_direntry(this, ent);
+    return true;
+  });
+
+  // if the walk failed, lookups will keep falling through to the filesystem
+  if (res >= 0) dir.complete = true;
+}
+
 struct inode *fs::inode::get_direntry(const char *name) {
   assert(type == T_DIR);
-  struct inode *ino = NULL;
-  // lock.lock();
-  ino = get_direntry_nolock(name);
-  // lock.unlock();
-  return ino;  // nothing found!
+  scoped_lock l(dir_lock);
+  return get_direntry_nolock(name);
 }
 
 int fs::inode::register_direntry(string name, int enttype, struct inode *ino) {
   assert(type == T_DIR);
-  lock.lock();
+  scoped_lock l(dir_lock);
 
   // check that there isn't a directory entry by that name
   for_in_ll(ent, dir.entries) {
     if (ent->name == name) {
       // there already exists a directory by that name
-      lock.unlock();
       return -EEXIST;
     }
   }
 
+  // drop a negative entry, if there was one
+  fs::dcache::invalidate(this, name.get());
+
   auto ent = new fs::direntry;
   ent->name = move(name);
   ent->ino = ino;
 
   ent->type = enttype;
-
-  ent->next = dir.entries;
-  if (dir.entries != NULL) dir.entries->prev = ent;
-  dir.entries = ent;
+  push_direntry(this, ent);
 
   if (ino != NULL) {
     fs::inode::acquire(ent->ino);
   }
 
-  lock.unlock();
   return 0;
 }
 
 int fs::inode::remove_direntry(string name) {
   assert(type == T_DIR);
-  lock.lock();
+  // make sure the entry is in the list, if the directory is only partially read
+  if (!dir.complete) get_direntry(name.get());
+
+  dir_lock.lock();
+  struct direntry *ent = NULL;
+  for_in_ll(it, dir.entries) {
+    if (it->name == name) {
+      ent = it;
+      break;
+    }
+  }
+  bool resident = ent != NULL && ent->type == ENT_RES;
+  dir_lock.unlock();
 
-  // walk the list and remove the entry
+  if (ent == NULL) return -ENOENT;
+
+  // check with the filesystem implementation first. It is called without the
+  // lock, since it looks names up in this directory itself
+  if (resident && dops != NULL && dops->unlink != NULL) {
+    int err = dops->unlink(*this, name.get());
+    if (err != 0) return err;
+  }
+
+  // the entry may have been removed by someone else in the meantime, so look
+  // for it again before taking it out of the list
+  dir_lock.lock();
+  for_in_ll(it, dir.entries) {
+    if (it != ent || it->name != name) continue;
+    if (ent->prev != NULL) ent->prev->next = ent->next;
+    if (ent->next != NULL) ent->next->prev = ent->prev;
+    if (ent == dir.entries) dir.entries = ent->next;
+    fs::dcache::invalidate(this, ent->name.get());
+    dir_lock.unlock();
+
+    // this may be the last reference to the inode
+    if (ent->ino != NULL) fs::inode::release(ent->ino);
+    // TODO: notify the vfs that the mount was deleted?
+    if (ent->mount_shadow != NULL) fs::inode::release(ent->mount_shadow);
+    delete ent;
+    return 0;
+  }
+  dir_lock.unlock();
+  return resident ? 0 : -ENOENT;
+}
+
+/*
+ * add_mount - shadow the directory entry `name` with the root of another
+ * filesystem. Lookups through the entry return `other_root` from then on, and
+ * ".." in the mounted root comes back to this directory
+ */
+int fs::inode::add_mount(string &name, struct inode *other_root) {
+  assert(type == T_DIR);
+  if (other_root == NULL || other_root->type != T_DIR) return -ENOTDIR;
+
+  // make sure the entry is in the list, if the directory is only partially read
+  if (!dir.complete) get_direntry(name.get());
+
+  scoped_lock l(dir_lock);
   for_in_ll(ent, dir.entries) {
     if (ent->name == name) {
-      if (ent->type == ENT_RES) {
-        // check with the filesystem implementation
-        if (ent->ino->dops->unlink(*ent->ino, ent->name.get()) != 0) {
-          return -1;
-        }
+      auto *host = get_direntry_ino(ent);
+      if (host == NULL || host->type != T_DIR) {
+        return -ENOTDIR;
+      }
+      if (ent->mount_shadow != NULL) {
+        return -EBUSY;
       }
-      if (ent->prev != NULL) ent->prev->next = ent->next;
-      if (ent->next != NULL) ent->next->prev = ent->prev;
-      if (ent == dir.entries) dir.entries = ent->next;
-
-      if (ent->ino != NULL) fs::inode::release(ent->ino);
-      // TODO: notify the vfs that the mount was deleted?
-      if (ent->mount_shadow != NULL) fs::inode::release(ent->mount_shadow);
-      delete ent;
-      lock.unlock();
+
+      fs::inode::acquire(other_root);
+      ent->mount_shadow = other_root;
+      other_root->dir.mountpoint = this;
+      other_root->set_name(name);
+
+      // namei may have the host directory cached under this name
+      fs::dcache::invalidate(this, name.get());
       return 0;
     }
   }
-
-  lock.unlock();
   return -ENOENT;
 }
 
@@ -208,6 +317,8 @@ int fs::inode::set_name(const string &s) {
 void fs::inode::walk_direntries(
     func<bool(const string &, struct inode *)> func) {
   assert(type == T_DIR);
+  scoped_lock l(dir_lock);
+  populate_direntries();
 
   for_in_ll(ent, dir.entries) {
     auto ino = get_direntry_ino(ent);
@@ -219,6 +330,8 @@ void fs::inode::walk_direntries(
 
 vec<string> fs::inode::direntries(void) {
   assert(type == T_DIR);
+  scoped_lock l(dir_lock);
+  populate_direntries();
 
   vec<string> e;
   for_in_ll(ent, dir.entries) { e.push(ent->name); }
@@ -238,12 +351,11 @@ int fs::inode::acquire(struct inode *in) {
 int fs::inode::release(struct inode *in) {
   assert(in != NULL);
   in->lock.lock();
-  in->rc--;
-  if (in->rc == 0) {
-    // printk("delete inode\n");
-    delete in;
-  }
+  bool last = --in->rc == 0;
   in->lock.unlock();
+  // the filesystem may have work to do when the last reference goes (like
+  // freeing an unlinked file), so this happens without the lock
+  if (last) delete in;
   return 0;
 }
 
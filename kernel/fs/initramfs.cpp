@@ -0,0 +1,259 @@
+#include <dev/driver.h>
+#include <errno.h>
+#include <fs/tmpfs.h>
+#include <mem.h>
+
+/*
+ * Unpacking an initramfs into a tmpfs.
+ *
+ * The archive is a multiboot module, so it is already in memory and stays
+ * there. Directories and device nodes are created as usual, but a file's data
+ * is not copied anywhere: its inode just records where in the archive the data
+ * is, and reads come straight out of the module. Only pages of a file that are
+ * written or mapped get a page of their own, and if the data in the archive
+ * happens to be page aligned that page is the archive's own.
+ *
+ * Both "newc" cpio (what the linux tools make) and ustar are understood.
+ */
+
+// #define INITRAMFS_DEBUG
+
+#ifdef INITRAMFS_DEBUG
+#define INFO(fmt, args...) printk("[INITRAMFS] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+#define S_IFMT 0170000
+#define S_IFDIR 0040000
+#define S_IFREG 0100000
+#define S_IFCHR 0020000
+
+// one thing to make, regardless of which archive format it came from
+struct archive_ent {
+  string path;
+  int mode;
+  int uid, gid;
+  int major, minor;
+  // physical address of the data
+  off_t data;
+  size_t size;
+};
+
+static bool has_magic(const char *s, const char *magic) {
+  for (; *magic; s++, magic++)
+    if (*s != *magic) return false;
+  return true;
+}
+
+// a string from a field that is NUL terminated only if it is short enough
+static string field_str(const char *s, size_t max) {
+  string str;
+  for (size_t i = 0; i < max && s[i] != '\0'; i++) str += s[i];
+  return str;
+}
+
+static u64 parse_num(const char *s, int len, int base) {
+  u64 n = 0;
+  for (int i = 0; i < len; i++) {
+    char c = s[i];
+    int d;
+    if (c >= '0' && c <= '9')
+      d = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      d = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      d = c - 'A' + 10;
+    else if (c == ' ' || c == '\0') {
+      // octal fields in tar are padded with spaces or NULs
+      if (n != 0) break;
+      continue;
+    } else
+      break;
+    if (d >= base) break;
+    n = n * base + d;
+  }
+  return n;
+}
+
+/*
+ * find (or make) the directory that `path` goes in. On return, `name` is the
+ * last component of the path
+ */
+static fs::inode *parent_dir(fs::inode *root, string &path, string &name) {
+  auto parts = path.split('/');
+  if (parts.size() == 0) return NULL;
+
+  fs::inode *dir = root;
+  for (int i = 0; i < parts.size() - 1; i++) {
+    auto &part = parts[i];
+    if (part == ".") continue;
+
+    auto *next = dir->get_direntry(part.get());
+    if (next == NULL) {
+      // archives don't have to list a directory before what is in it
+      fs::file_ownership own;
+      own.uid = 0;
+      own.gid = 0;
+      own.mode = 0755;
+      if (dir->dops->mkdir(*dir, part.get(), own) != 0) return NULL;
+      next = dir->get_direntry(part.get());
+    }
+    if (next == NULL || next->type != T_DIR) return NULL;
+    dir = next;
+  }
+
+  name = parts.last();
+  if (name == ".") return NULL;
+  return dir;
+}
+
+static int make_ent(fs::inode *root, archive_ent &e) {
+  string name;
+  auto *dir = parent_dir(root, e.path, name);
+  if (dir == NULL) {
+    // the root itself, or a path through something that isn't a directory
+    return 0;
+  }
+
+  fs::file_ownership own;
+  own.uid = e.uid;
+  own.gid = e.gid;
+  own.mode = e.mode & 07777;
+
+  switch (e.mode & S_IFMT) {
+    case S_IFDIR: {
+      auto *ino = dir->get_direntry(name.get());
+      if (ino != NULL) {
+        // made already, when something in it came first
+        ino->mode = (ino->mode & ~07777) | own.mode;
+        ino->uid = own.uid;
+        ino->gid = own.gid;
+        return 0;
+      }
+      return dir->dops->mkdir(*dir, name.get(), own);
+    }
+
+    case S_IFREG: {
+      int err = dir->dops->create(*dir, name.get(), own);
+      if (err != 0) return err;
+
+      auto *ino = (tmpfs_inode *)dir->get_direntry(name.get());
+      ino->image_pa = e.data;
+      ino->image_len = e.size;
+      ino->size = e.size;
+      return 0;
+    }
+
+    case S_IFCHR:
+      return dir->dops->mknod(*dir, name.get(), own, e.major, e.minor);
+
+    default:
+      INFO("skipping '%s' (mode %o)\n", e.path.get(), e.mode);
+      return 0;
+  }
+}
+
+#define CPIO_HDR_LEN 110
+#define align4(x) (((x) + 3) & ~3)
+
+// read a "newc" cpio archive. Returns how many entries were made, or -errno
+static int unpack_cpio(fs::inode *root, off_t pa, size_t len) {
+  auto *base = (const char *)p2v(pa);
+  size_t off = 0;
+  int count = 0;
+
+  while (off + CPIO_HDR_LEN <= len) {
+    const char *h = base + off;
+    if (!has_magic(h, "070701") && !has_magic(h, "070702"))
+      return -EINVAL;
+
+    // 13 fields of 8 hex digits follow the magic
+    auto field = [&](int i) { return parse_num(h + 6 + i * 8, 8, 16); };
+
+    archive_ent e;
+    e.mode = field(1);
+    e.uid = field(2);
+    e.gid = field(3);
+    e.size = field(6);
+    e.major = field(9);
+    e.minor = field(10);
+    size_t namesize = field(11);
+
+    size_t name_off = off + CPIO_HDR_LEN;
+    size_t data_off = align4(name_off + namesize);
+    if (namesize == 0 || data_off + e.size > len) return -EINVAL;
+
+    e.path = field_str(base + name_off, namesize - 1);
+    if (e.path == "TRAILER!!!") break;
+
+    e.data = pa + data_off;
+    int err = make_ent(root, e);
+    if (err != 0) return err;
+    count++;
+
+    off = align4(data_off + e.size);
+  }
+  return count;
+}
+
+#define TAR_BLOCK 512
+
+// read a ustar archive. Returns how many entries were made, or -errno
+static int unpack_tar(fs::inode *root, off_t pa, size_t len) {
+  auto *base = (const char *)p2v(pa);
+  size_t off = 0;
+  int count = 0;
+
+  while (off + TAR_BLOCK <= len) {
+    const char *h = base + off;
+    // the archive ends with zeroed blocks
+    if (h[0] == '\0') break;
+    if (!has_magic(h + 257, "ustar")) return -EINVAL;
+
+    archive_ent e;
+    e.mode = parse_num(h + 100, 8, 8) & 07777;
+    e.uid = parse_num(h + 108, 8, 8);
+    e.gid = parse_num(h + 116, 8, 8);
+    e.size = parse_num(h + 124, 12, 8);
+    e.major = parse_num(h + 329, 8, 8);
+    e.minor = parse_num(h + 337, 8, 8);
+    e.data = pa + off + TAR_BLOCK;
+
+    char type = h[156];
+    if (type == '0' || type == '\0') e.mode |= S_IFREG;
+    if (type == '5') e.mode |= S_IFDIR;
+    if (type == '3') e.mode |= S_IFCHR;
+
+    if (off + TAR_BLOCK + e.size > len) return -EINVAL;
+
+    // long names are split into a prefix and a name
+    if (h[345] != '\0') {
+      e.path = field_str(h + 345, 155);
+      e.path += "/";
+    }
+    e.path += field_str(h, 100);
+
+    int err = make_ent(root, e);
+    if (err != 0) return err;
+    count++;
+
+    off += TAR_BLOCK + round_up(e.size, TAR_BLOCK);
+  }
+  return count;
+}
+
+int fs::tmpfs::unpack(off_t pa, size_t len) {
+  if (root == nullptr) return -EINVAL;
+
+  auto *base = (const char *)p2v(pa);
+  int count = -EINVAL;
+  if (len >= CPIO_HDR_LEN && has_magic(base, "0707"))
+    count = unpack_cpio(root, pa, len);
+  else if (len >= TAR_BLOCK && has_magic(base + 257, "ustar"))
+    count = unpack_tar(root, pa, len);
+
+  if (count < 0) return count;
+  KINFO("initramfs: %d entries from %zu bytes\n", count, len);
+  return 0;
+}
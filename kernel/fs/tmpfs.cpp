@@ -0,0 +1,365 @@
+#include <dev/RTC.h>
+#include <dev/driver.h>
+#include <errno.h>
+#include <fs/tmpfs.h>
+#include <fs/vfs.h>
+#include <mem.h>
+#include <module.h>
+
+// #define TMPFS_DEBUG
+
+#ifdef TMPFS_DEBUG
+#define INFO(fmt, args...) printk("[TMPFS] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+extern fs::file_operations tmpfs_file_ops;
+extern fs::dir_operations tmpfs_dir_ops;
+
+// drop the file's use of a page. An address space may still have it mapped
+static void put_page(ref<mm::page> &p) {
+  spinlock::lock(p->lock);
+  p->users--;
+  spinlock::unlock(p->lock);
+}
+
+/* does not take the data lock! */
+static ref<mm::page> page_from_image(tmpfs_inode *ino, u64 index) {
+  off_t off = index * PGSIZE;
+  off_t pa = ino->image_pa + off;
+
+  // a whole page of the image can just be used where it is
+  if (pa % PGSIZE == 0 && off + PGSIZE <= (off_t)ino->image_len) {
+    auto p = make_ref<mm::page>();
+    p->pa = pa;
+    p->owns_page = 0;
+    return p;
+  }
+
+  auto p = mm::page::alloc();
+  memcpy(p2v(p->pa), p2v(pa), min((size_t)PGSIZE, ino->image_len - off));
+  return p;
+}
+
+/* does not take the data lock! */
+static ref<mm::page> &get_page(tmpfs_inode *ino, u64 index) {
+  auto *slot = ino->pages.lookup(index);
+  if (slot == NULL || !*slot) {
+    ref<mm::page> p;
+    if (index * PGSIZE < ino->image_len)
+      p = page_from_image(ino, index);
+    else
+      p = mm::page::alloc();
+    // the file itself is a user, so private mappings copy on write
+    p->users = 1;
+    ino->pages.set(index, move(p));
+    slot = ino->pages.lookup(index);
+  }
+  return *slot;
+}
+
+/* does not take the data lock! */
+static void read_hole(tmpfs_inode *ino, off_t off, char *dst, size_t n) {
+  size_t from_image = 0;
+  if (off < (off_t)ino->image_len)
+    from_image = min(n, (size_t)(ino->image_len - off));
+
+  memcpy(dst, p2v(ino->image_pa + off), from_image);
+  memset(dst + from_image, 0, n - from_image);
+}
+
+/*
+ * give a directory its "." and ".." entries. They don't hold a reference (the
+ * inode destructor skips them too), or a directory could never be freed
+ */
+static void add_dots(fs::inode *dir, fs::inode *parent) {
+  dir->register_direntry(".", ENT_MEM, dir);
+  fs::inode::release(dir);
+  dir->register_direntry("..", ENT_MEM, parent);
+  fs::inode::release(parent);
+}
+
+tmpfs_inode::tmpfs_inode(int type) : fs::inode(type) {}
+
+tmpfs_inode::~tmpfs_inode(void) {
+  pages.each([](u64, ref<mm::page> &p) { put_page(p); });
+  pages.clear();
+}
+
+fs::tmpfs::tmpfs(void) {}
+
+fs::tmpfs::~tmpfs(void) {
+  if (root != nullptr) fs::inode::release(root);
+}
+
+bool fs::tmpfs::init(void) {
+  fs::file_ownership own;
+  own.uid = 0;
+  own.gid = 0;
+  own.mode = 0777;
+
+  root = create_inode(T_DIR, own);
+  fs::inode::acquire(root);
+  add_dots(root, root);
+  return true;
+}
+
+struct fs::inode *fs::tmpfs::get_root(void) { return root; }
+
+struct fs::inode *fs::tmpfs::create_inode(int type,
+                                          struct fs::file_ownership &own) {
+  auto *ino = new tmpfs_inode(type);
+
+  lock.lock();
+  ino->ino = next_ino++;
+  lock.unlock();
+
+  ino->fs = this;
+  ino->fops = &tmpfs_file_ops;
+  ino->dops = &tmpfs_dir_ops;
+  ino->uid = own.uid;
+  ino->gid = own.gid;
+  ino->link_count = type == T_DIR ? 2 : 1;
+  ino->block_size = PGSIZE;
+  ino->atime = ino->ctime = ino->mtime = dev::RTC::now();
+
+  int fmt = 0;
+  if (type == T_DIR) fmt = 0x4000;
+  if (type == T_FILE) fmt = 0x8000;
+  if (type == T_CHAR) fmt = 0x2000;
+  ino->mode = fmt | (own.mode & 0xFFF);
+
+  // directories don't have anything to look up or walk, the entry list is
+  // all there is
+  if (type == T_DIR) ino->dir.complete = true;
+  return ino;
+}
+
+/* does not take the data lock! */
+static ssize_t tmpfs_do_rw(tmpfs_inode *ino, char *buf, size_t len, off_t off,
+                           bool write) {
+  if (!write) {
+    if (off >= ino->size) return 0;
+    len = min(len, (size_t)(ino->size - off));
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    u64 index = (off + done) / PGSIZE;
+    size_t poff = (off + done) % PGSIZE;
+    size_t n = min((size_t)PGSIZE - poff, len - done);
+
+    if (write) {
+      auto &p = get_page(ino, index);
+      memcpy((char *)p2v(p->pa) + poff, buf + done, n);
+    } else {
+      auto *slot = ino->pages.lookup(index);
+      if (slot != NULL && *slot)
+        memcpy(buf + done, (char *)p2v((*slot)->pa) + poff, n);
+      else
+        read_hole(ino, off + done, buf + done, n);
+    }
+    done += n;
+  }
+
+  if (write) {
+    if (off + (off_t)done > ino->size) ino->size = off + done;
+    ino->mtime = dev::RTC::now();
+  }
+  return done;
+}
+
+static ssize_t tmpfs_rw_vec(fs::file &f, const struct iovec *iov, int iovcnt,
+                            off_t off, bool write) {
+  auto *ino = (tmpfs_inode *)f.ino;
+  if (ino->type != T_FILE) return -EINVAL;
+
+  scoped_lock l(ino->data_lock);
+
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t n = tmpfs_do_rw(ino, (char *)iov[i].iov_base, iov[i].iov_len,
+                           off + total, write);
+    total += n;
+    if (n < iov[i].iov_len) break;
+  }
+  return total;
+}
+
+static ssize_t tmpfs_readv(fs::file &f, const struct iovec *iov, int iovcnt,
+                           off_t off) {
+  return tmpfs_rw_vec(f, iov, iovcnt, off, false);
+}
+
+static ssize_t tmpfs_writev(fs::file &f, const struct iovec *iov, int iovcnt,
+                            off_t off) {
+  return tmpfs_rw_vec(f, iov, iovcnt, off, true);
+}
+
+static ssize_t tmpfs_read(fs::file &f, char *dst, size_t sz) {
+  struct iovec iov = {dst, sz};
+  ssize_t n = tmpfs_readv(f, &iov, 1, f.offset());
+  if (n > 0) f.seek(n, SEEK_CUR);
+  return n;
+}
+
+static ssize_t tmpfs_write(fs::file &f, const char *src, size_t sz) {
+  struct iovec iov = {(void *)src, sz};
+  ssize_t n = tmpfs_writev(f, &iov, 1, f.offset());
+  if (n > 0) f.seek(n, SEEK_CUR);
+  return n;
+}
+
+static int tmpfs_resize(fs::file &f, size_t size) {
+  auto *ino = (tmpfs_inode *)f.ino;
+  if (ino->type != T_FILE) return -EINVAL;
+
+  scoped_lock l(ino->data_lock);
+
+  if ((off_t)size < ino->size) {
+    if (size < ino->image_len) ino->image_len = size;
+
+    u64 keep = (size + PGSIZE - 1) / PGSIZE;
+
+    vec<u64> drop;
+    ino->pages.each([&](u64 index, ref<mm::page> &p) {
+      if (index >= keep) {
+        put_page(p);
+        drop.push(index);
+      }
+    });
+    for (auto index : drop) ino->pages.remove(index);
+
+    // zero the rest of the last page, so growing again reads zeroes
+    if (size % PGSIZE != 0) {
+      auto *slot = ino->pages.lookup(size / PGSIZE);
+      if (slot != NULL && *slot) {
+        auto *data = (char *)p2v((*slot)->pa);
+        memset(data + size % PGSIZE, 0, PGSIZE - size % PGSIZE);
+      }
+    }
+  }
+
+  ino->size = size;
+  ino->mtime = dev::RTC::now();
+  return 0;
+}
+
+/*
+ * give the area the file's own pages, so faults on it just map them. Pages
+ * past the end of the file, and a last page that hangs off the end of the
+ * area, are left for the fault handler to fill in
+ */
+static int tmpfs_mmap(fs::file &f, mm::area &a) {
+  auto *ino = (tmpfs_inode *)f.ino;
+  if (ino->type != T_FILE) return -ENODEV;
+  if (a.off % PGSIZE != 0) return -EINVAL;
+
+  scoped_lock l(ino->data_lock);
+
+  for (int i = 0; i < a.pages.size(); i++) {
+    off_t roff = (off_t)i * PGSIZE;
+    off_t foff = a.off + roff;
+    if (roff + PGSIZE > (off_t)a.len || foff >= ino->size) break;
+
+    auto &p = get_page(ino, foff / PGSIZE);
+    spinlock::lock(p->lock);
+    p->users++;
+    spinlock::unlock(p->lock);
+    a.pages[i] = p;
+  }
+
+  INFO("mmap %d: %d pages at %p\n", ino->ino, a.pages.size(), a.va);
+  return 0;
+}
+
+fs::file_operations tmpfs_file_ops{
+    .read = tmpfs_read,
+    .write = tmpfs_write,
+    .readv = tmpfs_readv,
+    .writev = tmpfs_writev,
+    .mmap = tmpfs_mmap,
+    .resize = tmpfs_resize,
+};
+
+static int tmpfs_create(fs::inode &dir, const char *name,
+                        struct fs::file_ownership &own) {
+  if (dir.get_direntry(name) != NULL) return -EEXIST;
+
+  auto *tfs = (fs::tmpfs *)dir.fs;
+  auto *ino = tfs->create_inode(T_FILE, own);
+  return dir.register_direntry(name, ENT_RES, ino);
+}
+
+static int tmpfs_mkdir(fs::inode &dir, const char *name,
+                       struct fs::file_ownership &own) {
+  if (dir.get_direntry(name) != NULL) return -EEXIST;
+
+  auto *tfs = (fs::tmpfs *)dir.fs;
+  auto *ino = tfs->create_inode(T_DIR, own);
+  ino->set_name(name);
+
+  int err = dir.register_direntry(name, ENT_RES, ino);
+  if (err != 0) {
+    delete ino;
+    return err;
+  }
+  add_dots(ino, &dir);
+  dir.link_count++;
+  return 0;
+}
+
+static int tmpfs_mknod(fs::inode &dir, const char *name,
+                       struct fs::file_ownership &own, int major, int minor) {
+  if (dir.get_direntry(name) != NULL) return -EEXIST;
+
+  auto *tfs = (fs::tmpfs *)dir.fs;
+  auto *ino = tfs->create_inode(T_CHAR, own);
+  ino->major = major;
+  ino->minor = minor;
+  ino->fops = dev::get(major);
+  ino->dops = NULL;
+  return dir.register_direntry(name, ENT_RES, ino);
+}
+
+// called by remove_direntry, which drops the entry (and the inode) after
+static int tmpfs_unlink(fs::inode &dir, const char *name) {
+  auto *ino = dir.get_direntry(name);
+  if (ino == NULL) return -ENOENT;
+
+  if (ino->type == T_DIR) {
+    bool empty = true;
+    ino->walk_direntries([&](const string &n, fs::inode *) -> bool {
+      if (n == "." || n == "..") return true;
+      empty = false;
+      return false;
+    });
+    if (!empty) return -ENOTEMPTY;
+    dir.link_count--;
+  }
+  return 0;
+}
+
+static struct fs::inode *tmpfs_lookup(fs::inode &, const char *) {
+  // every name is in the entry list already
+  return NULL;
+}
+
+fs::dir_operations tmpfs_dir_ops{
+    .create = tmpfs_create,
+    .mkdir = tmpfs_mkdir,
+    .unlink = tmpfs_unlink,
+    .lookup = tmpfs_lookup,
+    .mknod = tmpfs_mknod,
+    .walk = NULL,
+};
+
+static unique_ptr<fs::filesystem> tmpfs_mounter(ref<dev::device>, int) {
+  // there is no backing device
+  return make_unique<fs::tmpfs>();
+}
+
+static void tmpfs_init(void) { vfs::register_filesystem("tmpfs", tmpfs_mounter); }
+
+module_init("fs::tmpfs", tmpfs_init);
@@ -1,5 +1,6 @@
 #include <cpu.h>
 #include <errno.h>
+#include <fs/dcache.h>
 #include <fs/vfs.h>
 #include <map.h>
 #include <syscall.h>
@@ -37,12 +38,16 @@ int vfs::mount_root(unique_ptr<fs::filesystem> fs) {
   return 0;
 }
 
-int vfs::mount(ref<dev::device>, string fs_name, string path) {
+int vfs::mount(ref<dev::device> dev, string fs_name, string path) {
+  if (!filesystems.contains(fs_name)) return -ENOENT;
+
+  auto fs = filesystems[fs_name](dev, 0);
+  if (!fs) return -EINVAL;
+  if (!fs->init()) return -EIO;
+
   // special case for mounting the root
-  if (path == "/") {
-    printk("mounting root!\n");
-  }
-  return -ENOTIMPL;
+  if (path == "/" && vfs_root == NULL) return mount_root(move(fs));
+  return mount(move(fs), move(path));
 }
 
 vfs::vfs() { panic("DO NOT CONSTRUCT A VFS INSTANCE\n"); }
@@ -63,7 +68,30 @@ struct fs::inode *vfs::get_root(void) {
   return vfs_root;
 }
 
-int vfs::mount(unique_ptr<fs::filesystem> fs, string host) { return -1; }
+int vfs::mount(unique_ptr<fs::filesystem> fs, string host) {
+  if (vfs_root == NULL) return -ENOENT;
+
+  auto *root = fs->get_root();
+  if (root == NULL) return -EINVAL;
+
+  // split the path into the directory the mount goes in and the entry in it
+  auto parts = host.split('/');
+  if (parts.size() == 0) return -EBUSY;  // "/" is already mounted
+
+  auto name = parts.last();
+  struct fs::inode *parent = vfs_root;
+  for (int i = 0; i < parts.size() - 1; i++) {
+    parent = parent->get_direntry(parts[i].get());
+    if (parent == NULL) return -ENOENT;
+    if (parent->type != T_DIR) return -ENOTDIR;
+  }
+
+  int err = parent->add_mount(name, root);
+  if (err != 0) return err;
+
+  mounted_filesystems.push(move(fs));
+  return 0;
+}
 
 struct fs::inode *vfs::open(string spath, int opts, int mode) {
   struct fs::inode *ino = NULL;
@@ -137,7 +165,20 @@ int vfs::namei(const char *path, int flags, int mode, struct fs::inode *cwd,
 
     // hexdump(name, strlen(name), true);
 
-    auto found = ino->get_direntry(name);
+    struct fs::inode *found = NULL;
+
+    // the common case is a lockless hit in the dcache. Only on a miss do we
+    // fall back to the directory (and maybe the filesystem)
+    int cached = fs::dcache::lookup(ino, name, found);
+    if (cached == DCACHE_MISS) {
+      if (ino->type != T_DIR) {
+        res = NULL;
+        return -ENOTDIR;
+      }
+      unsigned gen = fs::dcache::generation(ino);
+      found = ino->get_direntry(name);
+      fs::dcache::insert(ino, name, found, gen);
+    }
 
     if (found == NULL) {
 
@@ -149,7 +190,7 @@ int vfs::namei(const char *path, int flags, int mode, struct fs::inode *cwd,
           own.mode = mode;
           int r = ino->dops->create(*ino, name, own);
           if (r == 0) {
-            ino = ino->get_direntry(name);
+            res = ino->get_direntry(name);
           }
           return r;
         }
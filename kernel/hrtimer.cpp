@@ -0,0 +1,238 @@
+#include <arch.h>
+#include <asm.h>
+#include <cpu.h>
+#include <errno.h>
+#include <hrtimer.h>
+#include <lock.h>
+#include <printk.h>
+#include <timer.h>
+#include <vdso.h>
+
+/*
+ * The timers queued on one cpu, as a binary min-heap on `expires`. Only that
+ * cpu arms its hardware timer, but any cpu can take a timer off the heap.
+ * The lock is also taken from the timer interrupt, so it is only ever held
+ * with interrupts off.
+ */
+struct timer_base {
+  spinlock lock;
+  int nr = 0;
+  struct hrtimer *heap[HRTIMER_MAX];
+
+  struct hrtimer tick;
+  bool tick_stopped = false;
+  // what the hardware is armed for, or 0
+  u64 armed = 0;
+};
+
+static struct timer_base s_bases[16];
+
+// TSC -> ns is (cycles * s_mult) >> 32, like the vDSO does it
+static u64 s_boot_tsc = 0;
+static u64 s_tsc_khz = 0;
+static u64 s_mult = 0;
+
+static inline int cpu_index(void) { return &cpu::current() - cpus; }
+
+u64 time::now(void) {
+  u64 cycles = arch::read_timestamp() - s_boot_tsc;
+  return ((unsigned __int128)cycles * s_mult) >> 32;
+}
+
+u64 time::ns_to_tsc(u64 ns) {
+  return (unsigned __int128)ns * s_tsc_khz / NSEC_PER_MSEC;
+}
+
+static inline void heap_set(struct timer_base &b, int i, struct hrtimer *t) {
+  b.heap[i] = t;
+  t->slot = i;
+}
+
+static void sift_up(struct timer_base &b, int i) {
+  auto *t = b.heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (b.heap[parent]->expires <= t->expires) break;
+    heap_set(b, i, b.heap[parent]);
+    i = parent;
+  }
+  heap_set(b, i, t);
+}
+
+static void sift_down(struct timer_base &b, int i) {
+  auto *t = b.heap[i];
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= b.nr) break;
+    if (child + 1 < b.nr && b.heap[child + 1]->expires < b.heap[child]->expires)
+      child++;
+    if (t->expires <= b.heap[child]->expires) break;
+    heap_set(b, i, b.heap[child]);
+    i = child;
+  }
+  heap_set(b, i, t);
+}
+
+static void heap_remove(struct timer_base &b, struct hrtimer *t) {
+  int i = t->slot;
+  auto *last = b.heap[--b.nr];
+  if (i != b.nr) {
+    heap_set(b, i, last);
+    sift_up(b, i);
+    sift_down(b, last->slot);
+  }
+  t->slot = -1;
+  __atomic_store_n(&t->cpu, -1, __ATOMIC_RELEASE);
+}
+
+// arm this cpu's timer for the first timer on its heap. Lock held
+static void program(struct timer_base &b) {
+  u64 next = b.nr > 0 ? b.heap[0]->expires : 0;
+  // 0 means disarmed, so a timer that was due at boot is due now
+  if (b.nr > 0 && next == 0) next = 1;
+  if (next == b.armed) return;
+  b.armed = next;
+  arch::timer_arm(next != 0 ? s_boot_tsc + time::ns_to_tsc(next) : 0);
+}
+
+/*
+ * lock the base `t` is queued on, if it is queued. That can change until we
+ * hold the lock, so look again after
+ */
+static struct timer_base *lock_base(struct hrtimer *t) {
+  while (1) {
+    int c = __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE);
+    if (c < 0) return nullptr;
+    auto &b = s_bases[c];
+    b.lock.lock();
+    if (t->cpu == c) return &b;
+    b.lock.unlock();
+  }
+}
+
+bool hrtimer::cancel(void) {
+  cpu::pushcli();
+  auto *b = lock_base(this);
+  if (b == nullptr) {
+    cpu::popcli();
+    return false;
+  }
+  // the hardware may still go off for it, and find nothing to do
+  heap_remove(*b, this);
+  b->lock.unlock();
+  cpu::popcli();
+  return true;
+}
+
+int hrtimer::start(u64 when) {
+  cpu::pushcli();
+  cancel();
+
+  int c = cpu_index();
+  auto &b = s_bases[c];
+  b.lock.lock();
+  if (b.nr == HRTIMER_MAX) {
+    b.lock.unlock();
+    cpu::popcli();
+    return -ENOSPC;
+  }
+
+  expires = when;
+  cpu = c;
+  b.heap[b.nr] = this;
+  sift_up(b, b.nr++);
+  if (slot == 0) program(b);
+
+  b.lock.unlock();
+  cpu::popcli();
+  return 0;
+}
+
+void time::interrupt(void) {
+  cpu::pushcli();
+  auto &b = s_bases[cpu_index()];
+
+  b.lock.lock();
+  // it went off, so it isn't armed for anything anymore
+  b.armed = 0;
+
+  u64 now = time::now();
+  while (b.nr > 0 && b.heap[0]->expires <= now) {
+    auto *t = b.heap[0];
+    heap_remove(b, t);
+    // the function may well queue timers of its own
+    b.lock.unlock();
+    t->fn(t);
+    b.lock.lock();
+    now = time::now();
+  }
+
+  program(b);
+  b.lock.unlock();
+  cpu::popcli();
+}
+
+// catch this cpu's tick count up with the time
+static void update_ticks(void) {
+  auto &c = cpu::current();
+  c.ticks = time::now() / TICK_NS;
+  // the boot cpu keeps userspace's clock
+  if (&c == &cpus[0]) vdso::tick(arch::read_timestamp());
+}
+
+static void tick_fn(struct hrtimer *t) {
+  update_ticks();
+  time::run_timers(cpu::get_ticks());
+
+  if (!s_bases[cpu_index()].tick_stopped) {
+    t->start((cpu::get_ticks() + 1) * TICK_NS);
+  } else {
+    // idle, so only come back when the wheel needs us
+    u64 next = time::next_timer();
+    if (next != 0) t->start(next * TICK_NS);
+  }
+}
+
+void time::tick_stop(void) {
+  cpu::pushcli();
+  auto &b = s_bases[cpu_index()];
+  b.tick_stopped = true;
+
+  // the timing wheel still needs the tick, but only when it has something due
+  u64 next = time::next_timer();
+  if (next != 0) {
+    b.tick.start(next * TICK_NS);
+  } else {
+    b.lock.lock();
+    if (b.tick.pending()) heap_remove(b, &b.tick);
+    program(b);
+    b.lock.unlock();
+  }
+
+  cpu::popcli();
+}
+
+void time::tick_restart(void) {
+  cpu::pushcli();
+  auto &b = s_bases[cpu_index()];
+  if (b.tick_stopped) {
+    b.tick_stopped = false;
+    update_ticks();
+    b.tick.start((cpu::get_ticks() + 1) * TICK_NS);
+  }
+  cpu::popcli();
+}
+
+void time::init(void) {
+  // the boot cpu's calibration stands for them all
+  if (s_tsc_khz == 0) {
+    s_tsc_khz = cpu::current().speed_khz;
+    if (s_tsc_khz == 0) panic("time: the TSC was never calibrated\n");
+    s_mult = (NSEC_PER_MSEC << 32) / s_tsc_khz;
+    s_boot_tsc = arch::read_timestamp();
+  }
+
+  auto &b = s_bases[cpu_index()];
+  b.tick.fn = tick_fn;
+  b.tick.start(TICK_NS);
+}
@@ -0,0 +1,459 @@
+#include <arch.h>
+#include <cpu.h>
+#include <errno.h>
+#include <ioring.h>
+#include <lock.h>
+#include <mem.h>
+#include <phys.h>
+#include <syscall.h>
+#include <wait.h>
+
+/*
+ * Shared submission/completion rings (see include/ioring.h).
+ *
+ * ioring_enter() only copies submissions out of the SQ into the ring's work
+ * queue, so a batch of them costs one trip into the kernel. Each ring has a
+ * few kernel threads of its own that take work off that queue and run it, so
+ * a ring whose operations block (on an empty pipe, say) only holds up itself.
+ * A worker never touches user memory through user addresses: it pins the
+ * pages of the buffer (see mm::space::pin_page) and goes through a bounce
+ * buffer, so the process can unmap them under it without faulting the kernel.
+ *
+ * Userspace can scribble over the whole shared header, so the kernel keeps
+ * its own copy of everything it indexes with, and only ever writes the
+ * header. The one thing it reads is each side's index (sq_tail, cq_head),
+ * and those are clamped before use.
+ *
+ * The ring keeps its process alive, so its address space and files are there
+ * for as long as any of its work is. The process's files (and with them the
+ * ring's fd) are closed when it exits, which breaks the cycle.
+ */
+
+// #define IORING_DEBUG
+
+#ifdef IORING_DEBUG
+#define INFO(fmt, args...) printk("[IORING] " fmt, ##args)
+#else
+#define INFO(fmt, args...)
+#endif
+
+// how many kernel threads run each ring's submissions
+#define IORING_WORKERS 4
+
+// the most a single read or write moves. Longer ones complete short
+#define IORING_MAX_RW (64 * 1024)
+
+// how long a polling thread spins without work by default
+#define IORING_IDLE_MS 10
+
+#define round_up(x, y) (((x) + (y)-1) & ~((y)-1))
+
+struct ioring : public refcounted<ioring> {
+  process::ptr owner;
+
+  // the shared region, and the kernel's view of it
+  vec<ref<mm::page>> pages;
+  struct ioring_header *hdr = nullptr;
+  struct ioring_sqe *sqes = nullptr;
+  struct ioring_cqe *cqes = nullptr;
+
+  // the kernel's copies of the header, see above
+  u32 sq_entries = 0, sq_mask = 0, sq_head = 0;
+  u32 cq_entries = 0, cq_mask = 0, cq_tail = 0;
+
+  // serializes taking entries off the SQ (ioring_enter vs the poller)
+  spinlock sq_lock;
+  // serializes posting completions, and guards `inflight`
+  spinlock cq_lock;
+  // submissions taken off the SQ that haven't completed yet
+  unsigned inflight = 0;
+
+  // submissions waiting for a worker. Never more than cq_entries of them,
+  // since that bounds `inflight`
+  struct ioring_sqe *work = nullptr;
+  u32 work_head = 0, work_tail = 0;
+  spinlock work_lock;
+  waitqueue work_wq;
+
+  waitqueue cq_wait;
+  // the polling thread sleeps here
+  waitqueue sq_wait;
+
+  bool sqpoll = false;
+  unsigned idle_ms = IORING_IDLE_MS;
+
+  // set once the fd is closed. Submissions still queued complete with
+  // -ECANCELED
+  bool dead = false;
+
+  ~ioring(void);
+
+  int submit(unsigned max);
+  void complete(unsigned long user_data, long res);
+
+  // completions userspace hasn't consumed yet
+  unsigned cq_ready(void);
+  // are there submissions that could be taken right now
+  bool sq_ready(void);
+};
+
+ioring::~ioring(void) {
+  if (work != nullptr) kfree(work);
+
+  // the ring's own hold on its pages, see ioring_setup
+  for (auto &p : pages) {
+    spinlock::lock(p->lock);
+    p->users--;
+    spinlock::unlock(p->lock);
+  }
+}
+
+unsigned ioring::cq_ready(void) {
+  unsigned ready = cq_tail - __atomic_load_n(&hdr->cq_head, __ATOMIC_ACQUIRE);
+  // a cq_head from the future is userspace's mistake, count the CQ as full
+  return min(ready, cq_entries);
+}
+
+bool ioring::sq_ready(void) {
+  if (sq_head == __atomic_load_n(&hdr->sq_tail, __ATOMIC_ACQUIRE))
+    return false;
+  scoped_lock l(cq_lock);
+  return inflight + cq_ready() < cq_entries;
+}
+
+int ioring::submit(unsigned max) {
+  scoped_lock l(sq_lock);
+
+  // a tail more than a whole queue ahead is userspace's mistake
+  u32 tail = __atomic_load_n(&hdr->sq_tail, __ATOMIC_ACQUIRE);
+  if (tail - sq_head > sq_entries) tail = sq_head + sq_entries;
+
+  unsigned n = 0;
+  while (n < max && !dead && sq_head != tail) {
+    // only take what there is room to complete
+    cq_lock.lock();
+    if (inflight + cq_ready() >= cq_entries) {
+      cq_lock.unlock();
+      break;
+    }
+    inflight++;
+    cq_lock.unlock();
+
+    work_lock.lock();
+    // copied now, userspace may reuse the slot as soon as sq_head moves
+    work[work_head++ & cq_mask] = sqes[sq_head & sq_mask];
+    work_lock.unlock();
+
+    sq_head++;
+    __atomic_store_n(&hdr->sq_head, sq_head, __ATOMIC_RELEASE);
+    work_wq.notify();
+    n++;
+  }
+
+  return n;
+}
+
+void ioring::complete(unsigned long user_data, long res) {
+  {
+    scoped_lock l(cq_lock);
+    auto &cqe = cqes[cq_tail & cq_mask];
+    cqe.user_data = user_data;
+    cqe.res = res;
+    cq_tail++;
+    __atomic_store_n(&hdr->cq_tail, cq_tail, __ATOMIC_RELEASE);
+    inflight--;
+  }
+  cq_wait.notify();
+}
+
+/*
+ * copy between a kernel buffer and user memory at `addr` in `vm`, a page at
+ * a time through the pinned page. Returns 0, or -EFAULT if any of it isn't
+ * mapped with the access needed
+ */
+static int copy_user(mm::space &vm, unsigned long addr, char *kbuf, size_t len,
+                     bool to_user) {
+  while (len > 0) {
+    ref<mm::page> pg;
+    if (vm.pin_page(addr & ~(PGSIZE - 1), to_user, pg) != 0) return -EFAULT;
+
+    size_t off = addr & (PGSIZE - 1);
+    size_t n = min(PGSIZE - off, len);
+    auto *ubuf = (char *)p2v(pg->pa) + off;
+    if (to_user)
+      memcpy(ubuf, kbuf, n);
+    else
+      memcpy(kbuf, ubuf, n);
+
+    addr += n;
+    kbuf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static long run_rw(struct ioring *ring, struct ioring_sqe &sqe, bool write) {
+  auto *proc = ring->owner.get();
+  ref<fs::file> file = proc->get_fd(sqe.fd);
+  if (!file) return -EBADF;
+
+  size_t len = min(sqe.len, IORING_MAX_RW);
+  if (sqe.addr + len < sqe.addr) return -EFAULT;
+
+  // a read goes to userspace, so make sure there is somewhere to put it
+  // before taking anything out of the file
+  for (size_t off = 0; !write && off < len; off += PGSIZE) {
+    ref<mm::page> pg;
+    if (proc->mm->pin_page((sqe.addr + off) & ~(PGSIZE - 1), true, pg) != 0)
+      return -EFAULT;
+  }
+
+  auto *buf = (char *)kmalloc(len != 0 ? len : 1);
+  if (buf == nullptr) return -ENOMEM;
+
+  long res = 0;
+  if (write && copy_user(*proc->mm, sqe.addr, buf, len, false) != 0)
+    res = -EFAULT;
+
+  if (res == 0) {
+    if (sqe.off == -1)
+      res = write ? file->write(buf, len) : file->read(buf, len);
+    else
+      res = write ? file->pwrite(buf, len, sqe.off)
+                  : file->pread(buf, len, sqe.off);
+  }
+
+  // unmapped since it was checked. What was read is gone either way
+  if (!write && res > 0 && copy_user(*proc->mm, sqe.addr, buf, res, true) != 0)
+    res = -EFAULT;
+
+  kfree(buf);
+  return res;
+}
+
+static long run(struct ioring *ring, struct ioring_sqe &sqe) {
+  if (ring->dead) return -ECANCELED;
+
+  switch (sqe.opcode) {
+    case IORING_OP_NOP:
+      return 0;
+    case IORING_OP_READ:
+      return run_rw(ring, sqe, false);
+    case IORING_OP_WRITE:
+      return run_rw(ring, sqe, true);
+  }
+  return -EINVAL;
+}
+
+static int ioring_worker(void *arg) {
+  auto *ring = (struct ioring *)arg;  // holds a reference
+
+  while (1) {
+    ring->work_lock.lock();
+    if (ring->work_head == ring->work_tail) {
+      ring->work_lock.unlock();
+      // ioring_destroy leaves a notification for each of us to see this
+      if (ring->dead) break;
+      ring->work_wq.wait_noint();
+      continue;
+    }
+    auto sqe = ring->work[ring->work_tail++ & ring->cq_mask];
+    ring->work_lock.unlock();
+
+    INFO("op %d on fd %d\n", sqe.opcode, sqe.fd);
+    long res = run(ring, sqe);
+    ring->complete(sqe.user_data, res);
+  }
+
+  ring->ref_release();
+  return 0;
+}
+
+/*
+ * IORING_SETUP_SQPOLL: watch the SQ so userspace can submit without entering
+ * the kernel at all. After idle_ms without anything to do it sleeps, and
+ * userspace has to wake it with IORING_ENTER_SQ_WAKEUP
+ */
+static int ioring_poller(void *arg) {
+  auto *ring = (struct ioring *)arg;  // holds a reference
+
+  u64 khz = cpus[0].speed_khz;
+  u64 idle = ring->idle_ms * (khz != 0 ? khz : 1000000);
+  u64 last_work = arch::read_timestamp();
+
+  while (!ring->dead) {
+    if (ring->submit(~0U) > 0) {
+      last_work = arch::read_timestamp();
+      continue;
+    }
+
+    if (arch::read_timestamp() - last_work < idle) {
+      sched::yield();
+      continue;
+    }
+
+    __atomic_or_fetch(&ring->hdr->flags, IORING_SQ_NEED_WAKEUP,
+                      __ATOMIC_SEQ_CST);
+    // anything submitted before the flag was visible wouldn't wake us
+    if (!ring->sq_ready()) ring->sq_wait.wait_noint();
+    __atomic_and_fetch(&ring->hdr->flags, ~IORING_SQ_NEED_WAKEUP,
+                       __ATOMIC_SEQ_CST);
+    last_work = arch::read_timestamp();
+  }
+
+  ring->ref_release();
+  return 0;
+}
+
+static void ioring_destroy(fs::inode &ino) {
+  auto *ring = ino.priv<struct ioring>();
+  ring->dead = true;
+  ring->sq_wait.notify();
+  for (int i = 0; i < IORING_WORKERS; i++) ring->work_wq.notify();
+  ring->ref_release();
+}
+
+static fs::file_operations ioring_fops{
+    .destroy = ioring_destroy,
+};
+
+// map the ring's pages into the calling process
+static off_t map_ring(struct ioring *ring, size_t size) {
+  auto *vm = curproc->mm;
+  off_t addr = vm->mmap("[ioring]", 0, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANON, nullptr, 0);
+  auto *r = vm->lookup(addr);
+  if (r == nullptr) return -ENOMEM;
+
+  for (int i = 0; i < ring->pages.size(); i++) {
+    auto &p = ring->pages[i];
+    spinlock::lock(p->lock);
+    p->users++;
+    spinlock::unlock(p->lock);
+    r->pages[i] = p;
+  }
+  return addr;
+}
+
+int sys::ioring_setup(unsigned entries, struct ioring_params *params) {
+  if (!curproc->mm->validate_pointer(params, sizeof(*params), VALIDATE_WRITE))
+    return -EFAULT;
+
+  struct ioring_params p = *params;
+  if (entries == 0 || entries > IORING_MAX_ENTRIES) return -EINVAL;
+  if (p.flags & ~IORING_SETUP_SQPOLL) return -EINVAL;
+
+  unsigned sq_entries = 1;
+  while (sq_entries < entries) sq_entries <<= 1;
+  unsigned cq_entries = sq_entries * 2;
+
+  size_t sq_off = sizeof(struct ioring_header);
+  size_t cq_off =
+      round_up(sq_off + sq_entries * sizeof(struct ioring_sqe), 16);
+  size_t size = round_up(cq_off + cq_entries * sizeof(struct ioring_cqe), PGSIZE);
+  int npages = size / PGSIZE;
+
+  // contiguous, so the kernel can use the region through p2v
+  auto pa = (u64)phys::alloc(npages);
+  if (pa == 0) return -ENOMEM;
+  memset(p2v(pa), 0, size);
+
+  auto ring = make_ref<struct ioring>();
+  ring->owner = curproc;
+  ring->sq_entries = sq_entries;
+  ring->sq_mask = sq_entries - 1;
+  ring->cq_entries = cq_entries;
+  ring->cq_mask = cq_entries - 1;
+  ring->work = (struct ioring_sqe *)kmalloc(cq_entries * sizeof(struct ioring_sqe));
+  if (ring->work == nullptr) {
+    phys::free((void *)pa, npages);
+    return -ENOMEM;
+  }
+  for (int i = 0; i < npages; i++) {
+    auto pg = make_ref<mm::page>();
+    pg->pa = pa + i * PGSIZE;
+    pg->owns_page = 1;
+    // the ring's own hold, so the pages are always shared
+    pg->users = 1;
+    ring->pages.push(pg);
+  }
+
+  auto *base = (char *)p2v(pa);
+  ring->hdr = (struct ioring_header *)base;
+  ring->sqes = (struct ioring_sqe *)(base + sq_off);
+  ring->cqes = (struct ioring_cqe *)(base + cq_off);
+  // published for userspace, never read back
+  ring->hdr->sq_entries = sq_entries;
+  ring->hdr->sq_mask = ring->sq_mask;
+  ring->hdr->cq_entries = cq_entries;
+  ring->hdr->cq_mask = ring->cq_mask;
+
+  off_t addr = map_ring(ring.get(), size);
+  if (addr < 0) return addr;
+
+  auto *ino = new fs::inode(T_FILE);
+  ino->fops = &ioring_fops;
+  ino->dops = NULL;
+  // dropped by ioring_destroy
+  ino->priv<struct ioring>() = ring.get();
+  ring->ref_retain();
+  // ours until the fd holds it. If it never does, this frees it (and with it
+  // the ring's reference)
+  fs::inode::acquire(ino);
+
+  ref<fs::file> file = fs::file::create(ino, "[ioring]", FDIR_READ | FDIR_WRITE);
+  int fd = file ? curproc->add_fd(move(file)) : -ENOMEM;
+  fs::inode::release(ino);
+  if (fd < 0) {
+    curproc->mm->unmap(addr, size);
+    return fd;
+  }
+
+  for (int i = 0; i < IORING_WORKERS; i++) {
+    ring->ref_retain();
+    sched::proc::create_kthread("[ioring]", ioring_worker, ring.get());
+  }
+
+  if (p.flags & IORING_SETUP_SQPOLL) {
+    ring->sqpoll = true;
+    if (p.sq_idle_ms != 0) ring->idle_ms = p.sq_idle_ms;
+    ring->ref_retain();
+    sched::proc::create_kthread("[ioring-sq]", ioring_poller, ring.get());
+  }
+
+  p.sq_entries = sq_entries;
+  p.cq_entries = cq_entries;
+  p.addr = addr;
+  p.size = size;
+  p.sq_off = sq_off;
+  p.cq_off = cq_off;
+  *params = p;
+
+  INFO("pid %d: ring %d at %p, %u entries\n", curproc->pid, fd, addr,
+       sq_entries);
+  return fd;
+}
+
+int sys::ioring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                      unsigned flags) {
+  ref<fs::file> file = curproc->get_fd(fd);
+  if (!file) return -EBADF;
+  if (file->ino->fops != &ioring_fops) return -EINVAL;
+  auto *ring = file->ino->priv<struct ioring>();
+
+  int submitted = 0;
+  if (ring->sqpoll) {
+    if (flags & IORING_ENTER_SQ_WAKEUP) ring->sq_wait.notify();
+  } else if (to_submit > 0) {
+    submitted = ring->submit(to_submit);
+  }
+
+  if (flags & IORING_ENTER_GETEVENTS) {
+    min_complete = min(min_complete, ring->cq_entries);
+    while (ring->cq_ready() < min_complete) {
+      if (ring->cq_wait.wait() != 0) return submitted > 0 ? submitted : -EINTR;
+    }
+  }
+
+  return submitted;
+}
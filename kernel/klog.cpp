@@ -0,0 +1,294 @@
+#include <arch.h>
+#include <console.h>
+#include <cpu.h>
+#include <dev/driver.h>
+#include <errno.h>
+#include <klog.h>
+#include <module.h>
+#include <printk.h>
+#include <sched.h>
+#include <wait.h>
+
+#include "../drivers/majors.h"
+
+/*
+ * The kernel log ring (see include/klog.h).
+ *
+ * Slot i holds record seq where seq % LOG_SLOTS == i. Its `state` is 2*seq+1
+ * while the record is being written and 2*seq+2 once it is done, so a reader
+ * knows both whether the record is finished and whether it is still the one
+ * it asked for. Readers copy the record out and check the state again after,
+ * like a seqlock.
+ */
+
+struct log_slot {
+  u64 state;
+  struct klog::record rec;
+};
+
+static struct log_slot s_slots[LOG_SLOTS];
+static u64 s_next_seq = 0;
+
+// a line being built by printk on one CPU
+struct log_stage {
+  int level;  // of the message being printed
+  int line_level;  // of the line in buf
+  int len;
+  char buf[LOG_LINE];
+};
+
+static struct log_stage s_stage[16];
+
+// the console side. Whoever sets s_draining owns s_drain_seq
+static int s_draining = 0;
+static u64 s_drain_seq = 0;
+// records at a level past this stay out of the console (but not /dev/kmsg)
+static int s_console_level = LOG_INFO;
+
+static bool s_daemon = false;
+static int s_pending = 0;
+// set when a line came in where klogd couldn't be woken. The next tick does it
+static int s_deferred = 0;
+static waitqueue s_klogd_wait;
+
+static inline int cpu_index(void) {
+  // before seginit there is no current cpu, but there is only the boot cpu
+  if (cpunum == 0) return 0;
+  return &cpu::current() - cpus;
+}
+
+static inline struct log_stage &stage(void) { return s_stage[cpu_index()]; }
+
+static void commit(int level, const char *text, int len) {
+  u64 seq = __atomic_fetch_add(&s_next_seq, 1, __ATOMIC_ACQ_REL);
+  auto &slot = s_slots[seq & (LOG_SLOTS - 1)];
+
+  __atomic_store_n(&slot.state, 2 * seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  auto &r = slot.rec;
+  r.seq = seq;
+  r.tsc = arch::read_timestamp();
+  r.level = level;
+  r.cpu = cpu_index();
+  r.len = len;
+  memcpy(r.text, text, len);
+
+  __atomic_store_n(&slot.state, 2 * seq + 2, __ATOMIC_RELEASE);
+}
+
+u64 klog::next_seq(void) {
+  return __atomic_load_n(&s_next_seq, __ATOMIC_ACQUIRE);
+}
+
+u64 klog::first_seq(void) {
+  u64 next = klog::next_seq();
+  return next > LOG_SLOTS ? next - LOG_SLOTS : 0;
+}
+
+int klog::read(u64 seq, struct klog::record &out) {
+  u64 next = klog::next_seq();
+  if (seq >= next) return -EAGAIN;
+  if (next - seq > LOG_SLOTS) return -ENOENT;
+
+  auto &slot = s_slots[seq & (LOG_SLOTS - 1)];
+  u64 want = 2 * seq + 2;
+
+  u64 state = __atomic_load_n(&slot.state, __ATOMIC_ACQUIRE);
+  // claimed, but the writer isn't done with it
+  if (state < want) return -EAGAIN;
+  if (state > want) return -ENOENT;
+
+  out = slot.rec;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&slot.state, __ATOMIC_RELAXED) != want) return -ENOENT;
+  return 0;
+}
+
+static void console_puts(const char *s) {
+  for (; *s; s++) console::putc(*s);
+}
+
+/*
+ * write finished records out to the console. Unless forced, only one caller
+ * does this at a time and the others just leave. On the way out, anything
+ * that was committed while we held s_draining is picked up, as its producer
+ * will have found us busy
+ */
+static void drain(bool force) {
+  struct klog::record rec;
+
+  while (1) {
+    if (__atomic_exchange_n(&s_draining, 1, __ATOMIC_ACQUIRE) && !force) return;
+
+    u64 lost = 0;
+    while (1) {
+      u64 seq = s_drain_seq;
+      int err = klog::read(seq, rec);
+      if (err == -EAGAIN) break;
+      if (err == -ENOENT) {
+        u64 first = klog::first_seq();
+        u64 to = first > seq ? first : seq + 1;
+        lost += to - seq;
+        s_drain_seq = to;
+        continue;
+      }
+
+      if (lost != 0) {
+        char buf[48];
+        snprintk(buf, sizeof(buf), "klog: %llu messages lost\n", lost);
+        console_puts(buf);
+        lost = 0;
+      }
+
+      if (rec.level <= s_console_level) {
+        for (int i = 0; i < rec.len; i++) console::putc(rec.text[i]);
+      }
+      s_drain_seq = seq + 1;
+    }
+
+    __atomic_store_n(&s_draining, 0, __ATOMIC_RELEASE);
+    if (force || klog::read(s_drain_seq, rec) == -EAGAIN) return;
+  }
+}
+
+// let the console know there is something new
+static void kick(bool can_wake) {
+  if (!s_daemon) {
+    drain(false);
+    return;
+  }
+  // klogd clears s_pending before it drains, so if it is already set the
+  // wakeup is on its way. When the printer had interrupts off it may be
+  // inside the scheduler, so the wakeup is left to the next tick
+  if (!can_wake) {
+    __atomic_store_n(&s_deferred, 1, __ATOMIC_RELEASE);
+    return;
+  }
+  if (__atomic_exchange_n(&s_pending, 1, __ATOMIC_ACQ_REL) == 0)
+    s_klogd_wait.notify();
+}
+
+void klog::tick(void) {
+  // the scheduler holds its locks with interrupts off, so the tick never
+  // lands inside it
+  if (__atomic_exchange_n(&s_deferred, 0, __ATOMIC_ACQ_REL) != 0) kick(true);
+}
+
+unsigned long klog::begin(int level) {
+  unsigned long flags = readeflags();
+  arch::cli();
+  stage().level = level;
+  return flags;
+}
+
+void klog::putc(char c) {
+  auto &st = stage();
+  if (st.len == 0) st.line_level = st.level;
+  st.buf[st.len++] = c;
+  if (c == '\n' || st.len == LOG_LINE) {
+    commit(st.line_level, st.buf, st.len);
+    st.len = 0;
+  }
+}
+
+void klog::end(unsigned long flags) {
+  bool irqs = (flags & FL_IF) != 0;
+  if (irqs) arch::sti();
+  kick(irqs);
+}
+
+void klog::write(int level, const char *buf, size_t len) {
+  while (len > 0) {
+    size_t n = 0;
+    while (n < len && n < LOG_LINE) {
+      if (buf[n++] == '\n') break;
+    }
+    commit(level, buf, n);
+    buf += n;
+    len -= n;
+  }
+  kick((readeflags() & FL_IF) != 0);
+}
+
+void klog::flush(void) {
+  auto &st = stage();
+  if (st.len != 0) {
+    commit(st.line_level, st.buf, st.len);
+    st.len = 0;
+  }
+  drain(true);
+  console::sync();
+}
+
+static int klogd(void *) {
+  while (1) {
+    s_klogd_wait.wait_noint();
+    __atomic_store_n(&s_pending, 0, __ATOMIC_RELEASE);
+    drain(false);
+  }
+  return 0;
+}
+
+/*
+ * /dev/kmsg. The file offset is the sequence number of the next record to
+ * read, and each read returns one record as "level,seq,usecs,-;text\n". A
+ * reader that falls behind the ring skips ahead to the oldest record left
+ */
+static ssize_t kmsg_read(fs::file &fd, char *buf, size_t sz) {
+  struct klog::record rec;
+  u64 seq = fd.m_offset;
+
+  while (1) {
+    if (seq < klog::first_seq()) seq = klog::first_seq();
+    int err = klog::read(seq, rec);
+    if (err == -EAGAIN) return 0;
+    if (err == 0) break;
+    seq++;
+  }
+
+  u64 khz = cpus[0].speed_khz;
+  u64 usecs = khz ? (u64)((unsigned __int128)rec.tsc * 1000 / khz) : 0;
+
+  char line[LOG_LINE + 64];
+  int n = snprintk(line, sizeof(line), "%d,%llu,%llu,-;", rec.level, rec.seq,
+                   usecs);
+  int len = rec.len;
+  if (len > 0 && rec.text[len - 1] == '\n') len--;
+  memcpy(line + n, rec.text, len);
+  n += len;
+  line[n++] = '\n';
+
+  if ((size_t)n > sz) return -EINVAL;
+  memcpy(buf, line, n);
+  fd.m_offset = seq + 1;
+  return n;
+}
+
+// a write is logged as is, at the level given by a leading "<N>" if any
+static ssize_t kmsg_write(fs::file &fd, const char *buf, size_t sz) {
+  size_t n = sz;
+  int level = LOG_DEFAULT;
+  if (n >= 3 && buf[0] == '<' && buf[1] >= '0' && buf[1] <= '7' &&
+      buf[2] == '>') {
+    level = buf[1] - '0';
+    buf += 3;
+    n -= 3;
+  }
+  klog::write(level, buf, n);
+  return sz;
+}
+
+static struct fs::file_operations kmsg_ops = {
+    .read = kmsg_read,
+    .write = kmsg_write,
+};
+
+static void klog_init(void) {
+  dev::register_driver("kmsg", CHAR_DRIVER, MAJOR_KMSG, &kmsg_ops);
+  dev::register_name("kmsg", MAJOR_KMSG, 0);
+
+  sched::proc::create_kthread("[klogd]", klogd);
+  s_daemon = true;
+}
+module_init("klog", klog_init);
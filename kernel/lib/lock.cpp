@@ -1,8 +1,15 @@
+#include <arch.h>
 #include <cpu.h>
+#include <dev/driver.h>
+#include <errno.h>
 #include <lock.h>
+#include <mem.h>
+#include <module.h>
 #include <printk.h>
 #include <sched.h>
 
+#include "../../drivers/majors.h"
+
 // #define LOCK_DEBUG
 
 #ifdef LOCK_DEBUG
@@ -20,24 +27,87 @@ static inline void arch_atomic_store(volatile int* p, int x) {
   asm("movl %1, %0" : "=m"(*p) : "r"(x) : "memory");
 }
 
+// how many locks can keep statistics
+#define LOCK_STATS_MAX 64
+
+struct lock_stats {
+  const char *name;
+  spinlock *lock;
+  u64 acquisitions;
+  // acquisitions that had to wait, and how many times they looked
+  u64 contended;
+  u64 spins;
+  // in TSC cycles
+  u64 max_hold;
+  u64 acquired_at;
+};
+
+static struct lock_stats s_stats[LOCK_STATS_MAX];
+static int s_nstats = 0;
+
+// the lock is held, so nobody else is in here for it
+void spinlock::account(u64 spins) {
+  if (m_stats == nullptr) {
+    int i = __atomic_fetch_add(&s_nstats, 1, __ATOMIC_RELAXED);
+    if (i >= LOCK_STATS_MAX) {
+      // out of room, so stop trying
+      m_name = nullptr;
+      return;
+    }
+    s_stats[i].name = m_name;
+    s_stats[i].lock = this;
+    m_stats = &s_stats[i];
+  }
+
+  m_stats->acquisitions++;
+  if (spins != 0) {
+    m_stats->contended++;
+    m_stats->spins += spins;
+  }
+  m_stats->acquired_at = arch::read_timestamp();
+}
+
 void spinlock::lock(void) {
+  u32 ticket = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+  u64 spins = 0;
+
   while (1) {
-    // cpu::pushcli();
-    if (arch_atomic_swap(&locked, 1) == 0) {
-      break;
-    }
-    // cpu::popcli();
-    asm("pause");
+    u32 owner = __atomic_load_n(&m_owner, __ATOMIC_ACQUIRE);
+    if (owner == ticket) break;
+    // back off in proportion to our place in line, rather than have every
+    // waiter hammer the cache line
+    for (u32 i = ticket - owner; i > 0; i--) asm("pause");
+    spins++;
   }
+
+  if (unlikely(m_name != nullptr)) account(spins);
 }
 
 void spinlock::unlock(void) {
-  if (likely(locked)) {
-    arch_atomic_store(&locked, 0);
+  if (likely(is_locked())) {
+    if (unlikely(m_stats != nullptr) && m_stats->acquired_at != 0) {
+      u64 held = arch::read_timestamp() - m_stats->acquired_at;
+      if (held > m_stats->max_hold) m_stats->max_hold = held;
+    }
+    // only the holder writes m_owner
+    __atomic_store_n(&m_owner, m_owner + 1, __ATOMIC_RELEASE);
   }
 }
 
-bool spinlock::is_locked(void) { return locked; }
+void spinlock::lock_irqsave(void) {
+  cpu::pushcli();
+  lock();
+}
+
+void spinlock::unlock_irqrestore(void) {
+  unlock();
+  cpu::popcli();
+}
+
+bool spinlock::is_locked(void) {
+  return __atomic_load_n(&m_next, __ATOMIC_RELAXED) !=
+         __atomic_load_n(&m_owner, __ATOMIC_RELAXED);
+}
 
 static void spin_wait(volatile int* lock) { asm("pause"); }
 void spinlock::lock(volatile int& l) {
@@ -54,33 +124,46 @@ void spinlock::unlock(volatile int& l) {
   }
 }
 
-int rwlock::read_lock(void) {
-  m_lock.lock();
-  m_readers++;
-  m_lock.unlock();
-  return 0;
-}
-int rwlock::read_unlock(void) {
-  m_lock.lock();
-  m_readers--;
-  m_lock.unlock();
-  return 0;
-}
+/*
+ * /dev/lockstat: a line per lock that keeps statistics, read as one text
+ * file. Hold times are in TSC cycles
+ */
+static ssize_t lockstat_read(fs::file &fd, char *buf, size_t sz) {
+  int n = __atomic_load_n(&s_nstats, __ATOMIC_RELAXED);
+  if (n > LOCK_STATS_MAX) n = LOCK_STATS_MAX;
 
-int rwlock::write_lock(void) {
-  while (1) {
-    m_lock.lock();
+  size_t cap = 128 * (n + 1);
+  auto *text = (char *)kmalloc(cap);
+  if (text == nullptr) return -ENOMEM;
 
-    if (likely(m_readers == 0)) {
-      break;
-    } else {
-      m_lock.unlock();
-      /* TODO: we should yield if we're not spread across cores */
-    }
+  size_t len = snprintk(text, cap, "%-16s %16s %12s %12s %16s %14s\n", "name",
+                        "lock", "acquisitions", "contended", "spins",
+                        "max_hold");
+  for (int i = 0; i < n; i++) {
+    auto &st = s_stats[i];
+    len += snprintk(text + len, cap - len,
+                    "%-16s %16p %12llu %12llu %16llu %14llu\n", st.name,
+                    st.lock, st.acquisitions, st.contended, st.spins,
+                    st.max_hold);
+  }
+
+  ssize_t off = fd.m_offset;
+  ssize_t count = 0;
+  if (off < (ssize_t)len) {
+    count = min(sz, len - off);
+    memcpy(buf, text + off, count);
+    fd.m_offset += count;
   }
-  return 0;
+  kfree(text);
+  return count;
 }
-int rwlock::write_unlock(void) {
-  m_lock.unlock();
-  return 0;
+
+static struct fs::file_operations lockstat_ops = {
+    .read = lockstat_read,
+};
+
+static void lockstat_init(void) {
+  dev::register_driver("lockstat", CHAR_DRIVER, MAJOR_LOCKSTAT, &lockstat_ops);
+  dev::register_name("lockstat", MAJOR_LOCKSTAT, 0);
 }
+module_init("lockstat", lockstat_init);
@@ -0,0 +1,96 @@
+#include <cpu.h>
+#include <mutex.h>
+#include <sched.h>
+
+static inline int cpu_index(void) { return &cpu::current() - cpus; }
+
+static inline bool can_sleep(void) {
+  return cpu::in_thread() && sched::enabled();
+}
+
+bool mutex::try_lock(void) {
+  // look before writing, so waiters don't bounce the line around
+  if (__atomic_load_n(&m_locked, __ATOMIC_RELAXED) != 0) return false;
+  return __atomic_exchange_n(&m_locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+bool mutex::is_locked(void) {
+  return __atomic_load_n(&m_locked, __ATOMIC_RELAXED) != 0;
+}
+
+void mutex::lock(void) {
+  for (int i = 0; i < MUTEX_SPINS; i++) {
+    if (try_lock()) return;
+    asm("pause");
+  }
+
+  if (!can_sleep()) {
+    while (!try_lock()) asm("pause");
+    return;
+  }
+
+  /*
+   * unlock() clears the lock before it looks for waiters, and we count
+   * ourselves before we look at the lock, so one of us sees the other. If
+   * the notify comes before we sleep, the waitqueue keeps it for us
+   */
+  __atomic_fetch_add(&m_waiters, 1, __ATOMIC_SEQ_CST);
+  while (!try_lock()) m_wq.wait_noint();
+  __atomic_fetch_sub(&m_waiters, 1, __ATOMIC_RELAXED);
+}
+
+void mutex::unlock(void) {
+  __atomic_store_n(&m_locked, 0, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&m_waiters, __ATOMIC_SEQ_CST) > 0) m_wq.notify();
+}
+
+int rwlock::readers(void) {
+  int n = 0;
+  for (auto &r : m_readers) n += __atomic_load_n(&r.count, __ATOMIC_SEQ_CST);
+  return n;
+}
+
+int rwlock::read_lock(void) {
+  while (1) {
+    if (__atomic_load_n(&m_writer, __ATOMIC_ACQUIRE)) {
+      // the writer holds m_wlock until it is done
+      m_wlock.lock();
+      m_wlock.unlock();
+      continue;
+    }
+
+    __atomic_fetch_add(&m_readers[cpu_index()].count, 1, __ATOMIC_SEQ_CST);
+    // a writer announces itself before counting readers, so if there isn't one
+    // now, any that comes along will see us
+    if (!__atomic_load_n(&m_writer, __ATOMIC_SEQ_CST)) return 0;
+
+    // one got in first. Get out of its way
+    read_unlock();
+  }
+}
+
+int rwlock::read_unlock(void) {
+  __atomic_fetch_sub(&m_readers[cpu_index()].count, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&m_writer, __ATOMIC_SEQ_CST)) m_drained.notify();
+  return 0;
+}
+
+int rwlock::write_lock(void) {
+  m_wlock.lock();
+  __atomic_store_n(&m_writer, 1, __ATOMIC_SEQ_CST);
+
+  // wait for the readers that were already inside
+  for (int i = 0; readers() != 0; i++) {
+    if (i < MUTEX_SPINS || !can_sleep())
+      asm("pause");
+    else
+      m_drained.wait_noint();
+  }
+  return 0;
+}
+
+int rwlock::write_unlock(void) {
+  __atomic_store_n(&m_writer, 0, __ATOMIC_RELEASE);
+  m_wlock.unlock();
+  return 0;
+}
@@ -89,12 +89,8 @@
 
 #define IO_PORT_PUTCHAR 0xfad
 
-void putchar(char c) {
-
-  console::putc(c);
-  // vga::putchar(c);
-  // serial_send(SERIAL_PORT_A, c);
-}
+// the console sees it once the log is drained (see kernel/klog.cpp)
+void putchar(char c) { klog::putc(c); }
 int puts(char *s) {
   int i;
   for (i = 0; s[i] != '\0'; i++) outb(IO_PORT_PUTCHAR, s[i]);
@@ -909,8 +905,7 @@ static int _vsnprintf(out_fct_type out, char *buffer, const size_t maxlen,
 int printk(const char *format, ...) {
   va_list va;
   va_start(va, format);
-  char buffer[1];
-  const int ret = _vsnprintf(_out_char, buffer, (size_t)-1, format, va);
+  const int ret = vprintk(format, va);
   va_end(va);
   return ret;
 }
@@ -933,7 +928,16 @@ int snprintk(char *buffer, size_t count, const char *format, ...) {
 
 int vprintk(const char *format, va_list va) {
   char buffer[1];
-  return _vsnprintf(_out_char, buffer, (size_t)-1, format, va);
+  int level = LOG_DEFAULT;
+  if (format[0] == KERN_SOH[0] && format[1] >= '0' && format[1] <= '7') {
+    level = format[1] - '0';
+    format += 2;
+  }
+
+  unsigned long flags = klog::begin(level);
+  const int ret = _vsnprintf(_out_char, buffer, (size_t)-1, format, va);
+  klog::end(flags);
+  return ret;
 }
 
 int vsnprintf_(char *buffer, size_t count, const char *format, va_list va) {
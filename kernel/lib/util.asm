@@ -65,6 +65,14 @@ wrmsr:
   wrmsr
   ret
 
+global rdmsr
+rdmsr:
+	mov rcx, rdi ; msrnum <- arg0
+	rdmsr
+	shl rdx, 32
+	or rax, rdx
+	ret
+
 global get_sp
 get_sp:
 	mov rax, rsp
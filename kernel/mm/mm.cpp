@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <mm.h>
 #include <phys.h>
 #include <util.h>
@@ -125,14 +126,48 @@ int mm::space::pagefault(off_t va, int err) {
       }
     }
 
+    // a page someone else still uses (like a file's own page) is only mapped
+    // writable in a private region once the write fault has copied it
+    if (!(r->flags & MAP_SHARED) && r->pages[ind]->users > 1)
+      pte.prot &= ~PROT_WRITE;
+
     pte.ppn = r->pages[ind]->pa >> 12;
     auto va = (r->va + (ind << 12));
-    pt->add_mapping(va, pte);
+    // a COW copy replaces a mapping other threads may have cached
+    mm::tlb_batch tlb;
+    pt->add_mapping(va, pte, tlb);
+    pt->flush(tlb);
   }
 
   return 0;
 }
 
+int mm::space::pin_page(off_t va, bool write, ref<mm::page> &out) {
+  // once to find it missing (or shared), and again after faulting it in
+  for (int tries = 0; tries < 2; tries++) {
+    {
+      scoped_lock l(this->lock);
+      auto r = lookup(va);
+      if (r == nullptr) return -EFAULT;
+      if (!(r->prot & (write ? PROT_WRITE : PROT_READ))) return -EFAULT;
+
+      scoped_lock region_lock(r->lock);
+      auto &pg = r->pages[(va >> 12) - (r->va >> 12)];
+      // a private page that is still shared gets copied on the owner's first
+      // write, which would leave us writing to the old one
+      bool cow = write && !(r->flags & MAP_SHARED) && pg && pg->users > 1;
+      if (pg && !cow) {
+        out = pg;
+        return 0;
+      }
+    }
+
+    // the same as if the process had touched it
+    if (pagefault(va, write ? FAULT_WRITE : FAULT_READ) != 0) return -EFAULT;
+  }
+  return -EFAULT;
+}
+
 size_t mm::space::memory_usage(void) {
   scoped_lock l(lock);
 
@@ -180,6 +215,9 @@ mm::space *mm::space::fork(void) {
   printk("\n");
 #define DO_COW
 
+  // the parent's writable mappings all become read only
+  mm::tlb_batch tlb;
+
   for (auto &r : regions) {
     auto copy = new mm::area;
     copy->name = r->name;
@@ -216,12 +254,13 @@ mm::space *mm::space::fork(void) {
         pte.ppn = r->pages[i]->pa >> 12;
         // for copy on write
         pte.prot = r->prot & ~PROT_WRITE;
-        pt->add_mapping(r->va + (i * 4096), pte);
+        pt->add_mapping(r->va + (i * 4096), pte, tlb);
       }
     }
 #endif
     n->regions.push(copy);
   }
+  pt->flush(tlb);
 
   n->sort_regions();
 
@@ -265,6 +304,13 @@ off_t mm::space::mmap(string name, off_t addr, size_t size, int prot, int flags,
   r->fd = fd;
   for (int i = 0; i < pages; i++) r->pages.push(nullptr);
 
+  // let the filesystem hand over its pages. If it can't, the fault handler
+  // reads the file in a page at a time instead
+  if (fd && fd->ino != NULL && fd->ino->fops != NULL &&
+      fd->ino->fops->mmap != NULL) {
+    fd->ino->fops->mmap(*fd, *r);
+  }
+
   regions.push(r);
 
   sort_regions();
@@ -288,9 +334,12 @@ int mm::space::unmap(off_t ptr, size_t len) {
       regions.remove(i);
       sort_regions();
 
+      mm::tlb_batch tlb;
       for (off_t v = va; v < va + len; v += 4096) {
-        pt->del_mapping(va);
+        pt->del_mapping(v, tlb);
       }
+      // nobody may touch the pages once the region lets go of them
+      pt->flush(tlb);
 
       delete region;
       return 0;
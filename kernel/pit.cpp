@@ -36,6 +36,28 @@ void set_pit_freq(u16 per_sec) {
   outb(0x40, (t >> 8) & 0xFF);  // and the upper half
 }
 
+/*
+ * busy-wait using channel 2 in one-shot mode, which needs no interrupts. The
+ * count is 16 bits, so this can wait for at most ~54ms
+ */
+void pit_spin_ms(u16 ms) {
+  u64 t = 1193182UL * ms / 1000;
+  if (t > 0xFFFF) t = 0xFFFF;
+
+  // gate channel 2 on, with the speaker disconnected
+  u8 old = inb(0x61);
+  outb(0x61, (old & ~0x02) | 0x01);
+
+  outb(0x43, 0xB0);  // channel 2, both bytes, interrupt on terminal count
+  outb(0x42, t & 0xFF);
+  outb(0x42, (t >> 8) & 0xFF);
+
+  // the channel's output goes high when the count runs out
+  while ((inb(0x61) & 0x20) == 0) asm("pause");
+
+  outb(0x61, old);
+}
+
 void pic_enable(uint8_t irq) {
   uint8_t mask;
   if (irq < 8) {
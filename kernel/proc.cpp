@@ -10,9 +10,11 @@
 #include <fs/vfs.h>
 #include <lock.h>
 #include <mem.h>
+#include <mutex.h>
 #include <paging.h>
 #include <phys.h>
 #include <sched.h>
+#include <vdso.h>
 #include <wait_flags.h>
 
 // start out at pid 2, so init is pid 1 regardless of if kernel threads are
@@ -63,7 +65,8 @@ static process::ptr do_spawn_proc(process::ptr proc_ptr, int flags) {
 
     // inherit stdin(0) stdout(1) and stderr(2)
     for (int i = 0; i < 3; i++) {
-      proc.open_files[i] = proc_ptr->parent->get_fd(i);
+      auto f = proc_ptr->parent->get_fd(i);
+      if (f) proc.files.install_at(i, move(f));
     }
   }
 
@@ -190,30 +193,9 @@ pid_t sched::proc::create_kthread(const char *name, int (*func)(void *),
 
 pid_t process::fork(void) { return -1; }
 
-ref<fs::file> process::get_fd(int fd) {
-  ref<fs::file> file;
+ref<fs::file> process::get_fd(int fd) { return files.get(fd); }
 
-  scoped_lock l(file_lock);
-  auto it = open_files.find(fd);
-  if (it != open_files.end()) {
-    file = it->value;
-  }
-
-  return file;
-}
-
-int process::add_fd(ref<fs::file> file) {
-  int fd = 0;
-  scoped_lock l(file_lock);
-
-  while (1) {
-    if (!open_files.contains(fd)) break;
-    fd++;
-  }
-
-  open_files.set(fd, file);
-  return fd;
-}
+int process::add_fd(ref<fs::file> file) { return files.install(move(file)); }
 
 process::~process(void) {
   if (threads.size() != 0) {
@@ -238,15 +220,11 @@ void sched::proc::dump_table(void) {
 
     printk("files={");
 
-    int ifd = 0;
-    for (auto &fd : proc->open_files) {
-      printk("%d", fd.key);
-
-      ifd++;
-      if (ifd <= proc->open_files.size() - 1) {
-        printk(", ");
-      }
-    }
+    bool first = true;
+    proc->files.each([&](int fd, fs::file *) {
+      printk(first ? "%d" : ", %d", fd);
+      first = false;
+    });
     printk("} ");
     printk("embryo=%d ", proc->embryonic);
 
@@ -325,6 +303,12 @@ int process::exec(string &path, vec<string> &argv, vec<string> &envp) {
     return -ENOEXEC;
   }
 
+  // before the stack, which would otherwise take the top of the address space
+  if (vdso::map(*new_addr_space) != 0) {
+    delete new_addr_space;
+    return -ENOMEM;
+  }
+
   off_t stack = 0;
   // allocate a 1mb stack
   // TODO: this size is arbitrary.
@@ -1,10 +1,16 @@
 #include <asm.h>
 #include <cpu.h>
+#include <errno.h>
+#include <fpu.h>
+#include <hrtimer.h>
+#include <klog.h>
 #include <lock.h>
 #include <map.h>
 #include <pcspeaker.h>
 #include <sched.h>
 #include <single_list.h>
+#include <timer.h>
+#include <vdso.h>
 #include <wait.h>
 
 // #define SCHED_DEBUG
@@ -43,7 +49,7 @@ struct mlfq_entry {
   long ntasks = 0;
   long timeslice = 0;
 
-  spinlock queue_lock;
+  spinlock queue_lock{"mlfq"};
 };
 
 static struct mlfq_entry mlfq[SCHED_MLFQ_DEPTH];
@@ -192,32 +198,32 @@ static void switch_into(struct thread &thd) {
   cpu::current().current_thread = &thd;
   thd.state = PS_UNRUNNABLE;
 
-  if (!thd.fpu.initialized) {
-    asm volatile("fninit");
-    asm volatile("fxsave64 (%0);" ::"r"(thd.fpu.state));
-    thd.fpu.initialized = true;
-  } else {
-    asm volatile("fxrstor64 (%0);" ::"r"(thd.fpu.state));
-  }
+  fpu::switch_in(thd);
 
   thd.stats.run_count++;
 
   thd.sched.start_tick = cpu::get_ticks();
 
+  vdso::switch_to(&thd);
   cpu::switch_vm(&thd);
 
   // thd.stats.last_cpu = thd.stats.current_cpu;
 
+  // the thread leaves its own idea of whether interrupts were on behind
+  int intena = cpu::current().intena;
   swtch(&cpu::current().sched_ctx, thd.kern_context);
+  cpu::current().intena = intena;
 
-  // save the FPU state after the context switch returns here
-  asm volatile("fxsave64 (%0);" ::"r"(thd.fpu.state));
+  // save the FPU state, if the thread used it
+  fpu::switch_out(thd);
   cpu::current().current_thread = nullptr;
 
   thd.locks.run.unlock();
 }
 
-void sched::do_yield(int st) {
+// give up the cpu without touching the thread's state, which the caller has
+// already set (and someone may already have changed back)
+static void switch_away(void) {
   cpu::pushcli();
 
   auto &thd = *curthd;
@@ -230,10 +236,26 @@ void sched::do_yield(int st) {
 
   thd.sched.priority = PRIORITY_HIGH;
 
-  thd.state = st;
   thd.stats.last_cpu = thd.stats.current_cpu;
   thd.stats.current_cpu = -1;
+
+  // the scheduler expects one pushcli (its own, undone when it gets back), but
+  // we may be holding irqsave locks too. Ours are put back when we are
+  // resumed, along with whether interrupts were on before them
+  int ncli = cpu::current().ncli;
+  int intena = cpu::current().intena;
+  cpu::current().ncli = 1;
   swtch(&thd.kern_context, cpu::current().sched_ctx);
+  cpu::current().ncli = ncli;
+  cpu::current().intena = intena;
+
+  cpu::popcli();
+}
+
+void sched::do_yield(int st) {
+  cpu::pushcli();
+  curthd->state = st;
+  switch_away();
   cpu::popcli();
 }
 
@@ -252,19 +274,74 @@ void sched::exit() { do_yield(PS_ZOMBIE); }
 
 
 
-void sched::dumb_sleepticks(unsigned long t) {
-  auto now = cpu::get_ticks();
+static void sleep_wake(struct hrtimer *t) {
+  ((struct thread *)t->data)->awaken(false);
+}
 
-  while (cpu::get_ticks() * 10 < now + t) {
-    sched::yield();
+int sched::sleep_ns(u64 ns, u64 *rem) {
+  struct hrtimer t;
+  t.fn = sleep_wake;
+  t.data = curthd;
+
+  u64 deadline = time::now() + ns;
+
+  // the timer is on this cpu, so it can't go off before we have blocked
+  cpu::pushcli();
+  int err = t.start(deadline);
+  if (err == 0) do_yield(PS_BLOCKED);
+  cpu::popcli();
+  if (err != 0) return err;
+
+  // something else woke us up, and the timer is on the stack, so it can't be
+  // left queued
+  if (t.cancel()) {
+    if (rem != NULL) {
+      u64 now = time::now();
+      *rem = now < deadline ? deadline - now : 0;
+    }
+    return -EINTR;
+  }
+
+  if (rem != NULL) *rem = 0;
+  return 0;
+}
+
+static bool have_runnable(void) {
+  for (int i = SCHED_MLFQ_DEPTH - 1; i >= 0; i--) {
+    auto &Q = mlfq[i];
+    bool found = false;
+    Q.queue_lock.lock();
+    for (auto *t = Q.task_queue; t != NULL; t = t->sched.next) {
+      if (t->state == PS_RUNNABLE) {
+        found = true;
+        break;
+      }
+    }
+    Q.queue_lock.unlock();
+    if (found) return true;
   }
+  return false;
+}
+
+/*
+ * nothing to run, so stop the tick and wait for an interrupt. With the tick
+ * stopped, a thread woken between finding nothing and the hlt would wait for
+ * some unrelated interrupt, so look again with interrupts off. sti only takes
+ * effect after the next instruction, so nothing gets in before the hlt
+ */
+static void idle(void) {
+  cpu::pushcli();
+  time::tick_stop();
+  if (!have_runnable()) asm volatile("sti; hlt; cli");
+  time::tick_restart();
+  cpu::popcli();
 }
+
 static void schedule_one() {
   auto thd = get_next_thread();
 
   if (thd == nullptr) {
-    // idle loop when there isn't a task
-    asm("hlt");
+    idle();
     return;
   }
 
@@ -345,11 +422,14 @@ void sched::run() {
 
 bool sched::enabled() { return s_enabled; }
 
-static u64 beep_timeout = 0;
+static void beep_done(struct hrtimer *) { pcspeaker::clear(); }
+
+static struct hrtimer beep_timer;
 
 void sched::play_tone(int frq, int dur) {
   pcspeaker::set(frq);
-  beep_timeout = cpu::get_ticks() + dur;
+  beep_timer.fn = beep_done;
+  beep_timer.start(time::now() + dur * TICK_NS);
 }
 
 void sched::beep(void) { play_tone(440, 25); }
@@ -357,8 +437,8 @@ void sched::beep(void) { play_tone(440, 25); }
 void sched::handle_tick(u64 ticks) {
   // send the EOI signal to the lapic
   irq::eoi(32 /* IRQ_TICK */);
+  klog::tick();
 
-  if (ticks >= beep_timeout) pcspeaker::clear();
   if (!enabled() || !cpu::in_thread()) return;
 
   // grab the current thread
@@ -370,16 +450,47 @@ void sched::handle_tick(u64 ticks) {
   }
 }
 
-int waitqueue::wait(u32 on) { return do_wait(on, 0); }
+int waitqueue::wait(u32 on) { return do_wait(on, 0, 0); }
 
-void waitqueue::wait_noint(u32 on) { do_wait(on, WAIT_NOINT); }
+void waitqueue::wait_noint(u32 on) { do_wait(on, WAIT_NOINT, 0); }
 
-int waitqueue::do_wait(u32 on, int flags) {
-  lock.lock();
+int waitqueue::wait_timeout(u64 ns, u32 on) {
+  return do_wait(on, WAIT_NOINT, ns);
+}
+
+// take `thd` off the queue. Lock held
+void waitqueue::unlink(struct thread *thd) {
+  if (thd->wq.prev != NULL)
+    thd->wq.prev->wq.next = thd->wq.next;
+  else
+    front = thd->wq.next;
+  if (thd->wq.next != NULL)
+    thd->wq.next->wq.prev = thd->wq.prev;
+  else
+    back = thd->wq.prev;
+  thd->wq.next = thd->wq.prev = NULL;
+}
+
+void waitqueue::wait_expired(struct timer *t) {
+  auto *thd = (struct thread *)t->data;
+  auto *wq = thd->wq.current_wq;
+  if (wq == NULL) return;
+
+  // notify may have beaten us to it
+  scoped_irqlock lck(wq->lock);
+  if (thd->wq.current_wq != wq) return;
+  wq->unlink(thd);
+  thd->wq.timed_out = true;
+  thd->awaken(false);
+}
+
+int waitqueue::do_wait(u32 on, int flags, u64 timeout) {
+  // notify is called from interrupts, which must not find us half asleep
+  lock.lock_irqsave();
 
   if (navail > 0) {
     navail--;
-    lock.unlock();
+    lock.unlock_irqrestore();
     return 0;
   }
 
@@ -401,50 +512,62 @@ int waitqueue::do_wait(u32 on, int flags) {
     waiter->wq.prev = back;
     back = waiter;
   }
+  waiter->wq.current_wq = this;
+  waiter->wq.timed_out = false;
 
-  lock.unlock();
-  sched::do_yield(PS_BLOCKED);
+  // blocked before the lock is dropped, so a notify from another cpu in
+  // between isn't lost
+  waiter->state = PS_BLOCKED;
+  // but stay off the interrupts until we are off the cpu
+  cpu::pushcli();
+  lock.unlock_irqrestore();
+
+  struct timer t;
+  if (timeout != 0) {
+    t.fn = wait_expired;
+    t.data = waiter;
+    t.add(time::tick_after(timeout));
+  }
+
+  switch_away();
+  cpu::popcli();
+
+  if (timeout != 0) {
+    t.del();
+    if (waiter->wq.timed_out) return -ETIMEDOUT;
+  }
 
   // TODO: read form the thread if it was rudely notified or not
   return 0;
 }
 
 void waitqueue::notify() {
-  scoped_lock lck(lock);
+  scoped_irqlock lck(lock);
 
   if (front == NULL) {
     navail++;
   } else {
     auto waiter = front;
-    if (front == back) back = NULL;
-    front = waiter->wq.next;
+    unlink(waiter);
     // *nicely* awaken the thread
     waiter->awaken(false);
   }
 }
 
 void waitqueue::notify_all(void) {
-  scoped_lock lck(lock);
+  scoped_irqlock lck(lock);
 
   while (front != NULL) {
     auto waiter = front;
-    if (front == back) back = NULL;
-    front = waiter->wq.next;
+    unlink(waiter);
     // *nicely* awaken the thread
     waiter->awaken(false);
   }
 }
 
 bool waitqueue::should_notify(u32 val) {
-  lock.lock();
-  if (front != NULL) {
-    if (front->wq.waiting_on <= val) {
-      lock.unlock();
-      return true;
-    }
-  }
-  lock.unlock();
-  return false;
+  scoped_irqlock lck(lock);
+  return front != NULL && front->wq.waiting_on <= val;
 }
 
 void sched::before_iret(bool userspace) {
@@ -2,9 +2,14 @@
 #include <cpu.h>
 
 int sys::dup(int fd) {
-  return -1;
+  auto file = curproc->get_fd(fd);
+  if (!file) return -EBADF;
+  return curproc->files.install(move(file));
 }
 
 int sys::dup2(int oldfd, int newfd) {
-  return -1;
+  auto file = curproc->get_fd(oldfd);
+  if (!file) return -EBADF;
+  if (oldfd == newfd) return newfd;
+  return curproc->files.install_at(newfd, move(file));
 }
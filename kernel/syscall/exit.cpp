@@ -32,6 +32,10 @@ void sys::exit_proc(int code) {
     }
   }
 
+  // close everything now rather than when the process is reaped, so pipes see
+  // the end and anything holding on to the process (like an ioring) lets go
+  curproc->files.clear();
+
   curproc->exit_code = code;
   curproc->exited = true;
   curproc->parent->waiters.notify_all();
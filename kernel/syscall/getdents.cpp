@@ -0,0 +1,74 @@
+#include <cpu.h>
+#include <dirent.h>
+#include <syscall.h>
+
+#define round_up(x, y) (((x) + (y)-1) & ~((y)-1))
+
+static unsigned char dirent_type(struct fs::inode *ino) {
+  if (ino == NULL) return DT_UNKNOWN;
+  switch (ino->type) {
+    case T_DIR:
+      return DT_DIR;
+    case T_FILE:
+      return DT_REG;
+    case T_FIFO:
+      return DT_FIFO;
+    case T_CHAR:
+      return DT_CHR;
+    case T_BLK:
+      return DT_BLK;
+    case T_SYML:
+      return DT_LNK;
+    case T_SOCK:
+      return DT_SOCK;
+  }
+  return DT_UNKNOWN;
+}
+
+/*
+ * fill dirp with as many entries as fit, starting at the directory's cursor.
+ * The cursor is the file offset (the index of the next entry), so lseek(fd, 0,
+ * SEEK_SET) rewinds it. Returns the bytes written, or 0 at the end
+ */
+long sys::getdents64(int fd, void *dirp, unsigned long count) {
+  if (!curproc->mm->validate_pointer(dirp, count, VALIDATE_WRITE))
+    return -EFAULT;
+
+  ref<fs::file> file = curproc->get_fd(fd);
+  if (!file) return -EBADF;
+  if (file->ino->type != T_DIR) return -ENOTDIR;
+
+  auto *buf = (char *)dirp;
+  off_t cursor = file->offset();
+  off_t index = 0;
+  unsigned long written = 0;
+  bool too_small = false;
+
+  file->ino->walk_direntries(
+      [&](const string &name, struct fs::inode *ino) -> bool {
+        if (index++ < cursor) return true;
+
+        size_t reclen =
+            round_up(sizeof(struct dirent64) + name.size() + 1, 8);
+        if (written + reclen > count) {
+          too_small = written == 0;
+          return false;
+        }
+
+        auto *ent = (struct dirent64 *)(buf + written);
+        ent->d_ino = ino != NULL ? ino->ino : 0;
+        ent->d_off = index;
+        ent->d_reclen = reclen;
+        ent->d_type = dirent_type(ino);
+        memcpy(ent->d_name, name.get(), name.size() + 1);
+
+        written += reclen;
+        cursor = index;
+        return true;
+      });
+
+  if (too_small) return -EINVAL;
+
+  file->m_offset = cursor;
+  return written;
+}
@@ -0,0 +1,11 @@
+#include <cpu.h>
+#include <syscall.h>
+
+int sys::ioctl(int fd, unsigned long cmd, unsigned long arg) {
+  ref<fs::file> file = curproc->get_fd(fd);
+  if (!file) return -EBADF;
+
+  auto *ops = file->fops();
+  if (ops == NULL || ops->ioctl == NULL) return -ENOTTY;
+  return ops->ioctl(*file, cmd, arg);
+}
@@ -0,0 +1,21 @@
+#include <cpu.h>
+#include <syscall.h>
+
+long sys::pread64(int fd, void *data, long len, long offset) {
+  // a negative length is caught here too
+  if ((unsigned long)len > RW_MAX) return -EINVAL;
+  if (!curproc->mm->validate_pointer(data, len, VALIDATE_WRITE)) return -EFAULT;
+
+  ref<fs::file> file = curproc->get_fd(fd);
+  if (!file) return -EBADF;
+  return file->pread(data, len, offset);
+}
+
+long sys::pwrite64(int fd, void *data, long len, long offset) {
+  if ((unsigned long)len > RW_MAX) return -EINVAL;
+  if (!curproc->mm->validate_pointer(data, len, VALIDATE_READ)) return -EFAULT;
+
+  ref<fs::file> file = curproc->get_fd(fd);
+  if (!file) return -EBADF;
+  return file->pwrite(data, len, offset);
+}
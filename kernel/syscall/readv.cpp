@@ -0,0 +1,76 @@
+#include <cpu.h>
+#include <syscall.h>
+
+/*
+ * copy the caller's iovec array into the kernel, checking every segment is
+ * memory it may read from (or write to, for `mode` VALIDATE_WRITE). Returns
+ * NULL if anything is wrong with it, with the reason in `err`
+ */
+static struct iovec *import_iovec(const struct iovec *uiov, int iovcnt,
+                                  int mode, long &err) {
+  err = -EINVAL;
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) return NULL;
+
+  err = -EFAULT;
+  if (!curproc->mm->validate_pointer((void *)uiov, iovcnt * sizeof(*uiov),
+                                     VALIDATE_READ))
+    return NULL;
+
+  auto *iov = (struct iovec *)kmalloc(iovcnt * sizeof(struct iovec));
+  memcpy(iov, uiov, iovcnt * sizeof(*iov));
+
+  unsigned long total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > RW_MAX - total) {
+      err = -EINVAL;
+      kfree(iov);
+      return NULL;
+    }
+    total += iov[i].iov_len;
+
+    if (iov[i].iov_len != 0 &&
+        !curproc->mm->validate_pointer(iov[i].iov_base, iov[i].iov_len, mode)) {
+      kfree(iov);
+      return NULL;
+    }
+  }
+
+  err = 0;
+  return iov;
+}
+
+static long do_rw_vec(int fd, const struct iovec *uiov, int iovcnt, long offset,
+                      bool positional, bool write) {
+  long err;
+  auto *iov = import_iovec(uiov, iovcnt, write ? VALIDATE_READ : VALIDATE_WRITE, err);
+  if (iov == NULL) return err;
+
+  ref<fs::file> file = curproc->get_fd(fd);
+  long n = -EBADF;
+  if (file) {
+    if (positional)
+      n = write ? file->pwritev(iov, iovcnt, offset)
+                : file->preadv(iov, iovcnt, offset);
+    else
+      n = write ? file->writev(iov, iovcnt) : file->readv(iov, iovcnt);
+  }
+
+  kfree(iov);
+  return n;
+}
+
+long sys::readv(int fd, const struct iovec *iov, int iovcnt) {
+  return do_rw_vec(fd, iov, iovcnt, 0, false, false);
+}
+
+long sys::writev(int fd, const struct iovec *iov, int iovcnt) {
+  return do_rw_vec(fd, iov, iovcnt, 0, false, true);
+}
+
+long sys::preadv(int fd, const struct iovec *iov, int iovcnt, long offset) {
+  return do_rw_vec(fd, iov, iovcnt, offset, true, false);
+}
+
+long sys::pwritev(int fd, const struct iovec *iov, int iovcnt, long offset) {
+  return do_rw_vec(fd, iov, iovcnt, offset, true, true);
+}
@@ -1,6 +1,7 @@
 #include <syscall.h>
 #include <dev/RTC.h>
 #include <cpu.h>
+#include <hrtimer.h>
 
 time_t sys::localtime(struct tm *tloc) {
 
@@ -15,3 +16,27 @@ time_t sys::localtime(struct tm *tloc) {
 
   return t;
 }
+
+int sys::nanosleep(struct timespec *req, struct timespec *rem) {
+  if (!curproc->mm->validate_pointer(req, sizeof(*req), VPROT_READ)) {
+    return -EFAULT;
+  }
+  if (rem != NULL &&
+      !curproc->mm->validate_pointer(rem, sizeof(*rem), VPROT_WRITE)) {
+    return -EFAULT;
+  }
+
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= NSEC_PER_SEC) {
+    return -EINVAL;
+  }
+
+  u64 left = 0;
+  int err = sched::sleep_ns(req->tv_sec * NSEC_PER_SEC + req->tv_nsec, &left);
+  if (err != 0 && err != -EINTR) return err;
+
+  if (rem != NULL) {
+    rem->tv_sec = left / NSEC_PER_SEC;
+    rem->tv_nsec = left % NSEC_PER_SEC;
+  }
+  return err;
+}
@@ -45,7 +45,7 @@ void syscall_init(void) {
 }
 
 static u64 do_syscall(long num, u64 a, u64 b, u64 c, u64 d, u64 e, u64 f) {
-  if (num & !0xFF) return -1;
+  if (num < 0 || num >= 255) return -ENOSYS;
 
   if (syscall_table[num].handler == NULL) {
     return -1;
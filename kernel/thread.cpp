@@ -2,7 +2,9 @@
  * This file implements all the thread:: functions and methods
  */
 #include <cpu.h>
+#include <fpu.h>
 #include <mmap_flags.h>
+#include <mutex.h>
 #include <sched.h>
 #include <syscall.h>
 #include <util.h>
@@ -25,8 +27,7 @@ thread::thread(pid_t tid, struct process &proc) : proc(proc) {
 
   this->pid = proc.pid;
 
-  fpu.initialized = false;
-  fpu.state = kmalloc(512);
+  fpu::thread_init(*this);
 
   sched.priority = PRIORITY_HIGH;
 
@@ -80,7 +81,7 @@ bool thread::kickoff(void *rip, int initial_state) {
 thread::~thread(void) {
   sched::remove_task(this);
   kfree(stack);
-  kfree(fpu.state);
+  fpu::thread_free(*this);
 }
 
 bool thread::awaken(bool rudely) {
@@ -112,7 +113,7 @@ static void thread_create_callback(void *) {
     auto fn = (fn_t)arch::reg(REG_PC, tf);
     cpu::popcli();
     // run the kernel thread
-    int res = fn(NULL);
+    int res = fn((void *)tf[1]);
     // exit the thread with the return code of the func
     sys::exit_thread(res);
   } else {
@@ -0,0 +1,224 @@
+#include <cpu.h>
+#include <hrtimer.h>
+#include <lock.h>
+#include <timer.h>
+
+/*
+ * The timing wheels (see include/timer.h).
+ *
+ * `clk` is the next tick the wheel has to process. A timer lives in level 0
+ * at slot (expires % 64) if it expires within 64 ticks of clk, otherwise in
+ * the lowest level n whose reach covers it, at slot (expires >> 6n) % 64.
+ * Whenever clk's low 6n bits roll over to zero, the level n slot clk has
+ * reached is emptied back into the levels below.
+ */
+struct wheel {
+  spinlock lock;
+  u64 clk = 0;
+  int count = 0;
+  struct timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+  // the slot being run, taken off the wheel so what its functions add doesn't
+  // land in it (slot EXPIRING)
+  struct timer *expiring = nullptr;
+  // the timer whose function is being called, for del()
+  struct timer *running = nullptr;
+};
+
+static struct wheel s_wheels[16];
+
+#define EXPIRING (WHEEL_LEVELS * WHEEL_SIZE)
+
+static inline int cpu_index(void) { return &cpu::current() - cpus; }
+
+u64 time::current_tick(void) { return time::now() / TICK_NS; }
+
+u64 time::tick_after(u64 ns) {
+  // the current tick is already partly over, so round up past it
+  return time::current_tick() + (ns + TICK_NS - 1) / TICK_NS + 1;
+}
+
+static void enqueue(struct wheel &w, struct timer *t) {
+  if (t->expires < w.clk) t->expires = w.clk;
+  u64 delta = t->expires - w.clk;
+  if (delta > WHEEL_MAX_TICKS) {
+    t->expires = w.clk + WHEEL_MAX_TICKS;
+    delta = WHEEL_MAX_TICKS;
+  }
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (1UL << (WHEEL_BITS * (level + 1))))
+    level++;
+
+  int slot = (t->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+  auto *&head = w.slots[level][slot];
+  t->slot = level * WHEEL_SIZE + slot;
+  t->prev = nullptr;
+  t->next = head;
+  if (head != nullptr) head->prev = t;
+  head = t;
+}
+
+static void unlink(struct wheel &w, struct timer *t) {
+  if (t->prev != nullptr)
+    t->prev->next = t->next;
+  else if (t->slot == EXPIRING)
+    w.expiring = t->next;
+  else
+    w.slots[t->slot / WHEEL_SIZE][t->slot % WHEEL_SIZE] = t->next;
+  if (t->next != nullptr) t->next->prev = t->prev;
+  t->next = t->prev = nullptr;
+  t->slot = -1;
+}
+
+// lock the wheel `t` is queued on, if any (see hrtimer.cpp)
+static struct wheel *lock_wheel(struct timer *t) {
+  while (1) {
+    int c = __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE);
+    if (c < 0) return nullptr;
+    auto &w = s_wheels[c];
+    w.lock.lock();
+    if (t->cpu == c) return &w;
+    w.lock.unlock();
+  }
+}
+
+bool timer::del(void) {
+  cpu::pushcli();
+  bool was_pending = false;
+  auto *w = lock_wheel(this);
+  if (w != nullptr) {
+    unlink(*w, this);
+    w->count--;
+    __atomic_store_n(&cpu, -1, __ATOMIC_RELEASE);
+    w->lock.unlock();
+    was_pending = true;
+  }
+  cpu::popcli();
+
+  // it might be going off somewhere, and the caller is about to free it. Not
+  // here though: functions run with interrupts off, so that would be us
+  int self = cpu_index();
+  for (int i = 0; i < 16; i++) {
+    if (i == self) continue;
+    while (__atomic_load_n(&s_wheels[i].running, __ATOMIC_ACQUIRE) == this)
+      asm("pause");
+  }
+  return was_pending;
+}
+
+void timer::add(u64 when) {
+  cpu::pushcli();
+  del();
+
+  int c = cpu_index();
+  auto &w = s_wheels[c];
+  w.lock.lock();
+  // a wheel that has been empty for a while has fallen behind
+  if (w.count == 0) {
+    u64 now = time::current_tick();
+    if (now > w.clk) w.clk = now;
+  }
+  expires = when;
+  enqueue(w, this);
+  w.count++;
+  __atomic_store_n(&cpu, c, __ATOMIC_RELEASE);
+  w.lock.unlock();
+
+  cpu::popcli();
+}
+
+// empty the level `level` slot that clk has reached into the levels below
+static void cascade(struct wheel &w, int level) {
+  int slot = (w.clk >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+  auto *t = w.slots[level][slot];
+  w.slots[level][slot] = nullptr;
+  while (t != nullptr) {
+    auto *next = t->next;
+    enqueue(w, t);
+    t = next;
+  }
+}
+
+// the next tick that needs processing: either a level 0 slot with timers in
+// it, or a cascade of a slot that has some. Lock held
+static u64 next_locked(struct wheel &w) {
+  if (w.count == 0) return 0;
+
+  u64 next = ~0UL;
+  for (int i = 0; i < WHEEL_SIZE; i++) {
+    if (w.slots[0][(w.clk + i) & (WHEEL_SIZE - 1)] != nullptr) {
+      next = w.clk + i;
+      break;
+    }
+  }
+
+  for (int l = 1; l < WHEEL_LEVELS; l++) {
+    int shift = WHEEL_BITS * l;
+    u64 cur = w.clk >> shift;
+    // right on a boundary, the slot clk is at hasn't been cascaded yet
+    int first = (w.clk & ((1UL << shift) - 1)) == 0 ? 0 : 1;
+    for (int k = first; k <= WHEEL_SIZE; k++) {
+      if (w.slots[l][(cur + k) & (WHEEL_SIZE - 1)] != nullptr) {
+        u64 when = (cur + k) << shift;
+        if (when < next) next = when;
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+u64 time::next_timer(void) {
+  auto &w = s_wheels[cpu_index()];
+  scoped_irqlock lck(w.lock);
+  return next_locked(w);
+}
+
+void time::run_timers(u64 tick) {
+  cpu::pushcli();
+  auto &w = s_wheels[cpu_index()];
+  w.lock.lock();
+
+  while (w.clk <= tick) {
+    if (w.count == 0) {
+      w.clk = tick + 1;
+      break;
+    }
+
+    // skip straight over ticks with nothing to do, like after an idle spell
+    u64 next = next_locked(w);
+    if (next > w.clk) {
+      w.clk = next < tick + 1 ? next : tick + 1;
+      continue;
+    }
+
+    for (int l = 1; l < WHEEL_LEVELS; l++) {
+      if (w.clk & ((1UL << (WHEEL_BITS * l)) - 1)) break;
+      cascade(w, l);
+    }
+
+    // anything added from here on is for the next tick at the earliest
+    auto *&head = w.slots[0][w.clk & (WHEEL_SIZE - 1)];
+    w.expiring = head;
+    head = nullptr;
+    for (auto *t = w.expiring; t != nullptr; t = t->next) t->slot = EXPIRING;
+    w.clk++;
+
+    while (w.expiring != nullptr) {
+      auto *t = w.expiring;
+      unlink(w, t);
+      w.count--;
+      __atomic_store_n(&t->cpu, -1, __ATOMIC_RELEASE);
+
+      __atomic_store_n(&w.running, t, __ATOMIC_RELEASE);
+      w.lock.unlock();
+      t->fn(t);
+      w.lock.lock();
+      __atomic_store_n(&w.running, nullptr, __ATOMIC_RELEASE);
+    }
+  }
+
+  w.lock.unlock();
+  cpu::popcli();
+}
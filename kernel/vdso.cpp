@@ -0,0 +1,124 @@
+#include <arch.h>
+#include <cpu.h>
+#include <dev/RTC.h>
+#include <errno.h>
+#include <mm.h>
+#include <mmap_flags.h>
+#include <module.h>
+#include <phys.h>
+#include <sched.h>
+#include <vdso.h>
+
+#define NSEC_PER_SEC 1000000000UL
+
+// vdso.asm has its own copy of the layout
+static_assert(__builtin_offsetof(struct vdso_data, tsc_mult) == 16);
+static_assert(__builtin_offsetof(struct vdso_data, wall_ns) == 48);
+static_assert(__builtin_offsetof(struct vdso_data, cpus) == 64);
+static_assert(sizeof(struct vdso_cpu) == 16);
+
+// arch/x86_64/vdso.asm
+extern "C" char vdso_image_start[];
+extern "C" char vdso_image_end[];
+
+static struct vdso_data *s_data = nullptr;
+static ref<mm::page> s_data_page;
+static ref<mm::page> s_code_page;
+
+// the TSC and wall clock time at boot, as far as the vDSO is concerned
+static u64 s_boot_tsc = 0;
+static u64 s_boot_wall_ns = 0;
+
+// a kernel page that address spaces only ever share
+static ref<mm::page> shared_page(void) {
+  auto p = make_ref<mm::page>();
+  p->pa = (u64)phys::alloc();
+  p->owns_page = 1;
+  // the vDSO holds on to it too, so nobody ever gets it writable
+  p->users = 1;
+  memset(p2v(p->pa), 0, PGSIZE);
+  return p;
+}
+
+static inline u64 cycles_to_ns(u64 cycles) {
+  return ((unsigned __int128)cycles * s_data->tsc_mult) >> 32;
+}
+
+void vdso::tick(u64 tsc) {
+  auto *d = s_data;
+  if (d == nullptr) return;
+
+  u64 mono = cycles_to_ns(tsc - s_boot_tsc);
+
+  __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  d->ticks++;
+  d->tick_tsc = tsc;
+  d->mono_ns = mono;
+  d->wall_ns = s_boot_wall_ns + mono;
+  __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELEASE);
+}
+
+void vdso::switch_to(struct thread *thd) {
+  auto *d = s_data;
+  if (d == nullptr) return;
+
+  int ind = &cpu::current() - cpus;
+  if (ind < 0 || ind >= VDSO_MAX_CPUS) return;
+
+  // userspace can't be reading this slot, since this cpu isn't running it
+  auto &c = d->cpus[ind];
+  c.pid = thd->pid;
+  c.tid = thd->tid;
+  __atomic_store_n(&c.seq, c.seq + 1, __ATOMIC_RELEASE);
+}
+
+// map one of the vDSO's pages into an address space
+static int map_page(mm::space &vm, const char *name, off_t va, int prot,
+                    ref<mm::page> &page) {
+  off_t got = vm.mmap(name, va, PGSIZE, prot, MAP_PRIVATE | MAP_ANON, nullptr,
+                      0);
+  if (got != va) return -ENOMEM;
+
+  auto *r = vm.lookup(va);
+  if (r == nullptr) return -ENOMEM;
+
+  spinlock::lock(page->lock);
+  page->users++;
+  spinlock::unlock(page->lock);
+  r->pages[0] = page;
+  return 0;
+}
+
+int vdso::map(mm::space &vm) {
+  if (s_data == nullptr) return -ENOENT;
+
+  int err = map_page(vm, "[vvar]", VDSO_DATA, PROT_READ, s_data_page);
+  if (err != 0) return err;
+  return map_page(vm, "[vdso]", VDSO_CODE, PROT_READ | PROT_EXEC, s_code_page);
+}
+
+static void vdso_init(void) {
+  size_t code_size = vdso_image_end - vdso_image_start;
+  if (code_size > PGSIZE) panic("vdso: the code is %zu bytes\n", code_size);
+
+  s_data_page = shared_page();
+  s_code_page = shared_page();
+  memcpy(p2v(s_code_page->pa), vdso_image_start, code_size);
+
+  auto *d = (struct vdso_data *)p2v(s_data_page->pa);
+  d->nr_cpus = cpunum;
+  d->tsc_khz = cpus[0].speed_khz;
+  // without a calibrated TSC the clock functions leave it to the syscalls
+  if (d->tsc_khz != 0) d->tsc_mult = (1000000UL << 32) / d->tsc_khz;
+
+  s_boot_tsc = arch::read_timestamp();
+  s_boot_wall_ns = dev::RTC::now() * NSEC_PER_SEC;
+  d->tick_tsc = s_boot_tsc;
+  d->wall_ns = s_boot_wall_ns;
+
+  // publish it only once it is filled in
+  __atomic_store_n(&s_data, d, __ATOMIC_RELEASE);
+}
+
+module_init("vdso", vdso_init);
@@ -2,7 +2,12 @@
 #include <console.h>
 #include <cpu.h>
 #include <dev/driver.h>
+#include <errno.h>
+#include <fb.h>
+#include <kargs.h>
+#include <lock.h>
 #include <mem.h>
+#include <mm.h>
 #include <module.h>
 #include <pci.h>
 #include <printk.h>
@@ -24,13 +29,11 @@
 #define VBE_DISPI_INDEX_VIRT_HEIGHT 0x7
 #define VBE_DISPI_INDEX_X_OFFSET 0x8
 #define VBE_DISPI_INDEX_Y_OFFSET 0x9
+#define VBE_DISPI_INDEX_VIDEO_MEMORY_64K 0xa
 #define VBE_DISPI_DISABLED 0x00
 #define VBE_DISPI_ENABLED 0x01
 #define VBE_DISPI_LFB_ENABLED 0x40
 
-#define BXVGA_DEV_IOCTL_SET_Y_OFFSET 1982
-#define BXVGA_DEV_IOCTL_SET_RESOLUTION 1985
-
 #define COLUMNS 80
 #define LINES 25
 #define NPAR 16
@@ -52,6 +55,107 @@ static unsigned char attr = 0x07;
  */
 #define RESPONSE "\033[?1;2c"
 
+/*
+ * The framebuffer console.
+ *
+ * On a Bochs/QEMU (BGA) display, the console is drawn into the linear
+ * framebuffer instead of using text mode. The cells the code below writes go
+ * to `fb_cells`, the console's back buffer, and each row keeps the span of
+ * columns changed since it was last drawn. vga::flush() draws just those.
+ *
+ * The framebuffer is several screens tall. Scrolling moves the screen down a
+ * row by changing the Y offset register, so nothing is copied. Only when the
+ * screen reaches the bottom are the rows on it drawn again at the top.
+ */
+#define FONT_W 8
+#define FONT_H 16
+
+#define FB_WIDTH 1024
+#define FB_HEIGHT 768
+
+// the console is drawn to the framebuffer
+static bool fb_active = false;
+// how many have /dev/fb0 open. The console stays off the screen meanwhile
+static int fb_users = 0;
+static spinlock fb_lock;
+
+static u64 fb_pa = 0;
+static u32 *fb = nullptr;
+static int fb_width = 0;
+static int fb_height = 0;
+static int fb_virt_height = 0;
+
+// glyphs, as read from the VGA card's own text mode font
+static u8 font[256][FONT_H];
+
+// the cells of every text row in the framebuffer, fb_rows of them
+static u16 *fb_cells = nullptr;
+static int fb_rows = 0;
+// the row at the top of the screen, and where the hardware is showing
+static int fb_top = 0;
+static int fb_shown_top = -1;
+// per row, the columns [lo, hi) that need drawing
+static u16 *fb_dmg_lo = nullptr;
+static u16 *fb_dmg_hi = nullptr;
+// the cell the cursor is drawn on
+static long fb_cursor = 0;
+
+static const u32 palette[16] = {
+    0x000000, 0xaa0000, 0x00aa00, 0xaa5500, 0x0000aa, 0xaa00aa,
+    0x00aaaa, 0xaaaaaa, 0x555555, 0xff5555, 0x55ff55, 0xffff55,
+    0x5555ff, 0xff55ff, 0x55ffff, 0xffffff,
+};
+
+static inline u64 fb_lock_irq(void) {
+  u64 flags = readeflags();
+  arch::cli();
+  fb_lock.lock();
+  return flags;
+}
+
+static inline void fb_unlock_irq(u64 flags) {
+  fb_lock.unlock();
+  if (flags & FL_IF) arch::sti();
+}
+
+static void fb_damage(long cell) {
+  int row = cell / columns;
+  int col = cell % columns;
+  if (col < fb_dmg_lo[row]) fb_dmg_lo[row] = col;
+  if (col + 1 > fb_dmg_hi[row]) fb_dmg_hi[row] = col + 1;
+}
+
+static void fb_damage_screen(void) {
+  for (int r = fb_top; r < fb_top + (int)lines; r++) {
+    fb_dmg_lo[r] = 0;
+    fb_dmg_hi[r] = columns;
+  }
+}
+
+static void fb_scroll(void) {
+  if (fb_top + (int)lines < fb_rows) {
+    fb_top++;
+  } else {
+    // out of room below. Start again at the top with what's on screen
+    for (unsigned long r = 1; r < lines; r++)
+      memcpy(fb_cells + (r - 1) * columns, fb_cells + (fb_top + r) * columns,
+             columns * sizeof(u16));
+    for (int r = 0; r < fb_rows; r++) {
+      fb_dmg_lo[r] = columns;
+      fb_dmg_hi[r] = 0;
+    }
+    fb_top = 0;
+    fb_damage_screen();
+  }
+
+  // the new bottom line has never been drawn
+  long start = (fb_top + lines - 1) * columns;
+  for (unsigned long i = 0; i < columns; i++) {
+    fb_cells[start + i] = 0x0720;
+    fb_damage(start + i);
+  }
+}
+
 static inline void gotoxy(unsigned int new_x, unsigned int new_y) {
   if (new_x >= columns || new_y >= lines) return;
   x = new_x;
@@ -60,16 +164,27 @@ static inline void gotoxy(unsigned int new_x, unsigned int new_y) {
 }
 
 static inline void write(long pos, uint16_t val) {
-  if (pos <= 0 || pos >= COLUMNS * LINES) return;
+  if (pos < 0 || pos >= (long)(columns * lines)) return;
+  if (fb_active) {
+    long cell = fb_top * columns + pos;
+    fb_cells[cell] = val;
+    fb_damage(cell);
+    return;
+  }
   origin[pos] = val;
 }
 
 void scrollup(void) {
-  for (int i = 0; i < COLUMNS * (LINES - 1); i++)
-    origin[i] = origin[i + COLUMNS];
+  if (fb_active) {
+    fb_scroll();
+    return;
+  }
+
+  for (unsigned long i = 0; i < columns * (lines - 1); i++)
+    origin[i] = origin[i + columns];
 
   // fill the last line with spaces
-  for (int i = COLUMNS * (LINES - 1); i < COLUMNS * LINES; i++)
+  for (unsigned long i = columns * (lines - 1); i < columns * lines; i++)
     origin[i] = 0x0720;
 }
 
@@ -96,6 +211,14 @@ static void del(void) {
 }
 
 static inline void set_cursor(void) {
+  if (fb_active) {
+    // x runs one past the last column until the next char wraps
+    long p = min(pos, columns * lines - 1);
+    fb_damage(fb_cursor);
+    fb_cursor = fb_top * columns + p;
+    fb_damage(fb_cursor);
+    return;
+  }
   arch::cli();
   outb(0x3d4, 14);
   outb(0x3d5, 0xff & (pos >> 8));
@@ -109,7 +232,7 @@ static void csi_J(int par) {
   long start = 0;
   switch (par) {
     case 0: /* erase from cursor to end of display */
-      count = (COLUMNS * LINES - pos);
+      count = (columns * lines - pos);
       start = pos;
       break;
     case 1: /* erase from start to cursor */
@@ -124,7 +247,7 @@ static void csi_J(int par) {
       return;
   }
 
-  for (int i = start; i < start + count; i++) write(i, 0x7020);
+  for (int i = start; i < start + count; i++) write(i, 0x0720);
 }
 
 static void csi_K(int par) {
@@ -149,7 +272,7 @@ static void csi_K(int par) {
       return;
   }
 
-  for (int i = start; i < start + count; i++) write(i, 0x7020);
+  for (int i = start; i < start + count; i++) write(i, 0x0720);
 }
 
 void csi_m(void) {
@@ -188,7 +311,7 @@ void csi_m(void) {
   }
 }
 
-void vga::putchar(char c) {
+static void vt_putchar(char c) {
   switch (state) {
     case 0:
       if (c > 31 && c < 127) {
@@ -351,102 +474,266 @@ void vga::putchar(char c) {
   set_cursor();
 }
 
-/*
-struct BXVGAResolution {
-  int width;
-  int height;
-};
-
-u32 *vga_fba = 0;
-int m_framebuffer_width = 0;
-int m_framebuffer_height = 0;
-
 static void set_register(u16 index, u16 data) {
   outw(VBE_DISPI_IOPORT_INDEX, index);
   outw(VBE_DISPI_IOPORT_DATA, data);
 }
 
-static void set_resolution(int width, int height) {
-  m_framebuffer_width = width;
-  m_framebuffer_height = height;
+static u16 get_register(u16 index) {
+  outw(VBE_DISPI_IOPORT_INDEX, index);
+  return inw(VBE_DISPI_IOPORT_DATA);
+}
 
+static void set_resolution(int width, int height) {
   set_register(VBE_DISPI_INDEX_ENABLE, VBE_DISPI_DISABLED);
   set_register(VBE_DISPI_INDEX_XRES, (u16)width);
   set_register(VBE_DISPI_INDEX_YRES, (u16)height);
   set_register(VBE_DISPI_INDEX_VIRT_WIDTH, (u16)width);
-  set_register(VBE_DISPI_INDEX_VIRT_HEIGHT, (u16)height * 2);
+  // as tall as video memory allows. The card clamps this for us
+  set_register(VBE_DISPI_INDEX_VIRT_HEIGHT, 0xffff);
   // bits per pixel
   set_register(VBE_DISPI_INDEX_BPP, 32);
   set_register(VBE_DISPI_INDEX_ENABLE,
                VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
   set_register(VBE_DISPI_INDEX_BANK, 0);
-}
 
-pci::device *vga_dev = NULL;
+  fb_width = get_register(VBE_DISPI_INDEX_XRES);
+  fb_height = get_register(VBE_DISPI_INDEX_YRES);
+  fb_virt_height = get_register(VBE_DISPI_INDEX_VIRT_HEIGHT);
 
-static void *get_framebuffer_address(void) {
-  void *addr = nullptr;
+  // older cards don't clamp, but they do say how much memory they have
+  u64 vram = (u64)get_register(VBE_DISPI_INDEX_VIDEO_MEMORY_64K) * 64 * 1024;
+  if (vram != 0 && (u64)fb_virt_height * fb_width * 4 > vram)
+    fb_virt_height = vram / (fb_width * 4);
+  if (fb_virt_height < fb_height) fb_virt_height = fb_height;
+}
+
+static u64 get_framebuffer_address(void) {
+  u64 addr = 0;
   pci::walk_devices([&](pci::device *dev) {
     if (dev->is_device(0x1234, 0x1111) || dev->is_device(0x80ee, 0xbeef)) {
-      vga_dev = dev;
-      addr = (void *)(dev->get_bar(0).raw & 0xfffffff0l);
+      addr = dev->get_bar(0).raw & 0xfffffff0l;
     }
   });
   return addr;
 }
 
-int vga::flush_buffer(u32 *dbuf, int npixels) {
-  cpu::pushcli();
-  int len = width() * height();
-  if (npixels < len) len = npixels;
-  int i = 0;
-  for (; i < npixels; i += 2) *(u64 *)(vga_fba + i) = *(u64 *)(dbuf + i);
-  for (; i < npixels; i++) vga_fba[i] = dbuf[i];
+/*
+ * copy the 8x16 font out of plane 2 of VGA memory, where the card keeps it in
+ * text mode. Glyphs are 32 bytes apart
+ */
+static void read_vga_font(void) {
+  // plane 2, sequential addressing, at 0xA0000
+  outw(0x3C4, 0x0402);
+  outw(0x3C4, 0x0704);
+  outw(0x3CE, 0x0204);
+  outw(0x3CE, 0x0005);
+  outw(0x3CE, 0x0406);
+
+  auto *src = (u8 *)p2v(0xA0000);
+  for (int c = 0; c < 256; c++)
+    for (int i = 0; i < FONT_H; i++) font[c][i] = src[c * 32 + i];
+
+  // and back to text mode's odd/even layout
+  outw(0x3C4, 0x0302);
+  outw(0x3C4, 0x0304);
+  outw(0x3CE, 0x0004);
+  outw(0x3CE, 0x1005);
+  outw(0x3CE, 0x0E06);
+}
+
+static void fb_draw_cell(long cell) {
+  u16 val = fb_cells[cell];
+  u32 fg = palette[(val >> 8) & 0xF];
+  u32 bg = palette[(val >> 12) & 0xF];
+  if (cell == fb_cursor) {
+    u32 t = fg;
+    fg = bg;
+    bg = t;
+  }
+
+  const u8 *glyph = font[val & 0xFF];
+  int row = cell / columns;
+  int col = cell % columns;
+  u32 *dst = fb + (row * FONT_H) * fb_width + col * FONT_W;
+  for (int gy = 0; gy < FONT_H; gy++) {
+    u8 bits = glyph[gy];
+    for (int gx = 0; gx < FONT_W; gx++)
+      dst[gx] = (bits & (0x80 >> gx)) ? fg : bg;
+    dst += fb_width;
+  }
+}
+
+// draw what changed on screen. fb_lock must be held
+static void fb_flush(void) {
+  if (!fb_active || fb_users > 0) return;
+
+  for (int r = fb_top; r < fb_top + (int)lines; r++) {
+    if (fb_dmg_hi[r] <= fb_dmg_lo[r]) continue;
+    for (int c = fb_dmg_lo[r]; c < fb_dmg_hi[r]; c++)
+      fb_draw_cell(r * columns + c);
+    fb_dmg_lo[r] = columns;
+    fb_dmg_hi[r] = 0;
+  }
+
+  // only move the screen once the rows it's moving to are drawn
+  if (fb_shown_top != fb_top) {
+    set_register(VBE_DISPI_INDEX_Y_OFFSET, fb_top * FONT_H);
+    fb_shown_top = fb_top;
+  }
+}
+
+void vga::putchar(char c) {
+  u64 flags = fb_lock_irq();
+  vt_putchar(c);
+  if (c == '\n') fb_flush();
+  fb_unlock_irq(flags);
+}
 
-  cpu::popcli();
-  return len;
+void vga::flush(void) {
+  u64 flags = fb_lock_irq();
+  fb_flush();
+  fb_unlock_irq(flags);
+}
+
+bool vga::fbcon(void) { return fb_active; }
+
+static size_t fb_size(void) { return (size_t)fb_width * fb_virt_height * 4; }
+
+static ssize_t fb_read(fs::file &fd, char *buf, size_t sz) {
+  if (fb == nullptr) return -ENODEV;
+  if ((size_t)fd.offset() >= fb_size()) return 0;
+
+  size_t n = min(fb_size() - fd.offset(), sz);
+  memcpy(buf, (char *)fb + fd.offset(), n);
+  fd.seek(n, SEEK_CUR);
+  return n;
 }
 
 static ssize_t fb_write(fs::file &fd, const char *buf, size_t sz) {
-  if (fd) {
-    if (vga_fba == nullptr) return -1;
+  if (fb == nullptr) return -ENODEV;
+  if ((size_t)fd.offset() >= fb_size()) return -ENOSPC;
 
-    size_t fbsize = vga::npixels() * sizeof(u32);
-    auto off = fd.offset() % fbsize;
-    ssize_t space_left = fbsize - off;
+  size_t n = min(fb_size() - fd.offset(), sz);
+  memcpy((char *)fb + fd.offset(), buf, n);
+  fd.seek(n, SEEK_CUR);
+  return n;
+}
 
-    ssize_t to_copy = min(space_left, sz);
-    if (to_copy <= 0) return 0;
+// hand the framebuffer's own pages to the mapping, so drawing is just stores
+static int fb_mmap(fs::file &fd, mm::area &a) {
+  if (fb == nullptr) return -ENODEV;
+  if (a.off % PGSIZE != 0) return -EINVAL;
+
+  for (int i = 0; i < a.pages.size(); i++) {
+    size_t off = a.off + (size_t)i * PGSIZE;
+    if (off >= fb_size()) break;
+
+    auto p = make_ref<mm::page>();
+    p->pa = fb_pa + off;
+    // it's device memory, not ours to give back to the allocator
+    p->owns_page = 0;
+    p->users = 1;
+    a.pages[i] = p;
+  }
+  return 0;
+}
 
-    cpu::pushcli();
-    memcpy((char *)vga_fba + off, buf, to_copy);
-    cpu::popcli();
+static int fb_ioctl(fs::file &fd, unsigned int cmd, off_t arg) {
+  if (fb == nullptr) return -ENODEV;
+
+  switch (cmd) {
+    case FB_GET_INFO: {
+      auto *info = (struct fb_info *)arg;
+      if (!curproc->mm->validate_pointer(info, sizeof(*info), VALIDATE_WRITE))
+        return -EFAULT;
+      info->width = fb_width;
+      info->height = fb_height;
+      info->virt_height = fb_virt_height;
+      info->pitch = fb_width * 4;
+      info->bpp = 32;
+      return 0;
+    }
 
-    // seek past
-    fd.seek(sz, SEEK_CUR);
-    return sz;
+    case FB_SET_Y_OFFSET:
+      if (arg < 0 || arg + fb_height > fb_virt_height) return -EINVAL;
+      set_register(VBE_DISPI_INDEX_Y_OFFSET, arg);
+      return 0;
   }
-  return -1;
+  return -EINVAL;
 }
 
-static int fb_ioctl(fs::file &fd, unsigned int cmd, unsigned long arg) {
-  return -1;
+static int fb_open(fs::file &fd) {
+  u64 flags = fb_lock_irq();
+  fb_users++;
+  fb_unlock_irq(flags);
+  return 0;
+}
+
+static void fb_close(fs::file &fd) {
+  u64 flags = fb_lock_irq();
+  // the console gets the screen back, all of it
+  if (--fb_users == 0 && fb_active) {
+    fb_shown_top = -1;
+    fb_damage_screen();
+    fb_flush();
+  }
+  fb_unlock_irq(flags);
 }
 
-// can only write to the framebuffer
 struct fs::file_operations fb_ops = {
-    .llseek = NULL,
-    .read = NULL,
+    .read = fb_read,
     .write = fb_write,
     .ioctl = fb_ioctl,
 
-    .open = NULL,
-    .close = NULL,
+    .open = fb_open,
+    .close = fb_close,
+    .mmap = fb_mmap,
 };
-*/
 
 void vga::early_init(void) { gotoxy(0, 0); }
 void vga::late_init(void) {
   origin = (unsigned short *)p2v(VGA_BASE_ADDR);
-  // dev::register_driver("fb", CHAR_DRIVER, MAJOR_FB, &fb_ops);
 }
+
+/*
+ * switch a BGA display to its linear framebuffer, and move the console onto it
+ * unless the command line says fbcon=off. Needs PCI, so it's a module
+ */
+static void fb_init(void) {
+  fb_pa = get_framebuffer_address();
+  if (fb_pa == 0) return;
+
+  read_vga_font();
+  set_resolution(FB_WIDTH, FB_HEIGHT);
+  fb = (u32 *)p2v(fb_pa);
+
+  dev::register_driver("fb", CHAR_DRIVER, MAJOR_FB, &fb_ops);
+  dev::register_name("fb0", MAJOR_FB, 0);
+  KINFO("fb0: %dx%d, %d rows of video memory\n", fb_width, fb_height,
+        fb_virt_height);
+
+  if (!strcmp(kargs::get("fbcon", "on"), "off")) return;
+
+  int cols = fb_width / FONT_W;
+  fb_rows = fb_virt_height / FONT_H;
+  fb_cells = (u16 *)kmalloc(fb_rows * cols * sizeof(u16));
+  fb_dmg_lo = (u16 *)kmalloc(fb_rows * sizeof(u16));
+  fb_dmg_hi = (u16 *)kmalloc(fb_rows * sizeof(u16));
+  for (int i = 0; i < fb_rows * cols; i++) fb_cells[i] = 0x0720;
+  for (int r = 0; r < fb_rows; r++) {
+    fb_dmg_lo[r] = cols;
+    fb_dmg_hi[r] = 0;
+  }
+
+  u64 flags = fb_lock_irq();
+  columns = cols;
+  lines = bottom = fb_height / FONT_H;
+  fb_top = 0;
+  gotoxy(0, 0);
+  fb_damage_screen();
+  fb_active = true;
+  fb_flush();
+  fb_unlock_irq(flags);
+}
+module_init("fb", fb_init);
@@ -3,6 +3,7 @@
 #include <fs.h>
 #include <lock.h>
 #include <map.h>
+#include <mutex.h>
 #include <net/sock.h>
 #include <sched.h>
 #include <syscall.h>
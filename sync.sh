@@ -129,6 +129,8 @@ sudo nm -s build/vmchariot | c++filt > build/kernel.syms
 
 sudo cp build/vmchariot $mnt/boot/
 sudo cp build/kernel.syms $mnt/boot/
+# the initramfs boot entry needs the archive next to the kernel
+[ -f build/initrd.tar ] && sudo cp build/initrd.tar $mnt/boot/
 
 # create some device nodes
 sudo mknod $mnt/dev/urandom c 1 2
@@ -0,0 +1,18 @@
+#pragma once
+
+#ifndef _SYS_IOCTL_H
+#define _SYS_IOCTL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// device specific control. Requests are defined by each device's header
+// (like <chariot/fb.h>)
+int ioctl(int fd, unsigned long request, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
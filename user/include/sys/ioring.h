@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef _SYS_IORING_H
+#define _SYS_IORING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <chariot/ioring.h>
+
+// the system calls
+int ioring_setup(unsigned entries, struct ioring_params *params);
+int ioring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags);
+
+/*
+ * A ring as seen from userspace. The usual loop is: ioring_get_sqe() and
+ * fill in some entries, ioring_submit(), then ioring_peek_cqe() and
+ * ioring_cqe_seen() for each result.
+ */
+struct ioring {
+  int fd;
+  unsigned flags;
+  struct ioring_header *hdr;
+  struct ioring_sqe *sqes;
+  struct ioring_cqe *cqes;
+  // entries handed out by ioring_get_sqe, published by ioring_submit
+  unsigned sqe_tail;
+  void *region;
+  unsigned long size;
+};
+
+// returns 0, or -1 with errno set
+int ioring_init(struct ioring *ring, unsigned entries, unsigned flags);
+void ioring_exit(struct ioring *ring);
+
+// the next free submission, or NULL if the SQ is full
+struct ioring_sqe *ioring_get_sqe(struct ioring *ring);
+// hand over everything queued, and wait for at least wait_nr completions.
+// Returns how many were submitted, or -1 with errno set
+int ioring_submit(struct ioring *ring, unsigned wait_nr);
+// the oldest unconsumed completion, or NULL
+struct ioring_cqe *ioring_peek_cqe(struct ioring *ring);
+// consume the completion ioring_peek_cqe returned
+void ioring_cqe_seen(struct ioring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
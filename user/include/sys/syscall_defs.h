@@ -12,6 +12,7 @@
 #define SYS_lseek                    (0x12)
 #define SYS_read                     (0x13)
 #define SYS_write                    (0x14)
+#define SYS_ioctl                    (0x15)
 #define SYS_stat                     (0x16)
 #define SYS_fstat                    (0x17)
 #define SYS_lstat                    (0x18)
@@ -29,6 +30,15 @@
 #define SYS_mmap                     (0x30)
 #define SYS_munmap                   (0x31)
 #define SYS_mrename                  (0x32)
-#define SYS_dirent                   (0x40)
+#define SYS_getdents64               (0x41)
 #define SYS_localtime                (0x50)
+#define SYS_nanosleep                (0x51)
 #define SYS_socket                   (0x60)
+#define SYS_pread64                  (0x70)
+#define SYS_pwrite64                 (0x71)
+#define SYS_readv                    (0x72)
+#define SYS_writev                   (0x73)
+#define SYS_preadv                   (0x74)
+#define SYS_pwritev                  (0x75)
+#define SYS_ioring_setup             (0x80)
+#define SYS_ioring_enter             (0x81)
@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef _SYS_UIO_H
+#define _SYS_UIO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __NEED_ssize_t
+#define __NEED_off_t
+#include <bits/alltypes.h>
+
+#include <chariot/uio.h>
+
+// scatter/gather I/O. The p* variants read or write at `offset`, and leave
+// the file offset alone
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
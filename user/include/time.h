@@ -13,11 +13,11 @@ extern "C" {
 #define __NEED_time_t
 #define __NEED_clock_t
 #define __NEED_struct_timespec
+#define __NEED_clockid_t
 
 #if defined(_POSIX_SOURCE) || defined(_POSIX_C_SOURCE) \
  || defined(_XOPEN_SOURCE) || defined(_GNU_SOURCE) \
  || defined(_BSD_SOURCE)
-#define __NEED_clockid_t
 #define __NEED_timer_t
 #define __NEED_pid_t
 #define __NEED_locale_t
@@ -38,8 +38,13 @@ struct tm {
 };
 
 
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
 time_t time(time_t *);
 time_t getlocaltime(struct tm *tloc); // nonstandard
+int clock_gettime(clockid_t, struct timespec *);
+int nanosleep(const struct timespec *, struct timespec *);
 
 #ifdef __cplusplus
 }
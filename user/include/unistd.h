@@ -22,6 +22,10 @@ extern "C" {
 ssize_t read(int fd, void *buf, size_t count);
 ssize_t write(int fd, const void *buf, size_t count);
 
+// read or write at an offset, without moving the file offset
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+
 int close(int fd);
 
 /**
@@ -1,4 +1,5 @@
 #include <chariot.h>
+#include <chariot/vdso.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -86,6 +87,15 @@ int startpidvpe(int pid, char *const file, char *const argv[],
   return -1;
 }
 
-pid_t getpid(void) { return syscall(SYS_getpid); }
+// the vDSO knows which thread each cpu is running, so these rarely trap
+pid_t getpid(void) {
+  long pid = ((long (*)(void))VDSO_FUNC(VDSO_GETPID))();
+  if (pid == -ENOSYS) pid = syscall(SYS_getpid);
+  return pid;
+}
 
-pid_t gettid(void) { return syscall(SYS_gettid); }
+pid_t gettid(void) {
+  long tid = ((long (*)(void))VDSO_FUNC(VDSO_GETTID))();
+  if (tid == -ENOSYS) tid = syscall(SYS_gettid);
+  return tid;
+}
@@ -3,21 +3,26 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#define DIRBUF_SIZE 4096
+
 struct __dirstream {
   int fd;
+  // the records from the last getdents64, and how far through them we are
   int pos;
-  int nents;
+  int len;
   // volatile int lock[1];
-  struct dirent *ents;
+  struct dirent ent;
+  char buf[DIRBUF_SIZE];
 };
 
 static DIR *populate_dir(DIR *dir) {
-  dir->ents = NULL;
   dir->pos = 0;
+  dir->len = 0;
 
   struct stat st;
 
@@ -31,19 +36,6 @@ static DIR *populate_dir(DIR *dir) {
     return 0;
   }
 
-  dir->nents = errno_syscall(SYS_dirent, dir->fd, NULL, 0, 0);
-  if (dir->nents == -1) {
-    free(dir);
-    return NULL;
-  }
-
-  dir->ents = calloc(dir->nents, sizeof(struct dirent));
-  int n = errno_syscall(SYS_dirent, dir->fd, dir->ents, 0, dir->nents);
-
-  if (n != dir->nents) {
-    printf("populate_dir: hmm\n");
-  }
-
   return dir;
 }
 
@@ -72,10 +64,24 @@ DIR *fdopendir(int fd) {
 }
 
 struct dirent *readdir(DIR *d) {
-  if (d->pos == d->nents) return NULL;
-
   // TODO: lock
-  return &d->ents[d->pos++];
+  if (d->pos >= d->len) {
+    long n = errno_syscall(SYS_getdents64, d->fd, d->buf, DIRBUF_SIZE);
+    if (n <= 0) return NULL;
+    d->len = n;
+    d->pos = 0;
+  }
+
+  struct dirent64 *rec = (struct dirent64 *)(d->buf + d->pos);
+  d->pos += rec->d_reclen;
+
+  d->ent.d_ino = rec->d_ino;
+  d->ent.d_off = rec->d_off;
+  d->ent.d_reclen = sizeof(d->ent);
+  d->ent.d_type = rec->d_type;
+  strncpy(d->ent.d_name, rec->d_name, sizeof(d->ent.d_name) - 1);
+  d->ent.d_name[sizeof(d->ent.d_name) - 1] = '\0';
+  return &d->ent;
 }
 
 int closedir(DIR *dir) {
@@ -84,6 +90,10 @@ int closedir(DIR *dir) {
   return ret;
 }
 
-void rewinddir(DIR *d) { d->pos = 0; }
+void rewinddir(DIR *d) {
+  lseek(d->fd, 0, SEEK_SET);
+  d->pos = 0;
+  d->len = 0;
+}
 
 int dirfd(DIR *d) { return d->fd; }
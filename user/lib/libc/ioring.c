@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int ioring_setup(unsigned entries, struct ioring_params *params) {
+  return errno_syscall(SYS_ioring_setup, entries, params);
+}
+
+int ioring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags) {
+  return errno_syscall(SYS_ioring_enter, fd, to_submit, min_complete, flags);
+}
+
+int ioring_init(struct ioring *ring, unsigned entries, unsigned flags) {
+  struct ioring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = flags;
+
+  int fd = ioring_setup(entries, &p);
+  if (fd < 0) return -1;
+
+  ring->fd = fd;
+  ring->flags = flags;
+  ring->region = (void *)p.addr;
+  ring->size = p.size;
+  ring->hdr = (struct ioring_header *)p.addr;
+  ring->sqes = (struct ioring_sqe *)(p.addr + p.sq_off);
+  ring->cqes = (struct ioring_cqe *)(p.addr + p.cq_off);
+  ring->sqe_tail = 0;
+  return 0;
+}
+
+void ioring_exit(struct ioring *ring) {
+  munmap(ring->region, ring->size);
+  close(ring->fd);
+}
+
+struct ioring_sqe *ioring_get_sqe(struct ioring *ring) {
+  struct ioring_header *h = ring->hdr;
+  unsigned head = __atomic_load_n(&h->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head >= h->sq_entries) return NULL;
+
+  // the kernel doesn't see it until ioring_submit moves sq_tail past it
+  struct ioring_sqe *sqe = &ring->sqes[ring->sqe_tail++ & h->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int ioring_submit(struct ioring *ring, unsigned wait_nr) {
+  struct ioring_header *h = ring->hdr;
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+  __atomic_store_n(&h->sq_tail, ring->sqe_tail, __ATOMIC_SEQ_CST);
+  unsigned pending =
+      ring->sqe_tail - __atomic_load_n(&h->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->flags & IORING_SETUP_SQPOLL) {
+    // the kernel is already looking, unless its thread went to sleep
+    if (__atomic_load_n(&h->flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    if (flags == 0) return pending;
+    if (ioring_enter(ring->fd, 0, wait_nr, flags) < 0) return -1;
+    return pending;
+  }
+
+  if (pending == 0 && flags == 0) return 0;
+  return ioring_enter(ring->fd, pending, wait_nr, flags);
+}
+
+struct ioring_cqe *ioring_peek_cqe(struct ioring *ring) {
+  struct ioring_header *h = ring->hdr;
+  if (h->cq_head == __atomic_load_n(&h->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[h->cq_head & h->cq_mask];
+}
+
+void ioring_cqe_seen(struct ioring *ring) {
+  struct ioring_header *h = ring->hdr;
+  __atomic_store_n(&h->cq_head, h->cq_head + 1, __ATOMIC_RELEASE);
+}
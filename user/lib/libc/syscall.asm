@@ -8,5 +8,5 @@ __syscall:
 	mov r10, r8
 	mov r8, r9
 	mov r9, [rsp + 8]
-	int 0x80 ;; TODO: real syscall instruction
+	syscall ;; clobbers rcx and r11
 	ret
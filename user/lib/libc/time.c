@@ -1,10 +1,14 @@
-#include <time.h>
+#include <chariot/vdso.h>
+#include <errno.h>
 #include <sys/syscall.h>
-
+#include <time.h>
 
 time_t time(time_t *tloc) {
+  // the vDSO reads the time the kernel keeps in a shared page
+  long val = ((long (*)(time_t *))VDSO_FUNC(VDSO_TIME))(tloc);
+  if (val != -ENOSYS) return val;
 
-  time_t val = syscall(SYS_localtime, 0);
+  val = syscall(SYS_localtime, 0);
   if (tloc) *tloc = val;
   return val;
 }
@@ -12,3 +16,29 @@ time_t time(time_t *tloc) {
 time_t getlocaltime(struct tm *tloc) {
   return syscall(SYS_localtime, tloc);
 }
+
+int clock_gettime(clockid_t clk, struct timespec *ts) {
+  long ret = ((long (*)(int, struct timespec *))VDSO_FUNC(VDSO_CLOCK_GETTIME))(
+      clk, ts);
+
+  if (ret == -ENOSYS) {
+    // no calibrated TSC, so only whole seconds are known
+    if (clk != CLOCK_REALTIME) {
+      errno = EINVAL;
+      return -1;
+    }
+    ts->tv_sec = syscall(SYS_localtime, 0);
+    ts->tv_nsec = 0;
+    return 0;
+  }
+
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+  return errno_syscall(SYS_nanosleep, req, rem);
+}
@@ -1,6 +1,9 @@
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 int errno;
@@ -19,6 +22,38 @@ ssize_t read(int fd, void *buf, size_t count) {
   return errno_syscall(SYS_read, fd, buf, count);
 }
 
+int ioctl(int fd, unsigned long request, ...) {
+  va_list ap;
+  va_start(ap, request);
+  unsigned long arg = va_arg(ap, unsigned long);
+  va_end(ap);
+  return errno_syscall(SYS_ioctl, fd, request, arg);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  return errno_syscall(SYS_pread64, fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  return errno_syscall(SYS_pwrite64, fd, buf, count, offset);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+  return errno_syscall(SYS_readv, fd, iov, iovcnt);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  return errno_syscall(SYS_writev, fd, iov, iovcnt);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  return errno_syscall(SYS_preadv, fd, iov, iovcnt, offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  return errno_syscall(SYS_pwritev, fd, iov, iovcnt, offset);
+}
+
 off_t lseek(int fd, off_t offset, int whence) {
   return errno_syscall(SYS_lseek, fd, offset, whence);
 }
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall_defs.h>
+
+// time a null system call, entering the kernel both ways it can be entered
+
+#define DEFAULT_ITERS 100000
+
+static inline unsigned long rdtsc(void) {
+  unsigned int lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((unsigned long)hi << 32) | lo;
+}
+
+static inline long null_syscall(void) {
+  long ret;
+  __asm__ volatile("syscall"
+                   : "=a"(ret)
+                   : "a"(SYS_getpid)
+                   : "rcx", "r11", "memory");
+  return ret;
+}
+
+static inline long null_int80(void) {
+  long ret;
+  __asm__ volatile("int $0x80" : "=a"(ret) : "a"(SYS_getpid) : "memory");
+  return ret;
+}
+
+static void bench(const char *name, long (*fn)(void), long iters) {
+  // warm up the caches and the TLB first
+  for (int i = 0; i < 1000; i++) fn();
+
+  unsigned long start = rdtsc();
+  for (long i = 0; i < iters; i++) fn();
+  unsigned long end = rdtsc();
+
+  printf("%-8s %lu cycles/call\n", name, (end - start) / iters);
+}
+
+static long do_syscall(void) { return null_syscall(); }
+static long do_int80(void) { return null_int80(); }
+
+int main(int argc, char **argv) {
+  long iters = DEFAULT_ITERS;
+  if (argc > 1) iters = atol(argv[1]);
+  if (iters <= 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%ld calls to getpid()\n", iters);
+  bench("int 0x80", do_int80, iters);
+  bench("syscall", do_syscall, iters);
+  return 0;
+}